@@ -4,26 +4,22 @@
 
 struct FConvert
 {
-	static void To(const FOutBunch* InBunch, utcp_bunch* OutBunch)
+	// Only the header, the data is sent from InBunch by utcp_send_bunch_iov
+	static void To(const FOutBunch* InBunch, utcp_bunch_header* OutHeader)
 	{
-		memset(OutBunch, 0, sizeof(*OutBunch));
-		OutBunch->NameIndex = (uint32)(*(InBunch->ChName.ToEName()));
-		OutBunch->ChIndex = InBunch->ChIndex;
-		OutBunch->bOpen = InBunch->bOpen;
-		OutBunch->bClose = InBunch->bClose;
-		OutBunch->CloseReason = (uint8_t)InBunch->CloseReason;
-		OutBunch->bIsReplicationPaused = InBunch->bIsReplicationPaused;
-		OutBunch->bReliable = InBunch->bReliable;
-		OutBunch->bHasPackageMapExports = InBunch->bHasPackageMapExports;
-		OutBunch->bHasMustBeMappedGUIDs = InBunch->bHasMustBeMappedGUIDs;
-		OutBunch->bPartial = InBunch->bPartial;
-		OutBunch->bPartialInitial = InBunch->bPartialInitial;
-		OutBunch->bPartialFinal = InBunch->bPartialFinal;
-		OutBunch->DataBitsLen = InBunch->GetNumBits();
-		if (OutBunch->DataBitsLen > 0)
-		{
-			memcpy(OutBunch->Data, InBunch->GetData(), InBunch->GetNumBytes());
-		}
+		memset(OutHeader, 0, sizeof(*OutHeader));
+		OutHeader->NameIndex = (uint32)(*(InBunch->ChName.ToEName()));
+		OutHeader->ChIndex = InBunch->ChIndex;
+		OutHeader->bOpen = InBunch->bOpen;
+		OutHeader->bClose = InBunch->bClose;
+		OutHeader->CloseReason = (uint8_t)InBunch->CloseReason;
+		OutHeader->bIsReplicationPaused = InBunch->bIsReplicationPaused;
+		OutHeader->bReliable = InBunch->bReliable;
+		OutHeader->bHasPackageMapExports = InBunch->bHasPackageMapExports;
+		OutHeader->bHasMustBeMappedGUIDs = InBunch->bHasMustBeMappedGUIDs;
+		OutHeader->bPartial = InBunch->bPartial;
+		OutHeader->bPartialInitial = InBunch->bPartialInitial;
+		OutHeader->bPartialFinal = InBunch->bPartialFinal;
 	}
 
 	static void To(const utcp_bunch* InBunch, FInBunch* OutBunch)
@@ -67,9 +67,10 @@ int32 UUTcpConnection::InternalSendRawBunch(FOutBunch* InBunch, bool Merge)
 		check(SendBuffer.GetNumBits() == 0);
 		TimeSensitive = true;
 
-		utcp_bunch Bunch;
-		FConvert::To(InBunch, &Bunch);
-		PacketId = utcp_send_bunch(get_fd(), &Bunch);
+		utcp_bunch_header Header;
+		FConvert::To(InBunch, &Header);
+		utcp_iov Iov = {InBunch->GetData(), (uint32_t)InBunch->GetNumBits()};
+		PacketId = Merge ? utcp_send_bunch_iov_merge(get_fd(), &Header, &Iov, 1) : utcp_send_bunch_iov(get_fd(), &Header, &Iov, 1);
 	}
 	else
 	{
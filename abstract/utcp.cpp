@@ -6,6 +6,7 @@ extern "C" {
 #include "utcp/utcp_utils.h"
 }
 #include <algorithm>
+#include <memory>
 
 namespace utcp
 {
@@ -34,9 +35,10 @@ void event_handler::config(decltype(utcp_config::on_log) log_fn)
 		auto handler = static_cast<event_handler*>(userdata);
 		handler->on_outgoing(data, len);
 	};
-	config->on_recv_bunch = [](struct utcp_connection* fd, void* userdata, struct utcp_bunch* const bunches[], int count) {
+	// The views keep a completed partial bunch in one piece, on_recv_bunch would get it cut into copies of its bunches
+	config->on_recv_bunch_view = [](struct utcp_connection* fd, void* userdata, const struct utcp_bunch_view* views, int count) {
 		auto handler = static_cast<event_handler*>(userdata);
-		handler->on_recv_bunch(bunches, count);
+		handler->on_recv_bunch_view(views, count);
 	};
 	config->on_delivery_status = [](struct utcp_connection* fd, void* userdata, int32_t packet_id, bool ack) {
 		auto handler = static_cast<event_handler*>(userdata);
@@ -85,6 +87,37 @@ void event_handler::on_delivery_status(int32_t packet_id, bool ack)
 
 }
 
+void event_handler::on_recv_bunch_view(const struct utcp_bunch_view* views, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		auto& view = views[i];
+		if (view.Bunch->bPartial)
+		{
+			// The same bunches on_recv_bunch gets without views, with their own sequences and flags
+			std::unique_ptr<struct utcp_bunch[]> partial_bunches(new struct utcp_bunch[view.PartialCount]);
+			struct utcp_bunch* bunches[UTCP_MAX_PARTIAL_BUNCHES];
+			utcp_bunch_view_split(&view, partial_bunches.get());
+			for (int j = 0; j < view.PartialCount; ++j)
+				bunches[j] = &partial_bunches[j];
+			on_recv_bunch(bunches, view.PartialCount);
+		}
+		else if (view.Data == view.Bunch->Data && view.DataBitOffset == 0)
+		{
+			struct utcp_bunch* bunches[1] = {const_cast<struct utcp_bunch*>(view.Bunch)};
+			on_recv_bunch(bunches, 1);
+		}
+		else
+		{
+			struct utcp_bunch bunch;
+			memcpy(&bunch, view.Bunch, offsetof(struct utcp_bunch, Data));
+			utcp_bunch_view_read(&view, bunch.Data);
+			struct utcp_bunch* bunches[1] = {&bunch};
+			on_recv_bunch(bunches, 1);
+		}
+	}
+}
+
 large_bunch::large_bunch(const uint8_t* data, size_t data_bits_len)
 {
 	memset(this, 0, sizeof(*this));
@@ -204,10 +237,52 @@ int large_bunch::num()
 	return cnt;
 }
 
+bunch_fragmenter::bunch_fragmenter(utcp_bunch* header, const uint8_t* data, size_t data_bits_len)
+	: _header(header), _data(data), _data_bits_len(data_bits_len)
+{
+	if (bits2bytes(data_bits_len) > NetMaxConstructedPartialBunchSizeBytes)
+		throw;
+
+	_num = (int)((data_bits_len + MAX_PARTIAL_BUNCH_SIZE_BITS - 1) / MAX_PARTIAL_BUNCH_SIZE_BITS);
+	if (_num == 0)
+		_num = 1;
+
+	// The message may itself be a slice of a larger partial bunch
+	_partial = header->bPartial;
+	_partial_initial = header->bPartialInitial;
+	_partial_final = header->bPartialFinal;
+}
+
+bool bunch_fragmenter::next(const uint8_t*& data)
+{
+	if (_pos >= _num)
+		return false;
+
+	int pos = _pos++;
+	size_t offset = (size_t)pos * MAX_PARTIAL_BUNCH_SIZE_BITS;
+	_header->DataBitsLen = (uint16_t)std::min<size_t>(_data_bits_len - offset, MAX_PARTIAL_BUNCH_SIZE_BITS);
+	if (_num > 1)
+	{
+		_header->bPartial = 1;
+		_header->bPartialInitial = pos == 0 && (!_partial || _partial_initial);
+		_header->bPartialFinal = pos == _num - 1 && (!_partial || _partial_final);
+	}
+
+	// MAX_PARTIAL_BUNCH_SIZE_BITS is a whole number of bytes, every fragment starts on a byte
+	data = _data + offset / 8;
+	return true;
+}
+
+int bunch_fragmenter::num() const
+{
+	return _num;
+}
+
 conn::conn()
 {
 	_utcp_fd = utcp_connection_create();
 	utcp_init(_utcp_fd, this);
+	utcp_set_packet_order_cache(_utcp_fd, true);
 }
 
 conn::~conn()
@@ -228,22 +303,12 @@ void conn::update()
 
 void conn::incoming(uint8_t* data, int count)
 {
-	auto packet_id = utcp_peep_packet_id(_utcp_fd, data, count);
-	if (packet_id <= 0)
-	{
-		utcp_incoming(_utcp_fd, data, count);
-		return;
-	}
-
-	_packet_order_cache.emplace(packet_id, data, count);
-	utcp_log(Verbose, "[%s]incoming _packet_order_cache:%d, count:%d, cache_size:%d", _utcp_fd->debug_name, packet_id, count, _packet_order_cache.size());
-
-	flush_packet_order_cache(false);
+	utcp_incoming(_utcp_fd, data, count);
 }
 
 void conn::flush_incoming_cache()
 {
-	flush_packet_order_cache(true);
+	utcp_flush_packet_order_cache(_utcp_fd);
 }
 
 packet_id_range conn::send_bunch(large_bunch* bunch)
@@ -259,6 +324,21 @@ packet_id_range conn::send_bunch(large_bunch* bunch)
 	return range;
 }
 
+packet_id_range conn::send_bunch(utcp_bunch* header, const uint8_t* data, size_t data_bits_len)
+{
+	packet_id_range range{packet_id_range::INDEX_NONE, packet_id_range::INDEX_NONE};
+	bunch_fragmenter fragmenter(header, data, data_bits_len);
+	const uint8_t* fragment;
+	while (fragmenter.next(fragment))
+	{
+		auto packet_id = utcp_send_bunch_data(_utcp_fd, header, fragment);
+		if (range.first == packet_id_range::INDEX_NONE)
+			range.first = packet_id;
+		range.last = packet_id;
+	}
+	return range;
+}
+
 void conn::send_flush()
 {
 	utcp_send_flush(_utcp_fd);
@@ -274,20 +354,6 @@ bool conn::is_closed()
 	return _utcp_fd->bClose;
 }
 
-void conn::flush_packet_order_cache(bool forced_flush)
-{
-	while (!_packet_order_cache.empty())
-	{
-		int packet_id = forced_flush ? -1 : utcp_expect_packet_id(_utcp_fd);
-		auto& view = _packet_order_cache.top();
-		if (packet_id != -1 && view._packet_id > packet_id)
-			break;
-
-		utcp_incoming(_utcp_fd, const_cast<uint8_t*>(view._data), view._data_len);
-		_packet_order_cache.pop();
-	}
-}
-
 void conn::set_debug_name(const char* debug_name)
 {
 	if (debug_name)
@@ -349,6 +415,52 @@ utcp::packet_id_range bufconn::send_bunch(large_bunch* bunch)
 	return range;
 }
 
+packet_id_range bufconn::send_bunch(utcp_bunch* header, const uint8_t* data, size_t data_bits_len)
+{
+	try_send();
+
+	bunch_fragmenter fragmenter(header, data, data_bits_len);
+	if (!_send_buffer.empty() || utcp_send_would_block(_utcp_fd, fragmenter.num()))
+	{
+		if (!header->bReliable)
+			return {packet_id_range::INDEX_NONE, packet_id_range::INDEX_NONE};
+	}
+
+	// Only the fragments that have to wait are copied
+	auto buffer = [this, header](const uint8_t* fragment) {
+		_send_buffer.push_back(*header);
+		memcpy(_send_buffer.back().Data, fragment, bits2bytes(header->DataBitsLen));
+	};
+
+	const uint8_t* fragment;
+	if (!_send_buffer.empty())
+	{
+		while (fragmenter.next(fragment))
+		{
+			buffer(fragment);
+		}
+		_send_buffer_packet_id--;
+		return packet_id_range{_send_buffer_packet_id, _send_buffer_packet_id};
+	}
+
+	packet_id_range range{packet_id_range::INDEX_NONE, packet_id_range::INDEX_NONE};
+	while (fragmenter.next(fragment))
+	{
+		if (!utcp_send_would_block(_utcp_fd, 1))
+		{
+			auto packet_id = utcp_send_bunch_data(_utcp_fd, header, fragment);
+			if (range.first == packet_id_range::INDEX_NONE)
+				range.first = packet_id;
+			range.last = packet_id;
+		}
+		else
+		{
+			buffer(fragment);
+		}
+	}
+	return range;
+}
+
 void bufconn::try_send()
 {
 	while (!_send_buffer.empty())
@@ -378,23 +490,65 @@ void listener::update_secret()
 	utcp_listener_update_secret(_utcp_fd, nullptr);
 }
 
+void listener::copy_secret(const utcp_listener* source)
+{
+	utcp_listener_copy_secret(_utcp_fd, source);
+}
+
 
 void listener::incoming(const char* address, uint8_t* data, int count)
 {
 	utcp_listener_incoming(_utcp_fd, address, data, count);
 }
 
+void listener::incoming(const struct sockaddr* addr, int addr_len, uint8_t* data, int count)
+{
+	utcp_listener_incoming_addr(_utcp_fd, addr, addr_len, data, count);
+}
+
 void listener::accept(conn* c, bool reconnect)
 {
 	utcp_listener_accept(_utcp_fd, c->get_fd(), reconnect);
 }
 
+bool listener::set_pending_accepts(int capacity)
+{
+	return utcp_listener_set_pending_accepts(_utcp_fd, capacity);
+}
+
+int listener::take_accepts(utcp_accept_info* accepts, int max)
+{
+	return utcp_listener_take_accepts(_utcp_fd, accepts, max);
+}
+
+void listener::accept(conn* c, const utcp_accept_info& info)
+{
+	utcp_listener_accept_pending(c->get_fd(), &info);
+}
+
+bool listener::set_limits(const utcp_listener_limits* limits)
+{
+	return utcp_listener_set_limits(_utcp_fd, limits);
+}
+
+utcp_listener_stats listener::get_stats()
+{
+	utcp_listener_stats stats;
+	utcp_listener_get_stats(_utcp_fd, &stats);
+	return stats;
+}
+
 // StatelessConnectHandlerComponent::DoesRestartedHandshakeMatch
 bool listener::does_restarted_handshake_match(conn* c)
 {
 	return memcmp(_utcp_fd->AuthorisedCookie, c->get_fd()->AuthorisedCookie, sizeof(_utcp_fd->AuthorisedCookie)) == 0;
 }
 
+bool listener::does_restarted_handshake_match(conn* c, const utcp_accept_info& info)
+{
+	return memcmp(info.AuthorisedCookie, c->get_fd()->AuthorisedCookie, sizeof(info.AuthorisedCookie)) == 0;
+}
+
 utcp_listener* listener::get_fd()
 {
 	return _utcp_fd;
@@ -5,7 +5,6 @@
 #include <cstdio>
 #include <cstring>
 #include <list>
-#include <queue>
 
 namespace utcp
 {
@@ -37,24 +36,10 @@ class event_handler
 	virtual void on_outgoing(const void* data, int len);
 	virtual void on_recv_bunch(struct utcp_bunch* const bunches[], int count);
 	virtual void on_delivery_status(int32_t packet_id, bool ack);
-};
-
-struct packet_view
-{
-	int32_t _packet_id;
-	uint16_t _data_len;
-	uint8_t _data[NetMaxConstructedPartialBunchSizeBytes];
-
-	packet_view(int32_t packet_id, uint8_t* data, int count) : _packet_id(packet_id), _data_len(count)
-	{
-		assert(count < sizeof(_data));
-		memcpy(_data, data, count);
-	}
-
-	friend bool operator<(const packet_view& l, const packet_view& r)
-	{
-		return l._packet_id > r._packet_id;
-	}
+	// The bunches where they are in the received packet, only valid during the call, see utcp_bunch_view_read.
+	// By default a whole bunch is copied out for on_recv_bunch and a completed partial bunch is split back into the
+	// bunches it was sent as, override it to read them without the copy. A partial view holds the whole message
+	virtual void on_recv_bunch_view(const struct utcp_bunch_view* views, int count);
 };
 
 struct large_bunch : utcp_bunch
@@ -99,6 +84,28 @@ struct large_bunch : utcp_bunch
 #pragma endregion
 };
 
+// Splits a message into partial bunches without copying it, each fragment points into the caller buffer
+// and is only copied once, by utcp_send_bunch_data. The message must outlive the fragmenter
+class bunch_fragmenter
+{
+  public:
+	explicit bunch_fragmenter(utcp_bunch* header, const uint8_t* data, size_t data_bits_len);
+
+	// Sets the partial flags and DataBitsLen of the header for the next fragment and points data at it, false after the last one
+	bool next(const uint8_t*& data);
+	int num() const;
+
+  private:
+	utcp_bunch* _header;
+	const uint8_t* _data;
+	size_t _data_bits_len;
+	int _num;
+	int _pos = 0;
+	bool _partial;
+	bool _partial_initial;
+	bool _partial_final;
+};
+
 struct packet_id_range
 {
 	enum
@@ -121,6 +128,8 @@ class conn : public event_handler
 	virtual void incoming(uint8_t* data, int count);
 	virtual void flush_incoming_cache();
 	virtual packet_id_range send_bunch(large_bunch* bunch);
+	// Sends data_bits_len bits from data with the header, in partial bunches if it does not fit in one
+	virtual packet_id_range send_bunch(utcp_bunch* header, const uint8_t* data, size_t data_bits_len);
 	virtual void send_flush();
 
 	utcp_connection* get_fd();
@@ -129,10 +138,6 @@ class conn : public event_handler
 	const char* debug_name();
 
   protected:
-	void flush_packet_order_cache(bool forced_flush);
-
-  protected:
-	std::priority_queue<packet_view> _packet_order_cache;
 	utcp_connection* _utcp_fd;
 };
 
@@ -141,6 +146,7 @@ class bufconn : public conn
   public:
 	virtual void update() override;
 	virtual packet_id_range send_bunch(large_bunch* bunch) override;
+	virtual packet_id_range send_bunch(utcp_bunch* header, const uint8_t* data, size_t data_bits_len) override;
 
   protected:
 	void try_send();
@@ -156,10 +162,23 @@ class listener : public event_handler
 	virtual ~listener() override;
 
 	void update_secret();
+	// See utcp_listener_copy_secret
+	void copy_secret(const utcp_listener* source);
 
 	virtual void incoming(const char* address, uint8_t* data, int count);
+	// See utcp_listener_incoming_addr
+	virtual void incoming(const struct sockaddr* addr, int addr_len, uint8_t* data, int count);
 	virtual void accept(conn* c, bool reconnect);
+	// See utcp_listener_set_pending_accepts
+	bool set_pending_accepts(int capacity);
+	int take_accepts(utcp_accept_info* accepts, int max);
+	void accept(conn* c, const utcp_accept_info& info);
+	// See utcp_listener_set_limits
+	bool set_limits(const utcp_listener_limits* limits);
+	utcp_listener_stats get_stats();
 	virtual bool does_restarted_handshake_match(conn* c);
+	// For a restarted handshake taken with take_accepts, the listener keeps no challenge data then
+	bool does_restarted_handshake_match(conn* c, const utcp_accept_info& info);
 	
 	utcp_listener* get_fd();
 
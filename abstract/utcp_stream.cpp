@@ -0,0 +1,199 @@
+﻿#include "utcp_stream.hpp"
+
+extern "C" {
+#include "utcp/utcp_def_internal.h"
+}
+#include <algorithm>
+
+namespace utcp
+{
+enum
+{
+	STREAM_HEADER_BYTES = 8,
+};
+
+stream_sender::stream_sender(conn* c, uint16_t ch_index, uint16_t name_index, size_t window_bytes) : _conn(c)
+{
+	// One more would overflow the reliable buffer, see UChannel::SendBunch
+	_window_bunches = std::clamp<size_t>(window_bytes / MAX_SINGLE_BUNCH_SIZE_BYTES, 1, UTCP_RELIABLE_BUFFER - 2);
+
+	memset(&_header, 0, sizeof(_header));
+	_header.ChIndex = ch_index;
+	_header.NameIndex = name_index;
+	_header.bReliable = 1;
+}
+
+stream_sender::~stream_sender()
+{
+}
+
+uint32_t stream_sender::send(const uint8_t* data, uint64_t len)
+{
+	message msg;
+	msg.data = data;
+	msg.len = len;
+	msg.sent = 0;
+	msg.acked = 0;
+	msg.id = _next_message_id++;
+	msg.header_sent = false;
+	_messages.push_back(msg);
+	return msg.id;
+}
+
+void stream_sender::update()
+{
+	auto fd = _conn->get_fd();
+	on_acked((int32_t)_in_flight.size() - utcp_channel_reliable_in_flight(fd, _header.ChIndex));
+
+	bool sent = false;
+	for (auto& msg : _messages)
+	{
+		if (msg.header_sent && msg.sent == msg.len)
+			continue;
+
+		while (_in_flight.size() < _window_bunches && !utcp_send_would_block(fd, 1))
+		{
+			if (!send_next(msg))
+				break;
+			sent = true;
+			if (msg.sent == msg.len)
+				break;
+		}
+
+		// The messages go out one after the other
+		if (!msg.header_sent || msg.sent != msg.len)
+			break;
+	}
+
+	if (sent)
+		_conn->send_flush();
+}
+
+bool stream_sender::empty() const
+{
+	return _messages.empty();
+}
+
+size_t stream_sender::window_bunches() const
+{
+	return _window_bunches;
+}
+
+void stream_sender::on_progress(uint32_t message_id, uint64_t acked_bytes, uint64_t total_bytes)
+{
+}
+
+// The bunches before the oldest one not acked yet are acked, the progress only counts those
+void stream_sender::on_acked(int32_t count)
+{
+	for (; count > 0 && !_in_flight.empty(); --count)
+	{
+		auto bunch = _in_flight.front();
+		_in_flight.pop_front();
+
+		auto it = std::find_if(_messages.begin(), _messages.end(), [&bunch](const message& msg) { return msg.id == bunch.id; });
+		assert(it != _messages.end());
+		it->acked += bunch.bytes;
+		on_progress(it->id, it->acked, it->len);
+	}
+
+	while (!_messages.empty())
+	{
+		auto& msg = _messages.front();
+		if (!msg.header_sent || msg.sent != msg.len || msg.acked != msg.len)
+			break;
+		if (!_in_flight.empty() && _in_flight.front().id == msg.id)
+			break;
+		_messages.pop_front();
+	}
+}
+
+bool stream_sender::send_next(message& msg)
+{
+	_header.bOpen = !_opened;
+
+	int32_t packet_id;
+	uint32_t bytes;
+	if (!msg.header_sent)
+	{
+		uint8_t size[STREAM_HEADER_BYTES];
+		for (int i = 0; i < STREAM_HEADER_BYTES; ++i)
+		{
+			size[i] = (uint8_t)(msg.len >> (i * 8));
+		}
+		_header.DataBitsLen = sizeof(size) * 8;
+		packet_id = utcp_send_bunch_data(_conn->get_fd(), &_header, size);
+		bytes = 0;
+	}
+	else
+	{
+		bytes = (uint32_t)std::min<uint64_t>(msg.len - msg.sent, MAX_SINGLE_BUNCH_SIZE_BYTES);
+		_header.DataBitsLen = (uint16_t)(bytes * 8);
+		packet_id = utcp_send_bunch_data(_conn->get_fd(), &_header, msg.data + msg.sent);
+	}
+
+	if (packet_id == packet_id_range::INDEX_NONE)
+		return false;
+
+	_opened = true;
+	if (!msg.header_sent)
+		msg.header_sent = true;
+	else
+		msg.sent += bytes;
+	_in_flight.push_back({msg.id, bytes});
+	return true;
+}
+
+stream_receiver::~stream_receiver()
+{
+}
+
+bool stream_receiver::recv_bunch(const uint8_t* data, size_t data_bits_len)
+{
+	if (data_bits_len & 7)
+		return false;
+	size_t len = data_bits_len / 8;
+
+	if (!_in_message)
+	{
+		if (len != STREAM_HEADER_BYTES)
+			return false;
+
+		_len = 0;
+		for (int i = 0; i < STREAM_HEADER_BYTES; ++i)
+		{
+			_len |= (uint64_t)data[i] << (i * 8);
+		}
+		_received = 0;
+		_in_message = true;
+		on_stream_begin(_next_message_id, _len);
+	}
+	else
+	{
+		if (len == 0 || len > _len - _received)
+			return false;
+
+		on_stream_data(_next_message_id, _received, data, len);
+		_received += len;
+	}
+
+	if (_received == _len)
+	{
+		_in_message = false;
+		on_stream_complete(_next_message_id++);
+	}
+	return true;
+}
+
+void stream_receiver::on_stream_begin(uint32_t message_id, uint64_t total_bytes)
+{
+}
+
+void stream_receiver::on_stream_data(uint32_t message_id, uint64_t offset, const uint8_t* data, size_t len)
+{
+}
+
+void stream_receiver::on_stream_complete(uint32_t message_id)
+{
+}
+} // namespace utcp
@@ -0,0 +1,79 @@
+﻿#pragma once
+#include "utcp.hpp"
+#include <deque>
+
+namespace utcp
+{
+// Messages of any size over one reliable channel. A message is a bunch holding its size (8 bytes, little endian)
+// followed by bunches of its data, which are sent straight from the caller buffer. The stream owns the channel,
+// nothing else may send reliable bunches on it
+class stream_sender
+{
+  public:
+	static constexpr size_t DEFAULT_WINDOW_BYTES = 64 * 1024;
+
+	// window_bytes limits the data sent since the oldest bunch not acked yet, which the receiver may have to hold back.
+	// It is clamped to what the reliable buffer of the channel can hold
+	explicit stream_sender(conn* c, uint16_t ch_index, uint16_t name_index, size_t window_bytes = DEFAULT_WINDOW_BYTES);
+	virtual ~stream_sender();
+
+	// The data is not copied and must stay valid until on_progress reports it all acked. Returns the message id
+	uint32_t send(const uint8_t* data, uint64_t len);
+	// Reports the acked bunches and sends as much as the window allows, call it every tick
+	void update();
+
+	bool empty() const;
+	size_t window_bunches() const;
+
+  protected:
+	virtual void on_progress(uint32_t message_id, uint64_t acked_bytes, uint64_t total_bytes);
+
+  private:
+	struct message
+	{
+		const uint8_t* data;
+		uint64_t len;
+		uint64_t sent;
+		uint64_t acked;
+		uint32_t id;
+		bool header_sent;
+	};
+	struct in_flight_bunch
+	{
+		uint32_t id;
+		uint32_t bytes;
+	};
+
+	void on_acked(int32_t count);
+	bool send_next(message& msg);
+
+	conn* _conn;
+	std::deque<message> _messages;
+	std::deque<in_flight_bunch> _in_flight; // In send order, from the oldest bunch not acked yet
+	size_t _window_bunches;
+	uint32_t _next_message_id = 0;
+	bool _opened = false;
+	utcp_bunch _header;
+};
+
+// Reassembles the messages of a stream_sender, each bunch is handed out as soon as it arrives in order
+class stream_receiver
+{
+  public:
+	virtual ~stream_receiver();
+
+	// Feed it the bunches of the channel in order. Returns false if they do not follow the stream format
+	bool recv_bunch(const uint8_t* data, size_t data_bits_len);
+
+  protected:
+	virtual void on_stream_begin(uint32_t message_id, uint64_t total_bytes);
+	virtual void on_stream_data(uint32_t message_id, uint64_t offset, const uint8_t* data, size_t len);
+	virtual void on_stream_complete(uint32_t message_id);
+
+  private:
+	uint32_t _next_message_id = 0;
+	uint64_t _len = 0;
+	uint64_t _received = 0;
+	bool _in_message = false;
+};
+} // namespace utcp
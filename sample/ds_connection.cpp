@@ -99,14 +99,32 @@ void ds_connection::on_outgoing(const void* data, int len)
 void ds_connection::on_recv_bunch(struct utcp_bunch* const bunches[], int count)
 {
 	assert(count == 1);
-	if (bunches[0]->DataBitsLen == 0)
+	on_msg(*bunches[0], bunches[0]->Data, bunches[0]->DataBitsLen);
+}
+
+void ds_connection::on_recv_bunch_view(const struct utcp_bunch_view* views, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		// The messages are whole bytes, they are read in the packet unless they do not start on a byte boundary
+		auto& view = views[i];
+		if (view.Bunch->bPartial || (view.DataBitOffset & 7))
+			utcp::conn::on_recv_bunch_view(&view, 1);
+		else
+			on_msg(*view.Bunch, view.Data + view.DataBitOffset / 8, view.DataBitsLen);
+	}
+}
+
+void ds_connection::on_msg(const struct utcp_bunch& bunch, const uint8_t* data, uint32_t data_bits_len)
+{
+	if (data_bits_len == 0)
 	{
-		assert(bunches[0]->bClose);
+		assert(bunch.bClose);
 		log(log_level::Warning, "channel close");
 		return;
 	}
 
-	codec.reset(const_cast<uint8_t*>(bunches[0]->Data), bunches[0]->DataBitsLen / 8);
+	codec.reset(const_cast<uint8_t*>(data), data_bits_len / 8);
 
 	uint8_t msg_type;
 	codec >> msg_type;
@@ -138,13 +156,13 @@ void ds_connection::on_delivery_status(int32_t packet_id, bool ack)
 void ds_connection::send_data()
 {
 	auto len = uint16_t(codec.pos - send_buffer);
-	utcp::large_bunch bunch(send_buffer, len * 8);
+	utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
 	bunch.NameIndex = 255;
 	bunch.ChIndex = 0;
 	bunch.bReliable = 1;
-	bunch.ExtDataBitsLen = 0;
 
-	auto ret = send_bunch(&bunch);
+	auto ret = send_bunch(&bunch, send_buffer, len * 8);
 	log(log_level::Verbose, "send bunch %d\n", ret.first);
 	send_flush();
 }
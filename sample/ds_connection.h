@@ -33,10 +33,12 @@ class ds_connection : public utcp::conn
 	virtual void on_disconnect(int close_reason) override;
 	virtual void on_outgoing(const void* data, int len) override;
 	virtual void on_recv_bunch(struct utcp_bunch* const bunches[], int count) override;
+	virtual void on_recv_bunch_view(const struct utcp_bunch_view* views, int count) override;
 	virtual void on_delivery_status(int32_t packet_id, bool ack) override;
 
   private:
 	void send_data();
+	void on_msg(const struct utcp_bunch& bunch, const uint8_t* data, uint32_t data_bits_len);
 	void on_msg_hello();
 	void on_msg_login();
 	void on_msg_netspeed();
@@ -23,25 +23,25 @@ bool echo_connection::async_connnect(const char* ip, int port)
 
 void echo_connection::send(int num)
 {
-	utcp::large_bunch bunch((uint8_t*)&num, sizeof(num) * 8);
+	utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
 	bunch.NameIndex = 255;
 	bunch.ChIndex = 0;
 	bunch.bOpen = 1;
 	bunch.bReliable = 1;
-	bunch.ExtDataBitsLen = 0;
 	bunch.bPartial = 1;
 	bunch.bPartialInitial = 1;
 
-	auto ret = send_bunch(&bunch);
+	auto ret = send_bunch(&bunch, (uint8_t*)&num, sizeof(num) * 8);
 	log(log_level::Log, "[%s]send%d\t%d", this->debug_name(), ret.first, num);
 	send_flush();
 
 	bunch.bPartialInitial = 0;
-	ret = send_bunch(&bunch);
+	ret = send_bunch(&bunch, (uint8_t*)&num, sizeof(num) * 8);
 	send_flush();
 
 	bunch.bPartialFinal = 1;
-	ret = send_bunch(&bunch);
+	ret = send_bunch(&bunch, (uint8_t*)&num, sizeof(num) * 8);
 	send_flush();
 }
 
@@ -0,0 +1,383 @@
+﻿#include "io_uring_socket.h"
+
+#if defined(UDP_IO_URING)
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+constexpr unsigned IO_URING_SQ_ENTRIES = 1024;
+constexpr unsigned IO_URING_CQ_ENTRIES = 8192;
+// One sqe stays free for the recv to be armed again
+constexpr int IO_URING_SEND_ENTRIES = IO_URING_SQ_ENTRIES - 1;
+constexpr uint16_t RECV_BUFFER_COUNT = 1024; // power of two
+constexpr uint16_t RECV_BUFFER_GROUP = 0;
+// Multishot recvmsg layout: io_uring_recvmsg_out, the address, the payload
+constexpr size_t RECV_BUFFER_SIZE = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + UDP_DATAGRAM_SIZE;
+constexpr uint64_t RECV_USER_DATA = 1;
+constexpr uint64_t SEND_USER_DATA = 2;
+constexpr uint64_t PROBE_USER_DATA = 3;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void* map_ring(size_t size, int fd, off_t offset)
+{
+	void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+io_uring_socket::io_uring_socket()
+{
+	memset(&params, 0, sizeof(params));
+	memset(&recv_msg, 0, sizeof(recv_msg));
+}
+
+io_uring_socket::~io_uring_socket()
+{
+	// Closing the ring cancels the recv, the buffers go after it
+	if (ring_fd >= 0)
+		close(ring_fd);
+	if (buf_ring)
+		munmap(buf_ring, buf_ring_size);
+	if (sqes)
+		munmap(sqes, sqes_size);
+	if (cq_ring && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring)
+		munmap(sq_ring, sq_ring_size);
+}
+
+bool io_uring_socket::init()
+{
+	// Task work only runs when we enter the ring, which poll does once per tick anyway
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	params.cq_entries = IO_URING_CQ_ENTRIES;
+	ring_fd = io_uring_setup(IO_URING_SQ_ENTRIES, &params);
+	if (ring_fd < 0)
+	{
+		memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = IO_URING_CQ_ENTRIES;
+		ring_fd = io_uring_setup(IO_URING_SQ_ENTRIES, &params);
+	}
+	if (ring_fd < 0)
+		return false;
+
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+	sq_ring = map_ring(sq_ring_size, ring_fd, IORING_OFF_SQ_RING);
+	cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring : map_ring(cq_ring_size, ring_fd, IORING_OFF_CQ_RING);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = (struct io_uring_sqe*)map_ring(sqes_size, ring_fd, IORING_OFF_SQES);
+	if (!sq_ring || !cq_ring || !sqes)
+		return false;
+
+	uint8_t* sq = (uint8_t*)sq_ring;
+	sq_head = (unsigned*)(sq + params.sq_off.head);
+	sq_tail = (unsigned*)(sq + params.sq_off.tail);
+	sq_array = (unsigned*)(sq + params.sq_off.array);
+	sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+	for (unsigned i = 0; i < params.sq_entries; ++i)
+		sq_array[i] = i;
+	uint8_t* cq = (uint8_t*)cq_ring;
+	cq_head = (unsigned*)(cq + params.cq_off.head);
+	cq_tail = (unsigned*)(cq + params.cq_off.tail);
+	cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	sqe_tail = *sq_tail;
+
+	buf_ring_size = RECV_BUFFER_COUNT * sizeof(struct io_uring_buf);
+	void* ptr = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+		return false;
+	// Used as an array of io_uring_buf, io_uring_buf_ring::bufs does not start at 0 in C++.
+	// The tail overlays the resv of the first one
+	buf_ring = (struct io_uring_buf*)ptr;
+	buf_ring_tail = &buf_ring[0].resv;
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+	reg.ring_entries = RECV_BUFFER_COUNT;
+	reg.bgid = RECV_BUFFER_GROUP;
+	if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return false;
+
+	buffers.resize(RECV_BUFFER_COUNT * RECV_BUFFER_SIZE);
+	for (uint16_t bid = 0; bid < RECV_BUFFER_COUNT; ++bid)
+		recycle_buffer(bid);
+	__atomic_store_n(buf_ring_tail, buf_tail, __ATOMIC_RELEASE);
+
+	recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+	if (!probe_multishot_recv())
+		return false;
+
+	send_msgs.resize(IO_URING_SEND_ENTRIES);
+	send_iovs.resize(IO_URING_SEND_ENTRIES);
+	send_controls.resize(IO_URING_SEND_ENTRIES * UDP_SEGMENT_CONTROL_SIZE);
+	return true;
+}
+
+bool io_uring_socket::probe_multishot_recv()
+{
+	// 5.19 has the buffer rings but not multishot recvmsg, which fails there on every arm.
+	// Receive one datagram of our own with it: a kernel that supports it keeps the recv armed
+	socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == INVALID_SOCKET)
+		return false;
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(addr);
+	const char probe = 0;
+	bool ok = bind(fd, (struct sockaddr*)&addr, addr_len) == 0 && getsockname(fd, (struct sockaddr*)&addr, &addr_len) == 0 &&
+			  sendto(fd, &probe, sizeof(probe), 0, (struct sockaddr*)&addr, addr_len) == sizeof(probe);
+	if (ok)
+	{
+		struct io_uring_sqe* sqe = get_sqe();
+		sqe->opcode = IORING_OP_RECVMSG;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)&recv_msg;
+		sqe->len = 1;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = RECV_BUFFER_GROUP;
+		sqe->user_data = PROBE_USER_DATA;
+
+		struct io_uring_cqe cqe;
+		ok = wait_cqe(&cqe) && cqe.res >= 0 && (cqe.flags & IORING_CQE_F_MORE);
+		if (cqe.flags & IORING_CQE_F_BUFFER)
+			recycle_buffer((uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+
+		// Cancel the recv and wait for its last completion, and for the one of the cancel
+		if (cqe.flags & IORING_CQE_F_MORE)
+		{
+			sqe = get_sqe();
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = PROBE_USER_DATA;
+			sqe->user_data = 0;
+			bool recv_done = false;
+			bool cancel_done = false;
+			while (!(recv_done && cancel_done) && wait_cqe(&cqe))
+			{
+				if (cqe.flags & IORING_CQE_F_BUFFER)
+					recycle_buffer((uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+				if (cqe.user_data == PROBE_USER_DATA)
+					recv_done = !(cqe.flags & IORING_CQE_F_MORE);
+				else
+					cancel_done = true;
+			}
+			ok = ok && recv_done && cancel_done;
+		}
+		__atomic_store_n(buf_ring_tail, buf_tail, __ATOMIC_RELEASE);
+	}
+	close(fd);
+	return ok;
+}
+
+bool io_uring_socket::wait_cqe(struct io_uring_cqe* cqe)
+{
+	unsigned head = *cq_head;
+	while (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+	{
+		if (enter(1) < 0 && errno != EINTR)
+		{
+			memset(cqe, 0, sizeof(*cqe));
+			return false;
+		}
+	}
+	*cqe = cqes[head & cq_mask];
+	__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+bool io_uring_socket::start_recv()
+{
+	arm_recv();
+	return true;
+}
+
+void io_uring_socket::poll(const udp_recv_fn& fn)
+{
+	if (!recv_armed)
+		arm_recv();
+	// A multishot recv posts a limited number of completions per run, enter again while it keeps posting
+	for (size_t reaped = pending_cqes.size(); reaped < RECV_BUFFER_COUNT;)
+	{
+		enter(0);
+		reap(nullptr);
+		if (pending_cqes.size() == reaped)
+			break;
+		reaped = pending_cqes.size();
+	}
+
+	// fn may send, which reaps into pending_cqes again
+	proc_cqes.swap(pending_cqes);
+	for (auto& cqe : proc_cqes)
+	{
+		proc_cqe(cqe, fn);
+	}
+	proc_cqes.clear();
+	__atomic_store_n(buf_ring_tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+int io_uring_socket::send_batch(const struct utcp_send_batch* batch, const struct sockaddr_in* addrs)
+{
+	int syscalls = 0;
+	for (int begin = 0; begin < batch->Count;)
+	{
+		int count = 0;
+		for (; begin < batch->Count && count < IO_URING_SEND_ENTRIES; ++count)
+		{
+			struct msghdr& msg = send_msgs[count];
+			memset(&msg, 0, sizeof(msg));
+			int run = prepare_msg(batch, addrs, begin, &msg, &send_iovs[count], &send_controls[count * UDP_SEGMENT_CONTROL_SIZE]);
+			begin += run;
+
+			struct io_uring_sqe* sqe = get_sqe();
+			sqe->opcode = IORING_OP_SENDMSG;
+			sqe->fd = socket_fd;
+			sqe->addr = (uint64_t)(uintptr_t)&msg;
+			sqe->len = 1;
+			sqe->user_data = SEND_USER_DATA;
+		}
+
+		// The batch buffer is reused as soon as we return, wait until the kernel is done with every send.
+		// A send that fails is dropped like sendto would drop it. EAGAIN and EBUSY only say the rings are short of room:
+		// reaping makes some, the next enter submits what is left
+		int completed = 0;
+		while (completed < count)
+		{
+			syscalls++;
+			if (enter(count - completed) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				// The ring itself is unusable, nothing queued on it completes
+				assert(false);
+				break;
+			}
+			reap(&completed);
+		}
+	}
+	return syscalls;
+}
+
+bool io_uring_socket::enable_gro()
+{
+	return false;
+}
+
+struct io_uring_sqe* io_uring_socket::get_sqe()
+{
+	// Everything queued is submitted before the next batch, the ring never fills up
+	assert(sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) < params.sq_entries);
+	struct io_uring_sqe* sqe = &sqes[sqe_tail & sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe_tail++;
+	return sqe;
+}
+
+void io_uring_socket::arm_recv()
+{
+	struct io_uring_sqe* sqe = get_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = socket_fd;
+	sqe->addr = (uint64_t)(uintptr_t)&recv_msg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RECV_BUFFER_GROUP;
+	sqe->user_data = RECV_USER_DATA;
+	recv_armed = true;
+}
+
+int io_uring_socket::enter(unsigned min_complete)
+{
+	// What the kernel has not consumed yet, including entries an earlier enter failed to submit
+	unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+	enter_count++;
+	return io_uring_enter(ring_fd, to_submit, min_complete, IORING_ENTER_GETEVENTS);
+}
+
+void io_uring_socket::reap(int* sends)
+{
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head)
+	{
+		const struct io_uring_cqe& cqe = cqes[head & cq_mask];
+		if (cqe.user_data == SEND_USER_DATA)
+		{
+			// A GSO run the device rejects is dropped, the next batches go out unsegmented
+			if (cqe.res == -EIO)
+				gso = false;
+			if (sends)
+				(*sends)++;
+			continue;
+		}
+		pending_cqes.push_back(cqe);
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+void io_uring_socket::proc_cqe(const struct io_uring_cqe& cqe, const udp_recv_fn& fn)
+{
+	// Out of buffers or an error ends the multishot, the next poll arms it again
+	if (!(cqe.flags & IORING_CQE_F_MORE))
+		recv_armed = false;
+	if (cqe.res < 0 || !(cqe.flags & IORING_CQE_F_BUFFER))
+		return;
+
+	uint16_t bid = (uint16_t)(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+	uint8_t* buffer = buffers.data() + bid * RECV_BUFFER_SIZE;
+	struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buffer;
+	if (!(out->flags & MSG_TRUNC) && out->namelen <= recv_msg.msg_namelen)
+	{
+		struct sockaddr_storage* from_addr = (struct sockaddr_storage*)(buffer + sizeof(*out));
+		uint8_t* payload = buffer + sizeof(*out) + recv_msg.msg_namelen + recv_msg.msg_controllen;
+		fn(payload, (int)out->payloadlen, from_addr, (socklen_t)out->namelen);
+	}
+	recycle_buffer(bid);
+}
+
+void io_uring_socket::recycle_buffer(uint16_t bid)
+{
+	// Published to the kernel at the end of poll
+	struct io_uring_buf* buf = &buf_ring[buf_tail & (RECV_BUFFER_COUNT - 1)];
+	buf->addr = (uint64_t)(uintptr_t)(buffers.data() + bid * RECV_BUFFER_SIZE);
+	buf->len = (uint32_t)RECV_BUFFER_SIZE;
+	buf->bid = bid;
+	buf_tail++;
+}
+#endif
+
+std::unique_ptr<udp_socket> new_udp_socket(bool io_uring)
+{
+#if defined(UDP_IO_URING)
+	if (io_uring)
+	{
+		std::unique_ptr<io_uring_socket> socket(new io_uring_socket);
+		if (socket->init())
+			return std::move(socket);
+	}
+#endif
+	return std::unique_ptr<udp_socket>(new udp_socket);
+}
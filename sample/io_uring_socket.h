@@ -0,0 +1,87 @@
+﻿#pragma once
+#include "udp_socket.h"
+#include <memory>
+
+#if defined(__linux) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#if defined(IORING_RECV_MULTISHOT)
+#define UDP_IO_URING 1
+
+// udp_socket on io_uring, without the recv thread:
+// a multishot recvmsg keeps filling buffers of a provided buffer ring, poll hands them over in place and gives them back,
+// send_batch queues one sendmsg per packet (or GSO run) and submits them all at once.
+// One io_uring_enter per poll and per send_batch, the ring is driven by the thread that calls them
+struct io_uring_socket : public udp_socket
+{
+	io_uring_socket();
+	virtual ~io_uring_socket();
+
+	// Creates the ring and registers the buffers, false if the kernel is too old for multishot recvmsg.
+	// That is probed: 5.19 has everything else
+	bool init();
+
+	virtual void poll(const udp_recv_fn& fn) override;
+	virtual int send_batch(const struct utcp_send_batch* batch, const struct sockaddr_in* addrs) override;
+	// The provided buffers hold one datagram
+	virtual bool enable_gro() override;
+
+	// io_uring_enter calls so far
+	size_t enter_count = 0;
+
+  protected:
+	virtual bool start_recv() override;
+
+  private:
+	struct io_uring_sqe* get_sqe();
+	bool probe_multishot_recv();
+	// Waits for the next completion, only while nothing else is in flight
+	bool wait_cqe(struct io_uring_cqe* cqe);
+	void arm_recv();
+	// Submits what is queued and waits for min_complete completions
+	int enter(unsigned min_complete);
+	// Moves the recv completions to pending_cqes, counts the send ones
+	void reap(int* sends);
+	void proc_cqe(const struct io_uring_cqe& cqe, const udp_recv_fn& fn);
+	void recycle_buffer(uint16_t bid);
+
+	int ring_fd = -1;
+	struct io_uring_params params;
+	void* sq_ring = nullptr;
+	size_t sq_ring_size = 0;
+	void* cq_ring = nullptr;
+	size_t cq_ring_size = 0;
+	struct io_uring_sqe* sqes = nullptr;
+	size_t sqes_size = 0;
+
+	unsigned* sq_head = nullptr;
+	unsigned* sq_tail = nullptr;
+	unsigned* sq_array = nullptr;
+	unsigned sq_mask = 0;
+	unsigned* cq_head = nullptr;
+	unsigned* cq_tail = nullptr;
+	struct io_uring_cqe* cqes = nullptr;
+	unsigned cq_mask = 0;
+	unsigned sqe_tail = 0;
+
+	struct io_uring_buf* buf_ring = nullptr;
+	size_t buf_ring_size = 0;
+	uint16_t* buf_ring_tail = nullptr;
+	std::vector<uint8_t> buffers;
+	uint16_t buf_tail = 0;
+
+	struct msghdr recv_msg;
+	bool recv_armed = false;
+	// Recv completions reaped while send_batch waited for its sends
+	std::vector<struct io_uring_cqe> pending_cqes;
+	std::vector<struct io_uring_cqe> proc_cqes;
+
+	std::vector<struct msghdr> send_msgs;
+	std::vector<struct iovec> send_iovs;
+	std::vector<char> send_controls;
+};
+#endif
+
+// The engine is chosen at startup, io_uring falls back to the recv thread where it is not available
+std::unique_ptr<udp_socket> new_udp_socket(bool io_uring);
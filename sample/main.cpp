@@ -2,6 +2,7 @@
 #include "echo_connection.h"
 #include "sample_config.h"
 #include "utcp_listener.h"
+#include "utcp_listener_group.h"
 #include <chrono>
 #include <memory>
 #include <thread>
@@ -15,6 +16,8 @@ void config()
 
 	g_config->log_level_limit = log_level::Verbose;
 	g_config->outgoing_loss = 0;
+	g_config->io_uring = false;
+	g_config->listener_workers = 1;
 }
 
 static void vlog(int level, const char* fmt, va_list marker)
@@ -74,11 +77,13 @@ struct sample_loop
 
 void ds()
 {
-	std::unique_ptr<udp_utcp_listener> listener(new udp_utcp_listener_impl<ds_connection>);
+	std::unique_ptr<udp_utcp_listener> listener(new udp_utcp_listener_impl<ds_connection>(g_config->io_uring));
 	auto now = std::chrono::high_resolution_clock::now();
 	sample_loop loop;
 
 	listener->listen("127.0.0.1", 7777);
+	if (!listener->enable_offload())
+		log(log_level::Log, "UDP GSO/GRO not available");
 
 	while (true)
 	{
@@ -91,9 +96,31 @@ void ds()
 	}
 }
 
+void ds_workers()
+{
+	udp_utcp_listener_group group([]() { return new udp_utcp_listener_impl<ds_connection>(g_config->io_uring); });
+	sample_loop loop;
+
+	if (!group.listen("127.0.0.1", 7777, g_config->listener_workers))
+	{
+		log(log_level::Error, "listen failed");
+		return;
+	}
+
+	// The workers tick on their own, the clock and the secret rotation are driven from here
+	while (true)
+	{
+		loop.tick();
+		if (loop.frame % 3000 == 0) // SECRET_UPDATE_TIME
+		{
+			group.rotate_secret();
+		}
+	}
+}
+
 void echo()
 {
-	std::unique_ptr<udp_utcp_listener> listener(new udp_utcp_listener_impl<echo_connection>);
+	std::unique_ptr<udp_utcp_listener> listener(new udp_utcp_listener_impl<echo_connection>(g_config->io_uring));
 	std::unique_ptr<echo_connection> client(new echo_connection);
 	sample_loop loop;
 
@@ -125,7 +152,10 @@ int main(int argc, const char* argv[])
 	utcp::event_handler::config(vlog);
 	utcp::event_handler::enbale_dump_data(g_config->log_level_limit >= log_level::Verbose);
 
-	ds();
+	if (g_config->listener_workers > 1)
+		ds_workers();
+	else
+		ds();
 	// echo();
 
 	log(log_level::Log, "server stop");
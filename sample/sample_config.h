@@ -16,6 +16,10 @@ struct sample_config
 {
 	log_level log_level_limit;
 	int outgoing_loss;
+	// The listener socket engine, see io_uring_socket
+	bool io_uring;
+	// More than one: listeners sharing the port with SO_REUSEPORT, one worker thread each
+	int listener_workers;
 };
 
 extern sample_config* g_config;
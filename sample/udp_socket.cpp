@@ -1,6 +1,20 @@
 ﻿#include "udp_socket.h"
+#include <algorithm>
 #include <cassert>
 
+#if defined(__linux)
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+constexpr int UDP_MAX_SEGMENTS = 64;
+constexpr int UDP_MAX_GSO_BYTES = 65000;
+constexpr int UDP_GRO_BUFFER_SIZE = 65536;
+#endif
+
 #ifdef _MSC_VER
 struct WSAGuard
 {
@@ -26,10 +40,19 @@ udp_socket::udp_socket()
 udp_socket::~udp_socket()
 {
 	recv_thread_exit_flag = true;
-	recv_thread.join();
+	if (recv_thread.joinable())
+	{
+		// Wakes the blocking recvfrom up
+#ifdef WIN32
+		shutdown(socket_fd, SD_RECEIVE);
+#else
+		shutdown(socket_fd, SHUT_RD);
+#endif
+		recv_thread.join();
+	}
 }
 
-bool udp_socket::listen(const char* ip, int port)
+bool udp_socket::listen(const char* ip, int port, bool reuse_port)
 {
 	assert(socket_fd == INVALID_SOCKET);
 
@@ -40,6 +63,13 @@ bool udp_socket::listen(const char* ip, int port)
 	int one = 1;
 	if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, (char*)&one, sizeof(one)) == SOCKET_ERROR)
 		return false;
+#if defined(SO_REUSEPORT)
+	if (reuse_port && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, (char*)&one, sizeof(one)) == SOCKET_ERROR)
+		return false;
+#else
+	if (reuse_port)
+		return false;
+#endif
 
 	memset(&dest_addr, 0, sizeof(dest_addr));
 	struct sockaddr_in* addripv4 = (struct sockaddr_in*)&dest_addr;
@@ -54,8 +84,7 @@ bool udp_socket::listen(const char* ip, int port)
 	memset(&dest_addr, 0, sizeof(dest_addr));
 	dest_addr_len = 0;
 
-	create_recv_thread();
-	return true;
+	return start_recv();
 }
 
 bool udp_socket::connnect(const char* ip, int port)
@@ -73,6 +102,11 @@ bool udp_socket::connnect(const char* ip, int port)
 	addripv4->sin_port = htons(port);
 	dest_addr_len = sizeof(*addripv4);
 
+	return start_recv();
+}
+
+bool udp_socket::start_recv()
+{
 	create_recv_thread();
 	return true;
 }
@@ -84,24 +118,192 @@ std::vector<udp_datagram>& udp_socket::swap()
 	return proc_queue;
 }
 
+void udp_socket::poll(const udp_recv_fn& fn)
+{
+	auto& queue = swap();
+	for (auto& datagram : queue)
+	{
+		fn(datagram.data, datagram.data_len, &datagram.from_addr, datagram.from_addr_len);
+	}
+	queue.clear();
+}
+
+#if defined(__linux)
+// The packets from i on that can go out as one GSO datagram: same address, same size but the last one, one after another in the buffer
+static int gso_run(const struct utcp_send_batch* batch, const struct sockaddr_in* addrs, int i)
+{
+	const uint32_t segment = batch->Items[i].Len;
+	uint32_t bytes = segment;
+	int j = i + 1;
+	for (; j < batch->Count && j - i < UDP_MAX_SEGMENTS; ++j)
+	{
+		const struct utcp_send_batch_item& item = batch->Items[j];
+		if (item.Len > segment || bytes + item.Len > UDP_MAX_GSO_BYTES || item.Offset != batch->Items[j - 1].Offset + batch->Items[j - 1].Len)
+			break;
+		if (addrs[j].sin_addr.s_addr != addrs[i].sin_addr.s_addr || addrs[j].sin_port != addrs[i].sin_port)
+			break;
+		bytes += item.Len;
+		if (item.Len < segment)
+			return j - i + 1;
+	}
+	return j - i;
+}
+#endif
+
+int udp_socket::send_batch(const struct utcp_send_batch* batch, const struct sockaddr_in* addrs)
+{
+	int syscalls = 0;
+#if defined(__linux)
+	constexpr int max_messages = 1024; // UIO_MAXIOV
+	static thread_local struct mmsghdr msgs[max_messages];
+	static thread_local struct iovec iovs[max_messages];
+	static thread_local char controls[max_messages][UDP_SEGMENT_CONTROL_SIZE];
+	static thread_local int runs[max_messages];
+	for (int begin = 0; begin < batch->Count;)
+	{
+		int count = 0;
+		for (int i = begin; i < batch->Count && count < max_messages; i += runs[count++])
+		{
+			memset(&msgs[count], 0, sizeof(msgs[count]));
+			runs[count] = prepare_msg(batch, addrs, i, &msgs[count].msg_hdr, &iovs[count], controls[count]);
+		}
+
+		syscalls++;
+		int sent = sendmmsg(socket_fd, msgs, count, 0);
+		// A device without checksum offload rejects a GSO run with EIO: send it again unsegmented, and every run after it
+		if (sent < 0 && errno == EIO && runs[0] > 1)
+		{
+			gso = false;
+			continue;
+		}
+		// The first message failed, skip it like sendto would drop it
+		for (int i = 0; i < std::max(sent, 1); ++i)
+			begin += runs[i];
+	}
+#else
+	for (int i = 0; i < batch->Count; ++i)
+	{
+		const struct utcp_send_batch_item& item = batch->Items[i];
+		sendto(socket_fd, (const char*)batch->Buffer + item.Offset, item.Len, 0, (const sockaddr*)&addrs[i], sizeof(addrs[i]));
+		syscalls++;
+	}
+#endif
+	return syscalls;
+}
+
+#if defined(__linux)
+int udp_socket::prepare_msg(const struct utcp_send_batch* batch, const struct sockaddr_in* addrs, int i, struct msghdr* msg, struct iovec* iov, char* control)
+{
+	const struct utcp_send_batch_item& item = batch->Items[i];
+	const int run = gso ? gso_run(batch, addrs, i) : 1;
+	const struct utcp_send_batch_item& last = batch->Items[i + run - 1];
+	iov->iov_base = batch->Buffer + item.Offset;
+	iov->iov_len = last.Offset + last.Len - item.Offset;
+	msg->msg_name = (void*)&addrs[i];
+	msg->msg_namelen = sizeof(addrs[i]);
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 1;
+	if (run > 1)
+	{
+		msg->msg_control = control;
+		msg->msg_controllen = UDP_SEGMENT_CONTROL_SIZE;
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		uint16_t segment = (uint16_t)item.Len;
+		memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+	}
+	return run;
+}
+#endif
+
+bool udp_socket::enable_gso()
+{
+#if defined(__linux)
+	// Probe with a zero size, the real one goes with every message
+	int segment = 0;
+	gso = setsockopt(socket_fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+#endif
+	return gso;
+}
+
+bool udp_socket::enable_gro()
+{
+#if defined(__linux)
+	// Switch the recv thread first, it can read a coalesced datagram as soon as the option is set
+	int one = 1;
+	gro = true;
+	gro = setsockopt(socket_fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+#endif
+	return gro;
+}
+
 void udp_socket::create_recv_thread()
 {
 	recv_thread_exit_flag = false;
 	recv_thread = std::thread([this]() {
 		struct sockaddr_storage from_addr;
-		uint8_t buffer[UDP_DATAGRAM_SIZE];
+#if defined(__linux)
+		std::vector<uint8_t> buffer(UDP_GRO_BUFFER_SIZE);
+		char control[CMSG_SPACE(sizeof(int))];
+#else
+		std::vector<uint8_t> buffer(UDP_DATAGRAM_SIZE);
+#endif
 
 		while (!this->recv_thread_exit_flag)
 		{
+#if defined(__linux)
+			if (gro)
+			{
+				recv_gro(buffer.data(), (int)buffer.size(), control, sizeof(control));
+				continue;
+			}
+#endif
 			socklen_t addr_len = sizeof(from_addr);
-			ssize_t ret = ::recvfrom(socket_fd, (char*)buffer, sizeof(buffer), 0, (struct sockaddr*)&from_addr, &addr_len);
+			ssize_t ret = ::recvfrom(socket_fd, (char*)buffer.data(), UDP_DATAGRAM_SIZE, 0, (struct sockaddr*)&from_addr, &addr_len);
 			if (ret <= 0)
 				continue;
-			proc_recv(buffer, (int)ret, &from_addr, addr_len);
+			proc_recv(buffer.data(), (int)ret, &from_addr, addr_len);
 		}
 	});
 }
 
+#if defined(__linux)
+void udp_socket::recv_gro(uint8_t* buffer, int size, char* control, int control_size)
+{
+	struct sockaddr_storage from_addr;
+	struct iovec iov = {buffer, (size_t)size};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &from_addr;
+	msg.msg_namelen = sizeof(from_addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = control_size;
+
+	ssize_t ret = ::recvmsg(socket_fd, &msg, 0);
+	if (ret <= 0)
+		return;
+
+	// Without the control message the datagram was not coalesced
+	int segment = (int)ret;
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+			memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+	}
+	if (segment <= 0 || segment > UDP_DATAGRAM_SIZE)
+		return;
+
+	for (int offset = 0; offset < ret; offset += segment)
+	{
+		proc_recv(buffer + offset, std::min(segment, (int)ret - offset), &from_addr, msg.msg_namelen);
+	}
+}
+#endif
+
 void udp_socket::proc_recv(uint8_t* data, int data_len, struct sockaddr_storage* from_addr, socklen_t from_addr_len)
 {
 	std::lock_guard<decltype(recv_queue_mutex)> lock(recv_queue_mutex);
@@ -1,11 +1,18 @@
 ﻿#pragma once
 #include "socket.h"
+#include "utcp/utcp_def.h"
+#include <atomic>
 #include <cstring>
+#include <functional>
 #include <mutex>
 #include <thread>
 #include <vector>
 
 constexpr int UDP_DATAGRAM_SIZE = 2000;
+#if defined(__linux)
+// A UDP_SEGMENT control message
+constexpr int UDP_SEGMENT_CONTROL_SIZE = CMSG_SPACE(sizeof(uint16_t));
+#endif
 
 struct udp_datagram
 {
@@ -23,17 +30,34 @@ struct udp_datagram
 	}
 };
 
+using udp_recv_fn = std::function<void(uint8_t* data, int data_len, struct sockaddr_storage* from_addr, socklen_t from_addr_len)>;
+
+// Blocking recv thread plus sendmmsg, io_uring_socket is the alternative engine
 struct udp_socket
 {
 	udp_socket();
 	virtual ~udp_socket();
 
-	bool listen(const char* ip, int port);
+	// reuse_port: SO_REUSEPORT, several sockets share the port and the kernel spreads the flows over them
+	bool listen(const char* ip, int port, bool reuse_port = false);
 	bool connnect(const char* ip, int port);
 
 	std::vector<udp_datagram>& swap();
+	// Hands every datagram received since the last call to fn, the data is only valid during the call
+	virtual void poll(const udp_recv_fn& fn);
+	// Sends every packet of the batch to addrs[i], with sendmmsg where there is one. Returns the number of syscalls
+	virtual int send_batch(const struct utcp_send_batch* batch, const struct sockaddr_in* addrs);
+
+	// Linux UDP_SEGMENT: a run of packets of the same size to one address in a batch goes out as one datagram the kernel splits.
+	// False if the kernel does not support it
+	bool enable_gso();
+	// Linux UDP_GRO: the kernel may hand over datagrams of one sender coalesced, the recv thread splits them again
+	virtual bool enable_gro();
 
-	volatile int recv_thread_exit_flag = false;
+	std::atomic<bool> recv_thread_exit_flag{false};
+	// Read by the sending and recv threads while enable_gso, enable_gro or a failed GSO send changes them
+	std::atomic<bool> gso{false};
+	std::atomic<bool> gro{false};
 	std::thread recv_thread;
 
 	std::mutex recv_queue_mutex;
@@ -44,7 +68,19 @@ struct udp_socket
 	struct sockaddr_storage dest_addr;
 	socklen_t dest_addr_len = 0;
 
+  protected:
+	// Called once the socket exists, starts receiving
+	virtual bool start_recv();
+#if defined(__linux)
+	// Fills msg for the packets of the batch from i on: one packet, or a GSO run when gso is on. Returns how many it covers
+	int prepare_msg(const struct utcp_send_batch* batch, const struct sockaddr_in* addrs, int i, struct msghdr* msg, struct iovec* iov, char* control);
+#endif
+
   private:
 	void create_recv_thread();
 	void proc_recv(uint8_t* data, int data_len, struct sockaddr_storage* from_addr, socklen_t from_addr_len);
+#if defined(__linux)
+	// One recvmsg, the coalesced datagram is split in segments of the size the kernel reports
+	void recv_gro(uint8_t* buffer, int size, char* control, int control_size);
+#endif
 };
\ No newline at end of file
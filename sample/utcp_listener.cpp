@@ -2,18 +2,31 @@
 #include <cassert>
 #include <cstring>
 
-static bool sockaddr2str(sockaddr_in* addr, char ipstr[], int size)
+udp_utcp_listener::udp_utcp_listener(bool io_uring) : socket(new_udp_socket(io_uring))
 {
-	if (!inet_ntop(addr->sin_family, &addr->sin_addr, ipstr, size))
-		return false;
-	auto len = strlen(ipstr);
-	auto port = ntohs(addr->sin_port);
-	snprintf(ipstr + len, size - len, ":%d", port);
-	return true;
-}
+	constexpr int batch_capacity = 1024;
+	batch_buffer.resize(batch_capacity * UDP_MTU_SIZE);
+	batch_items.resize(batch_capacity);
+	batch_addrs.resize(batch_capacity);
 
-udp_utcp_listener::udp_utcp_listener()
-{
+	memset(&batch, 0, sizeof(batch));
+	batch.Buffer = batch_buffer.data();
+	batch.BufferSize = (uint32_t)batch_buffer.size();
+	batch.Items = batch_items.data();
+	batch.ItemCapacity = batch_capacity;
+	batch.userdata = this;
+	batch.on_full = [](struct utcp_send_batch* batch) {
+		static_cast<udp_utcp_listener*>(batch->userdata)->flush_batch();
+	};
+
+	// A client sends a few handshake packets, a flood from one prefix or of spoofed sources gets few replies
+	struct utcp_listener_limits limits = {};
+	limits.PrefixRate = 100;
+	limits.PrefixBurst = 200;
+	limits.PrefixBuckets = 64 * 1024;
+	limits.ChallengeRate = 50000;
+	limits.ChallengeBurst = 50000;
+	set_limits(&limits);
 }
 
 udp_utcp_listener::~udp_utcp_listener()
@@ -24,28 +37,69 @@ udp_utcp_listener::~udp_utcp_listener()
 	}
 }
 
-bool udp_utcp_listener::listen(const char* ip, int port)
+bool udp_utcp_listener::listen(const char* ip, int port, bool reuse_port)
 {
-	return socket.listen(ip, port);
+	return socket->listen(ip, port, reuse_port);
+}
+
+bool udp_utcp_listener::enable_offload()
+{
+	bool gso = socket->enable_gso();
+	bool gro = socket->enable_gro();
+	return gso && gro;
 }
 
 void udp_utcp_listener::tick()
 {
 	proc_recv_queue();
+	begin_batch();
 	for (auto& it : clients)
 	{
 		it.second->update();
 	}
+	end_batch();
 }
 
 void udp_utcp_listener::post_tick()
 {
 	proc_recv_queue();
+	begin_batch();
 	for (auto& it : clients)
 	{
 		it.second->flush_incoming_cache();
 		it.second->send_flush();
 	}
+	end_batch();
+}
+
+void udp_utcp_listener::begin_batch()
+{
+	assert(batch.Count == 0);
+	utcp_set_send_batch(&batch);
+}
+
+void udp_utcp_listener::end_batch()
+{
+	utcp_set_send_batch(nullptr);
+	flush_batch();
+}
+
+void udp_utcp_listener::flush_batch()
+{
+	// A packet of a connection without an address is dropped, the items after it move down
+	int count = 0;
+	for (int i = 0; i < batch.Count; ++i)
+	{
+		auto it = client_addrs.find(static_cast<utcp::event_handler*>(batch.Items[i].userdata));
+		if (it == client_addrs.end())
+			continue;
+		batch.Items[count] = batch.Items[i];
+		batch_addrs[count++] = it->second;
+	}
+	batch.Count = count;
+	socket->send_batch(&batch, batch_addrs.data());
+	batch.Count = 0;
+	batch.BufferUsed = 0;
 }
 
 void udp_utcp_listener::on_accept(bool reconnect)
@@ -71,41 +125,33 @@ void udp_utcp_listener::on_accept(bool reconnect)
 			return;
 	}
 
-	auto it = clients.insert(std::make_pair(*(sockaddr_in*)&socket.dest_addr, conn));
+	auto it = clients.insert(std::make_pair(*(sockaddr_in*)&socket->dest_addr, conn));
 	assert(it.second);
+	client_addrs[conn] = *(sockaddr_in*)&socket->dest_addr;
 
 	accept(conn, reconnect);
 }
 
 void udp_utcp_listener::on_outgoing(const void* data, int len)
 {
-	assert(socket.dest_addr_len > 0);
-	sendto(socket.socket_fd, (const char*)data, len, 0, (sockaddr*)&socket.dest_addr, socket.dest_addr_len);
+	assert(socket->dest_addr_len > 0);
+	sendto(socket->socket_fd, (const char*)data, len, 0, (sockaddr*)&socket->dest_addr, socket->dest_addr_len);
 }
 
 void udp_utcp_listener::proc_recv_queue()
 {
-	auto& proc_queue = socket.swap();
-	char ipstr[INET6_ADDRSTRLEN + 8];
-
-	for (auto& datagram : proc_queue)
-	{
-		assert(datagram.from_addr_len == sizeof(sockaddr_in));
-		auto it = clients.find(*(sockaddr_in*)&datagram.from_addr);
+	socket->poll([this](uint8_t* data, int data_len, struct sockaddr_storage* from_addr, socklen_t from_addr_len) {
+		assert(from_addr_len == sizeof(sockaddr_in));
+		auto it = clients.find(*(sockaddr_in*)from_addr);
 		if (it != clients.end())
 		{
-			it->second->incoming(datagram.data, datagram.data_len);
-			continue;
-		}
-
-		if (sockaddr2str((sockaddr_in*)&datagram.from_addr, ipstr, sizeof(ipstr)))
-		{
-			socket.dest_addr_len = datagram.from_addr_len;
-			memcpy(&socket.dest_addr, &datagram.from_addr, socket.dest_addr_len);
-			incoming(ipstr, datagram.data, datagram.data_len);
+			it->second->incoming(data, data_len);
+			return;
 		}
-		socket.dest_addr_len = 0;
-	}
 
-	proc_queue.clear();
+		socket->dest_addr_len = from_addr_len;
+		memcpy(&socket->dest_addr, from_addr, socket->dest_addr_len);
+		incoming((const sockaddr*)from_addr, (int)from_addr_len, data, data_len);
+		socket->dest_addr_len = 0;
+	});
 }
@@ -1,6 +1,7 @@
 ﻿#pragma once
 #include "abstract/utcp.hpp"
-#include "udp_socket.h"
+#include "io_uring_socket.h"
+#include <memory>
 #include <unordered_map>
 #include <vector>
 
@@ -25,11 +26,16 @@ struct sockaddr_in_Equal
 
 class udp_utcp_listener : public utcp::listener
 {
+	friend class udp_utcp_listener_group;
+
   public:
-	udp_utcp_listener();
+	// io_uring selects io_uring_socket where the kernel has it
+	udp_utcp_listener(bool io_uring = false);
 	~udp_utcp_listener();
 
-	bool listen(const char* ip, int port);
+	bool listen(const char* ip, int port, bool reuse_port = false);
+	// UDP GSO/GRO where the kernel has them, see udp_socket
+	bool enable_offload();
 
 	void tick();
 	void post_tick();
@@ -40,13 +46,28 @@ class udp_utcp_listener : public utcp::listener
 	virtual utcp::conn* new_conn() = 0;
 	void proc_recv_queue();
 
+	// The connections append their packets to the batch during tick and post_tick, which sends them with a few syscalls.
+	// The batch is set for the calling thread only, the workers of a udp_utcp_listener_group each batch their own
+	void begin_batch();
+	void end_batch();
+	void flush_batch();
+
   protected:
-	udp_socket socket;
+	std::unique_ptr<udp_socket> socket;
 	std::unordered_map<struct sockaddr_in, utcp::conn*, sockaddr_in_Hash, sockaddr_in_Equal> clients;
+	std::unordered_map<utcp::event_handler*, struct sockaddr_in> client_addrs;
+
+	struct utcp_send_batch batch;
+	std::vector<uint8_t> batch_buffer;
+	std::vector<struct utcp_send_batch_item> batch_items;
+	std::vector<struct sockaddr_in> batch_addrs;
 };
 
 template <typename T> class udp_utcp_listener_impl : public udp_utcp_listener
 {
+  public:
+	using udp_utcp_listener::udp_utcp_listener;
+
   protected:
 	virtual utcp::conn* new_conn() override
 	{
@@ -55,7 +76,7 @@ template <typename T> class udp_utcp_listener_impl : public udp_utcp_listener
 
 	virtual void accept(utcp::conn* c, bool reconnect) override
 	{
-		static_cast<T*>(c)->bind(socket.socket_fd, &socket.dest_addr, socket.dest_addr_len);
+		static_cast<T*>(c)->bind(socket->socket_fd, &socket->dest_addr, socket->dest_addr_len);
 		udp_utcp_listener::accept(c, reconnect);
 	}
 };
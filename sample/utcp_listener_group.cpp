@@ -0,0 +1,87 @@
+﻿#include "utcp_listener_group.h"
+#include <future>
+
+udp_utcp_listener_group::udp_utcp_listener_group(listener_factory new_listener, std::chrono::milliseconds tick_interval)
+	: new_listener(new_listener), tick_interval(tick_interval)
+{
+	// utcp_listener_init also picks the SHA-1 code for the CPU, here on the calling thread before any worker hashes a cookie
+	secret = utcp_listener_create();
+	utcp_listener_init(secret, nullptr);
+}
+
+udp_utcp_listener_group::~udp_utcp_listener_group()
+{
+	stop();
+	utcp_listener_destroy(secret);
+}
+
+bool udp_utcp_listener_group::listen(const char* ip, int port, int worker_count)
+{
+	std::vector<std::future<bool>> results;
+	for (int i = 0; i < worker_count; ++i)
+	{
+		auto result = std::make_shared<std::promise<bool>>();
+		results.push_back(result->get_future());
+
+		workers.emplace_back(new worker);
+		worker* w = workers.back().get();
+		w->thread = std::thread([this, w, ip, port, result]() {
+			w->listener.reset(new_listener());
+			bool ok = w->listener->listen(ip, port, true);
+			if (ok)
+				sync_secret(w);
+			result->set_value(ok);
+			if (ok)
+				run(w);
+		});
+	}
+
+	bool ok = true;
+	for (auto& result : results)
+	{
+		ok = result.get() && ok;
+	}
+	if (!ok)
+		stop();
+	return ok;
+}
+
+void udp_utcp_listener_group::stop()
+{
+	exit_flag = true;
+	for (auto& w : workers)
+	{
+		if (w->thread.joinable())
+			w->thread.join();
+	}
+	workers.clear();
+}
+
+void udp_utcp_listener_group::rotate_secret()
+{
+	std::lock_guard<decltype(secret_mutex)> lock(secret_mutex);
+	utcp_listener_update_secret(secret, nullptr);
+	secret_generation++;
+}
+
+void udp_utcp_listener_group::run(worker* w)
+{
+	int64_t frame = 0;
+	while (!exit_flag)
+	{
+		std::this_thread::sleep_for(tick_interval);
+		if (w->secret_generation != secret_generation)
+			sync_secret(w);
+
+		w->listener->tick();
+		if (++frame % 10 == 0)
+			w->listener->post_tick();
+	}
+}
+
+void udp_utcp_listener_group::sync_secret(worker* w)
+{
+	std::lock_guard<decltype(secret_mutex)> lock(secret_mutex);
+	w->listener->copy_secret(secret);
+	w->secret_generation = secret_generation;
+}
@@ -0,0 +1,53 @@
+﻿#pragma once
+#include "utcp_listener.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// N listeners on one port with SO_REUSEPORT, each with its own socket and worker thread. The kernel hashes the flow of a client
+// to one socket, so a client stays with the worker that accepted it.
+// The handshake secrets are rotated here and every worker copies them at its next tick: a cookie issued by one worker validates
+// on the others, for the clients whose flow moves while the group changes.
+// The workers share the utcp_config callbacks, set them before listen and leave them alone while the workers run.
+// Each worker batches the sends of its tick like a single udp_utcp_listener, the send batch is per thread.
+// The clock may be advanced from any thread, utcp_add_elapsed_time is atomic
+class udp_utcp_listener_group
+{
+  public:
+	// Called on the worker thread, the io_uring engine has to be created by the thread that drives it
+	using listener_factory = std::function<udp_utcp_listener*()>;
+
+	udp_utcp_listener_group(listener_factory new_listener, std::chrono::milliseconds tick_interval = std::chrono::milliseconds(5));
+	~udp_utcp_listener_group();
+
+	// Starts the workers, false if one of them could not listen
+	bool listen(const char* ip, int port, int worker_count);
+	void stop();
+
+	// New secrets for every worker, call it every SECRET_UPDATE_TIME seconds or so
+	void rotate_secret();
+
+  private:
+	struct worker
+	{
+		std::unique_ptr<udp_utcp_listener> listener;
+		std::thread thread;
+		uint64_t secret_generation = 0;
+	};
+
+	void run(worker* w);
+	void sync_secret(worker* w);
+
+	listener_factory new_listener;
+	std::chrono::milliseconds tick_interval;
+	std::vector<std::unique_ptr<worker>> workers;
+	std::atomic<bool> exit_flag{false};
+
+	std::mutex secret_mutex;
+	struct utcp_listener* secret;
+	std::atomic<uint64_t> secret_generation{1};
+};
@@ -0,0 +1,145 @@
+// Cost and gain of UTCP_FEATURE_BYTE_ALIGNED.
+// The micro benchmark copies MTU sized payloads in and out of a packet at a byte aligned and at an odd bit position,
+// the loopback benchmark sends replication sized unreliable bunches through two connections with the feature on and off.
+extern "C"
+{
+#include "utcp/bit_buffer.h"
+#include "utcp/utcp.h"
+#include "utcp/utcp_def_internal.h"
+#include "utcp/utcp_packet.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static double copy_payloads(size_t offset, int rounds)
+{
+	uint8_t payload[UTCP_MAX_PACKET - 32];
+	uint8_t packet[UTCP_MAX_PACKET];
+	uint8_t received[sizeof(payload)];
+	for (size_t i = 0; i < sizeof(payload); ++i)
+		payload[i] = (uint8_t)(i * 7);
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; ++round)
+	{
+		memset(packet, 0, sizeof(packet));
+		struct bitbuf writer;
+		bitbuf_write_init(&writer, packet, sizeof(packet));
+		writer.num = offset;
+		bitbuf_write_bits(&writer, payload, sizeof(payload) * 8);
+
+		struct bitbuf reader = {packet, writer.num, offset};
+		bitbuf_read_bits(&reader, received, sizeof(received) * 8);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	if (memcmp(payload, received, sizeof(payload)) != 0)
+		printf("copy mismatch at offset %zu\n", offset);
+	return seconds * 1e9 / rounds;
+}
+
+struct loopback_stats
+{
+	size_t bytes = 0;
+	size_t packets = 0;
+	size_t bunches = 0;
+};
+
+static void loopback(const char* name, uint8_t Features, int ticks)
+{
+	static loopback_stats stats;
+	stats = loopback_stats();
+
+	auto config = utcp_get_config();
+	config->on_outgoing = [](void* fd, void* userdata, const void* data, int len) {
+		auto packets = (std::vector<std::vector<uint8_t>>*)userdata;
+		packets->emplace_back((const uint8_t*)data, (const uint8_t*)data + len);
+	};
+	config->on_recv_bunch = [](struct utcp_connection* fd, void* userdata, struct utcp_bunch* const bunches[], int count) {
+		stats.bunches += count;
+	};
+
+	std::vector<std::vector<uint8_t>> server_out, client_out;
+	utcp_connection server, client;
+	utcp_init(&server, &server_out);
+	utcp_init(&client, &client_out);
+	utcp_sequence_init(&server, 1000, 2000);
+	utcp_sequence_init(&client, 2000, 1000);
+	server.Features = Features;
+	client.Features = Features;
+
+	enum
+	{
+		ChannelCount = 32,
+	};
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.NameIndex = 255;
+	bunch.bReliable = 1;
+	bunch.bOpen = 1;
+	bunch.DataBitsLen = 8;
+	for (uint16_t ChIndex = 1; ChIndex <= ChannelCount; ++ChIndex)
+	{
+		bunch.ChIndex = ChIndex;
+		utcp_send_bunch(&server, &bunch);
+	}
+	utcp_send_flush(&server);
+	for (auto& packet : server_out)
+		utcp_incoming(&client, packet.data(), (int)packet.size());
+	server_out.clear();
+	stats.bunches = 0;
+
+	uint32_t seed = 1;
+	std::chrono::duration<double> elapsed(0);
+	for (int tick = 0; tick < ticks; ++tick)
+	{
+		auto begin = std::chrono::steady_clock::now();
+		memset(&bunch, 0, sizeof(bunch));
+		for (uint16_t ChIndex = 1; ChIndex <= ChannelCount; ++ChIndex)
+		{
+			seed = seed * 1103515245 + 12345;
+			bunch.ChIndex = ChIndex;
+			bunch.DataBitsLen = (uint16_t)(8 * (16 + (seed >> 16) % 200));
+			utcp_send_bunch(&server, &bunch);
+		}
+		utcp_send_flush(&server);
+		for (auto& packet : server_out)
+		{
+			stats.bytes += packet.size();
+			stats.packets++;
+			utcp_incoming(&client, packet.data(), (int)packet.size());
+		}
+		server_out.clear();
+		elapsed += std::chrono::steady_clock::now() - begin;
+
+		// Keep the ack window moving
+		utcp_add_elapsed_time(1000 * 1000 * 1000);
+		utcp_send_flush(&client);
+		for (auto& packet : client_out)
+			utcp_incoming(&server, packet.data(), (int)packet.size());
+		client_out.clear();
+	}
+
+	utcp_uninit(&server);
+	utcp_uninit(&client);
+	config->on_outgoing = nullptr;
+	config->on_recv_bunch = nullptr;
+
+	printf("%-8s packets=%zu bunches=%zu bytes=%zu %.1f bytes/packet %.1f us/tick\n", name, stats.packets, stats.bunches, stats.bytes,
+		   (double)stats.bytes / stats.packets, elapsed.count() * 1e6 / ticks);
+}
+
+int main()
+{
+	const int rounds = 200000;
+	double aligned = copy_payloads(16, rounds);
+	double unaligned = copy_payloads(13, rounds);
+	printf("copy %d bytes: aligned %.1f ns, unaligned %.1f ns\n", UTCP_MAX_PACKET - 32, aligned, unaligned);
+
+	const int ticks = 20000;
+	loopback("bits", 0, ticks);
+	loopback("aligned", UTCP_FEATURE_BYTE_ALIGNED, ticks);
+	return 0;
+}
@@ -0,0 +1,54 @@
+// bitbuf_copy_bits against the byte at a time reference, for bunch and MTU sized copies at different bit phases.
+extern "C"
+{
+#include "utcp/bit_buffer.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <initializer_list>
+
+using copy_fn = void (*)(uint8_t*, size_t, const uint8_t*, size_t, size_t);
+
+static double measure(copy_fn fn, size_t dest_bit, size_t src_bit, size_t bits_size, int rounds)
+{
+	static uint8_t src[2048];
+	static uint8_t dest[2048];
+	for (size_t i = 0; i < sizeof(src); ++i)
+		src[i] = (uint8_t)(i * 31);
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; ++round)
+	{
+		fn(dest, dest_bit, src, src_bit, bits_size);
+		src[round & 1023] ^= dest[(round * 7) & 1023]; // Keep the copies from being hoisted out of the loop
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() * 1e9 / rounds;
+}
+
+int main()
+{
+	struct
+	{
+		const char* name;
+		size_t dest_bit;
+		size_t src_bit;
+	} phases[] = {
+		{"aligned", 0, 0},
+		{"same phase", 3, 3},
+		{"write", 5, 0},
+		{"read", 0, 5},
+		{"mixed", 3, 6},
+	};
+
+	const int rounds = 200000;
+	for (size_t bytes : {16, 64, 256, 1024})
+	{
+		for (auto& phase : phases)
+		{
+			double reference = measure(bitbuf_copy_bits_reference, phase.dest_bit, phase.src_bit, bytes * 8, rounds);
+			double wide = measure(bitbuf_copy_bits, phase.dest_bit, phase.src_bit, bytes * 8, rounds);
+			printf("%4zu bytes %-10s reference %8.1f ns  wide %8.1f ns  x%.1f\n", bytes, phase.name, reference, wide, reference / wide);
+		}
+	}
+	return 0;
+}
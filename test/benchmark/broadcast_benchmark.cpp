@@ -0,0 +1,109 @@
+// Fan-out of one reliable bunch to 1 to 1000 connections, sent to each on its own against utcp_send_shared_bunch.
+// Every round a new 800 byte bunch goes to all the connections, then they are flushed. Nothing is acked, so the
+// reliable buffers keep what was sent: a full copy per connection, or the header and a reference to the shared bunch.
+#include "abstract/utcp.hpp"
+extern "C"
+{
+#include "utcp/utcp_packet.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+struct counting_conn : public utcp::conn
+{
+	size_t packets = 0;
+	size_t bytes = 0;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		packets++;
+		bytes += len;
+	}
+};
+
+enum
+{
+	Rounds = 64,
+	PayloadBytes = 800,
+};
+
+static void make_bunch(int round, struct utcp_bunch* bunch)
+{
+	memset(bunch, 0, offsetof(struct utcp_bunch, Data));
+	bunch->NameIndex = 255;
+	bunch->ChIndex = 3;
+	bunch->bOpen = round == 0;
+	bunch->bReliable = 1;
+	bunch->DataBitsLen = PayloadBytes * 8;
+	for (int i = 0; i < PayloadBytes; ++i)
+		bunch->Data[i] = (uint8_t)(round + i * 7);
+}
+
+static double run(int recipients, bool shared, size_t* out_bytes)
+{
+	std::vector<std::unique_ptr<counting_conn>> conns;
+	for (int i = 0; i < recipients; ++i)
+	{
+		conns.emplace_back(new counting_conn);
+		utcp_sequence_init(conns.back()->get_fd(), 1000, 2000);
+	}
+
+	struct utcp_bunch bunch;
+	auto begin = std::chrono::steady_clock::now();
+	for (int round = 0; round < Rounds; ++round)
+	{
+		make_bunch(round, &bunch);
+		if (shared)
+		{
+			struct utcp_bunch_header header;
+			memcpy(&header, &bunch, sizeof(header));
+			const struct utcp_iov iov = {bunch.Data, bunch.DataBitsLen};
+			struct utcp_shared_bunch* shared_bunch = utcp_shared_bunch_create(&header, &iov, 1);
+			for (auto& conn : conns)
+				utcp_send_shared_bunch(conn->get_fd(), shared_bunch);
+			utcp_shared_bunch_release(shared_bunch);
+		}
+		else
+		{
+			for (auto& conn : conns)
+				utcp_send_bunch(conn->get_fd(), &bunch);
+		}
+
+		for (auto& conn : conns)
+			conn->send_flush();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	*out_bytes = 0;
+	for (auto& conn : conns)
+		*out_bytes += conn->bytes;
+	return seconds;
+}
+
+int main()
+{
+	utcp::event_handler::config(nullptr);
+
+	// What every connection keeps per reliable bunch until it is acked
+	const size_t full_node = sizeof(struct utcp_bunch_node);
+	const size_t shared_node = offsetof(struct utcp_bunch_node, bunch_data) + MAX_BUNCH_HEADER_BYTES + 1;
+	printf("reliable buffer per bunch: copy=%zuB shared=%zuB + %zuB once\n", full_node, shared_node, sizeof(struct utcp_shared_bunch) + PayloadBytes);
+
+	for (int recipients : {1, 10, 100, 1000})
+	{
+		size_t copy_bytes, shared_bytes;
+		double copy_seconds = run(recipients, false, &copy_bytes);
+		double shared_seconds = run(recipients, true, &shared_bytes);
+		if (copy_bytes != shared_bytes)
+			printf("output differs: %zu != %zu\n", copy_bytes, shared_bytes);
+
+		double sends = (double)Rounds * recipients;
+		printf("recipients=%-5d copy %.1f ns/send  shared %.1f ns/send (%.2fx)\n", recipients, copy_seconds * 1e9 / sends, shared_seconds * 1e9 / sends,
+			   copy_seconds / shared_seconds);
+	}
+	return 0;
+}
@@ -0,0 +1,127 @@
+﻿// Bunch header bits per bunch, full headers against UTCP_FEATURE_DELTA_HEADER.
+// The trace is generated to look like actor replication: every tick the relevant actor channels send their property
+// updates in channel order, some send reliable RPCs, and actors come and go.
+extern "C"
+{
+#include "utcp/utcp_bunch.h"
+#include "utcp/utcp_def_internal.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+struct trace_bunch
+{
+	utcp_bunch bunch;
+	bool bNewPacket;
+};
+
+static std::vector<trace_bunch> generate_trace(int ticks)
+{
+	enum
+	{
+		ActorCount = 64,
+		FirstActorChannel = 3,
+		PacketBits = UTCP_MAX_PACKET * 8,
+	};
+
+	std::vector<trace_bunch> trace;
+	int32_t out_reliable[FirstActorChannel + ActorCount * 2] = {};
+	bool opened[FirstActorChannel + ActorCount * 2] = {};
+	uint32_t seed = 1;
+	auto next_rand = [&seed](uint32_t range) {
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 16) % range;
+	};
+
+	for (int tick = 0; tick < ticks; ++tick)
+	{
+		int packet_bits = PacketBits;
+		for (uint16_t ChIndex = FirstActorChannel; ChIndex < FirstActorChannel + ActorCount * 2; ++ChIndex)
+		{
+			// Half of the actors are relevant, the others wake up now and then
+			bool bRelevant = ChIndex < FirstActorChannel + ActorCount || next_rand(100) < 5;
+			if (!bRelevant || next_rand(100) >= 70)
+				continue;
+
+			trace_bunch item;
+			memset(&item, 0, sizeof(item));
+			utcp_bunch& bunch = item.bunch;
+			bunch.ChIndex = ChIndex;
+			bunch.NameIndex = 255; // NAME_Actor
+
+			if (!opened[ChIndex])
+			{
+				opened[ChIndex] = true;
+				bunch.bOpen = 1;
+				bunch.bReliable = 1;
+				bunch.DataBitsLen = (uint16_t)(400 + next_rand(400));
+			}
+			else if (next_rand(100) < 10)
+			{
+				bunch.bReliable = 1;
+				bunch.DataBitsLen = (uint16_t)(40 + next_rand(80));
+			}
+			else if (next_rand(1000) < 5)
+			{
+				opened[ChIndex] = false;
+				bunch.bClose = 1;
+				bunch.bReliable = 1;
+				bunch.CloseReason = 1; // Relevancy
+			}
+			else
+			{
+				bunch.DataBitsLen = (uint16_t)(24 + next_rand(120));
+			}
+
+			if (bunch.bReliable)
+				bunch.ChSequence = ++out_reliable[ChIndex];
+
+			int bunch_bits = 64 + bunch.DataBitsLen;
+			item.bNewPacket = packet_bits + bunch_bits > PacketBits;
+			packet_bits = item.bNewPacket ? bunch_bits : packet_bits + bunch_bits;
+			trace.push_back(item);
+		}
+	}
+	return trace;
+}
+
+int main()
+{
+	std::vector<trace_bunch> trace = generate_trace(1000);
+	uint8_t buffer[MAX_BUNCH_HEADER_BYTES];
+
+	size_t full_bits = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (auto& item : trace)
+	{
+		struct bitbuf bitbuf;
+		bitbuf_write_init(&bitbuf, buffer, sizeof(buffer));
+		utcp_bunch_write_header(&item.bunch, &bitbuf);
+		full_bits += bitbuf.num;
+	}
+	double full_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	size_t delta_bits = 0;
+	struct utcp_bunch_delta_context ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	begin = std::chrono::steady_clock::now();
+	for (auto& item : trace)
+	{
+		if (item.bNewPacket)
+			ctx.bValid = 0;
+
+		struct bitbuf bitbuf;
+		bitbuf_write_init(&bitbuf, buffer, sizeof(buffer));
+		utcp_bunch_write_header_delta(&item.bunch, &bitbuf, &ctx);
+		delta_bits += bitbuf.num;
+	}
+	double delta_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	double count = (double)trace.size();
+	printf("bunches=%zu\n", trace.size());
+	printf("full   %.2f bits/bunch %.1f ns/bunch\n", full_bits / count, full_seconds * 1e9 / count);
+	printf("delta  %.2f bits/bunch %.1f ns/bunch (%.1f%% of full)\n", delta_bits / count, delta_seconds * 1e9 / count, delta_bits * 100.0 / full_bits);
+	return 0;
+}
@@ -0,0 +1,131 @@
+﻿// Throughput of the packet compression codec on replication-like payloads.
+// The payloads are generated: actors with a fixed property layout whose values drift a little every tick,
+// which is what a replication capture mostly looks like. Pass a capture file (raw packet payloads) to measure that instead.
+extern "C"
+{
+#include "utcp/utcp_compress.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+using payload_list = std::vector<std::vector<uint8_t>>;
+
+static payload_list generate_payloads(int ticks)
+{
+	payload_list payloads;
+	uint32_t seed = 1;
+	float positions[32][3] = {};
+	for (int tick = 0; tick < ticks; ++tick)
+	{
+		std::vector<uint8_t> payload;
+		for (int actor = 0; actor < 32; ++actor)
+		{
+			// NetGUID, property handles and replication flags, the same every tick
+			const uint8_t layout[] = {(uint8_t)(actor * 2 + 1), 0x00, 0x06, 0x82, 0x01, 0x00, 0x10, 0x03};
+			payload.insert(payload.end(), layout, layout + sizeof(layout));
+
+			for (auto& axis : positions[actor])
+			{
+				seed = seed * 1103515245 + 12345;
+				axis += (float)((seed >> 16) % 16) / 8.0f;
+				uint8_t bytes[sizeof(float)];
+				memcpy(bytes, &axis, sizeof(bytes));
+				payload.insert(payload.end(), bytes, bytes + sizeof(bytes));
+			}
+		}
+		payloads.push_back(std::move(payload));
+	}
+	return payloads;
+}
+
+static payload_list load_payloads(const char* path)
+{
+	// Length prefixed records: uint16 little endian size, then the payload
+	payload_list payloads;
+	FILE* file = fopen(path, "rb");
+	if (!file)
+		return payloads;
+
+	uint8_t size[2];
+	while (fread(size, 1, sizeof(size), file) == sizeof(size))
+	{
+		std::vector<uint8_t> payload(size[0] | (size[1] << 8));
+		if (fread(payload.data(), 1, payload.size(), file) != payload.size())
+			break;
+		payloads.push_back(std::move(payload));
+	}
+	fclose(file);
+	return payloads;
+}
+
+static void run(const char* name, const payload_list& payloads, int rounds)
+{
+	size_t raw_bytes = 0;
+	size_t compressed_bytes = 0;
+	std::vector<std::vector<uint8_t>> compressed(payloads.size());
+	for (size_t i = 0; i < payloads.size(); ++i)
+	{
+		compressed[i].resize(payloads[i].size() * 2 + 16);
+		int len = utcp_compress(payloads[i].data(), (int)payloads[i].size(), compressed[i].data(), (int)compressed[i].size());
+		compressed[i].resize(len);
+		raw_bytes += payloads[i].size();
+		compressed_bytes += len;
+	}
+
+	uint8_t buffer[64 * 1024];
+
+	auto wall_begin = std::chrono::steady_clock::now();
+	clock_t cpu_begin = clock();
+	for (int round = 0; round < rounds; ++round)
+	{
+		for (auto& payload : payloads)
+			utcp_compress(payload.data(), (int)payload.size(), buffer, sizeof(buffer));
+	}
+	double compress_cpu = (double)(clock() - cpu_begin) / CLOCKS_PER_SEC;
+	double compress_wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+
+	wall_begin = std::chrono::steady_clock::now();
+	cpu_begin = clock();
+	for (int round = 0; round < rounds; ++round)
+	{
+		for (size_t i = 0; i < compressed.size(); ++i)
+			utcp_decompress(compressed[i].data(), (int)compressed[i].size(), buffer, sizeof(buffer));
+	}
+	double decompress_cpu = (double)(clock() - cpu_begin) / CLOCKS_PER_SEC;
+	double decompress_wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+
+	double mb = (double)raw_bytes * rounds / (1024 * 1024);
+	printf("%-16s packets=%zu ratio=%.3f compress=%.1fMB/s (%.2fms cpu/MB) decompress=%.1fMB/s (%.2fms cpu/MB)\n", name, payloads.size(),
+		   (double)compressed_bytes / (double)raw_bytes, mb / compress_wall, compress_cpu * 1000 / mb, mb / decompress_wall, decompress_cpu * 1000 / mb);
+}
+
+int main(int argc, char* argv[])
+{
+	payload_list payloads = argc > 1 ? load_payloads(argv[1]) : generate_payloads(2000);
+	if (payloads.empty())
+	{
+		printf("no payloads\n");
+		return 1;
+	}
+
+	// Train the dictionary on the first ticks and measure on the rest
+	std::vector<uint8_t> dict;
+	size_t first = 0;
+	while (first < payloads.size() / 2 && dict.size() + payloads[first].size() <= UTCP_MAX_DICTIONARY_SIZE)
+	{
+		dict.insert(dict.end(), payloads[first].begin(), payloads[first].end());
+		first++;
+	}
+	payload_list samples(payloads.begin() + first, payloads.end());
+
+	const int rounds = 50;
+	utcp_compress_set_dictionary(nullptr, 0);
+	run("no dictionary", samples, rounds);
+
+	utcp_compress_set_dictionary(dict.data(), (int)dict.size());
+	run("dictionary", samples, rounds);
+	return 0;
+}
@@ -0,0 +1,258 @@
+// Handshake cookies per second on one core: the HMAC from the secret every time, from the key state cached when the
+// secret rotates, the cached state with the SHA extensions, and eight at a time with the AVX2 multi-buffer SHA-1.
+// Then the whole listener path for initial packets (challenges) and challenge responses (acks), one datagram at a time
+// through utcp_listener_incoming against 64 at a time through utcp_listener_incoming_batch. Last, initial packets from
+// spoofed addresses, formatted to "ip:port" for utcp_listener_incoming against the sockaddr for utcp_listener_incoming_addr.
+#include "abstract/utcp.hpp"
+extern "C"
+{
+#include "utcp/sha1.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__linux)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
+enum
+{
+	Cookies = 1000000,
+	Challenges = 256 * 1024,
+};
+
+// Timestamp, address length and address, like GenerateCookie
+static size_t make_cookie_data(int i, uint8_t* out)
+{
+	char address[64];
+	double timestamp = 1000.0 + i * 0.001;
+	size_t len = (size_t)snprintf(address, sizeof(address), "203.0.%d.%d:%d", (i >> 8) & 0xff, i & 0xff, 40000 + (i & 0x3fff));
+	memcpy(out, &timestamp, sizeof(timestamp));
+	memcpy(out + sizeof(timestamp), &len, sizeof(len));
+	memcpy(out + sizeof(timestamp) + sizeof(len), address, len);
+	return sizeof(timestamp) + sizeof(len) + len;
+}
+
+enum hash_mode
+{
+	portable,
+	sha_ni,
+	multi_buffer,
+};
+
+// The multi-buffer mode keeps the SHA extensions for what is hashed one at a time, false when the CPU lacks either
+static bool select_hash(hash_mode mode)
+{
+	bool hardware = Sha1UseHardware(mode != portable) == (mode != portable);
+	bool multi = sha1_use_multi_buffer(mode == multi_buffer) == (mode == multi_buffer);
+	return hardware && multi;
+}
+
+static void run_cookies(const char* name, bool cached, hash_mode mode, const uint8_t* secret)
+{
+	if (!select_hash(mode))
+		return;
+
+	std::vector<uint8_t> data(1024 * 96);
+	std::vector<size_t> sizes(1024);
+	for (int i = 0; i < 1024; ++i)
+		sizes[i] = make_cookie_data(i, &data[i * 96]);
+
+	struct sha1_hmac_key key;
+	sha1_hmac_key_init(&key, secret, 64);
+
+	uint8_t cookie[64][20];
+	struct sha1_hmac_job jobs[64];
+	uint8_t check = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < Cookies; i += 64)
+	{
+		for (int j = 0; j < 64; ++j)
+		{
+			const uint8_t* item = &data[((i + j) & 1023) * 96];
+			if (mode == multi_buffer)
+				jobs[j] = {&key, item, (uint32_t)sizes[(i + j) & 1023], cookie[j]};
+			else if (cached)
+				sha1_hmac_key_buffer(&key, item, sizes[(i + j) & 1023], cookie[j]);
+			else
+				sha1_hmac_buffer(secret, 64, item, sizes[(i + j) & 1023], cookie[j]);
+		}
+		if (mode == multi_buffer)
+			sha1_hmac_key_buffers(jobs, 64);
+		check ^= cookie[i & 63][0];
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	printf("%-22s %.2f M cookies/s, %.0f ns/cookie (%02x)\n", name, Cookies / seconds / 1e6, seconds * 1e9 / Cookies, check);
+}
+
+struct capture_conn : public utcp::conn
+{
+	std::vector<uint8_t> last;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		last.assign((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+};
+
+struct capture_listener : public utcp::listener
+{
+	std::vector<uint8_t> last;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		last.assign((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+};
+
+// Initial packets and the challenge responses of 1024 clients, whose acks wait in the pending accept table
+struct handshake_traffic
+{
+	capture_listener listener;
+	char addresses[1024][64];
+	std::vector<std::vector<uint8_t>> initial;
+	std::vector<std::vector<uint8_t>> responses;
+
+	handshake_traffic()
+	{
+		listener.set_pending_accepts(1024);
+		for (int i = 0; i < 1024; ++i)
+		{
+			snprintf(addresses[i], sizeof(addresses[i]), "203.0.%d.%d:%d", (i >> 8) & 0xff, i & 0xff, 40000 + i);
+			capture_conn client;
+			utcp_connect(client.get_fd());
+			initial.push_back(client.last);
+			listener.incoming(addresses[i], client.last.data(), (int)client.last.size());
+			client.incoming(listener.last.data(), (int)listener.last.size());
+			responses.push_back(client.last);
+		}
+	}
+
+	~handshake_traffic()
+	{
+		listener.set_pending_accepts(0);
+	}
+};
+
+static void run_listener(handshake_traffic& traffic, const char* name, bool responses, bool batched, hash_mode mode)
+{
+	if (!select_hash(mode))
+		return;
+
+	auto& packets = responses ? traffic.responses : traffic.initial;
+	std::vector<utcp_listener_datagram> datagrams(64);
+	utcp_accept_info accepts[1024];
+	size_t replies = 0;
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < Challenges; i += 64)
+	{
+		if (batched)
+		{
+			for (int j = 0; j < 64; ++j)
+			{
+				auto& packet = packets[(i + j) & 1023];
+				datagrams[j].Address = traffic.addresses[(i + j) & 1023];
+				datagrams[j].Buffer = packet.data();
+				datagrams[j].Len = (int32_t)packet.size();
+			}
+			utcp_listener_incoming_batch(traffic.listener.get_fd(), datagrams.data(), 64);
+			for (auto& datagram : datagrams)
+				replies += datagram.ReplyLen > 0;
+		}
+		else
+		{
+			for (int j = 0; j < 64; ++j)
+			{
+				auto& packet = packets[(i + j) & 1023];
+				traffic.listener.last.clear();
+				traffic.listener.incoming(traffic.addresses[(i + j) & 1023], packet.data(), (int)packet.size());
+				replies += !traffic.listener.last.empty();
+			}
+		}
+		if (responses && (i & 1023) == 1024 - 64)
+			traffic.listener.take_accepts(accepts, 1024);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	printf("%-30s %.2f M/s, %.0f ns/datagram%s\n", name, Challenges / seconds / 1e6, seconds * 1e9 / Challenges, replies == Challenges ? "" : " (missing replies)");
+}
+
+#if defined(__linux)
+static void run_spoofed(handshake_traffic& traffic, const char* name, bool formatted)
+{
+	std::vector<struct sockaddr_in> addrs(1024);
+	for (int i = 0; i < 1024; ++i)
+	{
+		memset(&addrs[i], 0, sizeof(addrs[i]));
+		addrs[i].sin_family = AF_INET;
+		addrs[i].sin_port = htons((uint16_t)(1024 + i * 37));
+		addrs[i].sin_addr.s_addr = htonl(0x0a000000u + (uint32_t)i * 2654435761u % 0xffffff);
+	}
+
+	char ipstr[INET6_ADDRSTRLEN + 8];
+	size_t replies = 0;
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < Challenges; ++i)
+	{
+		auto& packet = traffic.initial[i & 1023];
+		auto& addr = addrs[i & 1023];
+		traffic.listener.last.clear();
+		if (formatted)
+		{
+			// What the sample did for every datagram from an unknown address
+			inet_ntop(AF_INET, &addr.sin_addr, ipstr, sizeof(ipstr));
+			size_t len = strlen(ipstr);
+			snprintf(ipstr + len, sizeof(ipstr) - len, ":%d", ntohs(addr.sin_port));
+			traffic.listener.incoming(ipstr, packet.data(), (int)packet.size());
+		}
+		else
+		{
+			traffic.listener.incoming((const struct sockaddr*)&addr, (int)sizeof(addr), packet.data(), (int)packet.size());
+		}
+		replies += !traffic.listener.last.empty();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	printf("%-30s %.2f M/s, %.0f ns/datagram%s\n", name, Challenges / seconds / 1e6, seconds * 1e9 / Challenges, replies == Challenges ? "" : " (missing replies)");
+}
+#endif
+
+int main()
+{
+	utcp::event_handler::config(nullptr);
+	utcp::event_handler::add_elapsed_time(1000 * 1000 * 1000);
+
+	uint8_t secret[64];
+	for (int i = 0; i < 64; ++i)
+		secret[i] = (uint8_t)(i * 37 + 11);
+
+	printf("sha extensions: %s, multi-buffer: %s\n", Sha1UseHardware(1) ? "yes" : "no", sha1_use_multi_buffer(true) ? "yes" : "no");
+	run_cookies("secret portable", false, portable, secret);
+	run_cookies("cached key portable", true, portable, secret);
+	run_cookies("secret sha-ni", false, sha_ni, secret);
+	run_cookies("cached key sha-ni", true, sha_ni, secret);
+	run_cookies("cached key x8", true, multi_buffer, secret);
+
+	handshake_traffic traffic;
+	for (bool responses : {false, true})
+	{
+		printf("%s\n", responses ? "challenge responses" : "initial packets");
+		run_listener(traffic, "  one by one, portable", responses, false, portable);
+		run_listener(traffic, "  one by one, sha-ni", responses, false, sha_ni);
+		run_listener(traffic, "  batch, sha-ni", responses, true, sha_ni);
+		run_listener(traffic, "  batch, multi-buffer", responses, true, multi_buffer);
+	}
+	Sha1UseHardware(1);
+	sha1_use_multi_buffer(true);
+
+#if defined(__linux)
+	printf("spoofed initial packets\n");
+	run_spoofed(traffic, "  formatted address", true);
+	run_spoofed(traffic, "  sockaddr", false);
+#endif
+	return 0;
+}
@@ -0,0 +1,145 @@
+// Listener CPU under a junk flood of 1M packets per second, replayed in memory against one listener: random bytes,
+// packets of unknown connections and initial packets, all from spoofed sources. Logical time moves 1us per packet.
+// Without limits every initial packet gets a challenge and every unknown connection a restart request, with
+// utcp_listener_set_limits the replies are capped by the prefix buckets and the challenge budget.
+#include "abstract/utcp.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#if defined(__linux)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+enum
+{
+	Packets = 1000 * 1000,
+	Sources = 64 * 1024,
+};
+
+struct counting_listener : public utcp::listener
+{
+	size_t replies = 0;
+	size_t reply_bytes = 0;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		replies++;
+		reply_bytes += len;
+	}
+};
+
+struct capture_conn : public utcp::conn
+{
+	std::vector<uint8_t> last;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		last.assign((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+};
+
+struct flood_packet
+{
+	std::vector<uint8_t> data;
+	struct sockaddr_in addr;
+};
+
+static std::vector<flood_packet> make_flood(bool one_prefix)
+{
+	capture_conn client;
+	utcp_connect(client.get_fd());
+	const std::vector<uint8_t> initial = client.last;
+
+	uint32_t seed = 7;
+	auto next_rand = [&seed]() {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	};
+
+	std::vector<flood_packet> flood(Sources);
+	for (auto& packet : flood)
+	{
+		uint32_t kind = next_rand() % 10;
+		if (kind < 4)
+		{
+			// Random bytes
+			packet.data.resize(1 + next_rand() % 200);
+			for (auto& byte : packet.data)
+				byte = (uint8_t)next_rand();
+		}
+		else if (kind < 7)
+		{
+			// Header, cleared handshake bit and some payload: a connection the listener does not know
+			packet.data.resize(1 + next_rand() % 100);
+			for (auto& byte : packet.data)
+				byte = (uint8_t)next_rand();
+			packet.data[0] &= ~(1 << 5);
+		}
+		else
+		{
+			packet.data = initial;
+		}
+		if (packet.data.back() == 0)
+			packet.data.back() = 1;
+
+		memset(&packet.addr, 0, sizeof(packet.addr));
+		packet.addr.sin_family = AF_INET;
+		packet.addr.sin_port = htons((uint16_t)next_rand());
+		packet.addr.sin_addr.s_addr = htonl(one_prefix ? 0x0a000100u | (next_rand() & 0xff) : next_rand() << 1);
+	}
+	return flood;
+}
+
+static void run(const char* name, const std::vector<flood_packet>& flood, const utcp_listener_limits* limits)
+{
+	counting_listener listener;
+	listener.set_limits(limits);
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < Packets; ++i)
+	{
+		auto& packet = flood[i % Sources];
+		listener.incoming((const struct sockaddr*)&packet.addr, (int)sizeof(packet.addr), (uint8_t*)packet.data.data(), (int)packet.data.size());
+		utcp::event_handler::add_elapsed_time(1000);
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	utcp_listener_stats stats = listener.get_stats();
+	printf("%-22s %4.0f ns/packet (%.2f M pps on one core) replies=%-7zu reply MB=%-6.1f dropped=%llu limited=%llu challenged=%llu restarts=%llu\n", name,
+		   seconds * 1e9 / Packets, Packets / seconds / 1e6, listener.replies, listener.reply_bytes / 1e6, (unsigned long long)stats.Dropped,
+		   (unsigned long long)stats.RateLimited, (unsigned long long)stats.Challenged, (unsigned long long)stats.RestartRequests);
+}
+
+int main()
+{
+	utcp::event_handler::config(nullptr);
+	utcp::event_handler::add_elapsed_time(1000 * 1000 * 1000);
+
+	// What the sample listener uses
+	utcp_listener_limits limits = {};
+	limits.PrefixRate = 100;
+	limits.PrefixBurst = 200;
+	limits.PrefixBuckets = 64 * 1024;
+	limits.ChallengeRate = 50000;
+	limits.ChallengeBurst = 50000;
+
+	for (bool one_prefix : {false, true})
+	{
+		printf("%s\n", one_prefix ? "sources in one /24" : "sources all over IPv4");
+		auto flood = make_flood(one_prefix);
+		run("  no limits", flood, nullptr);
+		run("  limits", flood, &limits);
+	}
+	return 0;
+}
+#else
+int main()
+{
+	printf("The flood uses sockaddr_in, Linux only\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,228 @@
+// Bulk transfer over loopback UDP, one datagram per packet against UDP_SEGMENT (GSO) on send and UDP_GRO on receive.
+// Every tick the sender fills 64 packets with 908 byte bunches, the batch goes out with sendmmsg, with runs of same size
+// packets merged into GSO datagrams when enabled. The receiver drains its socket, splits GRO datagrams and passes every
+// packet to utcp_incoming. CPU covers both sides.
+#include "abstract/utcp.hpp"
+extern "C"
+{
+#include "utcp/utcp_packet.h"
+}
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+#if defined(__linux)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+enum
+{
+	PacketsPerTick = 64,
+	BunchBytes = 908, // MAX_SINGLE_BUNCH_SIZE_BYTES
+};
+
+static int send_fd = -1;
+static int recv_fd = -1;
+static struct sockaddr_in recv_addr;
+static size_t syscalls = 0;
+
+struct receiver : public utcp::conn
+{
+	size_t bytes = 0;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+	}
+
+	virtual void on_recv_bunch(struct utcp_bunch* const bunches[], int count) override
+	{
+		for (int i = 0; i < count; ++i)
+			bytes += bunches[i]->DataBitsLen / 8;
+	}
+};
+
+static void send_batch(struct utcp_send_batch* batch, bool gso)
+{
+	struct mmsghdr msgs[PacketsPerTick];
+	struct iovec iovs[PacketsPerTick];
+	char control[CMSG_SPACE(sizeof(uint16_t))];
+	int count = 0;
+	for (int i = 0; i < batch->Count;)
+	{
+		// A run of the same size, the last one may be shorter
+		int run = 1;
+		while (gso && i + run < batch->Count && batch->Items[i + run].Len <= batch->Items[i].Len)
+		{
+			run++;
+			if (batch->Items[i + run - 1].Len < batch->Items[i].Len)
+				break;
+		}
+
+		const struct utcp_send_batch_item& last = batch->Items[i + run - 1];
+		iovs[count].iov_base = batch->Buffer + batch->Items[i].Offset;
+		iovs[count].iov_len = last.Offset + last.Len - batch->Items[i].Offset;
+		memset(&msgs[count], 0, sizeof(msgs[count]));
+		msgs[count].msg_hdr.msg_name = &recv_addr;
+		msgs[count].msg_hdr.msg_namelen = sizeof(recv_addr);
+		msgs[count].msg_hdr.msg_iov = &iovs[count];
+		msgs[count].msg_hdr.msg_iovlen = 1;
+		if (run > 1)
+		{
+			msgs[count].msg_hdr.msg_control = control;
+			msgs[count].msg_hdr.msg_controllen = sizeof(control);
+			struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msgs[count].msg_hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t segment = (uint16_t)batch->Items[i].Len;
+			memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+		}
+		count++;
+		i += run;
+	}
+	syscalls++;
+	sendmmsg(send_fd, msgs, count, 0);
+	batch->Count = 0;
+	batch->BufferUsed = 0;
+}
+
+static void drain(receiver* conn, bool gro, std::vector<uint8_t>& buffer)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	while (true)
+	{
+		struct iovec iov = {buffer.data(), buffer.size()};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		syscalls++;
+		ssize_t ret = recvmsg(recv_fd, &msg, MSG_DONTWAIT);
+		if (ret <= 0)
+			break;
+
+		int segment = (int)ret;
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); gro && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+				memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+		}
+		for (int offset = 0; offset < ret; offset += segment)
+			conn->incoming(buffer.data() + offset, std::min(segment, (int)ret - offset));
+	}
+}
+
+static void run(const char* name, size_t megabytes, bool gso, bool gro)
+{
+	int value = gro ? 1 : 0;
+	setsockopt(recv_fd, SOL_UDP, UDP_GRO, &value, sizeof(value));
+
+	utcp::conn sender;
+	receiver recv;
+	utcp_sequence_init(sender.get_fd(), 1000, 2000);
+	utcp_sequence_init(recv.get_fd(), 2000, 1000);
+
+	std::vector<uint8_t> batch_buffer(PacketsPerTick * UDP_MTU_SIZE);
+	std::vector<struct utcp_send_batch_item> items(PacketsPerTick);
+	struct utcp_send_batch batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.Buffer = batch_buffer.data();
+	batch.BufferSize = (uint32_t)batch_buffer.size();
+	batch.Items = items.data();
+	batch.ItemCapacity = PacketsPerTick;
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.NameIndex = 255;
+	bunch.ChIndex = 1;
+	bunch.bOpen = 1;
+	bunch.DataBitsLen = BunchBytes * 8;
+	for (int i = 0; i < BunchBytes; ++i)
+		bunch.Data[i] = (uint8_t)(i * 13);
+
+	std::vector<uint8_t> recv_buffer(65536);
+	const size_t total = megabytes * 1024 * 1024;
+	size_t sent = 0;
+	syscalls = 0;
+	auto wall_begin = std::chrono::steady_clock::now();
+	clock_t cpu_begin = clock();
+	while (sent < total)
+	{
+		utcp_set_send_batch(&batch);
+		for (int i = 0; i < PacketsPerTick; ++i)
+		{
+			utcp_send_bunch(sender.get_fd(), &bunch);
+			sender.send_flush();
+			sent += BunchBytes;
+		}
+		utcp_set_send_batch(nullptr);
+		send_batch(&batch, gso);
+		drain(&recv, gro, recv_buffer);
+	}
+	double cpu = (double)(clock() - cpu_begin) / CLOCKS_PER_SEC;
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+
+	double mb = (double)sent / (1024 * 1024);
+	printf("%-16s %.0fMB received=%.1f%% syscalls/MB=%.1f cpu %.2f ms/MB, %.0f MB/s\n", name, mb, recv.bytes * 100.0 / sent, syscalls / mb, cpu * 1000 / mb,
+		   mb / wall);
+}
+
+int main()
+{
+	utcp::event_handler::config(nullptr);
+
+	send_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	recv_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&recv_addr, 0, sizeof(recv_addr));
+	recv_addr.sin_family = AF_INET;
+	recv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(recv_addr);
+	int rcvbuf = 8 * 1024 * 1024;
+	setsockopt(recv_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if (send_fd < 0 || recv_fd < 0 || bind(recv_fd, (struct sockaddr*)&recv_addr, sizeof(recv_addr)) != 0 ||
+		getsockname(recv_fd, (struct sockaddr*)&recv_addr, &addr_len) != 0)
+	{
+		printf("socket failed\n");
+		return 1;
+	}
+
+	int segment = 0;
+	bool gso = setsockopt(send_fd, SOL_UDP, UDP_SEGMENT, &segment, sizeof(segment)) == 0;
+	int one = 1;
+	bool gro = setsockopt(recv_fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0;
+	printf("gso=%d gro=%d\n", gso, gro);
+
+	const size_t megabytes = 200;
+	run("sendmmsg/recv", megabytes, false, false);
+	if (gso)
+		run("gso/recv", megabytes, true, false);
+	if (gso && gro)
+		run("gso/gro", megabytes, true, true);
+
+	close(send_fd);
+	close(recv_fd);
+	return 0;
+}
+#else
+int main()
+{
+	printf("UDP GSO/GRO is Linux only\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,117 @@
+// Challenge responses per second on one listener, accepted from on_accept one by one against the pending accept table
+// taken in batches. The clients run in memory: they connect and answer the challenge first, then all the responses
+// reach the listener back to back, like a login burst. Only the responses and the accepts are timed.
+#include "abstract/utcp.hpp"
+extern "C"
+{
+#include "utcp/utcp_def_internal.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct capture_conn : public utcp::conn
+{
+	std::vector<uint8_t> last;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		last.assign((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+};
+
+struct bench_listener : public utcp::listener
+{
+	std::vector<uint8_t> last;
+	std::vector<std::unique_ptr<capture_conn>>* servers = nullptr;
+	size_t accepted = 0;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		last.assign((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+
+	virtual void on_accept(bool reconnect) override
+	{
+		accept((*servers)[accepted++].get(), reconnect);
+	}
+};
+
+enum
+{
+	BatchSize = 256,
+};
+
+static void run(int clients, bool batched)
+{
+	bench_listener listener;
+	std::vector<std::unique_ptr<capture_conn>> servers;
+	std::vector<std::unique_ptr<capture_conn>> conns;
+	std::vector<std::vector<uint8_t>> responses(clients);
+	std::vector<std::string> addresses(clients);
+	listener.servers = &servers;
+	if (batched)
+		listener.set_pending_accepts(BatchSize);
+
+	for (int i = 0; i < clients; ++i)
+	{
+		char address[64];
+		snprintf(address, sizeof(address), "10.0.%d.%d:%d", (i >> 8) & 0xff, i & 0xff, 7777 + (i >> 16));
+		addresses[i] = address;
+
+		servers.emplace_back(new capture_conn);
+		conns.emplace_back(new capture_conn);
+		utcp_connect(conns[i]->get_fd());
+		listener.incoming(address, conns[i]->last.data(), (int)conns[i]->last.size());
+		conns[i]->incoming(listener.last.data(), (int)listener.last.size());
+		responses[i] = conns[i]->last;
+	}
+
+	std::vector<utcp_accept_info> accepts(BatchSize);
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < clients; ++i)
+	{
+		listener.incoming(addresses[i].c_str(), responses[i].data(), (int)responses[i].size());
+		responses[i].swap(listener.last);
+		if (batched && (i % BatchSize == BatchSize - 1 || i == clients - 1))
+		{
+			int count = listener.take_accepts(accepts.data(), BatchSize);
+			for (int j = 0; j < count; ++j)
+				listener.accept(servers[listener.accepted++].get(), accepts[j]);
+		}
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	// The responses now hold the acks
+	size_t matched = 0;
+	for (int i = 0; i < clients; ++i)
+	{
+		conns[i]->incoming(responses[i].data(), (int)responses[i].size());
+		matched += memcmp(servers[i]->get_fd()->AuthorisedCookie, conns[i]->get_fd()->AuthorisedCookie, sizeof(servers[i]->get_fd()->AuthorisedCookie)) == 0;
+	}
+	if (batched)
+		listener.set_pending_accepts(0);
+
+	printf("%-8s clients=%-6d accepted=%-6zu %.0f handshakes/s, %.0f ns/handshake\n", batched ? "batched" : "on_accept", clients, listener.accepted, clients / seconds,
+		   seconds * 1e9 / clients);
+	if (matched != (size_t)clients)
+		printf("cookie mismatch: %zu of %d\n", clients - matched, clients);
+}
+
+int main()
+{
+	utcp::event_handler::config(nullptr);
+	utcp::event_handler::add_elapsed_time(1000 * 1000 * 1000);
+
+	for (int clients : {1000, 10000})
+	{
+		run(clients, false);
+		run(clients, true);
+	}
+	return 0;
+}
@@ -0,0 +1,97 @@
+// Time to serialize and parse bunch headers and packet headers, in ns per header.
+extern "C"
+{
+#include "utcp/utcp_bunch.h"
+#include "utcp/utcp_def_internal.h"
+#include "utcp/utcp_packet_notify.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static std::vector<utcp_bunch> generate_bunches(int count)
+{
+	std::vector<utcp_bunch> bunches(count);
+	uint32_t seed = 1;
+	for (auto& bunch : bunches)
+	{
+		seed = seed * 1103515245 + 12345;
+		uint32_t r = seed >> 8;
+		memset(&bunch, 0, sizeof(bunch));
+		bunch.ChIndex = (uint16_t)(3 + r % 200);
+		bunch.bReliable = (r >> 8) % 10 == 0;
+		bunch.bOpen = (r >> 12) % 50 == 0;
+		bunch.bClose = !bunch.bOpen && (r >> 16) % 200 == 0;
+		bunch.CloseReason = bunch.bClose ? 1 : 0;
+		bunch.bReliable |= bunch.bOpen | bunch.bClose;
+		bunch.ChSequence = bunch.bReliable ? (int32_t)((r >> 4) % UTCP_MAX_CHSEQUENCE) : 0;
+		bunch.NameIndex = 255;
+		bunch.DataBitsLen = (uint16_t)(24 + (r >> 2) % 400);
+	}
+	return bunches;
+}
+
+template <typename Fn> static double measure(int count, int rounds, Fn fn)
+{
+	auto begin = std::chrono::steady_clock::now();
+	for (int round = 0; round < rounds; ++round)
+		fn();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count() * 1e9 / ((double)count * rounds);
+}
+
+int main()
+{
+	const int count = 10000;
+	const int rounds = 100;
+	std::vector<utcp_bunch> bunches = generate_bunches(count);
+
+	std::vector<uint8_t> headers(count * MAX_BUNCH_HEADER_BYTES);
+	double write_ns = measure(count, rounds, [&]() {
+		for (int i = 0; i < count; ++i)
+		{
+			struct bitbuf bitbuf;
+			bitbuf_write_init(&bitbuf, headers.data() + i * MAX_BUNCH_HEADER_BYTES, MAX_BUNCH_HEADER_BYTES);
+			utcp_bunch_write_header(&bunches[i], &bitbuf);
+		}
+	});
+
+	uint32_t check = 0;
+	double read_ns = measure(count, rounds, [&]() {
+		for (int i = 0; i < count; ++i)
+		{
+			struct bitbuf bitbuf = {headers.data() + i * MAX_BUNCH_HEADER_BYTES, MAX_BUNCH_HEADER_BYTES * 8, 0};
+			struct utcp_bunch bunch;
+			utcp_bunch_read_header(&bunch, &bitbuf, nullptr);
+			check += bunch.ChIndex;
+		}
+	});
+	printf("bunch header   write %.1f ns read %.1f ns\n", write_ns, read_ns);
+
+	uint8_t packet[UTCP_MAX_PACKET];
+	struct packet_header packet_header;
+	memset(&packet_header, 0, sizeof(packet_header));
+	packet_header.notification_header.Seq = 100;
+	packet_header.notification_header.AckedSeq = 50;
+	packet_header.notification_header.HistoryWordCount = 2;
+	write_ns = measure(count, rounds, [&]() {
+		for (int i = 0; i < count; ++i)
+		{
+			struct bitbuf bitbuf;
+			bitbuf_write_reuse(&bitbuf, packet, i & 7, sizeof(packet));
+			packet_header.notification_header.Seq = (uint16_t)i;
+			packet_header_write(&packet_header, &bitbuf);
+		}
+	});
+	read_ns = measure(count, rounds, [&]() {
+		for (int i = 0; i < count; ++i)
+		{
+			struct bitbuf bitbuf = {packet, sizeof(packet) * 8, 0};
+			struct packet_header parsed;
+			packet_header_read(&parsed, &bitbuf);
+			check += parsed.notification_header.Seq;
+		}
+	});
+	printf("packet header  write %.1f ns read %.1f ns (check %u)\n", write_ns, read_ns, check);
+	return 0;
+}
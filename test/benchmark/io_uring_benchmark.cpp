@@ -0,0 +1,243 @@
+// The sample socket engines on loopback UDP: the recv thread with recvfrom, a recvmmsg loop, and io_uring_socket.
+// Every tick a plain socket sends a burst of 200 byte packets with sendmmsg, then the engine under test hands over
+// what arrived. CPU is the whole process, the sender is the same in every run. The send side is measured on its own:
+// udp_socket::send_batch (sendmmsg) against io_uring_socket::send_batch, to a socket nobody reads.
+#include "sample/io_uring_socket.h"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#if defined(UDP_IO_URING)
+#include <sys/resource.h>
+
+enum
+{
+	Ticks = 2000,
+	Burst = 256,
+	PacketBytes = 200,
+};
+
+static double process_cpu()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static bool local_addr(socket_t fd, struct sockaddr_in* addr)
+{
+	socklen_t addr_len = sizeof(*addr);
+	return getsockname(fd, (struct sockaddr*)addr, &addr_len) == 0;
+}
+
+// The recv thread blocks in recvfrom, an empty datagram lets it see the exit flag
+static void stop(udp_socket* engine, socket_t fd)
+{
+	struct sockaddr_in addr;
+	engine->recv_thread_exit_flag = true;
+	if (local_addr(engine->socket_fd, &addr))
+		sendto(fd, "", 0, 0, (const struct sockaddr*)&addr, sizeof(addr));
+}
+
+static void send_burst(socket_t fd, const struct sockaddr_in* to, int tick)
+{
+	static uint8_t payloads[Burst][PacketBytes];
+	struct mmsghdr msgs[Burst];
+	struct iovec iovs[Burst];
+	for (int i = 0; i < Burst; ++i)
+	{
+		payloads[i][0] = (uint8_t)tick;
+		iovs[i].iov_base = payloads[i];
+		iovs[i].iov_len = PacketBytes;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = (void*)to;
+		msgs[i].msg_hdr.msg_namelen = sizeof(*to);
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	sendmmsg(fd, msgs, Burst, 0);
+}
+
+static void print_recv(const char* name, size_t packets, size_t syscalls, double cpu, double wall)
+{
+	double thousands = (double)Ticks * Burst / 1000;
+	printf("recv %-16s received=%.1f%% syscalls/1k packets=%-7.1f cpu %.3f ms/1k packets, wall %.3f ms/1k packets\n", name,
+		   packets * 100.0 / (Ticks * Burst), syscalls / thousands, cpu * 1000 / thousands, wall * 1000 / thousands);
+}
+
+// udp_socket or io_uring_socket, polled every tick like udp_utcp_listener does
+static void run_engine(const char* name, udp_socket* engine, socket_t send_fd, bool threaded)
+{
+	struct sockaddr_in to;
+	engine->listen("127.0.0.1", 0);
+	local_addr(engine->socket_fd, &to);
+	int rcvbuf = 4 * 1024 * 1024;
+	setsockopt(engine->socket_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	io_uring_socket* ring = dynamic_cast<io_uring_socket*>(engine);
+	size_t packets = 0;
+	auto proc = [&packets](uint8_t* data, int data_len, struct sockaddr_storage* from_addr, socklen_t from_addr_len) {
+		packets++;
+	};
+	auto wall_begin = std::chrono::steady_clock::now();
+	double cpu_begin = process_cpu();
+	const size_t enter_begin = ring ? ring->enter_count : 0;
+	for (int tick = 0; tick < Ticks; ++tick)
+	{
+		send_burst(send_fd, &to, tick);
+		const size_t expected = (size_t)(tick + 1) * Burst;
+		// The recv thread needs a moment to catch up, give up on what the kernel dropped
+		for (int retry = 0; retry < 100 && packets < expected; ++retry)
+		{
+			engine->poll(proc);
+			if (threaded && packets < expected)
+				std::this_thread::sleep_for(std::chrono::microseconds(20));
+		}
+	}
+	double cpu = process_cpu() - cpu_begin;
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+	// One recvfrom per packet in the recv thread, poll itself is no syscall there
+	print_recv(name, packets, ring ? ring->enter_count - enter_begin : packets, cpu, wall);
+	stop(engine, send_fd);
+}
+
+static void run_recvmmsg(socket_t send_fd)
+{
+	socket_t fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int rcvbuf = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(fd, (struct sockaddr*)&to, sizeof(to));
+	local_addr(fd, &to);
+
+	constexpr int vlen = 64;
+	static uint8_t buffers[vlen][UDP_DATAGRAM_SIZE];
+	struct sockaddr_storage addrs[vlen];
+	struct mmsghdr msgs[vlen];
+	struct iovec iovs[vlen];
+	size_t packets = 0;
+	size_t syscalls = 0;
+	auto wall_begin = std::chrono::steady_clock::now();
+	double cpu_begin = process_cpu();
+	for (int tick = 0; tick < Ticks; ++tick)
+	{
+		send_burst(send_fd, &to, tick);
+		while (true)
+		{
+			for (int i = 0; i < vlen; ++i)
+			{
+				iovs[i].iov_base = buffers[i];
+				iovs[i].iov_len = UDP_DATAGRAM_SIZE;
+				memset(&msgs[i], 0, sizeof(msgs[i]));
+				msgs[i].msg_hdr.msg_name = &addrs[i];
+				msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			syscalls++;
+			int ret = recvmmsg(fd, msgs, vlen, MSG_DONTWAIT, nullptr);
+			if (ret <= 0)
+				break;
+			packets += ret;
+		}
+	}
+	double cpu = process_cpu() - cpu_begin;
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+	print_recv("recvmmsg", packets, syscalls, cpu, wall);
+	close(fd);
+}
+
+static void run_send(const char* name, udp_socket* engine, socket_t sink_fd, const struct sockaddr_in* sink_addr)
+{
+	engine->connnect("127.0.0.1", ntohs(sink_addr->sin_port));
+
+	std::vector<uint8_t> buffer(Burst * PacketBytes);
+	std::vector<struct utcp_send_batch_item> items(Burst);
+	std::vector<struct sockaddr_in> addrs(Burst, *sink_addr);
+	struct utcp_send_batch batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.Buffer = buffer.data();
+	batch.BufferSize = (uint32_t)buffer.size();
+	batch.Items = items.data();
+	batch.ItemCapacity = Burst;
+	for (int i = 0; i < Burst; ++i)
+	{
+		items[i].Offset = i * PacketBytes;
+		items[i].Len = PacketBytes;
+	}
+	batch.Count = Burst;
+	batch.BufferUsed = batch.BufferSize;
+
+	size_t syscalls = 0;
+	auto wall_begin = std::chrono::steady_clock::now();
+	double cpu_begin = process_cpu();
+	for (int tick = 0; tick < Ticks; ++tick)
+	{
+		buffer[0] = (uint8_t)tick;
+		syscalls += engine->send_batch(&batch, addrs.data());
+	}
+	double cpu = process_cpu() - cpu_begin;
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+
+	double thousands = (double)Ticks * Burst / 1000;
+	printf("send %-16s syscalls/1k packets=%-7.1f cpu %.3f ms/1k packets, wall %.3f ms/1k packets\n", name, syscalls / thousands, cpu * 1000 / thousands,
+		   wall * 1000 / thousands);
+	stop(engine, sink_fd);
+}
+
+int main()
+{
+	socket_t send_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (send_fd == INVALID_SOCKET)
+	{
+		printf("socket failed\n");
+		return 1;
+	}
+
+	{
+		std::unique_ptr<udp_socket> engine = new_udp_socket(false);
+		run_engine("recvfrom thread", engine.get(), send_fd, true);
+	}
+	run_recvmmsg(send_fd);
+	{
+		std::unique_ptr<udp_socket> engine = new_udp_socket(true);
+		if (!dynamic_cast<io_uring_socket*>(engine.get()))
+		{
+			printf("io_uring not available\n");
+			return 0;
+		}
+		run_engine("io_uring", engine.get(), send_fd, false);
+	}
+
+	// The sink is never read, the kernel drops what does not fit
+	socket_t sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in sink_addr;
+	memset(&sink_addr, 0, sizeof(sink_addr));
+	sink_addr.sin_family = AF_INET;
+	sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(sink_fd, (struct sockaddr*)&sink_addr, sizeof(sink_addr));
+	local_addr(sink_fd, &sink_addr);
+	{
+		std::unique_ptr<udp_socket> engine = new_udp_socket(false);
+		run_send("sendmmsg", engine.get(), sink_fd, &sink_addr);
+	}
+	{
+		std::unique_ptr<udp_socket> engine = new_udp_socket(true);
+		run_send("io_uring", engine.get(), sink_fd, &sink_addr);
+	}
+	close(sink_fd);
+	close(send_fd);
+	return 0;
+}
+#else
+int main()
+{
+	printf("io_uring is Linux only\n");
+	return 0;
+}
+#endif
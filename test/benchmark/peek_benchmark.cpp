@@ -0,0 +1,83 @@
+// Receive cost per packet on the packet order cache path: peek the packet id, then process the packet,
+// with utcp_incoming parsing the header again against utcp_incoming_peeked continuing from the peek.
+extern "C"
+{
+#include "utcp/utcp.h"
+#include "utcp/utcp_def_internal.h"
+#include "utcp/utcp_packet.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static std::vector<std::vector<uint8_t>> outgoing;
+
+static std::vector<std::vector<uint8_t>> generate_packets(int count)
+{
+	auto config = utcp_get_config();
+	config->on_outgoing = [](void* fd, void* userdata, const void* data, int len) { outgoing.emplace_back((const uint8_t*)data, (const uint8_t*)data + len); };
+
+	utcp_connection server;
+	utcp_init(&server, nullptr);
+	utcp_sequence_init(&server, 1000, 2000);
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.NameIndex = 255;
+	bunch.ChIndex = 1;
+	bunch.bOpen = 1;
+	bunch.bReliable = 1;
+	bunch.DataBitsLen = 8;
+	utcp_send_bunch(&server, &bunch);
+	utcp_send_flush(&server);
+
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.ChIndex = 1;
+	bunch.DataBitsLen = 64;
+	for (int i = 1; i < count; ++i)
+	{
+		utcp_send_bunch(&server, &bunch);
+		utcp_send_flush(&server);
+	}
+	utcp_uninit(&server);
+	config->on_outgoing = nullptr;
+	return std::move(outgoing);
+}
+
+template <typename Fn> static double run(std::vector<std::vector<uint8_t>>& packets, int rounds, Fn fn)
+{
+	std::chrono::duration<double> elapsed(0);
+	for (int round = 0; round < rounds; ++round)
+	{
+		utcp_connection client;
+		utcp_init(&client, nullptr);
+		utcp_sequence_init(&client, 2000, 1000);
+
+		auto begin = std::chrono::steady_clock::now();
+		for (auto& packet : packets)
+			fn(&client, packet);
+		elapsed += std::chrono::steady_clock::now() - begin;
+		utcp_uninit(&client);
+	}
+	return elapsed.count() * 1e9 / ((double)packets.size() * rounds);
+}
+
+int main()
+{
+	// The ack window has to keep up without an ack path, stay inside the history
+	auto packets = generate_packets(200);
+	const int rounds = 2000;
+
+	double full = run(packets, rounds, [](utcp_connection* fd, std::vector<uint8_t>& packet) {
+		utcp_peep_packet_id(fd, packet.data(), (int)packet.size());
+		utcp_incoming(fd, packet.data(), (int)packet.size());
+	});
+	double peeked = run(packets, rounds, [](utcp_connection* fd, std::vector<uint8_t>& packet) {
+		utcp_peeked_packet peeked;
+		if (utcp_peep_packet(fd, packet.data(), (int)packet.size(), &peeked) > 0)
+			utcp_incoming_peeked(fd, packet.data(), (int)packet.size(), &peeked);
+	});
+	printf("packets=%zu peek+incoming %.1f ns/packet, peek+incoming_peeked %.1f ns/packet\n", packets.size(), full, peeked);
+	return 0;
+}
@@ -0,0 +1,104 @@
+// Receive cost of packets full of small unreliable bunches, delivered through on_recv_bunch (every bunch copied into a
+// utcp_bunch) against on_recv_bunch_view (the bunches are read where they are in the packet).
+extern "C"
+{
+#include "utcp/utcp.h"
+#include "utcp/utcp_def_internal.h"
+#include "utcp/utcp_packet.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+static std::vector<std::vector<uint8_t>> outgoing;
+static uint64_t checksum;
+
+static std::vector<std::vector<uint8_t>> generate_packets(int count, int bunches_per_packet)
+{
+	auto config = utcp_get_config();
+	config->on_outgoing = [](void* fd, void* userdata, const void* data, int len) { outgoing.emplace_back((const uint8_t*)data, (const uint8_t*)data + len); };
+
+	utcp_connection server;
+	utcp_init(&server, nullptr);
+	utcp_sequence_init(&server, 1000, 2000);
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.NameIndex = 255;
+	bunch.ChIndex = 1;
+	bunch.bOpen = 1;
+	bunch.bReliable = 1;
+	bunch.DataBitsLen = 8;
+	utcp_send_bunch(&server, &bunch);
+	utcp_send_flush(&server);
+
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.ChIndex = 1;
+	bunch.DataBitsLen = 160;
+	for (int i = 1; i < count; ++i)
+	{
+		for (int j = 0; j < bunches_per_packet; ++j)
+		{
+			bunch.Data[0] = (uint8_t)j;
+			utcp_send_bunch(&server, &bunch);
+		}
+		utcp_send_flush(&server);
+	}
+	utcp_uninit(&server);
+	config->on_outgoing = nullptr;
+	return std::move(outgoing);
+}
+
+static double run(std::vector<std::vector<uint8_t>>& packets, int rounds)
+{
+	std::chrono::duration<double> elapsed(0);
+	size_t bunches = 0;
+	for (int round = 0; round < rounds; ++round)
+	{
+		utcp_connection client;
+		utcp_init(&client, &bunches);
+		utcp_sequence_init(&client, 2000, 1000);
+
+		auto begin = std::chrono::steady_clock::now();
+		for (auto& packet : packets)
+			utcp_incoming(&client, packet.data(), (int)packet.size());
+		elapsed += std::chrono::steady_clock::now() - begin;
+		utcp_uninit(&client);
+	}
+	return elapsed.count() * 1e9 / (double)bunches;
+}
+
+int main()
+{
+	// The ack window has to keep up without an ack path, stay inside the history
+	auto packets = generate_packets(200, 40);
+	const int rounds = 500;
+
+	auto config = utcp_get_config();
+	config->on_recv_bunch = [](struct utcp_connection* fd, void* userdata, struct utcp_bunch* const bunches[], int count) {
+		*(size_t*)userdata += count;
+		for (int i = 0; i < count; ++i)
+			checksum += bunches[i]->Data[0];
+	};
+	double copied = run(packets, rounds);
+	config->on_recv_bunch = nullptr;
+
+	config->on_recv_bunch_view = [](struct utcp_connection* fd, void* userdata, const struct utcp_bunch_view* views, int count) {
+		*(size_t*)userdata += count;
+		for (int i = 0; i < count; ++i)
+		{
+			uint8_t first[1];
+			const uint8_t* data = views[i].Data;
+			const uint32_t offset = views[i].DataBitOffset;
+			first[0] = (uint8_t)((data[offset >> 3] >> (offset & 7)) | ((offset & 7) ? data[(offset >> 3) + 1] << (8 - (offset & 7)) : 0));
+			checksum += first[0];
+		}
+	};
+	double viewed = run(packets, rounds);
+	config->on_recv_bunch_view = nullptr;
+
+	printf("packets=%zu on_recv_bunch %.1f ns/bunch, on_recv_bunch_view %.1f ns/bunch (checksum %llu)\n", packets.size(), copied, viewed,
+		   (unsigned long long)checksum);
+	return 0;
+}
@@ -0,0 +1,213 @@
+// udp_utcp_listener_group with 1 to 4 SO_REUSEPORT workers on loopback: handshakes per second while all clients connect
+// at once, then unreliable packets per second the workers take in while the clients send for two seconds. Every client has its own socket, so the kernel spreads
+// the flows over the workers; the spread is printed per worker. The workers send with their batches, as in the sample.
+// The clients all run on the main thread, on a machine with
+// fewer cores than workers plus one the numbers cannot scale.
+#include "sample/utcp_listener_group.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if defined(__linux)
+enum
+{
+	Clients = 2000,
+	// Clients that send before the clients are pumped again, keeps the bursts below the socket buffers
+	SendChunk = 100,
+	BunchBytes = 32,
+};
+
+static std::atomic<int> accepted{0};
+static std::atomic<int> received{0};
+static std::mutex spread_mutex;
+static std::map<std::thread::id, int> spread;
+
+struct server_conn : public utcp::conn
+{
+	server_conn()
+	{
+		accepted++;
+		std::lock_guard<decltype(spread_mutex)> lock(spread_mutex);
+		spread[std::this_thread::get_id()]++;
+	}
+
+	void bind(socket_t fd, struct sockaddr_storage* addr, socklen_t addr_len)
+	{
+		memcpy(&dest_addr, addr, addr_len);
+		dest_addr_len = addr_len;
+		socket_fd = fd;
+	}
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		sendto(socket_fd, (const char*)data, len, 0, (sockaddr*)&dest_addr, dest_addr_len);
+	}
+
+	virtual void on_recv_bunch(struct utcp_bunch* const bunches[], int count) override
+	{
+		received += count;
+	}
+
+	socket_t socket_fd = INVALID_SOCKET;
+	struct sockaddr_storage dest_addr;
+	socklen_t dest_addr_len = 0;
+};
+
+struct client_conn : public utcp::conn
+{
+	bool connected = false;
+
+	client_conn(int port)
+	{
+		socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		memset(&server_addr, 0, sizeof(server_addr));
+		server_addr.sin_family = AF_INET;
+		server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		server_addr.sin_port = htons(port);
+	}
+
+	virtual ~client_conn() override
+	{
+		close(socket_fd);
+	}
+
+	void pump()
+	{
+		uint8_t buffer[UDP_MTU_SIZE];
+		while (true)
+		{
+			ssize_t ret = recv(socket_fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+			if (ret <= 0)
+				break;
+			incoming(buffer, (int)ret);
+		}
+	}
+
+  protected:
+	virtual void on_connect(bool reconnect) override
+	{
+		connected = true;
+	}
+
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		sendto(socket_fd, (const char*)data, len, 0, (const sockaddr*)&server_addr, sizeof(server_addr));
+	}
+
+	socket_t socket_fd;
+	struct sockaddr_in server_addr;
+};
+
+// Pumps the clients and advances the utcp clock until done or the timeout, returns the seconds it took
+template <typename Pred>
+static double wait(std::vector<std::unique_ptr<client_conn>>& clients, Pred done, std::chrono::steady_clock::time_point begin, std::chrono::seconds timeout)
+{
+	auto last = std::chrono::steady_clock::now();
+	while (!done())
+	{
+		auto now = std::chrono::steady_clock::now();
+		if (now - begin > timeout)
+			break;
+		utcp::event_handler::add_elapsed_time(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+		last = now;
+
+		for (auto& client : clients)
+		{
+			client->pump();
+			client->update();
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+}
+
+static void run(int workers, bool io_uring, int port)
+{
+	accepted = 0;
+	received = 0;
+	spread.clear();
+
+	udp_utcp_listener_group group([io_uring]() { return new udp_utcp_listener_impl<server_conn>(io_uring); }, std::chrono::milliseconds(1));
+	if (!group.listen("127.0.0.1", port, workers))
+	{
+		printf("listen failed\n");
+		return;
+	}
+
+	std::vector<std::unique_ptr<client_conn>> clients;
+	for (int i = 0; i < Clients; ++i)
+		clients.emplace_back(new client_conn(port));
+
+	auto begin = std::chrono::steady_clock::now();
+	for (auto& client : clients)
+		client->connect();
+	double handshake_seconds = wait(
+		clients, [&clients]() { return std::all_of(clients.begin(), clients.end(), [](const std::unique_ptr<client_conn>& c) { return c->connected; }); },
+		begin, std::chrono::seconds(20));
+	int connected = (int)std::count_if(clients.begin(), clients.end(), [](const std::unique_ptr<client_conn>& c) { return c->connected; });
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.NameIndex = 255;
+	bunch.ChIndex = 1;
+	bunch.bOpen = 1;
+	bunch.DataBitsLen = BunchBytes * 8;
+
+	int sent = 0;
+	begin = std::chrono::steady_clock::now();
+	while (std::chrono::steady_clock::now() - begin < std::chrono::seconds(2))
+	{
+		for (size_t i = 0; i < clients.size(); ++i)
+		{
+			if (clients[i]->connected)
+			{
+				utcp_send_bunch(clients[i]->get_fd(), &bunch);
+				clients[i]->send_flush();
+				sent++;
+			}
+			if (i % SendChunk == SendChunk - 1)
+				std::this_thread::yield();
+		}
+		for (auto& client : clients)
+			client->pump();
+	}
+	// What is still in flight, what was dropped does not come
+	const int expected = sent;
+	double data_seconds = wait(clients, [expected]() { return received >= expected; }, begin, std::chrono::seconds(3));
+
+	std::string spread_str;
+	{
+		std::lock_guard<decltype(spread_mutex)> lock(spread_mutex);
+		for (auto& it : spread)
+			spread_str += std::to_string(it.second) + " ";
+	}
+	printf("workers=%d %-8s connected=%d/%d handshakes/s=%-8.0f received=%.1f%% packets/s=%-8.0f spread=[ %s]\n", workers, io_uring ? "io_uring" : "recvfrom",
+		   connected, Clients, connected / handshake_seconds, received * 100.0 / std::max(expected, 1), received / data_seconds, spread_str.c_str());
+}
+
+int main()
+{
+	utcp::event_handler::config(nullptr);
+	printf("cores=%u\n", std::thread::hardware_concurrency());
+
+	int port = 27100;
+	for (bool io_uring : {false, true})
+	{
+		for (int workers : {1, 2, 4})
+			run(workers, io_uring, port++);
+	}
+	return 0;
+}
+#else
+int main()
+{
+	printf("SO_REUSEPORT flow hashing is Linux only\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,149 @@
+// Egress cost per 1000 packets: one sendto per packet from on_outgoing, against utcp_set_send_batch flushed with sendmmsg.
+// Every tick each connection sends one unreliable bunch and flushes, like a server flushing all its clients.
+// The packets go to a local UDP socket that is never read, the kernel drops what does not fit in its buffer.
+#include "abstract/utcp.hpp"
+extern "C"
+{
+#include "utcp/utcp_packet.h"
+}
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <vector>
+
+#if defined(__linux)
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int socket_fd = -1;
+static struct sockaddr_in sink_addr;
+static size_t syscalls = 0;
+
+struct sendto_conn : public utcp::conn
+{
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		syscalls++;
+		sendto(socket_fd, data, len, 0, (const struct sockaddr*)&sink_addr, sizeof(sink_addr));
+	}
+};
+
+static void send_batch(struct utcp_send_batch* batch)
+{
+	constexpr int max_messages = 1024; // UIO_MAXIOV
+	static struct mmsghdr msgs[max_messages];
+	static struct iovec iovs[max_messages];
+	for (int begin = 0; begin < batch->Count;)
+	{
+		int count = std::min(batch->Count - begin, max_messages);
+		for (int i = 0; i < count; ++i)
+		{
+			iovs[i].iov_base = batch->Buffer + batch->Items[begin + i].Offset;
+			iovs[i].iov_len = batch->Items[begin + i].Len;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &sink_addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(sink_addr);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		syscalls++;
+		int sent = sendmmsg(socket_fd, msgs, count, 0);
+		begin += sent > 0 ? sent : 1;
+	}
+	batch->Count = 0;
+	batch->BufferUsed = 0;
+}
+
+static void run(int connections, int ticks, bool batched)
+{
+	std::vector<std::unique_ptr<sendto_conn>> conns;
+	for (int i = 0; i < connections; ++i)
+	{
+		conns.emplace_back(new sendto_conn);
+		utcp_sequence_init(conns.back()->get_fd(), 1000, 2000);
+	}
+
+	std::vector<uint8_t> buffer(1024 * UDP_MTU_SIZE);
+	std::vector<struct utcp_send_batch_item> items(1024);
+	struct utcp_send_batch batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.Buffer = buffer.data();
+	batch.BufferSize = (uint32_t)buffer.size();
+	batch.Items = items.data();
+	batch.ItemCapacity = (int32_t)items.size();
+	batch.on_full = send_batch;
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.NameIndex = 255;
+	bunch.ChIndex = 1;
+	bunch.bOpen = 1;
+	bunch.DataBitsLen = 100 * 8;
+
+	syscalls = 0;
+	auto wall_begin = std::chrono::steady_clock::now();
+	clock_t cpu_begin = clock();
+	for (int tick = 0; tick < ticks; ++tick)
+	{
+		if (batched)
+			utcp_set_send_batch(&batch);
+		for (auto& conn : conns)
+		{
+			bunch.Data[0] = (uint8_t)tick;
+			utcp_send_bunch(conn->get_fd(), &bunch);
+			conn->send_flush();
+		}
+		if (batched)
+		{
+			utcp_set_send_batch(nullptr);
+			send_batch(&batch);
+		}
+	}
+	double cpu = (double)(clock() - cpu_begin) / CLOCKS_PER_SEC;
+	double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_begin).count();
+
+	double thousands = (double)connections * ticks / 1000;
+	printf("%-8s connections=%-6d syscalls/1k packets=%-7.1f cpu %.3f ms/1k packets, wall %.3f ms/1k packets\n", batched ? "sendmmsg" : "sendto", connections,
+		   syscalls / thousands, cpu * 1000 / thousands, wall * 1000 / thousands);
+}
+
+int main()
+{
+	utcp::event_handler::config(nullptr);
+
+	socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+	memset(&sink_addr, 0, sizeof(sink_addr));
+	sink_addr.sin_family = AF_INET;
+	sink_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t addr_len = sizeof(sink_addr);
+	if (socket_fd < 0 || sink_fd < 0 || bind(sink_fd, (struct sockaddr*)&sink_addr, sizeof(sink_addr)) != 0 ||
+		getsockname(sink_fd, (struct sockaddr*)&sink_addr, &addr_len) != 0)
+	{
+		printf("socket failed\n");
+		return 1;
+	}
+
+	for (int connections : {100, 1000, 10000})
+	{
+		run(connections, 100000 / connections, false);
+		run(connections, 100000 / connections, true);
+	}
+
+	close(sink_fd);
+	close(socket_fd);
+	return 0;
+}
+#else
+int main()
+{
+	printf("sendmmsg is Linux only\n");
+	return 0;
+}
+#endif
@@ -0,0 +1,118 @@
+// Throughput of utcp::stream_sender over an in-process loopback, for 1 to 100 MB messages.
+// Every round the sender fills its window, the packets cross to the receiver, and the acks come back.
+// Pass a loss rate in percent to drop that share of the data packets, the reliable resends then fill the gaps.
+#include "abstract/utcp_stream.hpp"
+extern "C"
+{
+#include "utcp/utcp_packet.h"
+}
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const uint16_t stream_channel = 1;
+
+struct loopback_endpoint : public utcp::conn, public utcp::stream_receiver
+{
+	std::vector<std::vector<uint8_t>> outgoing;
+	uint64_t received = 0;
+	uint64_t checksum = 0;
+	bool complete = false;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		outgoing.emplace_back((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+
+	virtual void on_recv_bunch(struct utcp_bunch* const bunches[], int count) override
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			if (bunches[i]->ChIndex == stream_channel && !recv_bunch(bunches[i]->Data, bunches[i]->DataBitsLen))
+				abort();
+		}
+	}
+
+	virtual void on_stream_data(uint32_t message_id, uint64_t offset, const uint8_t* data, size_t len) override
+	{
+		received += len;
+		checksum += data[0] + data[len - 1];
+	}
+
+	virtual void on_stream_complete(uint32_t message_id) override
+	{
+		complete = true;
+	}
+};
+
+static void run(size_t megabytes, size_t window_bytes, int loss_percent)
+{
+	std::vector<uint8_t> message(megabytes * 1024 * 1024);
+	uint32_t seed = 1;
+	for (auto& value : message)
+	{
+		seed = seed * 1103515245 + 12345;
+		value = (uint8_t)(seed >> 16);
+	}
+
+	loopback_endpoint server;
+	loopback_endpoint client;
+	utcp_sequence_init(server.get_fd(), 1000, 2000);
+	utcp_sequence_init(client.get_fd(), 2000, 1000);
+
+	utcp::stream_sender sender(&server, stream_channel, 255, window_bytes);
+	sender.send(message.data(), message.size());
+
+	int rounds = 0;
+	size_t packets = 0;
+	size_t packet_bytes = 0;
+	auto begin = std::chrono::steady_clock::now();
+	while (!sender.empty())
+	{
+		rounds++;
+		utcp::event_handler::add_elapsed_time(10 * 1000 * 1000);
+		sender.update();
+		server.send_flush();
+
+		for (auto& packet : server.outgoing)
+		{
+			packets++;
+			packet_bytes += packet.size();
+			seed = seed * 1103515245 + 12345;
+			if ((int)((seed >> 16) % 100) < loss_percent)
+				continue;
+			client.incoming(packet.data(), (int)packet.size());
+		}
+		server.outgoing.clear();
+		client.update();
+		client.send_flush();
+
+		for (auto& packet : client.outgoing)
+			server.incoming(packet.data(), (int)packet.size());
+		client.outgoing.clear();
+		server.update();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	if (!client.complete || client.received != message.size())
+	{
+		printf("%zuMB transfer incomplete\n", megabytes);
+		return;
+	}
+	printf("%4zuMB window=%3zuKB loss=%d%% %8.1f MB/s rounds=%d packets=%zu overhead=%.1f%% checksum=%llu\n", megabytes, window_bytes / 1024, loss_percent,
+		   megabytes / seconds, rounds, packets, (double)(packet_bytes - message.size()) * 100 / message.size(), (unsigned long long)client.checksum);
+}
+
+int main(int argc, char* argv[])
+{
+	utcp::event_handler::config(nullptr);
+	int loss_percent = argc > 1 ? atoi(argv[1]) : 0;
+	for (size_t window_bytes : {64 * 1024, 224 * 1024})
+	{
+		for (size_t megabytes : {1, 10, 100})
+			run(megabytes, window_bytes, loss_percent);
+	}
+	return 0;
+}
@@ -0,0 +1,240 @@
+﻿extern "C"
+{
+#include "utcp/bit_buffer.h"
+#include "utcp/bit_stream.h"
+}
+#include "gtest/gtest.h"
+#include <vector>
+
+static std::vector<uint8_t> random_bytes(size_t size, uint32_t seed)
+{
+	std::vector<uint8_t> bytes(size);
+	for (auto& value : bytes)
+	{
+		seed = seed * 1103515245 + 12345;
+		value = (uint8_t)(seed >> 16);
+	}
+	return bytes;
+}
+
+static void expect_same_copy(size_t dest_bit, size_t src_bit, size_t bits_size, uint32_t seed)
+{
+	// The source is sized to the copied range, the destination keeps a guard byte on each side
+	auto src = random_bytes((src_bit + bits_size + 7) / 8, seed);
+	auto expected = random_bytes((dest_bit + bits_size + 7) / 8 + 2, ~seed);
+	auto actual = expected;
+
+	bitbuf_copy_bits_reference(expected.data() + 1, dest_bit, src.data(), src_bit, bits_size);
+	bitbuf_copy_bits(actual.data() + 1, dest_bit, src.data(), src_bit, bits_size);
+	ASSERT_EQ(actual, expected) << "dest_bit=" << dest_bit << " src_bit=" << src_bit << " bits_size=" << bits_size;
+}
+
+TEST(bit_buffer, copy_bits_matches_reference)
+{
+	for (size_t dest_bit = 0; dest_bit < 16; ++dest_bit)
+	{
+		for (size_t src_bit = 0; src_bit < 16; ++src_bit)
+		{
+			for (size_t bits_size = 0; bits_size <= 300; ++bits_size)
+			{
+				expect_same_copy(dest_bit, src_bit, bits_size, (uint32_t)(dest_bit * 100000 + src_bit * 1000 + bits_size));
+				if (HasFatalFailure())
+					return;
+			}
+		}
+	}
+}
+
+TEST(bit_buffer, copy_bits_matches_reference_mtu)
+{
+	for (size_t dest_bit = 0; dest_bit < 8; ++dest_bit)
+	{
+		for (size_t src_bit = 0; src_bit < 8; ++src_bit)
+		{
+			for (size_t bits_size : {1016, 1024, 4093, 8000, 8192 - 16})
+			{
+				expect_same_copy(dest_bit, src_bit, bits_size, (uint32_t)bits_size);
+				if (HasFatalFailure())
+					return;
+			}
+		}
+	}
+}
+
+TEST(bit_buffer, write_read_bits)
+{
+	auto data = random_bytes(200, 7);
+	for (size_t offset = 0; offset < 16; ++offset)
+	{
+		uint8_t buffer[256];
+		struct bitbuf writer;
+		bitbuf_write_init(&writer, buffer, sizeof(buffer));
+		writer.num = offset;
+		ASSERT_TRUE(bitbuf_write_bits(&writer, data.data(), data.size() * 8 - 3));
+
+		uint8_t read[200];
+		struct bitbuf reader = {buffer, writer.num, offset};
+		ASSERT_TRUE(bitbuf_read_bits(&reader, read, data.size() * 8 - 3));
+		ASSERT_EQ(memcmp(read, data.data(), data.size() - 1), 0);
+		ASSERT_EQ(read[data.size() - 1], data.back() & 0x1F);
+	}
+}
+
+struct stream_field
+{
+	enum
+	{
+		Bits,
+		Int,
+		Wrapped,
+		Packed,
+	} type;
+	uint32_t value;
+	uint32_t arg;
+};
+
+static std::vector<stream_field> random_fields(uint32_t seed)
+{
+	std::vector<stream_field> fields;
+	auto next = [&seed]() {
+		seed = seed * 1103515245 + 12345;
+		return seed >> 8;
+	};
+	for (int i = 0; i < 64; ++i)
+	{
+		stream_field field;
+		field.type = (decltype(field.type))(next() % 4);
+		switch (field.type)
+		{
+		case stream_field::Bits:
+			field.arg = 1 + next() % 32;
+			field.value = next() & (uint32_t)((1ull << field.arg) - 1);
+			break;
+		case stream_field::Int:
+			// Both power of two and other maximums, like EChannelCloseReasonMAX
+			field.arg = (next() & 1) ? 1u << (1 + next() % 16) : 2 + next() % 1000;
+			field.value = next() % field.arg;
+			break;
+		case stream_field::Wrapped:
+			field.arg = 1u << (1 + next() % 16);
+			field.value = next();
+			break;
+		case stream_field::Packed:
+			field.value = next() >> (next() % 24);
+			field.arg = 0;
+			break;
+		}
+		fields.push_back(field);
+	}
+	return fields;
+}
+
+TEST(bit_buffer, stream_matches_bitbuf)
+{
+	for (uint32_t seed = 0; seed < 50; ++seed)
+	{
+		auto fields = random_fields(seed);
+		for (size_t offset = 0; offset < 16; ++offset)
+		{
+			// The bits before the offset and after the fields must survive the stream writer
+			auto expected = random_bytes(512, seed);
+			auto actual = expected;
+
+			struct bitbuf bitbuf;
+			bitbuf_write_reuse(&bitbuf, expected.data(), offset, expected.size());
+			for (auto& field : fields)
+			{
+				// bitbuf writes or into the buffer, clear the bits first so both overwrite
+				for (size_t bit = bitbuf.num; bit < bitbuf.num + 40 && bit < bitbuf.size; ++bit)
+					expected[bit >> 3] &= (uint8_t) ~(1u << (bit & 7));
+				switch (field.type)
+				{
+				case stream_field::Bits:
+					ASSERT_TRUE(bitbuf_write_bits(&bitbuf, &field.value, field.arg));
+					break;
+				case stream_field::Int:
+					ASSERT_TRUE(bitbuf_write_int(&bitbuf, field.value, field.arg));
+					break;
+				case stream_field::Wrapped:
+					ASSERT_TRUE(bitbuf_write_int_wrapped(&bitbuf, field.value, field.arg));
+					break;
+				case stream_field::Packed:
+					ASSERT_TRUE(bitbuf_write_int_packed(&bitbuf, field.value));
+					break;
+				}
+			}
+			const size_t end = bitbuf.num;
+			for (size_t bit = end; bit < (end + 7) / 8 * 8; ++bit)
+				expected[bit >> 3] = (uint8_t)((expected[bit >> 3] & ~(1u << (bit & 7))) | (actual[bit >> 3] & (1u << (bit & 7))));
+			for (size_t byte = (end + 7) / 8; byte < expected.size(); ++byte)
+				expected[byte] = actual[byte];
+
+			struct bitbuf_stream stream;
+			bitbuf_write_reuse(&bitbuf, actual.data(), offset, actual.size());
+			bitbuf_stream_write_begin(&stream, &bitbuf);
+			for (auto& field : fields)
+			{
+				switch (field.type)
+				{
+				case stream_field::Bits:
+					ASSERT_TRUE(bitbuf_stream_write(&stream, field.value, field.arg));
+					break;
+				case stream_field::Int:
+					ASSERT_TRUE(bitbuf_stream_write_int(&stream, field.value, field.arg));
+					break;
+				case stream_field::Wrapped:
+					ASSERT_TRUE(bitbuf_stream_write_int_wrapped(&stream, field.value, field.arg));
+					break;
+				case stream_field::Packed:
+					ASSERT_TRUE(bitbuf_stream_write_int_packed(&stream, field.value));
+					break;
+				}
+			}
+			bitbuf_stream_write_end(&stream, &bitbuf);
+			ASSERT_EQ(bitbuf.num, end);
+			ASSERT_EQ(actual, expected) << "seed=" << seed << " offset=" << offset;
+
+			// Read back with the buffer ending right after the fields
+			struct bitbuf reader = {actual.data(), end, offset};
+			bitbuf_stream_read_begin(&stream, &reader);
+			for (auto& field : fields)
+			{
+				uint32_t value = 0;
+				switch (field.type)
+				{
+				case stream_field::Bits:
+					ASSERT_TRUE(bitbuf_stream_read(&stream, &value, field.arg));
+					ASSERT_EQ(value, field.value);
+					break;
+				case stream_field::Int:
+					ASSERT_TRUE(bitbuf_stream_read_int(&stream, &value, field.arg));
+					ASSERT_EQ(value, field.value);
+					break;
+				case stream_field::Wrapped:
+					ASSERT_TRUE(bitbuf_stream_read_int(&stream, &value, field.arg));
+					ASSERT_EQ(value, field.value & (field.arg - 1));
+					break;
+				case stream_field::Packed:
+					ASSERT_TRUE(bitbuf_stream_read_int_packed(&stream, &value));
+					ASSERT_EQ(value, field.value);
+					break;
+				}
+			}
+			uint32_t value;
+			ASSERT_FALSE(bitbuf_stream_read(&stream, &value, 1));
+			bitbuf_stream_read_end(&stream, &reader);
+			ASSERT_EQ(reader.num, end);
+		}
+	}
+}
+
+TEST(bit_buffer, ceil_log_two)
+{
+	ASSERT_EQ(bitbuf_ceil_log_two(1), 0);
+	ASSERT_EQ(bitbuf_ceil_log_two(2), 1);
+	ASSERT_EQ(bitbuf_ceil_log_two(15), 4);
+	ASSERT_EQ(bitbuf_ceil_log_two(16), 4);
+	ASSERT_EQ(bitbuf_ceil_log_two(17), 5);
+	ASSERT_EQ(bitbuf_ceil_log_two(8192), 13);
+	ASSERT_EQ(bitbuf_ceil_log_two(0x80000001u), 32);
+}
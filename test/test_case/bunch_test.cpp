@@ -2,6 +2,7 @@
 extern "C"
 {
 #include "utcp/utcp_bunch.h"
+#include "utcp/utcp_def_internal.h"
 }
 #include "gtest/gtest.h"
 #include <memory>
@@ -42,3 +43,94 @@ TEST(bunch, read_write)
 	ASSERT_TRUE(utcp_bunch_read(&utcp_bunch2, &bitbuf2));
 	ASSERT_EQ(0, memcmp(&utcp_bunch1, &utcp_bunch2, sizeof(utcp_bunch1)));
 }
+
+TEST(bunch, read_write_delta)
+{
+	struct utcp_bunch bunches[6];
+	memset(bunches, 0, sizeof(bunches));
+	for (int i = 0; i < 4; ++i)
+	{
+		// Channels opened together
+		bunches[i].ChIndex = 10 + i;
+		bunches[i].ChSequence = 1023;
+		bunches[i].NameIndex = 255;
+		bunches[i].bOpen = 1;
+		bunches[i].bReliable = 1;
+		bunches[i].DataBitsLen = 8;
+		bunches[i].Data[0] = (uint8_t)i;
+	}
+	bunches[4] = bunches[3];
+	bunches[4].ChSequence = 0;
+	bunches[4].bOpen = 0;
+	bunches[5].ChIndex = 543;
+	bunches[5].bClose = 1;
+	bunches[5].CloseReason = 9;
+	bunches[5].bPartial = 1;
+	bunches[5].bPartialFinal = 1;
+	bunches[5].DataBitsLen = 789;
+
+	uint8_t buffer[UDP_MTU_SIZE];
+	struct bitbuf bitbuf1;
+	ASSERT_TRUE(bitbuf_write_init(&bitbuf1, buffer, sizeof(buffer)));
+
+	struct utcp_bunch_delta_context write_context;
+	memset(&write_context, 0, sizeof(write_context));
+	size_t full_bits = 0;
+	size_t delta_bits = 0;
+	for (auto& bunch : bunches)
+	{
+		uint8_t full_buffer[MAX_BUNCH_HEADER_BYTES];
+		struct bitbuf full;
+		ASSERT_TRUE(bitbuf_write_init(&full, full_buffer, sizeof(full_buffer)));
+		ASSERT_TRUE(utcp_bunch_write_header(&bunch, &full));
+		full_bits += full.num;
+
+		size_t start = bitbuf1.num;
+		ASSERT_TRUE(utcp_bunch_write_header_delta(&bunch, &bitbuf1, &write_context));
+		ASSERT_LE(bitbuf1.num - start, full.num + 1);
+		delta_bits += bitbuf1.num - start;
+		ASSERT_TRUE(bitbuf_write_bits(&bitbuf1, bunch.Data, bunch.DataBitsLen));
+	}
+	ASSERT_LT(delta_bits, full_bits);
+	bitbuf_write_end(&bitbuf1);
+
+	struct bitbuf bitbuf2;
+	ASSERT_TRUE(bitbuf_read_init(&bitbuf2, buffer, bitbuf_num_bytes(&bitbuf1)));
+
+	struct utcp_bunch_delta_context read_context;
+	memset(&read_context, 0, sizeof(read_context));
+	for (auto& bunch : bunches)
+	{
+		struct utcp_bunch read_bunch;
+		ASSERT_TRUE(utcp_bunch_read_delta(&read_bunch, &bitbuf2, &read_context));
+		ASSERT_EQ(0, memcmp(&bunch, &read_bunch, sizeof(bunch)));
+	}
+	ASSERT_EQ(bitbuf2.num, bitbuf2.size);
+}
+
+TEST(bunch, read_delta_without_context)
+{
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.ChIndex = 3;
+	bunch.DataBitsLen = 8;
+
+	uint8_t buffer[UDP_MTU_SIZE];
+	struct bitbuf bitbuf1;
+	ASSERT_TRUE(bitbuf_write_init(&bitbuf1, buffer, sizeof(buffer)));
+	struct utcp_bunch_delta_context write_context;
+	memset(&write_context, 0, sizeof(write_context));
+	ASSERT_TRUE(utcp_bunch_write_header_delta(&bunch, &bitbuf1, &write_context));
+	ASSERT_TRUE(utcp_bunch_write_header_delta(&bunch, &bitbuf1, &write_context));
+	bitbuf_write_end(&bitbuf1);
+
+	// The second header is a delta one, it can not be read on its own
+	struct bitbuf bitbuf2;
+	ASSERT_TRUE(bitbuf_read_init(&bitbuf2, buffer, bitbuf_num_bytes(&bitbuf1)));
+	struct utcp_bunch_delta_context read_context;
+	memset(&read_context, 0, sizeof(read_context));
+	struct utcp_bunch read_bunch;
+	ASSERT_TRUE(utcp_bunch_read_delta(&read_bunch, &bitbuf2, &read_context));
+	read_context.bValid = 0;
+	ASSERT_FALSE(utcp_bunch_read_delta(&read_bunch, &bitbuf2, &read_context));
+}
@@ -10,6 +10,11 @@ void reset_nodes(utcp_bunch_node_raii nodes[], size_t size)
 	}
 }
 
+static int merge_partial(utcp_channel* channel, utcp_bunch_node* node, bool* bOutSkipAck)
+{
+	return merge_partial_data(channel, &node->utcp_bunch, node->utcp_bunch.Data, 0, bOutSkipAck);
+}
+
 TEST(channel, same_incoming)
 {
 	utcp_channel_rtti channel;
@@ -124,6 +129,7 @@ TEST(channel, partial_reliable)
 	for (int i = 0; i < std::size(nodes); ++i)
 	{
 		auto node = &nodes[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i;
 		node->utcp_bunch.bReliable = true;
 		node->utcp_bunch.bPartial = true;
@@ -135,7 +141,7 @@ TEST(channel, partial_reliable)
 	{
 		auto node = &nodes[i];
 		bool bOutSkipAck;
-		int ret = merge_partial_data(&channel, node, &bOutSkipAck);
+		int ret = merge_partial(&channel, node, &bOutSkipAck);
 		if (i + 1 != std::size(nodes))
 		{
 			ASSERT_EQ(ret, partial_merge_succeed);
@@ -147,10 +153,10 @@ TEST(channel, partial_reliable)
 		ASSERT_FALSE(bOutSkipAck);
 	}
 
-	struct utcp_bunch* handle_bunches[MaxSequenceHistoryLength];
-	ASSERT_EQ(get_partial_bunch(&channel, handle_bunches, (int)std::size(handle_bunches)), 4);
+	auto partial_bunch = get_partial_bunch(&channel);
+	ASSERT_EQ(partial_bunch->Count, 4);
+	ASSERT_EQ(partial_bunch->Header.ChSequence, 3);
 
-	reset_nodes(nodes, std::size(nodes));
 	clear_partial_data(&channel);
 }
 
@@ -161,6 +167,7 @@ TEST(channel, partial_reliable_failed)
 	for (int i = 0; i < std::size(nodes); ++i)
 	{
 		auto node = &nodes[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i * 2;
 		node->utcp_bunch.bReliable = true;
 		node->utcp_bunch.bPartial = true;
@@ -172,12 +179,11 @@ TEST(channel, partial_reliable_failed)
 	{
 		auto node = &nodes[i];
 		bool bOutSkipAck;
-		int ret = merge_partial_data(&channel, node, &bOutSkipAck);
+		int ret = merge_partial(&channel, node, &bOutSkipAck);
 		if (i == 0)
 		{
 			ASSERT_EQ(ret, partial_merge_succeed);
 			ASSERT_FALSE(bOutSkipAck);
-			nodes[i].reset();
 		}
 		else
 		{
@@ -195,6 +201,7 @@ TEST(channel, partial_reliable_none_initial)
 	for (int i = 0; i < std::size(nodes); ++i)
 	{
 		auto node = &nodes[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i;
 		node->utcp_bunch.bReliable = true;
 		node->utcp_bunch.bPartial = true;
@@ -206,7 +213,7 @@ TEST(channel, partial_reliable_none_initial)
 	{
 		auto node = &nodes[i];
 		bool bOutSkipAck;
-		ASSERT_EQ(merge_partial_data(&channel, node, &bOutSkipAck), partial_merge_failed);
+		ASSERT_EQ(merge_partial(&channel, node, &bOutSkipAck), partial_merge_failed);
 	}
 }
 
@@ -217,6 +224,7 @@ TEST(channel, partial_unreliable)
 	for (int i = 0; i < std::size(nodes); ++i)
 	{
 		auto node = &nodes[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i;
 		node->utcp_bunch.bReliable = false;
 		node->utcp_bunch.bPartial = true;
@@ -228,7 +236,7 @@ TEST(channel, partial_unreliable)
 	{
 		auto node = &nodes[i];
 		bool bOutSkipAck;
-		int ret = merge_partial_data(&channel, node, &bOutSkipAck);
+		int ret = merge_partial(&channel, node, &bOutSkipAck);
 		if (i + 1 != std::size(nodes))
 			ASSERT_EQ(ret, partial_merge_succeed);
 		else
@@ -236,15 +244,10 @@ TEST(channel, partial_unreliable)
 		ASSERT_FALSE(bOutSkipAck);
 	}
 
-	struct utcp_bunch* handle_bunches[MaxSequenceHistoryLength];
-	ASSERT_EQ(get_partial_bunch(&channel, handle_bunches, (int)std::size(handle_bunches)), std::size(nodes));
+	auto partial_bunch = get_partial_bunch(&channel);
+	ASSERT_EQ(partial_bunch->Count, std::size(nodes));
+	ASSERT_EQ(partial_bunch->Header.ChSequence, std::size(nodes) - 1);
 
-	for (int i = 0; i < std::size(nodes); ++i)
-	{
-		ASSERT_EQ(handle_bunches[i]->ChSequence, i);
-	}
-
-	reset_nodes(nodes, std::size(nodes));
 
 	clear_partial_data(&channel);
 }
@@ -256,6 +259,7 @@ TEST(channel, partial_unreliable_failed)
 	for (int i = 0; i < std::size(nodes); ++i)
 	{
 		auto node = &nodes[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i * 2;
 		node->utcp_bunch.bReliable = false;
 		node->utcp_bunch.bPartial = true;
@@ -267,13 +271,12 @@ TEST(channel, partial_unreliable_failed)
 	{
 		auto node = &nodes[i];
 		bool bOutSkipAck;
-		int ret = merge_partial_data(&channel, node, &bOutSkipAck);
+		int ret = merge_partial(&channel, node, &bOutSkipAck);
 
 		if (i == 0)
 		{
 			ASSERT_EQ(ret, partial_merge_succeed);
 			ASSERT_FALSE(bOutSkipAck);
-			nodes[i].reset();
 		}
 		else
 		{
@@ -290,6 +293,7 @@ TEST(channel, partial_unreliable_none_initial)
 	for (int i = 0; i < std::size(nodes); ++i)
 	{
 		auto node = &nodes[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i;
 		node->utcp_bunch.bReliable = false;
 		node->utcp_bunch.bPartial = true;
@@ -301,7 +305,7 @@ TEST(channel, partial_unreliable_none_initial)
 	{
 		auto node = &nodes[i];
 		bool bOutSkipAck;
-		ASSERT_EQ(merge_partial_data(&channel, node, &bOutSkipAck), partial_merge_failed);
+		ASSERT_EQ(merge_partial(&channel, node, &bOutSkipAck), partial_merge_failed);
 	}
 }
 
@@ -312,6 +316,7 @@ TEST(channel, partial_unreliable_reliable)
 	for (int i = 0; i < std::size(nodes1); ++i)
 	{
 		auto node = &nodes1[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i;
 		node->utcp_bunch.bReliable = false;
 		node->utcp_bunch.bPartial = true;
@@ -323,6 +328,7 @@ TEST(channel, partial_unreliable_reliable)
 	for (int i = 0; i < std::size(nodes1); ++i)
 	{
 		auto node = &nodes2[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i;
 		node->utcp_bunch.bReliable = true;
 		node->utcp_bunch.bPartial = true;
@@ -334,16 +340,14 @@ TEST(channel, partial_unreliable_reliable)
 	{
 		auto node = &nodes1[i];
 		bool bOutSkipAck;
-		ASSERT_EQ(merge_partial_data(&channel, node, &bOutSkipAck), partial_merge_succeed);
-		nodes1[i].reset();
+		ASSERT_EQ(merge_partial(&channel, node, &bOutSkipAck), partial_merge_succeed);
 	}
 
 	for (int i = 0; i < std::size(nodes2); ++i)
 	{
 		auto node = &nodes2[i];
 		bool bOutSkipAck;
-		ASSERT_EQ(merge_partial_data(&channel, node, &bOutSkipAck), partial_merge_succeed);
-		nodes2[i].reset();
+		ASSERT_EQ(merge_partial(&channel, node, &bOutSkipAck), partial_merge_succeed);
 	}
 }
 
@@ -354,6 +358,7 @@ TEST(channel, partial_reliable_unreliable)
 	for (int i = 0; i < std::size(nodes1); ++i)
 	{
 		auto node = &nodes1[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i;
 		node->utcp_bunch.bReliable = false;
 		node->utcp_bunch.bPartial = true;
@@ -365,6 +370,7 @@ TEST(channel, partial_reliable_unreliable)
 	for (int i = 0; i < std::size(nodes1); ++i)
 	{
 		auto node = &nodes2[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
 		node->utcp_bunch.ChSequence = i;
 		node->utcp_bunch.bReliable = true;
 		node->utcp_bunch.bPartial = true;
@@ -376,14 +382,101 @@ TEST(channel, partial_reliable_unreliable)
 	{
 		auto node = &nodes2[i];
 		bool bOutSkipAck;
-		ASSERT_EQ(merge_partial_data(&channel, node, &bOutSkipAck), partial_merge_succeed);
-		nodes2[i].reset();
+		ASSERT_EQ(merge_partial(&channel, node, &bOutSkipAck), partial_merge_succeed);
 	}
 
 	for (int i = 0; i < std::size(nodes1); ++i)
 	{
 		auto node = &nodes1[i];
 		bool bOutSkipAck;
-		ASSERT_EQ(merge_partial_data(&channel, node, &bOutSkipAck), partial_merge_failed);
+		ASSERT_EQ(merge_partial(&channel, node, &bOutSkipAck), partial_merge_failed);
+	}
+}
+
+TEST(channel, partial_contiguous)
+{
+	// Unaligned sizes, every merged bunch lands right after the previous one
+	utcp_channel_rtti channel;
+	utcp_bunch_node_raii nodes[5];
+	const uint16_t sizes[] = {7265, 13, 1, 4000, 5};
+	std::vector<uint8_t> expected;
+	size_t expected_bits = 0;
+	uint32_t seed = 1;
+	for (int i = 0; i < std::size(nodes); ++i)
+	{
+		auto node = &nodes[i];
+		memset(&node->utcp_bunch, 0, sizeof(node->utcp_bunch));
+		node->utcp_bunch.ChSequence = i;
+		node->utcp_bunch.bReliable = true;
+		node->utcp_bunch.bPartial = true;
+		node->utcp_bunch.bPartialInitial = i == 0;
+		node->utcp_bunch.bPartialFinal = (i + 1 == std::size(nodes));
+		node->utcp_bunch.bOpen = i == 0;
+		node->utcp_bunch.DataBitsLen = sizes[i];
+		for (int bit = 0; bit < sizes[i]; ++bit)
+		{
+			seed = seed * 1103515245 + 12345;
+			uint8_t value = (seed >> 16) & 1;
+			node->utcp_bunch.Data[bit >> 3] |= value << (bit & 7);
+			expected.resize((expected_bits + 8) / 8);
+			expected[expected_bits >> 3] |= value << (expected_bits & 7);
+			expected_bits++;
+		}
+
+		bool bOutSkipAck;
+		ASSERT_EQ(merge_partial(&channel, node, &bOutSkipAck), i + 1 == std::size(nodes) ? partial_available : partial_merge_succeed);
 	}
+
+	auto partial_bunch = get_partial_bunch(&channel);
+	ASSERT_EQ(partial_bunch->DataBitsLen, expected_bits);
+	ASSERT_EQ(0, memcmp(partial_bunch->Data, expected.data(), expected.size()));
+	ASSERT_TRUE(partial_bunch->Header.bOpen);
+	for (int i = 0; i < std::size(nodes); ++i)
+	{
+		ASSERT_EQ(partial_bunch->BunchBitsLen[i], sizes[i]);
+	}
+
+	clear_partial_data(&channel);
+	ASSERT_EQ((&channel)->InPartialBunch->Count, 0);
+}
+
+TEST(channel, partial_too_large)
+{
+	utcp_channel_rtti channel;
+	utcp_bunch_node_raii node;
+	memset(&(&node)->utcp_bunch, 0, sizeof((&node)->utcp_bunch));
+	(&node)->utcp_bunch.bReliable = true;
+	(&node)->utcp_bunch.bPartial = true;
+	(&node)->utcp_bunch.DataBitsLen = UTCP_MAX_PACKET * 8;
+
+	bool bOutSkipAck;
+	const int count = UTCP_MAX_PARTIAL_BUNCH_BYTES / UTCP_MAX_PACKET;
+	for (int i = 0; i < count; ++i)
+	{
+		(&node)->utcp_bunch.ChSequence = i;
+		(&node)->utcp_bunch.bPartialInitial = i == 0;
+		ASSERT_EQ(merge_partial(&channel, &node, &bOutSkipAck), partial_merge_succeed);
+	}
+	(&node)->utcp_bunch.ChSequence = count;
+	ASSERT_EQ(merge_partial(&channel, &node, &bOutSkipAck), partial_merge_fatal);
+	ASSERT_EQ((&channel)->InPartialBunch->Count, 0);
+}
+
+TEST(channel, unordered_incoming)
+{
+	utcp_channel_rtti channel;
+	(&channel)->bUnordered = true;
+
+	ASSERT_EQ(mark_unordered_incoming(&channel, 3), 1);
+	ASSERT_EQ(mark_unordered_incoming(&channel, 3), 0);
+	ASSERT_EQ(mark_unordered_incoming(&channel, 2), 1);
+	ASSERT_EQ(mark_unordered_incoming(&channel, UTCP_UNORDERED_WINDOW), 1);
+	ASSERT_EQ(mark_unordered_incoming(&channel, UTCP_UNORDERED_WINDOW + 1), -1);
+
+	(&channel)->InReliable = 1;
+	shift_unordered_incoming(&channel);
+	ASSERT_EQ(mark_unordered_incoming(&channel, 2), 0);
+	ASSERT_EQ(mark_unordered_incoming(&channel, 3), 0);
+	ASSERT_EQ(mark_unordered_incoming(&channel, UTCP_UNORDERED_WINDOW), 0);
+	ASSERT_EQ(mark_unordered_incoming(&channel, UTCP_UNORDERED_WINDOW + 1), 1);
 }
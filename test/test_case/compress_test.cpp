@@ -0,0 +1,116 @@
+﻿#include "gtest/gtest.h"
+extern "C"
+{
+#include "utcp/utcp_compress.h"
+}
+#include <vector>
+
+static std::vector<uint8_t> replication_payload(uint32_t seed, int count)
+{
+	// Property layout repeated every tick, only the values change
+	std::vector<uint8_t> payload;
+	for (int i = 0; i < count; ++i)
+	{
+		const uint8_t layout[] = {0x12, 0x00, 0x04, 0x80, 0x3F, 0x00, 0x00, 0x05, 0x01, 0x00};
+		payload.insert(payload.end(), layout, layout + sizeof(layout));
+		seed = seed * 1103515245 + 12345;
+		payload.push_back((uint8_t)(seed >> 16));
+		payload.push_back((uint8_t)(i));
+	}
+	return payload;
+}
+
+static std::vector<uint8_t> round_trip(const std::vector<uint8_t>& src, int* compressed_size = nullptr)
+{
+	std::vector<uint8_t> compressed(src.size() * 2 + 16);
+	int len = utcp_compress(src.data(), (int)src.size(), compressed.data(), (int)compressed.size());
+	EXPECT_GE(len, 0);
+	if (compressed_size)
+		*compressed_size = len;
+
+	std::vector<uint8_t> dst(src.size());
+	int dst_len = utcp_decompress(compressed.data(), len, dst.data(), (int)dst.size());
+	EXPECT_EQ(dst_len, (int)src.size());
+	return dst;
+}
+
+TEST(compress, round_trip)
+{
+	for (int count : {0, 1, 2, 10, 80})
+	{
+		auto src = replication_payload(count, count);
+		ASSERT_EQ(round_trip(src), src);
+	}
+
+	std::vector<uint8_t> random(1000);
+	uint32_t seed = 1;
+	for (auto& value : random)
+	{
+		seed = seed * 1103515245 + 12345;
+		value = (uint8_t)(seed >> 16);
+	}
+	ASSERT_EQ(round_trip(random), random);
+
+	std::vector<uint8_t> zeros(1000);
+	int compressed_size;
+	ASSERT_EQ(round_trip(zeros, &compressed_size), zeros);
+	ASSERT_LT(compressed_size, 20);
+}
+
+TEST(compress, dictionary)
+{
+	auto dict = replication_payload(1, 50);
+	auto src = replication_payload(2, 10);
+
+	int plain_size;
+	ASSERT_EQ(round_trip(src, &plain_size), src);
+
+	utcp_compress_set_dictionary(dict.data(), (int)dict.size());
+	ASSERT_NE(utcp_compress_dictionary_id(), 0);
+
+	int dict_size;
+	ASSERT_EQ(round_trip(src, &dict_size), src);
+	ASSERT_LT(dict_size, plain_size);
+
+	utcp_compress_set_dictionary(nullptr, 0);
+	ASSERT_EQ(utcp_compress_dictionary_id(), 0);
+}
+
+TEST(compress, output_too_small)
+{
+	auto src = replication_payload(3, 20);
+	std::vector<uint8_t> compressed(src.size());
+	int len = utcp_compress(src.data(), (int)src.size(), compressed.data(), (int)compressed.size());
+	ASSERT_GT(len, 0);
+
+	ASSERT_EQ(utcp_compress(src.data(), (int)src.size(), compressed.data(), 4), -1);
+
+	std::vector<uint8_t> dst(src.size() - 1);
+	ASSERT_EQ(utcp_decompress(compressed.data(), len, dst.data(), (int)dst.size()), -1);
+}
+
+TEST(compress, malformed)
+{
+	uint8_t dst[64];
+
+	// Match before the start of the output, without a dictionary
+	const uint8_t bad_offset[] = {0x10, 'a', 0x02, 0x00};
+	ASSERT_EQ(utcp_decompress(bad_offset, sizeof(bad_offset), dst, sizeof(dst)), -1);
+
+	// Zero offset
+	const uint8_t zero_offset[] = {0x10, 'a', 0x00, 0x00};
+	ASSERT_EQ(utcp_decompress(zero_offset, sizeof(zero_offset), dst, sizeof(dst)), -1);
+
+	// Literal length runs past the input
+	const uint8_t long_literal[] = {0xF0, 0xFF, 0xFF, 'a'};
+	ASSERT_EQ(utcp_decompress(long_literal, sizeof(long_literal), dst, sizeof(dst)), -1);
+
+	// Truncated offset
+	const uint8_t truncated[] = {0x10, 'a', 0x01};
+	ASSERT_EQ(utcp_decompress(truncated, sizeof(truncated), dst, sizeof(dst)), -1);
+
+	// Overlapping match repeats the literal
+	const uint8_t repeat[] = {0x14, 'a', 0x01, 0x00};
+	ASSERT_EQ(utcp_decompress(repeat, sizeof(repeat), dst, sizeof(dst)), 9);
+	ASSERT_EQ(memcmp(dst, "aaaaaaaaa", 9), 0);
+}
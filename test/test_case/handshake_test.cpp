@@ -1,9 +1,18 @@
 ﻿#include "test_utils.h"
+#include "abstract/utcp.hpp"
 #include "utcp/utcp.h"
 #include "utcp/utcp_def.h"
 #include "gtest/gtest.h"
 #include <memory>
 
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#endif
+
 static uint8_t handshake_step1[] = {1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8};
 static std::vector<uint8_t> last_send;
 static bool new_conn;
@@ -58,4 +67,607 @@ TEST_F(handshake, client)
 	ASSERT_EQ(last_send.size(), sizeof(handshake_step1));
 	ASSERT_EQ(memcmp(handshake_step1, last_send.data(), last_send.size()), 0);
 }
-*/
\ No newline at end of file
+*/
+
+struct handshake_endpoint
+{
+	std::vector<std::vector<uint8_t>> outgoing;
+	utcp_connection* accepted = nullptr;
+};
+
+struct handshake_features : public ::testing::Test
+{
+	utcp_listener_rtti listener;
+	utcp_connection_rtti server;
+	utcp_connection_rtti client;
+	handshake_endpoint listener_endpoint;
+	handshake_endpoint client_endpoint;
+
+	virtual void SetUp() override
+	{
+		auto config = utcp_get_config();
+		config->on_outgoing = [](void* fd, void* userdata, const void* data, int len) {
+			auto endpoint = (handshake_endpoint*)userdata;
+			endpoint->outgoing.emplace_back((const uint8_t*)data, (const uint8_t*)data + len);
+		};
+		config->on_accept = [](struct utcp_listener* fd, void* userdata, bool reconnect) {
+			auto endpoint = (handshake_endpoint*)userdata;
+			utcp_listener_accept(fd, endpoint->accepted, reconnect);
+		};
+		config->Features = UTCP_FEATURE_COMPRESSION;
+
+		listener.get()->userdata = &listener_endpoint;
+		client.get()->userdata = &client_endpoint;
+		listener_endpoint.accepted = server.get();
+		utcp_add_elapsed_time(1000 * 1000 * 1000);
+	}
+
+	virtual void TearDown() override
+	{
+		auto config = utcp_get_config();
+		config->on_outgoing = nullptr;
+		config->on_accept = nullptr;
+		config->Features = 0;
+		utcp_set_compress_dictionary(nullptr, 0);
+		utcp_listener_set_pending_accepts(listener.get(), 0);
+		utcp_listener_set_limits(listener.get(), nullptr);
+	}
+
+	void begin()
+	{
+		utcp_connect(client.get());
+		ASSERT_EQ(client_endpoint.outgoing.size(), 1);
+		ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:12345", client_endpoint.outgoing[0].data(), (int)client_endpoint.outgoing[0].size()), 0);
+		ASSERT_EQ(listener_endpoint.outgoing.size(), 1);
+		ASSERT_TRUE(utcp_incoming(client.get(), listener_endpoint.outgoing[0].data(), (int)listener_endpoint.outgoing[0].size()));
+		ASSERT_EQ(client_endpoint.outgoing.size(), 2);
+	}
+
+	void finish()
+	{
+		ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:12345", client_endpoint.outgoing[1].data(), (int)client_endpoint.outgoing[1].size()), 0);
+		ASSERT_EQ(listener_endpoint.outgoing.size(), 2);
+		ASSERT_TRUE(utcp_incoming(client.get(), listener_endpoint.outgoing[1].data(), (int)listener_endpoint.outgoing[1].size()));
+	}
+};
+
+TEST_F(handshake_features, agree_compression)
+{
+	const uint8_t dict[] = "ReplicatedMovement Location Rotation Velocity";
+	utcp_set_compress_dictionary(dict, sizeof(dict));
+
+	begin();
+	finish();
+	ASSERT_EQ((&server)->Features, UTCP_FEATURE_COMPRESSION);
+	ASSERT_EQ((&client)->Features, UTCP_FEATURE_COMPRESSION);
+}
+
+TEST_F(handshake_features, dictionary_mismatch)
+{
+	begin();
+
+	// The client response carries the id of an empty dictionary
+	const uint8_t dict[] = "ReplicatedMovement Location Rotation Velocity";
+	utcp_set_compress_dictionary(dict, sizeof(dict));
+
+	finish();
+	ASSERT_EQ((&server)->Features, 0);
+	ASSERT_EQ((&client)->Features, 0);
+}
+
+TEST_F(handshake_features, ack_resend)
+{
+	const uint8_t dict[] = "ReplicatedMovement Location Rotation Velocity";
+	utcp_set_compress_dictionary(dict, sizeof(dict));
+	server.get()->userdata = &listener_endpoint;
+
+	begin();
+	// The ack is lost, the client sends its response again and the connection resends the ack
+	ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:12345", client_endpoint.outgoing[1].data(), (int)client_endpoint.outgoing[1].size()), 0);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 2);
+	ASSERT_TRUE(utcp_incoming(server.get(), client_endpoint.outgoing[1].data(), (int)client_endpoint.outgoing[1].size()));
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 3);
+	ASSERT_TRUE(utcp_incoming(client.get(), listener_endpoint.outgoing[2].data(), (int)listener_endpoint.outgoing[2].size()));
+	ASSERT_EQ((&server)->Features, UTCP_FEATURE_COMPRESSION);
+	ASSERT_EQ((&client)->Features, UTCP_FEATURE_COMPRESSION);
+}
+
+TEST_F(handshake_features, shared_secret)
+{
+	utcp_listener_rtti other;
+	other.get()->userdata = &listener_endpoint;
+
+	begin();
+	// Another listener of the port has its own secrets
+	ASSERT_EQ(utcp_listener_incoming(other.get(), "127.0.0.1:12345", client_endpoint.outgoing[1].data(), (int)client_endpoint.outgoing[1].size()), -7);
+
+	// The cookie was issued before the rotation, the previous secret still validates it
+	utcp_listener_update_secret(listener.get(), nullptr);
+	utcp_listener_copy_secret(other.get(), listener.get());
+	ASSERT_EQ(utcp_listener_incoming(other.get(), "127.0.0.1:12345", client_endpoint.outgoing[1].data(), (int)client_endpoint.outgoing[1].size()), 0);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 2);
+	ASSERT_TRUE(utcp_incoming(client.get(), listener_endpoint.outgoing[1].data(), (int)listener_endpoint.outgoing[1].size()));
+	ASSERT_EQ((&server)->Features, UTCP_FEATURE_COMPRESSION);
+}
+
+struct handshake_pending_accepts : public handshake_features
+{
+	utcp_connection_rtti server2;
+	utcp_connection_rtti client2;
+	handshake_endpoint client2_endpoint;
+
+	virtual void SetUp() override
+	{
+		handshake_features::SetUp();
+		client2.get()->userdata = &client2_endpoint;
+		// Nothing may reach on_accept
+		listener_endpoint.accepted = nullptr;
+
+		begin();
+		utcp_connect(client2.get());
+		ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:12346", client2_endpoint.outgoing[0].data(), (int)client2_endpoint.outgoing[0].size()), 0);
+		ASSERT_EQ(listener_endpoint.outgoing.size(), 2);
+		ASSERT_TRUE(utcp_incoming(client2.get(), listener_endpoint.outgoing[1].data(), (int)listener_endpoint.outgoing[1].size()));
+		ASSERT_EQ(client2_endpoint.outgoing.size(), 2);
+		listener_endpoint.outgoing.clear();
+	}
+
+	int respond(utcp_connection_rtti& from, const char* address)
+	{
+		auto endpoint = (handshake_endpoint*)from.get()->userdata;
+		return utcp_listener_incoming(listener.get(), address, endpoint->outgoing[1].data(), (int)endpoint->outgoing[1].size());
+	}
+};
+
+TEST_F(handshake_pending_accepts, take)
+{
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), 4));
+
+	ASSERT_EQ(respond(client2, "127.0.0.1:12346"), 0);
+	ASSERT_EQ(respond(client, "127.0.0.1:12345"), 0);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 2);
+
+	struct utcp_accept_info accepts[4];
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts, 4), 2);
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts + 2, 2), 0);
+	char address[64];
+	ASSERT_STREQ(utcp_address_format(&accepts[0].Address, address, sizeof(address)), "127.0.0.1:12346");
+	ASSERT_STREQ(utcp_address_format(&accepts[1].Address, address, sizeof(address)), "127.0.0.1:12345");
+
+	utcp_listener_accept_pending(server2.get(), &accepts[0]);
+	utcp_listener_accept_pending(server.get(), &accepts[1]);
+
+	ASSERT_TRUE(utcp_incoming(client2.get(), listener_endpoint.outgoing[0].data(), (int)listener_endpoint.outgoing[0].size()));
+	ASSERT_TRUE(utcp_incoming(client.get(), listener_endpoint.outgoing[1].data(), (int)listener_endpoint.outgoing[1].size()));
+	ASSERT_EQ(memcmp((&server)->AuthorisedCookie, (&client)->AuthorisedCookie, sizeof((&client)->AuthorisedCookie)), 0);
+	ASSERT_EQ(memcmp((&server2)->AuthorisedCookie, (&client2)->AuthorisedCookie, sizeof((&client2)->AuthorisedCookie)), 0);
+	ASSERT_NE(memcmp((&server)->AuthorisedCookie, (&server2)->AuthorisedCookie, sizeof((&server)->AuthorisedCookie)), 0);
+	ASSERT_EQ((&server)->Features, UTCP_FEATURE_COMPRESSION);
+	ASSERT_EQ((&server2)->Features, UTCP_FEATURE_COMPRESSION);
+}
+
+TEST_F(handshake_pending_accepts, retry)
+{
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), 2));
+
+	ASSERT_EQ(respond(client, "127.0.0.1:12345"), 0);
+	ASSERT_EQ(respond(client, "127.0.0.1:12345"), 0);
+	ASSERT_EQ(respond(client2, "127.0.0.1:12346"), 0);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 3);
+
+	struct utcp_accept_info accepts[2];
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts, 2), 2);
+}
+
+TEST_F(handshake_pending_accepts, full)
+{
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), 1));
+
+	ASSERT_EQ(respond(client, "127.0.0.1:12345"), 0);
+	ASSERT_EQ(respond(client2, "127.0.0.1:12346"), -8);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 1);
+
+	// Once the table is taken the retry goes through
+	struct utcp_accept_info accept;
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), &accept, 1), 1);
+	ASSERT_EQ(respond(client2, "127.0.0.1:12346"), 0);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 2);
+}
+
+TEST_F(handshake_pending_accepts, many)
+{
+	// Enough addresses for the index to probe and shift, and the ring to wrap
+	const int count = 100;
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), count));
+
+	std::vector<std::unique_ptr<utcp_connection_rtti>> clients;
+	std::vector<handshake_endpoint> endpoints(count);
+	std::vector<std::string> addresses;
+	for (int i = 0; i < count; ++i)
+	{
+		clients.emplace_back(new utcp_connection_rtti);
+		clients[i]->get()->userdata = &endpoints[i];
+		addresses.push_back("10.0." + std::to_string(i / 256) + "." + std::to_string(i % 256) + ":7777");
+		utcp_connect(clients[i]->get());
+		ASSERT_EQ(utcp_listener_incoming(listener.get(), addresses[i].c_str(), endpoints[i].outgoing[0].data(), (int)endpoints[i].outgoing[0].size()), 0);
+		ASSERT_TRUE(utcp_incoming(clients[i]->get(), listener_endpoint.outgoing.back().data(), (int)listener_endpoint.outgoing.back().size()));
+		ASSERT_EQ(respond(*clients[i], addresses[i].c_str()), 0);
+	}
+	ASSERT_EQ(respond(client2, "127.0.0.1:12346"), -8);
+
+	// Retries keep their slot
+	for (int i = 0; i < count; i += 2)
+		ASSERT_EQ(respond(*clients[i], addresses[i].c_str()), 0);
+
+	struct utcp_accept_info accepts[count];
+	char address[64];
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts, 30), 30);
+	for (int i = 0; i < 30; ++i)
+		ASSERT_STREQ(utcp_address_format(&accepts[i].Address, address, sizeof(address)), addresses[i].c_str());
+
+	// The taken ones come in again behind the rest, the waiting ones are still found
+	for (int i = 0; i < 30; ++i)
+		ASSERT_EQ(respond(*clients[i], addresses[i].c_str()), 0);
+	for (int i = 30; i < count; ++i)
+		ASSERT_EQ(respond(*clients[i], addresses[i].c_str()), 0);
+	ASSERT_EQ(respond(client2, "127.0.0.1:12346"), -8);
+
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts, count), count);
+	for (int i = 0; i < count; ++i)
+		ASSERT_STREQ(utcp_address_format(&accepts[i].Address, address, sizeof(address)), addresses[(i + 30) % count].c_str());
+}
+
+TEST_F(handshake_pending_accepts, resize)
+{
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), 2));
+	struct utcp_accept_info accepts[2];
+
+	// The ring has wrapped when it grows
+	ASSERT_EQ(respond(client, "127.0.0.1:12345"), 0);
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts, 1), 1);
+	ASSERT_EQ(respond(client2, "127.0.0.1:12346"), 0);
+	ASSERT_EQ(respond(client, "127.0.0.1:12345"), 0);
+	ASSERT_FALSE(utcp_listener_set_pending_accepts(listener.get(), 1));
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), 4));
+
+	ASSERT_EQ(respond(client2, "127.0.0.1:12346"), 0);
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts, 2), 2);
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts, 2), 0);
+	char address[64];
+	ASSERT_STREQ(utcp_address_format(&accepts[0].Address, address, sizeof(address)), "127.0.0.1:12346");
+	ASSERT_STREQ(utcp_address_format(&accepts[1].Address, address, sizeof(address)), "127.0.0.1:12345");
+}
+
+TEST_F(handshake_pending_accepts, batch)
+{
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), 4));
+
+	const uint8_t garbage[] = {0};
+	struct utcp_listener_datagram datagrams[3];
+	datagrams[0] = {"127.0.0.1:12345", client_endpoint.outgoing[1].data(), (int32_t)client_endpoint.outgoing[1].size()};
+	datagrams[1] = {"127.0.0.1:12347", garbage, sizeof(garbage)};
+	datagrams[2] = {"127.0.0.1:12346", client2_endpoint.outgoing[1].data(), (int32_t)client2_endpoint.outgoing[1].size()};
+	utcp_listener_incoming_batch(listener.get(), datagrams, 3);
+
+	// The acks come back with their datagrams
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 0);
+	ASSERT_EQ(datagrams[0].Result, 0);
+	ASSERT_EQ(datagrams[1].Result, -1);
+	ASSERT_EQ(datagrams[1].ReplyLen, 0);
+	ASSERT_EQ(datagrams[2].Result, 0);
+	ASSERT_TRUE(utcp_incoming(client.get(), datagrams[0].Reply, datagrams[0].ReplyLen));
+	ASSERT_TRUE(utcp_incoming(client2.get(), datagrams[2].Reply, datagrams[2].ReplyLen));
+
+	struct utcp_accept_info accepts[4];
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), accepts, 4), 2);
+	utcp_listener_accept_pending(server.get(), &accepts[0]);
+	utcp_listener_accept_pending(server2.get(), &accepts[1]);
+	ASSERT_EQ(memcmp((&server)->AuthorisedCookie, (&client)->AuthorisedCookie, sizeof((&client)->AuthorisedCookie)), 0);
+	ASSERT_EQ(memcmp((&server2)->AuthorisedCookie, (&client2)->AuthorisedCookie, sizeof((&client2)->AuthorisedCookie)), 0);
+}
+
+struct restart_endpoint : public utcp::conn
+{
+	std::vector<std::vector<uint8_t>> outgoing;
+	int connects = 0;
+	bool reconnected = false;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		outgoing.emplace_back((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+
+	virtual void on_connect(bool reconnect) override
+	{
+		connects++;
+		reconnected = reconnect;
+	}
+};
+
+struct restart_listener : public utcp::listener
+{
+	std::vector<std::vector<uint8_t>> outgoing;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		outgoing.emplace_back((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+};
+
+struct handshake_restart : public ::testing::Test
+{
+	restart_listener listener;
+	restart_endpoint server;
+	restart_endpoint other;
+	restart_endpoint client;
+
+	virtual void SetUp() override
+	{
+		utcp::event_handler::config(nullptr);
+		utcp::event_handler::add_elapsed_time(1000 * 1000 * 1000);
+		ASSERT_TRUE(listener.set_pending_accepts(4));
+	}
+
+	virtual void TearDown() override
+	{
+		auto config = utcp_get_config();
+		config->on_accept = nullptr;
+		config->on_connect = nullptr;
+		config->on_disconnect = nullptr;
+		config->on_outgoing = nullptr;
+		config->on_recv_bunch_view = nullptr;
+		config->on_delivery_status = nullptr;
+		listener.set_pending_accepts(0);
+	}
+
+	// The client answers the last packet of the listener, its reply goes to the listener from address
+	void round_trip(const char* address)
+	{
+		client.incoming(listener.outgoing.back().data(), (int)listener.outgoing.back().size());
+		listener.incoming(address, client.outgoing.back().data(), (int)client.outgoing.back().size());
+	}
+};
+
+TEST_F(handshake_restart, pending_accept)
+{
+	client.connect();
+	listener.incoming("127.0.0.1:12345", client.outgoing.back().data(), (int)client.outgoing.back().size());
+	round_trip("127.0.0.1:12345");
+
+	utcp_accept_info accept;
+	ASSERT_EQ(listener.take_accepts(&accept, 1), 1);
+	ASSERT_FALSE(accept.bRestartedHandshake);
+	listener.accept(&server, accept);
+	client.incoming(listener.outgoing.back().data(), (int)listener.outgoing.back().size());
+	ASSERT_EQ(client.connects, 1);
+
+	// The address of the client changes, a data packet from it is answered with a restart request
+	utcp::event_handler::add_elapsed_time(11ll * 1000 * 1000 * 1000);
+	uint8_t data[] = {1, 2, 3};
+	utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.ChIndex = 1;
+	bunch.bOpen = 1;
+	bunch.bReliable = 1;
+	client.send_bunch(&bunch, data, sizeof(data) * 8);
+	client.send_flush();
+	size_t sent = listener.outgoing.size();
+	listener.incoming("127.0.0.1:23456", client.outgoing.back().data(), (int)client.outgoing.back().size());
+	ASSERT_EQ(listener.outgoing.size(), sent + 1);
+
+	// Restart request, challenge, restart response
+	round_trip("127.0.0.1:23456");
+	round_trip("127.0.0.1:23456");
+
+	ASSERT_EQ(listener.take_accepts(&accept, 1), 1);
+	ASSERT_TRUE(accept.bRestartedHandshake);
+	char address[64];
+	ASSERT_STREQ(utcp_address_format(&accept.Address, address, sizeof(address)), "127.0.0.1:23456");
+
+	// Nothing is left on the listener to compare with, the taken accept has the original cookie
+	ASSERT_TRUE(listener.does_restarted_handshake_match(&server, accept));
+	ASSERT_FALSE(listener.does_restarted_handshake_match(&other, accept));
+	ASSERT_FALSE(listener.does_restarted_handshake_match(&server));
+
+	listener.accept(&server, accept);
+	client.incoming(listener.outgoing.back().data(), (int)listener.outgoing.back().size());
+	ASSERT_EQ(client.connects, 2);
+	ASSERT_TRUE(client.reconnected);
+	ASSERT_EQ(memcmp(server.get_fd()->AuthorisedCookie, client.get_fd()->AuthorisedCookie, sizeof(client.get_fd()->AuthorisedCookie)), 0);
+}
+
+TEST_F(handshake_features, batch_challenge)
+{
+	utcp_connect(client.get());
+	ASSERT_EQ(client_endpoint.outgoing.size(), 1);
+
+	struct utcp_listener_datagram datagram = {"127.0.0.1:12345", client_endpoint.outgoing[0].data(), (int32_t)client_endpoint.outgoing[0].size()};
+	utcp_listener_incoming_batch(listener.get(), &datagram, 1);
+	ASSERT_EQ(datagram.Result, 0);
+	ASSERT_GT(datagram.ReplyLen, 0);
+	ASSERT_TRUE(utcp_incoming(client.get(), datagram.Reply, datagram.ReplyLen));
+	ASSERT_EQ(client_endpoint.outgoing.size(), 2);
+
+	// The response is checked one by one, against the cookie of the batch
+	listener_endpoint.outgoing.emplace_back();
+	finish();
+	ASSERT_EQ((&server)->Features, UTCP_FEATURE_COMPRESSION);
+}
+
+static struct sockaddr_in make_sockaddr_in(const char* ip, uint16_t port)
+{
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET, ip, &addr.sin_addr);
+	return addr;
+}
+
+TEST_F(handshake_features, binary_address)
+{
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), 2));
+	struct sockaddr_in addr = make_sockaddr_in("127.0.0.1", 12345);
+	struct sockaddr_in other = make_sockaddr_in("127.0.0.1", 12346);
+
+	utcp_connect(client.get());
+	ASSERT_EQ(utcp_listener_incoming_addr(listener.get(), (const sockaddr*)&addr, sizeof(addr), client_endpoint.outgoing[0].data(), (int)client_endpoint.outgoing[0].size()), 0);
+	ASSERT_TRUE(utcp_incoming(client.get(), listener_endpoint.outgoing[0].data(), (int)listener_endpoint.outgoing[0].size()));
+
+	// The cookie is bound to the binary form, neither another port nor the same address as a string passes
+	auto& response = client_endpoint.outgoing[1];
+	ASSERT_EQ(utcp_listener_incoming_addr(listener.get(), (const sockaddr*)&other, sizeof(other), response.data(), (int)response.size()), -7);
+	ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:12345", response.data(), (int)response.size()), -7);
+	ASSERT_EQ(utcp_listener_incoming_addr(listener.get(), (const sockaddr*)&addr, sizeof(addr), response.data(), (int)response.size()), 0);
+
+	struct utcp_accept_info accept;
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), &accept, 1), 1);
+	char address[64];
+	ASSERT_STREQ(utcp_address_format(&accept.Address, address, sizeof(address)), "127.0.0.1:12345");
+
+	struct sockaddr_storage storage;
+	int storage_len = 0;
+	ASSERT_TRUE(utcp_address_to_sockaddr(&accept.Address, &storage, &storage_len));
+	ASSERT_EQ(storage_len, (int)sizeof(addr));
+	ASSERT_EQ(memcmp(&storage, &addr, sizeof(addr)), 0);
+
+	utcp_listener_accept_pending(server.get(), &accept);
+	ASSERT_TRUE(utcp_incoming(client.get(), listener_endpoint.outgoing[1].data(), (int)listener_endpoint.outgoing[1].size()));
+	ASSERT_EQ(memcmp((&server)->AuthorisedCookie, (&client)->AuthorisedCookie, sizeof((&client)->AuthorisedCookie)), 0);
+}
+
+TEST_F(handshake_features, binary_address_batch)
+{
+	ASSERT_TRUE(utcp_listener_set_pending_accepts(listener.get(), 1));
+	struct sockaddr_in6 addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_port = htons(7777);
+	inet_pton(AF_INET6, "2001:db8::1", &addr.sin6_addr);
+	struct sockaddr unknown;
+	memset(&unknown, 0, sizeof(unknown));
+
+	utcp_connect(client.get());
+	struct utcp_listener_datagram datagrams[2] = {};
+	datagrams[0].Buffer = client_endpoint.outgoing[0].data();
+	datagrams[0].Len = (int32_t)client_endpoint.outgoing[0].size();
+	datagrams[0].SockAddr = (const sockaddr*)&addr;
+	datagrams[0].SockAddrLen = sizeof(addr);
+	datagrams[1] = datagrams[0];
+	datagrams[1].SockAddr = &unknown;
+	datagrams[1].SockAddrLen = sizeof(unknown);
+	utcp_listener_incoming_batch(listener.get(), datagrams, 2);
+	ASSERT_EQ(datagrams[0].Result, 0);
+	ASSERT_EQ(datagrams[1].Result, -9);
+	ASSERT_EQ(datagrams[1].ReplyLen, 0);
+	ASSERT_TRUE(utcp_incoming(client.get(), datagrams[0].Reply, datagrams[0].ReplyLen));
+
+	// The response checked one by one matches the cookie hashed with the batch
+	ASSERT_EQ(utcp_listener_incoming_addr(listener.get(), (const sockaddr*)&addr, sizeof(addr), client_endpoint.outgoing[1].data(), (int)client_endpoint.outgoing[1].size()), 0);
+	ASSERT_TRUE(utcp_incoming(client.get(), listener_endpoint.outgoing[0].data(), (int)listener_endpoint.outgoing[0].size()));
+
+	struct utcp_accept_info accept;
+	ASSERT_EQ(utcp_listener_take_accepts(listener.get(), &accept, 1), 1);
+	char address[64];
+	ASSERT_STREQ(utcp_address_format(&accept.Address, address, sizeof(address)), "[2001:db8:0:0:0:0:0:1]:7777");
+	utcp_listener_accept_pending(server.get(), &accept);
+	ASSERT_EQ(memcmp((&server)->AuthorisedCookie, (&client)->AuthorisedCookie, sizeof((&client)->AuthorisedCookie)), 0);
+}
+
+TEST_F(handshake_features, prefix_limit)
+{
+	struct utcp_listener_limits limits = {};
+	limits.PrefixRate = 1;
+	limits.PrefixBurst = 2;
+	limits.PrefixBuckets = 1024;
+	ASSERT_TRUE(utcp_listener_set_limits(listener.get(), &limits));
+
+	utcp_connect(client.get());
+	auto& initial = client_endpoint.outgoing[0];
+	auto incoming = [&](const char* ip) {
+		struct sockaddr_in addr = make_sockaddr_in(ip, 7777);
+		return utcp_listener_incoming_addr(listener.get(), (const sockaddr*)&addr, sizeof(addr), initial.data(), (int)initial.size());
+	};
+
+	// One /24 shares a bucket
+	ASSERT_EQ(incoming("10.0.0.1"), 0);
+	ASSERT_EQ(incoming("10.0.0.2"), 0);
+	ASSERT_EQ(incoming("10.0.0.3"), -10);
+	ASSERT_EQ(incoming("10.0.1.1"), 0);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 3);
+
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	ASSERT_EQ(incoming("10.0.0.3"), 0);
+	ASSERT_EQ(incoming("10.0.0.3"), -10);
+
+	struct utcp_listener_stats stats;
+	utcp_listener_get_stats(listener.get(), &stats);
+	ASSERT_EQ(stats.Challenged, 4);
+	ASSERT_EQ(stats.RateLimited, 2);
+}
+
+TEST_F(handshake_features, challenge_budget)
+{
+	struct utcp_listener_limits limits = {};
+	limits.ChallengeRate = 1;
+	limits.ChallengeBurst = 1;
+	ASSERT_TRUE(utcp_listener_set_limits(listener.get(), &limits));
+
+	begin();
+	// Header bits and a cleared handshake bit: a packet of a connection the listener does not know
+	const uint8_t data_packet[] = {0x80};
+	ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:23456", data_packet, sizeof(data_packet)), -10);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 1);
+
+	// The response is not a reply the budget pays for
+	finish();
+
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:23456", data_packet, sizeof(data_packet)), -3);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 3);
+
+	struct utcp_listener_stats stats;
+	utcp_listener_get_stats(listener.get(), &stats);
+	ASSERT_EQ(stats.Challenged, 1);
+	ASSERT_EQ(stats.RestartRequests, 1);
+	ASSERT_EQ(stats.RateLimited, 1);
+	ASSERT_EQ(stats.Accepted, 1);
+}
+
+TEST_F(handshake_features, prefilter)
+{
+	begin();
+
+	// The challenge reflected back carries a cookie, but a client never sends one
+	auto& challenge = listener_endpoint.outgoing[0];
+	ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:12345", challenge.data(), (int)challenge.size()), -4);
+
+	const uint8_t empty[] = {0};
+	ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:12345", empty, sizeof(empty)), -1);
+
+	// A wrong cookie is hashed and rejected
+	auto response = client_endpoint.outgoing[1];
+	response[response.size() / 2] ^= 0x10;
+	ASSERT_EQ(utcp_listener_incoming(listener.get(), "127.0.0.1:12345", response.data(), (int)response.size()), -7);
+	ASSERT_EQ(listener_endpoint.outgoing.size(), 1);
+
+	struct utcp_listener_stats stats;
+	utcp_listener_get_stats(listener.get(), &stats);
+	ASSERT_EQ(stats.Dropped, 2);
+	ASSERT_EQ(stats.Rejected, 1);
+	ASSERT_EQ(stats.Challenged, 1);
+	ASSERT_EQ(stats.Accepted, 0);
+}
+
+TEST_F(handshake_features, not_supported)
+{
+	utcp_get_config()->Features = 0;
+
+	begin();
+	utcp_get_config()->Features = UTCP_FEATURE_COMPRESSION;
+	finish();
+	ASSERT_EQ((&server)->Features, 0);
+	ASSERT_EQ((&client)->Features, 0);
+}
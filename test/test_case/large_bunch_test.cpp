@@ -58,3 +58,58 @@ TEST_P(large_bunch_param_test, test)
 INSTANTIATE_TEST_CASE_P(test_constructor, large_bunch_param_test,
 						testing::Values(0, utcp::MAX_SINGLE_BUNCH_SIZE_BYTES - 10, utcp::MAX_SINGLE_BUNCH_SIZE_BYTES, utcp::MAX_SINGLE_BUNCH_SIZE_BYTES + 10,
 										utcp::NetMaxConstructedPartialBunchSizeBytes - 10, utcp::NetMaxConstructedPartialBunchSizeBytes));
+
+class bunch_fragmenter_param_test : public ::testing::TestWithParam<int>
+{
+};
+
+TEST_P(bunch_fragmenter_param_test, test)
+{
+	int test_count = GetParam();
+	std::vector<uint8_t> test_data;
+	for (int i = 0; i < test_count; ++i)
+	{
+		test_data.push_back(rand() % 256);
+	}
+
+	utcp_bunch header;
+	memset(&header, 0, sizeof(header));
+	header.ChIndex = 1;
+	header.bReliable = 1;
+
+	// The fragments point into the message, and reassemble like the sub bunches of a large_bunch
+	std::vector<utcp_bunch> bunches;
+	std::vector<utcp_bunch*> ref_bunches;
+	bunches.reserve(1024);
+
+	utcp::bunch_fragmenter fragmenter(&header, test_data.data(), test_count * 8);
+	int expected_num = test_count * 8 > utcp::MAX_PARTIAL_BUNCH_SIZE_BITS ? (test_count + utcp::MAX_SINGLE_BUNCH_SIZE_BYTES - 1) / utcp::MAX_SINGLE_BUNCH_SIZE_BYTES : 1;
+	ASSERT_EQ(fragmenter.num(), expected_num);
+	const uint8_t* fragment;
+	while (fragmenter.next(fragment))
+	{
+		ASSERT_EQ(fragment, test_data.data() + bunches.size() * utcp::MAX_SINGLE_BUNCH_SIZE_BYTES);
+		bunches.push_back(header);
+		memcpy(bunches.back().Data, fragment, utcp::bits2bytes(header.DataBitsLen));
+		ref_bunches.push_back(&bunches.back());
+	}
+	ASSERT_EQ((int)bunches.size(), expected_num);
+	ASSERT_EQ(bunches.front().bPartialInitial, expected_num > 1);
+	ASSERT_EQ(bunches.back().bPartialFinal, expected_num > 1);
+
+	utcp::large_bunch large_bunch2(ref_bunches.data(), (int)ref_bunches.size());
+	if (expected_num == 1)
+	{
+		ASSERT_EQ(large_bunch2.DataBitsLen, test_count * 8);
+		ASSERT_EQ(memcmp(large_bunch2.Data, test_data.data(), test_count), 0);
+	}
+	else
+	{
+		ASSERT_EQ(large_bunch2.ExtDataBitsLen, test_count * 8);
+		ASSERT_EQ(memcmp(large_bunch2.ExtData, test_data.data(), test_count), 0);
+	}
+}
+
+INSTANTIATE_TEST_CASE_P(test_fragments, bunch_fragmenter_param_test,
+						testing::Values(0, utcp::MAX_SINGLE_BUNCH_SIZE_BYTES - 10, utcp::MAX_SINGLE_BUNCH_SIZE_BYTES, utcp::MAX_SINGLE_BUNCH_SIZE_BYTES + 10,
+										utcp::MAX_SINGLE_BUNCH_SIZE_BYTES * 3, utcp::NetMaxConstructedPartialBunchSizeBytes));
@@ -1,5 +1,10 @@
-﻿#include "utcp/utcp_sequence_number.h"
+﻿extern "C"
+{
+#include "utcp/utcp_packet_notify.h"
+}
+#include "utcp/utcp_sequence_number.h"
 #include "gtest/gtest.h"
+#include <vector>
 
 TEST(packet_notify, sequence_number)
 {
@@ -24,4 +29,76 @@ TEST(packet_notify, sequence_number)
 	ASSERT_EQ(seq_num_diff(num1, num3), -10);
 	ASSERT_EQ(seq_num_diff(num2, num3), -5);
 }
-// FNetPacketNotifyTest::RunTest
\ No newline at end of file
+// FNetPacketNotifyTest::RunTest
+static bool history_bit(const SequenceHistoryWord* History, int Index)
+{
+	return (History[Index / SequenceHistoryBitsPerWord] >> (Index % SequenceHistoryBitsPerWord)) & 1;
+}
+
+TEST(packet_notify, ack_seq_gaps)
+{
+	struct packet_notify packet_notify;
+	packet_notify_init(&packet_notify, 100, 100);
+
+	// Newest first, like the history bits
+	std::vector<bool> expected;
+	uint32_t seed = 1;
+	uint16_t Seq = 100;
+	for (int i = 0; i < 2000; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		int Gap = (seed >> 16) % 8 == 0 ? 1 + (seed >> 8) % 300 : 1;
+		bool IsAck = (seed >> 4) % 5 != 0;
+
+		Seq = seq_num_init(Seq + Gap);
+		packet_notify.InSeq = Seq;
+		packet_notify_ack_seq(&packet_notify, Seq, IsAck);
+
+		for (int j = 1; j < Gap; ++j)
+			expected.insert(expected.begin(), false);
+		expected.insert(expected.begin(), IsAck);
+		if (expected.size() > MaxSequenceHistoryLength)
+			expected.resize(MaxSequenceHistoryLength);
+
+		ASSERT_EQ(packet_notify.InAckSeq, Seq);
+		for (size_t Index = 0; Index < expected.size(); ++Index)
+			ASSERT_EQ(history_bit(packet_notify.InSeqHistory, (int)Index), expected[Index]) << "i=" << i << " Index=" << Index;
+	}
+}
+
+TEST(packet_notify, update_reports_history_in_order)
+{
+	for (int AckCount : {1, 5, 31, 32, 33, 100, 256, 300})
+	{
+		struct packet_notify packet_notify;
+		packet_notify_init(&packet_notify, 100, 1000);
+		packet_notify.OutSeq = 2000;
+
+		struct notification_header header;
+		memset(&header, 0, sizeof(header));
+		header.Seq = 101;
+		header.AckedSeq = (uint16_t)(999 + AckCount);
+		header.HistoryWordCount = SequenceHistoryWordCount;
+		uint32_t seed = AckCount;
+		for (auto& Word : header.History)
+		{
+			seed = seed * 1103515245 + 12345;
+			Word = (seed >> 8) & (seed >> 4); // Mostly NAKs, with runs of both
+		}
+
+		// Oldest first, everything older than the history is a NAK
+		std::vector<std::pair<uint16_t, bool>> expected;
+		for (int Index = AckCount - 1; Index >= 0; --Index)
+		{
+			bool bDelivered = Index < MaxSequenceHistoryLength && history_bit(header.History, Index);
+			expected.emplace_back((uint16_t)(1000 + AckCount - 1 - Index), bDelivered);
+		}
+
+		static std::vector<std::pair<uint16_t, bool>> reported;
+		reported.clear();
+		auto handle = [](void* fd, uint16_t AckedSequence, bool bDelivered) { reported.emplace_back(AckedSequence, bDelivered); };
+		ASSERT_EQ(packet_notify_update(handle, nullptr, &packet_notify, &header), 1);
+		ASSERT_EQ(reported, expected) << "AckCount=" << AckCount;
+		ASSERT_EQ(packet_notify.OutAckSeq, header.AckedSeq);
+	}
+}
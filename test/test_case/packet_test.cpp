@@ -6,6 +6,7 @@ extern "C"
 }
 #include "gtest/gtest.h"
 #include <memory>
+#include <thread>
 
 static std::vector<uint8_t> last_send;
 static std::vector<struct utcp_bunch> last_recv;
@@ -32,6 +33,7 @@ struct packet : public ::testing::Test
 		auto config = utcp_get_config();
 		config->on_outgoing = nullptr;
 		config->on_recv_bunch = nullptr;
+		config->on_recv_bunch_view = nullptr;
 	}
 };
 
@@ -161,4 +163,962 @@ TEST_F(packet, accept_hello_login)
 
 	utcp_send_flush(fd.get());
 }
-*/
\ No newline at end of file
+*/
+struct packet_endpoint
+{
+	std::vector<std::vector<uint8_t>> outgoing;
+	std::vector<std::vector<uint8_t>> received;
+};
+
+struct packet_loopback : public ::testing::Test
+{
+	utcp_connection_rtti server;
+	utcp_connection_rtti client;
+	packet_endpoint server_endpoint;
+	packet_endpoint client_endpoint;
+
+	virtual void SetUp() override
+	{
+		auto config = utcp_get_config();
+		config->on_outgoing = [](void* fd, void* userdata, const void* data, int len) {
+			auto endpoint = (packet_endpoint*)userdata;
+			endpoint->outgoing.emplace_back((const uint8_t*)data, (const uint8_t*)data + len);
+		};
+		config->on_recv_bunch = [](struct utcp_connection* fd, void* userdata, struct utcp_bunch* const bunches[], int count) {
+			auto endpoint = (packet_endpoint*)userdata;
+			for (int i = 0; i < count; ++i)
+			{
+				endpoint->received.emplace_back(bunches[i]->Data, bunches[i]->Data + bunches[i]->DataBitsLen / 8);
+			}
+		};
+
+		server.get()->userdata = &server_endpoint;
+		client.get()->userdata = &client_endpoint;
+		utcp_sequence_init(server.get(), 1000, 2000);
+		utcp_sequence_init(client.get(), 2000, 1000);
+	}
+
+	virtual void TearDown() override
+	{
+		auto config = utcp_get_config();
+		config->on_outgoing = nullptr;
+		config->on_recv_bunch = nullptr;
+		config->on_recv_bunch_view = nullptr;
+		utcp_set_send_batch(nullptr);
+	}
+
+	int32_t send(utcp_connection* fd, uint16_t ChIndex, bool bReliable, bool bOpen, uint8_t value)
+	{
+		struct utcp_bunch bunch;
+		memset(&bunch, 0, sizeof(bunch));
+		bunch.NameIndex = 255;
+		bunch.ChIndex = ChIndex;
+		bunch.bReliable = bReliable;
+		bunch.bOpen = bOpen;
+		bunch.DataBitsLen = 8;
+		bunch.Data[0] = value;
+		return utcp_send_bunch(fd, &bunch);
+	}
+
+	static void deliver(utcp_connection* fd, std::vector<uint8_t>& packet)
+	{
+		ASSERT_TRUE(utcp_incoming(fd, packet.data(), (int)packet.size()));
+	}
+
+	static std::vector<uint8_t> received_values(const packet_endpoint& endpoint)
+	{
+		std::vector<uint8_t> values;
+		for (auto& data : endpoint.received)
+		{
+			values.push_back(data.empty() ? 0 : data[0]);
+		}
+		return values;
+	}
+};
+
+TEST_F(packet_loopback, ordered_reliable_waits_for_gap)
+{
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		send(server.get(), 1, true, i == 0, i);
+		utcp_send_flush(server.get());
+	}
+	ASSERT_EQ(server_endpoint.outgoing.size(), 4);
+
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	deliver(client.get(), server_endpoint.outgoing[3]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0}));
+}
+
+TEST_F(packet_loopback, unordered_reliable_delivers_on_first_receipt)
+{
+	utcp_set_channel_unordered(client.get(), 1, true);
+
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		send(server.get(), 1, true, i == 0, i);
+		utcp_send_flush(server.get());
+	}
+	ASSERT_EQ(server_endpoint.outgoing.size(), 4);
+
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	deliver(client.get(), server_endpoint.outgoing[3]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 2, 3}));
+
+	// The lost bunch is resent after the server learns about the gap, and is delivered exactly once
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	ASSERT_EQ(client_endpoint.outgoing.size(), 1);
+	deliver(server.get(), client_endpoint.outgoing[0]);
+
+	utcp_send_flush(server.get());
+	ASSERT_EQ(server_endpoint.outgoing.size(), 5);
+	deliver(client.get(), server_endpoint.outgoing[4]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 2, 3, 1}));
+
+	// Sequence continues in order afterwards
+	send(server.get(), 1, true, false, 4);
+	utcp_send_flush(server.get());
+	deliver(client.get(), server_endpoint.outgoing[5]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 2, 3, 1, 4}));
+	ASSERT_EQ((&client)->channels.Channels[1]->InReliable, (&server)->channels.Channels[1]->OutReliable);
+}
+
+TEST_F(packet_loopback, unordered_close_waits_for_gap)
+{
+	utcp_set_channel_unordered(client.get(), 1, true);
+
+	send(server.get(), 1, true, true, 0);
+	utcp_send_flush(server.get());
+	send(server.get(), 1, true, false, 1);
+	utcp_send_flush(server.get());
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.NameIndex = 255;
+	bunch.ChIndex = 1;
+	bunch.bReliable = 1;
+	bunch.bClose = 1;
+	bunch.DataBitsLen = 8;
+	bunch.Data[0] = 2;
+	utcp_send_bunch(server.get(), &bunch);
+	utcp_send_flush(server.get());
+	ASSERT_EQ(server_endpoint.outgoing.size(), 3);
+
+	// The close overtakes the lost bunch, it waits for it instead of closing the channel
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	ASSERT_EQ(utcp_update(client.get()), 0);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0}));
+	ASSERT_NE((&client)->channels.Channels[1], nullptr);
+
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	ASSERT_FALSE(client_endpoint.outgoing.empty());
+	deliver(server.get(), client_endpoint.outgoing.back());
+
+	utcp_send_flush(server.get());
+	ASSERT_EQ(server_endpoint.outgoing.size(), 4);
+	deliver(client.get(), server_endpoint.outgoing[3]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 1, 2}));
+
+	ASSERT_EQ(utcp_update(client.get()), 0);
+	ASSERT_EQ((&client)->channels.Channels[1], nullptr);
+}
+
+TEST_F(packet_loopback, merge_unreliable_bunches)
+{
+	send(server.get(), 1, true, true, 0);
+	utcp_send_flush(server.get());
+	deliver(client.get(), server_endpoint.outgoing[0]);
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.ChIndex = 1;
+	bunch.DataBitsLen = 8;
+
+	// Without merging every bunch carries its own header
+	for (uint8_t i = 1; i <= 3; ++i)
+	{
+		bunch.Data[0] = i;
+		utcp_send_bunch(server.get(), &bunch);
+	}
+	utcp_send_flush(server.get());
+
+	int32_t packet_ids[3];
+	for (uint8_t i = 4; i <= 6; ++i)
+	{
+		bunch.Data[0] = i;
+		packet_ids[i - 4] = utcp_send_bunch_merge(server.get(), &bunch);
+	}
+	ASSERT_EQ(packet_ids[0], packet_ids[1]);
+	ASSERT_EQ(packet_ids[0], packet_ids[2]);
+	ASSERT_GT((&server)->MergedHeaderBits, 0);
+	utcp_send_flush(server.get());
+	ASSERT_EQ((&server)->MergedHeaderBits, 0);
+
+	ASSERT_EQ(server_endpoint.outgoing.size(), 3);
+	ASSERT_LT(server_endpoint.outgoing[2].size(), server_endpoint.outgoing[1].size());
+
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	ASSERT_EQ(client_endpoint.received.size(), 5);
+	ASSERT_EQ(client_endpoint.received[4], std::vector<uint8_t>({4, 5, 6}));
+}
+
+TEST_F(packet_loopback, merge_requires_same_channel)
+{
+	send(server.get(), 1, true, true, 0);
+	send(server.get(), 2, true, true, 0);
+	utcp_send_flush(server.get());
+	deliver(client.get(), server_endpoint.outgoing[0]);
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.DataBitsLen = 8;
+
+	bunch.ChIndex = 1;
+	utcp_send_bunch_merge(server.get(), &bunch);
+	bunch.ChIndex = 2;
+	utcp_send_bunch_merge(server.get(), &bunch);
+	bunch.bReliable = 1;
+	utcp_send_bunch_merge(server.get(), &bunch);
+	ASSERT_EQ((&server)->MergedHeaderBits, 0);
+	utcp_send_flush(server.get());
+
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	ASSERT_EQ(client_endpoint.received.size(), 5);
+}
+
+TEST_F(packet_loopback, compress_payload)
+{
+	(&server)->Features = UTCP_FEATURE_COMPRESSION;
+	(&client)->Features = UTCP_FEATURE_COMPRESSION;
+
+	send(server.get(), 1, true, true, 0);
+	utcp_send_flush(server.get());
+	deliver(client.get(), server_endpoint.outgoing[0]);
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.ChIndex = 1;
+	bunch.DataBitsLen = 8 * 40;
+	for (int i = 0; i < 4; ++i)
+	{
+		for (int j = 0; j < 40; ++j)
+		{
+			bunch.Data[j] = (uint8_t)(j == 0 ? i : j % 10);
+		}
+		utcp_send_bunch(server.get(), &bunch);
+	}
+	utcp_send_flush(server.get());
+
+	ASSERT_EQ(server_endpoint.outgoing.size(), 2);
+	ASSERT_LT(server_endpoint.outgoing[1].size(), 4 * 40);
+
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	ASSERT_EQ(client_endpoint.received.size(), 5);
+	for (int i = 0; i < 4; ++i)
+	{
+		ASSERT_EQ(client_endpoint.received[i + 1].size(), 40);
+		ASSERT_EQ(client_endpoint.received[i + 1][0], i);
+		ASSERT_EQ(client_endpoint.received[i + 1][39], 9);
+	}
+}
+
+TEST_F(packet_loopback, compress_corrupt_payload)
+{
+	(&server)->Features = UTCP_FEATURE_COMPRESSION;
+	(&client)->Features = UTCP_FEATURE_COMPRESSION;
+
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.ChIndex = 1;
+	bunch.bOpen = 1;
+	bunch.bReliable = 1;
+	bunch.DataBitsLen = 8 * 100;
+	utcp_send_bunch(server.get(), &bunch);
+	utcp_send_flush(server.get());
+
+	auto& packet = server_endpoint.outgoing[0];
+	ASSERT_LT(packet.size(), 100);
+	packet[packet.size() - 2] ^= 0xFF;
+	ASSERT_FALSE(utcp_incoming(client.get(), packet.data(), (int)packet.size()));
+	ASSERT_TRUE((&client)->bClose);
+	ASSERT_EQ(client_endpoint.received.size(), 0);
+}
+
+TEST_F(packet_loopback, delta_header)
+{
+	for (uint16_t ChIndex = 1; ChIndex <= 8; ++ChIndex)
+		send(server.get(), ChIndex, true, true, (uint8_t)ChIndex);
+	utcp_send_flush(server.get());
+
+	(&server)->Features = UTCP_FEATURE_DELTA_HEADER;
+	(&client)->Features = UTCP_FEATURE_DELTA_HEADER;
+	for (uint16_t ChIndex = 1; ChIndex <= 8; ++ChIndex)
+		send(server.get(), ChIndex, true, false, (uint8_t)(ChIndex + 10));
+	utcp_send_flush(server.get());
+
+	ASSERT_EQ(server_endpoint.outgoing.size(), 2);
+	ASSERT_LT(server_endpoint.outgoing[1].size(), server_endpoint.outgoing[0].size());
+
+	// The first packet is sent without the feature
+	(&client)->Features = 0;
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	(&client)->Features = UTCP_FEATURE_DELTA_HEADER;
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({1, 2, 3, 4, 5, 6, 7, 8, 11, 12, 13, 14, 15, 16, 17, 18}));
+}
+
+TEST_F(packet_loopback, delta_header_after_resend)
+{
+	(&server)->Features = UTCP_FEATURE_DELTA_HEADER;
+	(&client)->Features = UTCP_FEATURE_DELTA_HEADER;
+
+	send(server.get(), 1, true, true, 1);
+	utcp_send_flush(server.get());
+	send(server.get(), 2, true, true, 2);
+	utcp_send_flush(server.get());
+
+	// The first packet is lost, the client acks the second one
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	ASSERT_EQ(client_endpoint.outgoing.size(), 1);
+
+	// The nak puts the resend in the send buffer, the next bunch of the packet must not be relative to it
+	deliver(server.get(), client_endpoint.outgoing[0]);
+	send(server.get(), 1, true, false, 3);
+	send(server.get(), 1, true, false, 4);
+	utcp_send_flush(server.get());
+	ASSERT_EQ(server_endpoint.outgoing.size(), 3);
+
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({2, 1, 3, 4}));
+}
+
+static void send_sized_bunches(utcp_connection* fd, bool bOpen)
+{
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.NameIndex = 255;
+	bunch.bReliable = 1;
+	bunch.bOpen = bOpen;
+	for (uint16_t ChIndex = 1; ChIndex <= 4; ++ChIndex)
+	{
+		bunch.ChIndex = ChIndex;
+		bunch.DataBitsLen = (uint16_t)(8 * (ChIndex * 11 % 40 + 1));
+		for (int i = 0; i < bunch.DataBitsLen / 8; ++i)
+			bunch.Data[i] = (uint8_t)(ChIndex + i % 10);
+		utcp_send_bunch(fd, &bunch);
+	}
+}
+
+static void check_sized_bunches(const packet_endpoint& endpoint, size_t first)
+{
+	ASSERT_EQ(endpoint.received.size(), first + 4);
+	for (uint16_t ChIndex = 1; ChIndex <= 4; ++ChIndex)
+	{
+		auto& data = endpoint.received[first + ChIndex - 1];
+		ASSERT_EQ(data.size(), ChIndex * 11 % 40 + 1);
+		for (size_t i = 0; i < data.size(); ++i)
+			ASSERT_EQ(data[i], (uint8_t)(ChIndex + i % 10));
+	}
+}
+
+TEST_F(packet_loopback, byte_aligned)
+{
+	(&server)->Features = UTCP_FEATURE_BYTE_ALIGNED;
+	(&client)->Features = UTCP_FEATURE_BYTE_ALIGNED;
+
+	send_sized_bunches(server.get(), true);
+	utcp_send_flush(server.get());
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	check_sized_bunches(client_endpoint, 0);
+
+	// Merged data continues right after the previous data, the header padding stays in front of it
+	struct utcp_bunch bunch;
+	memset(&bunch, 0, sizeof(bunch));
+	bunch.ChIndex = 1;
+	bunch.DataBitsLen = 8;
+	for (uint8_t i = 1; i <= 3; ++i)
+	{
+		bunch.Data[0] = i;
+		utcp_send_bunch_merge(server.get(), &bunch);
+	}
+	ASSERT_GT((&server)->MergedHeaderBits, 0);
+	utcp_send_flush(server.get());
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	ASSERT_EQ(client_endpoint.received.size(), 5);
+	ASSERT_EQ(client_endpoint.received[4], std::vector<uint8_t>({1, 2, 3}));
+}
+
+TEST_F(packet_loopback, byte_aligned_with_delta_header_and_compression)
+{
+	const uint8_t Features = UTCP_FEATURE_BYTE_ALIGNED | UTCP_FEATURE_DELTA_HEADER | UTCP_FEATURE_COMPRESSION;
+	(&server)->Features = Features;
+	(&client)->Features = Features;
+
+	send_sized_bunches(server.get(), true);
+	utcp_send_flush(server.get());
+	send_sized_bunches(server.get(), false);
+	utcp_send_flush(server.get());
+
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	check_sized_bunches(client_endpoint, 0);
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	check_sized_bunches(client_endpoint, 4);
+}
+
+TEST_F(packet_loopback, byte_aligned_resend)
+{
+	(&server)->Features = UTCP_FEATURE_BYTE_ALIGNED | UTCP_FEATURE_DELTA_HEADER;
+	(&client)->Features = UTCP_FEATURE_BYTE_ALIGNED | UTCP_FEATURE_DELTA_HEADER;
+
+	send_sized_bunches(server.get(), true);
+	utcp_send_flush(server.get());
+	send(server.get(), 5, true, true, 5);
+	utcp_send_flush(server.get());
+
+	// The first packet is lost, its bunches are resent behind an unaligned bunch
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	deliver(server.get(), client_endpoint.outgoing[0]);
+	utcp_send_flush(server.get());
+	ASSERT_EQ(server_endpoint.outgoing.size(), 3);
+
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	ASSERT_EQ(received_values(client_endpoint)[0], 5);
+	check_sized_bunches(packet_endpoint{{}, {client_endpoint.received.begin() + 1, client_endpoint.received.end()}}, 0);
+}
+
+TEST_F(packet_loopback, incoming_peeked)
+{
+	(&server)->Features = UTCP_FEATURE_DELTA_HEADER;
+	(&client)->Features = UTCP_FEATURE_DELTA_HEADER;
+	for (uint8_t i = 0; i < 3; ++i)
+	{
+		send(server.get(), 1, true, i == 0, i);
+		utcp_send_flush(server.get());
+	}
+
+	// Reordered like the packet order cache does, each header is parsed by the peek only
+	utcp_peeked_packet peeked[3];
+	for (int i = 2; i >= 0; --i)
+	{
+		auto& packet = server_endpoint.outgoing[i];
+		ASSERT_EQ(utcp_peep_packet(client.get(), packet.data(), (int)packet.size(), &peeked[i]), utcp_expect_packet_id(client.get()) + i);
+		ASSERT_EQ(peeked[i].PacketId, utcp_expect_packet_id(client.get()) + i);
+	}
+	for (int i = 0; i < 3; ++i)
+	{
+		auto& packet = server_endpoint.outgoing[i];
+		ASSERT_TRUE(utcp_incoming_peeked(client.get(), packet.data(), (int)packet.size(), &peeked[i]));
+	}
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 1, 2}));
+
+	// A replayed packet is dropped, as with utcp_incoming
+	ASSERT_FALSE(utcp_incoming_peeked(client.get(), server_endpoint.outgoing[1].data(), (int)server_endpoint.outgoing[1].size(), &peeked[1]));
+	ASSERT_FALSE((&client)->bClose);
+	ASSERT_EQ(client_endpoint.received.size(), 3);
+
+	// The acks written from the peeked headers are the same as from a full parse
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	deliver(server.get(), client_endpoint.outgoing[0]);
+	ASSERT_EQ((&server)->OutAckPacketId, (&server)->OutPacketId - 1);
+}
+
+TEST_F(packet_loopback, peep_oversized_datagram)
+{
+	send(server.get(), 1, true, true, 0);
+	utcp_send_flush(server.get());
+	auto& packet = server_endpoint.outgoing[0];
+
+	utcp_peeked_packet expected;
+	ASSERT_GT(utcp_peep_packet(client.get(), packet.data(), (int)packet.size(), &expected), 0);
+
+	// Same header, padded past what 16 bits can count, the end bit moved to the last byte
+	std::vector<uint8_t> oversized(9000, 0);
+	memcpy(oversized.data(), packet.data(), packet.size() - 1);
+	oversized.back() = 1;
+
+	utcp_peeked_packet peeked;
+	ASSERT_EQ(utcp_peep_packet(client.get(), oversized.data(), (int)oversized.size(), &peeked), expected.PacketId);
+	ASSERT_EQ(peeked.SizeBits, (oversized.size() - 1) * 8 - 1);
+	ASSERT_EQ(peeked.HeaderEndBits, expected.HeaderEndBits);
+}
+
+TEST_F(packet_loopback, packet_order_cache_reorders)
+{
+	utcp_set_channel_unordered(client.get(), 1, true);
+	utcp_set_packet_order_cache(client.get(), true);
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		send(server.get(), 1, true, i == 0, i);
+		utcp_send_flush(server.get());
+	}
+
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	deliver(client.get(), server_endpoint.outgoing[3]);
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	deliver(client.get(), server_endpoint.outgoing[3]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0}));
+	ASSERT_EQ((&client)->PacketOrderCache->Count, 2);
+
+	// The missing packet releases the held back ones behind it, the duplicate is gone
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 1, 2, 3}));
+	ASSERT_EQ((&client)->PacketOrderCache->Count, 0);
+
+	// All of them are acked
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	deliver(server.get(), client_endpoint.outgoing[0]);
+	ASSERT_EQ((&server)->OutAckPacketId, (&server)->OutPacketId - 1);
+}
+
+TEST_F(packet_loopback, packet_order_cache_timeout)
+{
+	utcp_set_channel_unordered(client.get(), 1, true);
+	utcp_set_packet_order_cache(client.get(), true);
+	for (uint8_t i = 0; i < 5; ++i)
+	{
+		send(server.get(), 1, true, i == 0, i);
+		utcp_send_flush(server.get());
+	}
+
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	ASSERT_EQ(utcp_update(client.get()), 0);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0}));
+
+	// The missing packet is given up once it is late
+	utcp_add_elapsed_time((PACKET_ORDER_CACHE_TIMEOUT + 1) * 1000 * 1000);
+	ASSERT_EQ(utcp_update(client.get()), 0);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 2}));
+
+	// and dropped if it still arrives
+	ASSERT_FALSE(utcp_incoming(client.get(), server_endpoint.outgoing[1].data(), (int)server_endpoint.outgoing[1].size()));
+	ASSERT_FALSE((&client)->bClose);
+
+	// A forced flush does not wait for the timeout
+	deliver(client.get(), server_endpoint.outgoing[4]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 2}));
+	utcp_flush_packet_order_cache(client.get());
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 2, 4}));
+}
+
+TEST_F(packet_loopback, packet_order_cache_window)
+{
+	utcp_set_channel_unordered(client.get(), 1, true);
+	utcp_set_packet_order_cache(client.get(), true);
+	for (int i = 0; i < PACKET_ORDER_CACHE_SIZE + 2; ++i)
+	{
+		send(server.get(), 1, true, i == 0, (uint8_t)i);
+		utcp_send_flush(server.get());
+	}
+
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	deliver(client.get(), server_endpoint.outgoing[2]);
+	deliver(client.get(), server_endpoint.outgoing[PACKET_ORDER_CACHE_SIZE]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0}));
+
+	// Too far ahead to wait for, the held back packets go first
+	deliver(client.get(), server_endpoint.outgoing[PACKET_ORDER_CACHE_SIZE + 1]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({0, 2, PACKET_ORDER_CACHE_SIZE, PACKET_ORDER_CACHE_SIZE + 1}));
+	ASSERT_EQ((&client)->PacketOrderCache->Count, 0);
+
+	utcp_set_packet_order_cache(client.get(), false);
+	ASSERT_EQ((&client)->PacketOrderCache, nullptr);
+}
+
+struct bunch_view_record
+{
+	std::vector<uint8_t> data;
+	bool in_packet;
+};
+static std::vector<bunch_view_record> view_records;
+static const std::vector<uint8_t>* view_packet;
+
+TEST_F(packet_loopback, recv_bunch_view)
+{
+	view_records.clear();
+	utcp_get_config()->on_recv_bunch_view = [](struct utcp_connection* fd, void* userdata, const struct utcp_bunch_view* views, int count) {
+		for (int i = 0; i < count; ++i)
+		{
+			bunch_view_record record;
+			record.data.resize((views[i].DataBitsLen + 7) / 8);
+			utcp_bunch_view_read(&views[i], record.data.data());
+			record.in_packet = views[i].Data >= view_packet->data() && views[i].Data < view_packet->data() + view_packet->size();
+			view_records.push_back(record);
+		}
+	};
+
+	for (uint8_t i = 0; i < 4; ++i)
+	{
+		send(server.get(), 1, true, i == 0, i);
+		utcp_send_flush(server.get());
+	}
+
+	// In order bunches come straight from the packet, the bunches behind the lost one are copied while they wait
+	for (int i : {0, 2, 3})
+	{
+		view_packet = &server_endpoint.outgoing[i];
+		deliver(client.get(), server_endpoint.outgoing[i]);
+	}
+	ASSERT_EQ(view_records.size(), 1);
+
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	deliver(server.get(), client_endpoint.outgoing[0]);
+	utcp_send_flush(server.get());
+	ASSERT_EQ(server_endpoint.outgoing.size(), 5);
+	view_packet = &server_endpoint.outgoing[4];
+	deliver(client.get(), server_endpoint.outgoing[4]);
+
+	ASSERT_TRUE(client_endpoint.received.empty());
+	ASSERT_EQ(view_records.size(), 4);
+	const bool expect_in_packet[] = {true, true, false, false};
+	for (int i = 0; i < 4; ++i)
+	{
+		ASSERT_EQ(view_records[i].data, std::vector<uint8_t>({(uint8_t)i}));
+		ASSERT_EQ(view_records[i].in_packet, expect_in_packet[i]);
+	}
+}
+
+TEST_F(packet_loopback, partial_bunch_contiguous)
+{
+	// One message sent as four partial bunches, received by two connections
+	std::vector<uint8_t> message(500);
+	for (size_t i = 0; i < message.size(); ++i)
+		message[i] = (uint8_t)(i * 7);
+
+	const int count = 4;
+	const int bunch_bytes = (int)message.size() / count;
+	for (int i = 0; i < count; ++i)
+	{
+		struct utcp_bunch bunch;
+		memset(&bunch, 0, sizeof(bunch));
+		bunch.NameIndex = 255;
+		bunch.ChIndex = 1;
+		bunch.bReliable = 1;
+		bunch.bOpen = i == 0;
+		bunch.bPartial = 1;
+		bunch.bPartialInitial = i == 0;
+		bunch.bPartialFinal = i == count - 1;
+		bunch.DataBitsLen = bunch_bytes * 8;
+		memcpy(bunch.Data, message.data() + i * bunch_bytes, bunch_bytes);
+		ASSERT_GE(utcp_send_bunch(server.get(), &bunch), 0);
+		utcp_send_flush(server.get());
+	}
+	ASSERT_EQ(server_endpoint.outgoing.size(), count);
+
+	// on_recv_bunch gets them one by one
+	for (int i = 0; i < count; ++i)
+		deliver(client.get(), server_endpoint.outgoing[i]);
+	ASSERT_EQ(client_endpoint.received.size(), count);
+	std::vector<uint8_t> received;
+	for (auto& data : client_endpoint.received)
+		received.insert(received.end(), data.begin(), data.end());
+	ASSERT_EQ(received, message);
+
+	// on_recv_bunch_view gets the whole message at once
+	view_records.clear();
+	utcp_get_config()->on_recv_bunch_view = [](struct utcp_connection* fd, void* userdata, const struct utcp_bunch_view* views, int count) {
+		for (int i = 0; i < count; ++i)
+		{
+			ASSERT_TRUE(views[i].Bunch->bPartialInitial && views[i].Bunch->bPartialFinal && views[i].Bunch->bOpen);
+			ASSERT_EQ(views[i].PartialCount, 4);
+			bunch_view_record record;
+			record.data.resize((views[i].DataBitsLen + 7) / 8);
+			utcp_bunch_view_read(&views[i], record.data.data());
+			view_records.push_back(record);
+		}
+	};
+	utcp_connection_rtti other;
+	other.get()->userdata = &client_endpoint;
+	utcp_sequence_init(other.get(), 2000, 1000);
+	for (int i = 0; i < count; ++i)
+		deliver(other.get(), server_endpoint.outgoing[i]);
+	ASSERT_EQ(view_records.size(), 1);
+	ASSERT_EQ(view_records[0].data, message);
+}
+
+TEST_F(packet_loopback, partial_bunch_merge_fatal)
+{
+	// A reliable partial bunch that starts while the previous one is unfinished loses data, the connection closes
+	for (int i = 0; i < 2; ++i)
+	{
+		struct utcp_bunch bunch;
+		memset(&bunch, 0, sizeof(bunch));
+		bunch.NameIndex = 255;
+		bunch.ChIndex = 1;
+		bunch.bReliable = 1;
+		bunch.bOpen = i == 0;
+		bunch.bPartial = 1;
+		bunch.bPartialInitial = 1;
+		bunch.DataBitsLen = 8 * 100;
+		ASSERT_GE(utcp_send_bunch(server.get(), &bunch), 0);
+		utcp_send_flush(server.get());
+	}
+	ASSERT_EQ(server_endpoint.outgoing.size(), 2);
+
+	ASSERT_TRUE(utcp_incoming(client.get(), server_endpoint.outgoing[0].data(), (int)server_endpoint.outgoing[0].size()));
+	ASSERT_FALSE((&client)->bClose);
+	utcp_incoming(client.get(), server_endpoint.outgoing[1].data(), (int)server_endpoint.outgoing[1].size());
+	ASSERT_TRUE((&client)->bClose);
+	ASSERT_EQ((&client)->CloseReason, PartialMergeFail);
+	ASSERT_EQ(client_endpoint.received.size(), 0);
+}
+
+TEST_F(packet_loopback, send_bunch_data)
+{
+	// The partial bunches are sent straight from the message, bunch.Data is never read or written
+	std::vector<uint8_t> message(300);
+	for (size_t i = 0; i < message.size(); ++i)
+		message[i] = (uint8_t)(i * 3);
+
+	struct utcp_bunch bunch;
+	memset(bunch.Data, 0xAA, sizeof(bunch.Data));
+	const int count = 3;
+	const int bunch_bytes = (int)message.size() / count;
+	for (int i = 0; i < count; ++i)
+	{
+		memset(&bunch, 0, offsetof(struct utcp_bunch, Data));
+		bunch.NameIndex = 255;
+		bunch.ChIndex = 1;
+		bunch.bReliable = 1;
+		bunch.bOpen = i == 0;
+		bunch.bPartial = 1;
+		bunch.bPartialInitial = i == 0;
+		bunch.bPartialFinal = i == count - 1;
+		bunch.DataBitsLen = bunch_bytes * 8;
+		ASSERT_GE(utcp_send_bunch_data(server.get(), &bunch, message.data() + i * bunch_bytes), 0);
+		utcp_send_flush(server.get());
+	}
+	for (auto value : bunch.Data)
+		ASSERT_EQ(value, 0xAA);
+
+	for (int i = 0; i < count; ++i)
+		deliver(client.get(), server_endpoint.outgoing[i]);
+	std::vector<uint8_t> received;
+	for (auto& data : client_endpoint.received)
+		received.insert(received.end(), data.begin(), data.end());
+	ASSERT_EQ(received, message);
+}
+
+TEST_F(packet_loopback, send_bunch_iov)
+{
+	// Fragments that do not end on a byte boundary, gathered into the same bits as one flat bunch
+	std::vector<uint8_t> payload(100);
+	for (size_t i = 0; i < payload.size(); ++i)
+		payload[i] = (uint8_t)(i * 5 + 1);
+	const uint8_t head = 0x05;
+	const uint8_t tail[2] = {0xAB, 0x1C};
+	const struct utcp_iov iov[] = {{&head, 3}, {tail, 13}, {payload.data(), (uint32_t)payload.size() * 8}};
+
+	struct utcp_bunch flat;
+	memset(&flat, 0, sizeof(flat));
+	flat.NameIndex = 255;
+	flat.ChIndex = 1;
+	flat.bOpen = 1;
+	flat.bReliable = 1;
+	struct bitbuf bitbuf;
+	bitbuf_write_init(&bitbuf, flat.Data, sizeof(flat.Data));
+	for (auto& fragment : iov)
+		bitbuf_write_bits(&bitbuf, fragment.Data, fragment.DataBitsLen);
+	flat.DataBitsLen = (uint16_t)bitbuf.num;
+
+	struct utcp_bunch_header header;
+	memset(&header, 0, sizeof(header));
+	header.NameIndex = 255;
+	header.ChIndex = 1;
+	header.bOpen = 1;
+	header.bReliable = 1;
+	ASSERT_GE(utcp_send_bunch_iov(server.get(), &header, iov, 3), 0);
+	utcp_send_flush(server.get());
+	ASSERT_EQ(header.DataBitsLen, flat.DataBitsLen);
+
+	packet_endpoint other_endpoint;
+	utcp_connection_rtti other;
+	other.get()->userdata = &other_endpoint;
+	utcp_sequence_init(other.get(), 1000, 2000);
+	ASSERT_GE(utcp_send_bunch(other.get(), &flat), 0);
+	utcp_send_flush(other.get());
+	ASSERT_EQ(header.ChSequence, flat.ChSequence);
+
+	// The packet and the copy kept for resending are the same
+	ASSERT_EQ(server_endpoint.outgoing, other_endpoint.outgoing);
+	auto node = CONTAINING_RECORD(server.get()->channels.Channels[1]->OutRec.next, struct utcp_bunch_node, dl_list_node);
+	auto other_node = CONTAINING_RECORD(other.get()->channels.Channels[1]->OutRec.next, struct utcp_bunch_node, dl_list_node);
+	ASSERT_EQ(node->bunch_data_len, other_node->bunch_data_len);
+	ASSERT_EQ(memcmp(node->bunch_data, other_node->bunch_data, (node->bunch_data_len + 7) / 8), 0);
+
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	ASSERT_EQ(client_endpoint.received.size(), 1);
+	ASSERT_EQ(client_endpoint.received[0], std::vector<uint8_t>(flat.Data, flat.Data + flat.DataBitsLen / 8));
+
+	// Too large for a packet
+	std::vector<uint8_t> large(UTCP_MAX_PACKET + 1);
+	const struct utcp_iov large_iov[] = {{large.data(), (uint32_t)large.size() * 8}};
+	ASSERT_EQ(utcp_send_bunch_iov(server.get(), &header, large_iov, 1), -1);
+}
+
+TEST_F(packet_loopback, shared_bunch)
+{
+	(&server)->Features = UTCP_FEATURE_BYTE_ALIGNED | UTCP_FEATURE_DELTA_HEADER;
+	(&client)->Features = UTCP_FEATURE_BYTE_ALIGNED | UTCP_FEATURE_DELTA_HEADER;
+
+	packet_endpoint other_endpoint;
+	utcp_connection_rtti other;
+	other.get()->userdata = &other_endpoint;
+	(&other)->Features = UTCP_FEATURE_BYTE_ALIGNED | UTCP_FEATURE_DELTA_HEADER;
+	utcp_sequence_init(other.get(), 1000, 2000);
+
+	// Open, reliable, unreliable: the same bits as sending each bunch on its own
+	std::vector<std::vector<uint8_t>> payloads;
+	std::vector<utcp_shared_bunch*> shared;
+	for (int i = 0; i < 3; ++i)
+	{
+		struct utcp_bunch flat;
+		memset(&flat, 0, sizeof(flat));
+		flat.NameIndex = 255;
+		flat.ChIndex = 1;
+		flat.bOpen = i == 0;
+		flat.bReliable = i < 2;
+		flat.DataBitsLen = 100 * 8 - i;
+		for (int j = 0; j < 100; ++j)
+			flat.Data[j] = (uint8_t)(i * 31 + j);
+		flat.Data[99] &= 0x7F >> i;
+		payloads.emplace_back(flat.Data, flat.Data + 100);
+
+		struct utcp_bunch_header header;
+		memcpy(&header, &flat, sizeof(header));
+		const struct utcp_iov iov = {flat.Data, flat.DataBitsLen};
+		shared.push_back(utcp_shared_bunch_create(&header, &iov, 1));
+		ASSERT_NE(shared.back(), nullptr);
+
+		ASSERT_GE(utcp_send_shared_bunch(server.get(), shared.back()), 0);
+		ASSERT_GE(utcp_send_bunch(other.get(), &flat), 0);
+	}
+	utcp_send_flush(server.get());
+	utcp_send_flush(other.get());
+	ASSERT_EQ(server_endpoint.outgoing, other_endpoint.outgoing);
+	ASSERT_EQ(shared[0]->RefCount, 2);
+	ASSERT_EQ(shared[2]->RefCount, 1);
+
+	// The first packet is lost, the resend takes the data from the shared bunches after the caller released them
+	utcp_shared_bunch_release(shared[1]);
+	utcp_shared_bunch_release(shared[2]);
+	ASSERT_GE(send(server.get(), 5, true, true, 3), 0);
+	utcp_send_flush(server.get());
+	deliver(client.get(), server_endpoint.outgoing[1]);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>{3});
+
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	deliver(server.get(), client_endpoint.outgoing[0]);
+	utcp_send_flush(server.get());
+	ASSERT_EQ(server_endpoint.outgoing.size(), 3);
+	deliver(client.get(), server_endpoint.outgoing[2]);
+
+	ASSERT_EQ(client_endpoint.received.size(), 3);
+	ASSERT_EQ(client_endpoint.received[1], payloads[0]);
+	ASSERT_EQ(client_endpoint.received[2], std::vector<uint8_t>(payloads[1].begin(), payloads[1].end() - 1));
+
+	// Acked, only the caller holds it
+	utcp_add_elapsed_time(1000 * 1000 * 1000);
+	utcp_send_flush(client.get());
+	deliver(server.get(), client_endpoint.outgoing.back());
+	ASSERT_EQ(shared[0]->RefCount, 1);
+	utcp_shared_bunch_release(shared[0]);
+
+	// Too large for a packet
+	std::vector<uint8_t> large(UTCP_MAX_PACKET + 1);
+	struct utcp_bunch_header header;
+	memset(&header, 0, sizeof(header));
+	const struct utcp_iov large_iov[] = {{large.data(), (uint32_t)large.size() * 8}};
+	ASSERT_EQ(utcp_shared_bunch_create(&header, large_iov, 1), nullptr);
+}
+
+TEST_F(packet_loopback, send_batch)
+{
+	uint8_t buffer[UTCP_MAX_PACKET * 2];
+	struct utcp_send_batch_item items[2];
+	struct utcp_send_batch batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.Buffer = buffer;
+	batch.BufferSize = sizeof(buffer);
+	batch.Items = items;
+	batch.ItemCapacity = 2;
+	utcp_set_send_batch(&batch);
+
+	// Appended to the batch instead of on_outgoing
+	send(server.get(), 1, true, true, 1);
+	utcp_send_flush(server.get());
+	send(server.get(), 1, true, false, 2);
+	utcp_send_flush(server.get());
+	ASSERT_TRUE(server_endpoint.outgoing.empty());
+	ASSERT_EQ(batch.Count, 2);
+	ASSERT_EQ(items[0].fd, server.get());
+	ASSERT_EQ(items[0].userdata, &server_endpoint);
+	ASSERT_EQ(items[1].Offset, items[0].Len);
+	ASSERT_EQ(batch.BufferUsed, items[0].Len + items[1].Len);
+
+	// Full without on_full, the packet goes to on_outgoing
+	send(server.get(), 1, true, false, 3);
+	utcp_send_flush(server.get());
+	ASSERT_EQ(server_endpoint.outgoing.size(), 1);
+
+	// on_full sends the batch and empties it
+	static std::vector<std::vector<uint8_t>> sent;
+	sent.clear();
+	batch.on_full = [](struct utcp_send_batch* batch) {
+		for (int i = 0; i < batch->Count; ++i)
+			sent.emplace_back(batch->Buffer + batch->Items[i].Offset, batch->Buffer + batch->Items[i].Offset + batch->Items[i].Len);
+		batch->Count = 0;
+		batch->BufferUsed = 0;
+	};
+	send(server.get(), 1, true, false, 4);
+	utcp_send_flush(server.get());
+	ASSERT_EQ(sent.size(), 2);
+	ASSERT_EQ(batch.Count, 1);
+	utcp_set_send_batch(nullptr);
+
+	for (auto& packet : sent)
+		deliver(client.get(), packet);
+	deliver(client.get(), server_endpoint.outgoing[0]);
+	std::vector<uint8_t> last(buffer + items[0].Offset, buffer + items[0].Offset + items[0].Len);
+	deliver(client.get(), last);
+	ASSERT_EQ(received_values(client_endpoint), std::vector<uint8_t>({1, 2, 3, 4}));
+}
+
+TEST_F(packet_loopback, send_batch_per_thread)
+{
+	uint8_t buffer[UTCP_MAX_PACKET];
+	struct utcp_send_batch_item items[1];
+	struct utcp_send_batch batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.Buffer = buffer;
+	batch.BufferSize = sizeof(buffer);
+	batch.Items = items;
+	batch.ItemCapacity = 1;
+	utcp_set_send_batch(&batch);
+
+	// Another thread does not see the batch of this one
+	std::thread other([this]() {
+		ASSERT_EQ(utcp_get_send_batch(), nullptr);
+		send(server.get(), 1, true, true, 1);
+		utcp_send_flush(server.get());
+	});
+	other.join();
+	utcp_set_send_batch(nullptr);
+
+	ASSERT_EQ(batch.Count, 0);
+	ASSERT_EQ(server_endpoint.outgoing.size(), 1);
+}
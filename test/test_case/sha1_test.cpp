@@ -1,5 +1,10 @@
 ﻿#include "gtest/gtest.h"
-extern "C" void sha1_hmac_buffer(const void* Key, uint32_t KeySize, const void* Data, uint64_t DataSize, uint8_t* OutHash);
+#include <array>
+#include <vector>
+extern "C"
+{
+#include "utcp/sha1.h"
+}
 
 TEST(sha1, test)
 {
@@ -41,4 +46,125 @@ TEST(sha1, test)
 		sha1_hmac_buffer(HandshakeSecret, std::size(HandshakeSecret), CookieData, 100 + i, Cookie);
 		ASSERT_EQ(memcmp(Cookie, result[i], std::size(Cookie)), 0);
 	}
-}
\ No newline at end of file
+}
+
+TEST(sha1, hardware)
+{
+	const char* messages[] = {"abc", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"};
+	const uint8_t digests[][20] = {
+		{0xA9, 0x99, 0x3E, 0x36, 0x47, 0x06, 0x81, 0x6A, 0xBA, 0x3E, 0x25, 0x71, 0x78, 0x50, 0xC2, 0x6C, 0x9C, 0xD0, 0xD8, 0x9D},
+		{0x84, 0x98, 0x3E, 0x44, 0x1C, 0x3B, 0xD2, 0x6E, 0xBA, 0xAE, 0x4A, 0xA1, 0xF9, 0x51, 0x29, 0xE5, 0xE5, 0x46, 0x70, 0xF1},
+	};
+
+	uint8_t data[300];
+	for (int i = 0; i < std::size(data); ++i)
+	{
+		data[i] = (uint8_t)(i * 7 + 3);
+	}
+
+	// Both the portable code and the SHA extensions, when the CPU has them
+	std::vector<SHA1_HASH> portable;
+	for (int hardware = 0; hardware < 2; ++hardware)
+	{
+		if (Sha1UseHardware(hardware) != hardware)
+		{
+			continue;
+		}
+
+		for (int i = 0; i < std::size(messages); ++i)
+		{
+			SHA1_HASH hash;
+			Sha1Calculate(messages[i], (uint32_t)strlen(messages[i]), &hash);
+			ASSERT_EQ(memcmp(hash.bytes, digests[i], sizeof(hash.bytes)), 0);
+		}
+
+		for (uint32_t len = 0; len <= std::size(data); ++len)
+		{
+			SHA1_HASH hash;
+			Sha1Calculate(data, len, &hash);
+			if (hardware)
+			{
+				ASSERT_EQ(memcmp(hash.bytes, portable[len].bytes, sizeof(hash.bytes)), 0) << len;
+			}
+			else
+			{
+				portable.push_back(hash);
+			}
+		}
+	}
+	Sha1UseHardware(1);
+}
+
+TEST(sha1, hmac_key)
+{
+	uint8_t key[64];
+	uint8_t data[200];
+	for (int i = 0; i < std::size(key); ++i)
+	{
+		key[i] = (uint8_t)(i * 3);
+	}
+	for (int i = 0; i < std::size(data); ++i)
+	{
+		data[i] = (uint8_t)i;
+	}
+
+	struct sha1_hmac_key hmac_key;
+	sha1_hmac_key_init(&hmac_key, key, sizeof(key));
+	for (uint32_t len = 0; len <= std::size(data); ++len)
+	{
+		uint8_t expected[20];
+		uint8_t hash[20];
+		sha1_hmac_buffer(key, sizeof(key), data, len, expected);
+		sha1_hmac_key_buffer(&hmac_key, data, len, hash);
+		ASSERT_EQ(memcmp(hash, expected, sizeof(hash)), 0) << len;
+	}
+}
+
+TEST(sha1, hmac_key_buffers)
+{
+	uint8_t keys[2][64];
+	uint8_t data[300 + 7];
+	for (int i = 0; i < std::size(keys[0]); ++i)
+	{
+		keys[0][i] = (uint8_t)(i * 3);
+		keys[1][i] = (uint8_t)(i * 5 + 1);
+	}
+	for (int i = 0; i < std::size(data); ++i)
+	{
+		data[i] = (uint8_t)(i * 11);
+	}
+
+	struct sha1_hmac_key hmac_keys[2];
+	sha1_hmac_key_init(&hmac_keys[0], keys[0], sizeof(keys[0]));
+	sha1_hmac_key_init(&hmac_keys[1], keys[1], sizeof(keys[1]));
+
+	// Sizes across the block boundaries and past what a lane takes, runs shorter and longer than the lanes
+	const uint32_t sizes[] = {0, 1, 20, 55, 56, 63, 64, 80, 119, 120, 128, 247, 248, 300};
+	for (int multi_buffer = 0; multi_buffer < 2; ++multi_buffer)
+	{
+		if (sha1_use_multi_buffer(multi_buffer) != (bool)multi_buffer)
+		{
+			continue;
+		}
+
+		for (int count = 1; count <= 20; ++count)
+		{
+			std::vector<struct sha1_hmac_job> jobs(count);
+			std::vector<std::array<uint8_t, 20>> hashes(count);
+			for (int i = 0; i < count; ++i)
+			{
+				uint32_t size = sizes[(i * 5 + count) % std::size(sizes)];
+				jobs[i] = {&hmac_keys[i & 1], data + (i % 7), size, hashes[i].data()};
+			}
+			sha1_hmac_key_buffers(jobs.data(), count);
+
+			for (int i = 0; i < count; ++i)
+			{
+				uint8_t expected[20];
+				sha1_hmac_key_buffer(jobs[i].Key, jobs[i].Data, jobs[i].DataSize, expected);
+				ASSERT_EQ(memcmp(hashes[i].data(), expected, sizeof(expected)), 0) << count << " " << i;
+			}
+		}
+	}
+	sha1_use_multi_buffer(true);
+}
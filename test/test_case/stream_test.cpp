@@ -0,0 +1,281 @@
+#include "abstract/utcp_stream.hpp"
+#include "gtest/gtest.h"
+extern "C"
+{
+#include "utcp/utcp_packet.h"
+}
+#include <vector>
+
+static const uint16_t stream_channel = 1;
+static const uint16_t split_channel = 3;
+
+struct stream_endpoint : public utcp::conn, public utcp::stream_receiver
+{
+	std::vector<std::vector<uint8_t>> outgoing;
+	std::vector<std::vector<uint8_t>> messages;
+	std::vector<uint64_t> totals;
+	std::vector<std::vector<uint8_t>> partial_bunches; // Completed partial bunches, read whole from their views
+	std::vector<struct utcp_bunch> split_bunches;	  // The bunches of the last channel, as a conn without views gets them
+	std::vector<std::vector<uint8_t>> packet_views; // The whole bunches of the other channels, read where they are in the packet
+	bool bad_bunch = false;
+
+  protected:
+	virtual void on_outgoing(const void* data, int len) override
+	{
+		outgoing.emplace_back((const uint8_t*)data, (const uint8_t*)data + len);
+	}
+
+	virtual void on_recv_bunch(struct utcp_bunch* const bunches[], int count) override
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			if (bunches[i]->ChIndex == stream_channel && !recv_bunch(bunches[i]->Data, bunches[i]->DataBitsLen))
+				bad_bunch = true;
+			else if (bunches[i]->ChIndex == split_channel)
+				split_bunches.push_back(*bunches[i]);
+		}
+	}
+
+	virtual void on_recv_bunch_view(const struct utcp_bunch_view* views, int count) override
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			auto& view = views[i];
+			if (view.Bunch->ChIndex == stream_channel || view.Bunch->ChIndex == split_channel || view.Data == view.Bunch->Data)
+			{
+				utcp::conn::on_recv_bunch_view(&view, 1);
+				continue;
+			}
+			std::vector<uint8_t> data((view.DataBitsLen + 7) / 8);
+			utcp_bunch_view_read(&view, data.data());
+			if (view.Bunch->bPartial)
+				partial_bunches.push_back(std::move(data));
+			else
+				packet_views.push_back(std::move(data));
+		}
+	}
+
+	virtual void on_stream_begin(uint32_t message_id, uint64_t total_bytes) override
+	{
+		EXPECT_EQ(message_id, messages.size());
+		messages.emplace_back();
+		totals.push_back(total_bytes);
+	}
+
+	virtual void on_stream_data(uint32_t message_id, uint64_t offset, const uint8_t* data, size_t len) override
+	{
+		EXPECT_EQ(offset, messages[message_id].size());
+		messages[message_id].insert(messages[message_id].end(), data, data + len);
+	}
+
+	virtual void on_stream_complete(uint32_t message_id) override
+	{
+		EXPECT_EQ(messages[message_id].size(), totals[message_id]);
+	}
+};
+
+struct progress_sender : public utcp::stream_sender
+{
+	using utcp::stream_sender::stream_sender;
+	std::vector<uint64_t> acked;
+
+  protected:
+	virtual void on_progress(uint32_t message_id, uint64_t acked_bytes, uint64_t total_bytes) override
+	{
+		if (acked.size() <= message_id)
+			acked.resize(message_id + 1);
+		EXPECT_GE(acked_bytes, acked[message_id]);
+		EXPECT_LE(acked_bytes, total_bytes);
+		acked[message_id] = acked_bytes;
+	}
+};
+
+struct stream : public ::testing::Test
+{
+	stream_endpoint server;
+	stream_endpoint client;
+
+	virtual void SetUp() override
+	{
+		utcp::event_handler::config(nullptr);
+		utcp_sequence_init(server.get_fd(), 1000, 2000);
+		utcp_sequence_init(client.get_fd(), 2000, 1000);
+	}
+
+	virtual void TearDown() override
+	{
+		auto config = utcp_get_config();
+		config->on_accept = nullptr;
+		config->on_connect = nullptr;
+		config->on_disconnect = nullptr;
+		config->on_outgoing = nullptr;
+		config->on_recv_bunch_view = nullptr;
+		config->on_delivery_status = nullptr;
+	}
+
+	// One round trip, every drop_every-th packet from the server is lost
+	void run(progress_sender& sender, int drop_every, int max_rounds)
+	{
+		int packets = 0;
+		for (int round = 0; round < max_rounds && !sender.empty(); ++round)
+		{
+			utcp::event_handler::add_elapsed_time(10 * 1000 * 1000);
+			sender.update();
+			ASSERT_LE((size_t)utcp_channel_reliable_in_flight(server.get_fd(), stream_channel), sender.window_bunches());
+			// Keep alive, a lost last packet is only found out when a later one is acked
+			server.send_flush();
+
+			for (auto& packet : server.outgoing)
+			{
+				if (drop_every && ++packets % drop_every == 0)
+					continue;
+				client.incoming(packet.data(), (int)packet.size());
+			}
+			server.outgoing.clear();
+			client.update();
+			client.send_flush();
+
+			for (auto& packet : client.outgoing)
+				server.incoming(packet.data(), (int)packet.size());
+			client.outgoing.clear();
+			server.update();
+		}
+		ASSERT_TRUE(sender.empty());
+		ASSERT_FALSE(client.bad_bunch);
+	}
+};
+
+static std::vector<uint8_t> make_message(size_t len, uint32_t seed)
+{
+	std::vector<uint8_t> message(len);
+	for (auto& value : message)
+	{
+		seed = seed * 1103515245 + 12345;
+		value = (uint8_t)(seed >> 16);
+	}
+	return message;
+}
+
+TEST_F(stream, messages_in_order)
+{
+	// Beyond the 64 KB partial bunch limit, and an empty message in between
+	std::vector<std::vector<uint8_t>> sent = {make_message(100, 1), make_message(0, 2), make_message(300 * 1024 + 7, 3)};
+
+	progress_sender sender(&server, stream_channel, 255, 16 * 1024);
+	for (auto& message : sent)
+		sender.send(message.data(), message.size());
+	run(sender, 0, 1000);
+
+	ASSERT_EQ(client.messages, sent);
+	ASSERT_EQ(sender.acked.size(), sent.size());
+	for (size_t i = 0; i < sent.size(); ++i)
+		ASSERT_EQ(sender.acked[i], sent[i].size());
+}
+
+TEST_F(stream, lost_packets)
+{
+	auto sent = make_message(200 * 1024, 4);
+
+	progress_sender sender(&server, stream_channel, 255, 32 * 1024);
+	sender.send(sent.data(), sent.size());
+	run(sender, 7, 10000);
+
+	ASSERT_EQ(client.messages.size(), 1);
+	ASSERT_EQ(client.messages[0], sent);
+	ASSERT_EQ(sender.acked[0], sent.size());
+}
+
+TEST_F(stream, partial_bunch_in_one_piece)
+{
+	// A message sent in partial bunches reaches the conn whole, with no copy per bunch
+	auto sent = make_message(20 * 1024, 5);
+
+	struct utcp_bunch header;
+	memset(&header, 0, sizeof(header));
+	header.NameIndex = 255;
+	header.ChIndex = stream_channel + 1;
+	header.bOpen = 1;
+	header.bReliable = 1;
+	auto range = server.send_bunch(&header, sent.data(), sent.size() * 8);
+	ASSERT_GT(range.last, range.first);
+	server.send_flush();
+
+	for (auto& packet : server.outgoing)
+		client.incoming(packet.data(), (int)packet.size());
+	client.update();
+
+	ASSERT_EQ(client.partial_bunches.size(), 1);
+	ASSERT_EQ(client.partial_bunches[0], sent);
+}
+
+TEST_F(stream, partial_bunch_split)
+{
+	// A conn that leaves partial views to the default gets the bunches as they were sent, each with its own header
+	auto sent = make_message(20 * 1024, 7);
+
+	struct utcp_bunch header;
+	memset(&header, 0, sizeof(header));
+	header.NameIndex = 255;
+	header.ChIndex = split_channel;
+	header.bOpen = 1;
+	header.bClose = 1;
+	header.CloseReason = 1;
+	header.bReliable = 1;
+	server.send_bunch(&header, sent.data(), sent.size() * 8);
+	server.send_flush();
+
+	for (auto& packet : server.outgoing)
+		client.incoming(packet.data(), (int)packet.size());
+	client.update();
+
+	auto& bunches = client.split_bunches;
+	ASSERT_GT(bunches.size(), 1);
+	std::vector<uint8_t> received;
+	for (size_t i = 0; i < bunches.size(); ++i)
+	{
+		auto& bunch = bunches[i];
+		ASSERT_EQ(bunch.ChSequence, bunches[0].ChSequence + (int)i);
+		ASSERT_TRUE(bunch.bPartial);
+		ASSERT_EQ(bunch.bPartialInitial, i == 0);
+		ASSERT_EQ(bunch.bPartialFinal, i == bunches.size() - 1);
+		ASSERT_EQ(bunch.bOpen, i == 0);
+		ASSERT_EQ(bunch.bClose, i == bunches.size() - 1);
+		ASSERT_EQ(bunch.CloseReason, bunch.bClose ? 1 : 0);
+		ASSERT_EQ(bunch.DataBitsLen % 8, 0);
+		received.insert(received.end(), bunch.Data, bunch.Data + bunch.DataBitsLen / 8);
+	}
+	ASSERT_EQ(received, sent);
+}
+
+TEST_F(stream, bunch_view_in_packet)
+{
+	// A conn that overrides on_recv_bunch_view reads the bunch in the packet, on_recv_bunch never gets a copy
+	const uint8_t sent[] = {1, 2, 3, 4, 5};
+	struct utcp_bunch header;
+	memset(&header, 0, sizeof(header));
+	header.NameIndex = 255;
+	header.ChIndex = stream_channel + 1;
+	header.bOpen = 1;
+	header.bReliable = 1;
+	server.send_bunch(&header, sent, sizeof(sent) * 8);
+	server.send_flush();
+
+	for (auto& packet : server.outgoing)
+		client.incoming(packet.data(), (int)packet.size());
+
+	ASSERT_EQ(client.packet_views.size(), 1);
+	ASSERT_EQ(client.packet_views[0], std::vector<uint8_t>(sent, sent + sizeof(sent)));
+}
+
+TEST(stream_receiver, malformed)
+{
+	utcp::stream_receiver receiver;
+	const uint8_t header[8] = {4};
+	ASSERT_FALSE(receiver.recv_bunch(header, 4 * 8));
+	ASSERT_TRUE(receiver.recv_bunch(header, sizeof(header) * 8));
+
+	// More data than the size in the header
+	const uint8_t data[5] = {};
+	ASSERT_FALSE(receiver.recv_bunch(data, sizeof(data) * 8));
+	ASSERT_TRUE(receiver.recv_bunch(data, 4 * 8));
+}
@@ -17,6 +17,23 @@
 #include "WjCryptLib_Sha1.h"
 #include <memory.h>
 
+// The x86 SHA extensions (SHA-NI) are compiled in on x86 with gcc, clang and msvc, and used when cpuid reports them
+#if ( defined(__GNUC__) || defined(__clang__) ) && ( defined(__x86_64__) || defined(__i386__) )
+    #include <cpuid.h>
+    #include <immintrin.h>
+    #define USE_SHA_EXTENSIONS
+    #define SHA_EXTENSIONS_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+#elif defined(_MSC_VER) && ( defined(_M_X64) || defined(_M_IX86) )
+    #include <immintrin.h>
+    #include <intrin.h>
+    #define USE_SHA_EXTENSIONS
+    #define SHA_EXTENSIONS_TARGET
+#endif
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //  DEFINES
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -146,6 +163,283 @@ void
     state[4] += e;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//  TransformBlocks
+//
+//  Hash BlockCount consecutive 512-bit blocks with the portable code
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static
+void
+    TransformBlocks
+    (
+        uint32_t            state[5],
+        uint8_t const*      Buffer,
+        uint32_t            BlockCount
+    )
+{
+    uint32_t i;
+    for( i=0; i<BlockCount; i++ )
+    {
+        TransformFunction( state, Buffer + i*64 );
+    }
+}
+
+#ifdef USE_SHA_EXTENSIONS
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//  TransformBlocksShaExtensions
+//
+//  Hash BlockCount consecutive 512-bit blocks with the SHA extensions. The state stays in registers between blocks.
+//  Four rounds per sha1rnds4, the message schedule is expanded by sha1msg1/sha1msg2 and E by sha1nexte.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+static
+SHA_EXTENSIONS_TARGET
+void
+    TransformBlocksShaExtensions
+    (
+        uint32_t            state[5],
+        uint8_t const*      Buffer,
+        uint32_t            BlockCount
+    )
+{
+    __m128i const mask = _mm_set_epi64x( 0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL );
+    __m128i abcd = _mm_shuffle_epi32( _mm_loadu_si128( (__m128i const*)state ), 0x1B );
+    __m128i E0 = _mm_set_epi32( (int)state[4], 0, 0, 0 );
+    __m128i E1;
+    __m128i MSG0;
+    __m128i MSG1;
+    __m128i MSG2;
+    __m128i MSG3;
+
+    for( ; BlockCount > 0; BlockCount--, Buffer += 64 )
+    {
+        __m128i const abcdSave = abcd;
+        __m128i const E0Save = E0;
+
+        // Rounds 0-3
+        MSG0 = _mm_shuffle_epi8( _mm_loadu_si128( (__m128i const*)(Buffer + 0) ), mask );
+        E0 = _mm_add_epi32( E0, MSG0 );
+        E1 = abcd;
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 0 );
+
+        // Rounds 4-7
+        MSG1 = _mm_shuffle_epi8( _mm_loadu_si128( (__m128i const*)(Buffer + 16) ), mask );
+        E1 = _mm_sha1nexte_epu32( E1, MSG1 );
+        E0 = abcd;
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 0 );
+        MSG0 = _mm_sha1msg1_epu32( MSG0, MSG1 );
+
+        // Rounds 8-11
+        MSG2 = _mm_shuffle_epi8( _mm_loadu_si128( (__m128i const*)(Buffer + 32) ), mask );
+        E0 = _mm_sha1nexte_epu32( E0, MSG2 );
+        E1 = abcd;
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 0 );
+        MSG1 = _mm_sha1msg1_epu32( MSG1, MSG2 );
+        MSG0 = _mm_xor_si128( MSG0, MSG2 );
+
+        // Rounds 12-15
+        MSG3 = _mm_shuffle_epi8( _mm_loadu_si128( (__m128i const*)(Buffer + 48) ), mask );
+        E1 = _mm_sha1nexte_epu32( E1, MSG3 );
+        E0 = abcd;
+        MSG0 = _mm_sha1msg2_epu32( MSG0, MSG3 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 0 );
+        MSG2 = _mm_sha1msg1_epu32( MSG2, MSG3 );
+        MSG1 = _mm_xor_si128( MSG1, MSG3 );
+
+        // Rounds 16-19
+        E0 = _mm_sha1nexte_epu32( E0, MSG0 );
+        E1 = abcd;
+        MSG1 = _mm_sha1msg2_epu32( MSG1, MSG0 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 0 );
+        MSG3 = _mm_sha1msg1_epu32( MSG3, MSG0 );
+        MSG2 = _mm_xor_si128( MSG2, MSG0 );
+
+        // Rounds 20-23
+        E1 = _mm_sha1nexte_epu32( E1, MSG1 );
+        E0 = abcd;
+        MSG2 = _mm_sha1msg2_epu32( MSG2, MSG1 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 1 );
+        MSG0 = _mm_sha1msg1_epu32( MSG0, MSG1 );
+        MSG3 = _mm_xor_si128( MSG3, MSG1 );
+
+        // Rounds 24-27
+        E0 = _mm_sha1nexte_epu32( E0, MSG2 );
+        E1 = abcd;
+        MSG3 = _mm_sha1msg2_epu32( MSG3, MSG2 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 1 );
+        MSG1 = _mm_sha1msg1_epu32( MSG1, MSG2 );
+        MSG0 = _mm_xor_si128( MSG0, MSG2 );
+
+        // Rounds 28-31
+        E1 = _mm_sha1nexte_epu32( E1, MSG3 );
+        E0 = abcd;
+        MSG0 = _mm_sha1msg2_epu32( MSG0, MSG3 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 1 );
+        MSG2 = _mm_sha1msg1_epu32( MSG2, MSG3 );
+        MSG1 = _mm_xor_si128( MSG1, MSG3 );
+
+        // Rounds 32-35
+        E0 = _mm_sha1nexte_epu32( E0, MSG0 );
+        E1 = abcd;
+        MSG1 = _mm_sha1msg2_epu32( MSG1, MSG0 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 1 );
+        MSG3 = _mm_sha1msg1_epu32( MSG3, MSG0 );
+        MSG2 = _mm_xor_si128( MSG2, MSG0 );
+
+        // Rounds 36-39
+        E1 = _mm_sha1nexte_epu32( E1, MSG1 );
+        E0 = abcd;
+        MSG2 = _mm_sha1msg2_epu32( MSG2, MSG1 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 1 );
+        MSG0 = _mm_sha1msg1_epu32( MSG0, MSG1 );
+        MSG3 = _mm_xor_si128( MSG3, MSG1 );
+
+        // Rounds 40-43
+        E0 = _mm_sha1nexte_epu32( E0, MSG2 );
+        E1 = abcd;
+        MSG3 = _mm_sha1msg2_epu32( MSG3, MSG2 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 2 );
+        MSG1 = _mm_sha1msg1_epu32( MSG1, MSG2 );
+        MSG0 = _mm_xor_si128( MSG0, MSG2 );
+
+        // Rounds 44-47
+        E1 = _mm_sha1nexte_epu32( E1, MSG3 );
+        E0 = abcd;
+        MSG0 = _mm_sha1msg2_epu32( MSG0, MSG3 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 2 );
+        MSG2 = _mm_sha1msg1_epu32( MSG2, MSG3 );
+        MSG1 = _mm_xor_si128( MSG1, MSG3 );
+
+        // Rounds 48-51
+        E0 = _mm_sha1nexte_epu32( E0, MSG0 );
+        E1 = abcd;
+        MSG1 = _mm_sha1msg2_epu32( MSG1, MSG0 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 2 );
+        MSG3 = _mm_sha1msg1_epu32( MSG3, MSG0 );
+        MSG2 = _mm_xor_si128( MSG2, MSG0 );
+
+        // Rounds 52-55
+        E1 = _mm_sha1nexte_epu32( E1, MSG1 );
+        E0 = abcd;
+        MSG2 = _mm_sha1msg2_epu32( MSG2, MSG1 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 2 );
+        MSG0 = _mm_sha1msg1_epu32( MSG0, MSG1 );
+        MSG3 = _mm_xor_si128( MSG3, MSG1 );
+
+        // Rounds 56-59
+        E0 = _mm_sha1nexte_epu32( E0, MSG2 );
+        E1 = abcd;
+        MSG3 = _mm_sha1msg2_epu32( MSG3, MSG2 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 2 );
+        MSG1 = _mm_sha1msg1_epu32( MSG1, MSG2 );
+        MSG0 = _mm_xor_si128( MSG0, MSG2 );
+
+        // Rounds 60-63
+        E1 = _mm_sha1nexte_epu32( E1, MSG3 );
+        E0 = abcd;
+        MSG0 = _mm_sha1msg2_epu32( MSG0, MSG3 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 3 );
+        MSG2 = _mm_sha1msg1_epu32( MSG2, MSG3 );
+        MSG1 = _mm_xor_si128( MSG1, MSG3 );
+
+        // Rounds 64-67
+        E0 = _mm_sha1nexte_epu32( E0, MSG0 );
+        E1 = abcd;
+        MSG1 = _mm_sha1msg2_epu32( MSG1, MSG0 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 3 );
+        MSG3 = _mm_sha1msg1_epu32( MSG3, MSG0 );
+        MSG2 = _mm_xor_si128( MSG2, MSG0 );
+
+        // Rounds 68-71
+        E1 = _mm_sha1nexte_epu32( E1, MSG1 );
+        E0 = abcd;
+        MSG2 = _mm_sha1msg2_epu32( MSG2, MSG1 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 3 );
+        MSG3 = _mm_xor_si128( MSG3, MSG1 );
+
+        // Rounds 72-75
+        E0 = _mm_sha1nexte_epu32( E0, MSG2 );
+        E1 = abcd;
+        MSG3 = _mm_sha1msg2_epu32( MSG3, MSG2 );
+        abcd = _mm_sha1rnds4_epu32( abcd, E0, 3 );
+
+        // Rounds 76-79
+        E1 = _mm_sha1nexte_epu32( E1, MSG3 );
+        E0 = abcd;
+        abcd = _mm_sha1rnds4_epu32( abcd, E1, 3 );
+
+        // Add the working vars back into the state
+        E0 = _mm_sha1nexte_epu32( E0, E0Save );
+        abcd = _mm_add_epi32( abcd, abcdSave );
+    }
+
+    _mm_storeu_si128( (__m128i*)state, _mm_shuffle_epi32( abcd, 0x1B ) );
+    state[4] = (uint32_t)_mm_extract_epi32( E0, 3 );
+}
+
+static
+int
+    HasShaExtensions
+    (
+        void
+    )
+{
+    // SHA: leaf 7 ebx bit 29. SSSE3 and SSE4.1: leaf 1 ecx bits 9 and 19
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid( regs, 0 );
+    if( regs[0] < 7 )
+    {
+        return 0;
+    }
+    __cpuid( regs, 1 );
+    uint32_t const ecx1 = (uint32_t)regs[2];
+    __cpuidex( regs, 7, 0 );
+    uint32_t const ebx7 = (uint32_t)regs[1];
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+    {
+        return 0;
+    }
+    uint32_t const ecx1 = ecx;
+    if( !__get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx ) )
+    {
+        return 0;
+    }
+    uint32_t const ebx7 = ebx;
+#endif
+    return ( ebx7 & (1u << 29) ) && ( ecx1 & (1u << 9) ) && ( ecx1 & (1u << 19) );
+}
+#endif
+
+typedef void (*TransformBlocksFunction)( uint32_t state[5], uint8_t const* Buffer, uint32_t BlockCount );
+
+static void SelectTransform( uint32_t state[5], uint8_t const* Buffer, uint32_t BlockCount );
+
+// Picked on first use or by Sha1UseHardware. Every thread that hashes reads it, so it is only accessed atomically
+static TransformBlocksFunction Transform = SelectTransform;
+
+#if defined(_MSC_VER)
+    #define LoadTransform()         ( (TransformBlocksFunction)_InterlockedCompareExchangePointer( (void* volatile*)&Transform, NULL, NULL ) )
+    #define StoreTransform( f )     _InterlockedExchangePointer( (void* volatile*)&Transform, (void*)(f) )
+#else
+    #define LoadTransform()         __atomic_load_n( &Transform, __ATOMIC_RELAXED )
+    #define StoreTransform( f )     __atomic_store_n( &Transform, (f), __ATOMIC_RELAXED )
+#endif
+
+static
+void
+    SelectTransform
+    (
+        uint32_t            state[5],
+        uint8_t const*      Buffer,
+        uint32_t            BlockCount
+    )
+{
+    Sha1SelectTransform( );
+    LoadTransform()( state, Buffer, BlockCount );
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //  PUBLIC FUNCTIONS
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -187,6 +481,7 @@ void
 {
     uint32_t    i;
     uint32_t    j;
+    TransformBlocksFunction const transform = LoadTransform();
 
     j = (Context->Count[0] >> 3) & 63;
     if( (Context->Count[0] += BufferSize << 3) < (BufferSize << 3) )
@@ -199,10 +494,11 @@ void
     {
         i = 64 - j;
         memcpy( &Context->Buffer[j], Buffer, i );
-        TransformFunction(Context->State, Context->Buffer);
-        for( ; i + 63 < BufferSize; i += 64 )
+        transform(Context->State, Context->Buffer, 1);
+        if( i + 63 < BufferSize )
         {
-            TransformFunction(Context->State, (uint8_t*)Buffer + i);
+            transform(Context->State, (uint8_t*)Buffer + i, (BufferSize - i) / 64);
+            i += (BufferSize - i) & ~63u;
         }
         j = 0;
     }
@@ -229,17 +525,16 @@ void
 {
     uint32_t    i;
     uint8_t     finalcount[8];
+    uint8_t     padding[64] = { 0x80 };
 
     for( i=0; i<8; i++ )
     {
         finalcount[i] = (unsigned char)((Context->Count[(i >= 4 ? 0 : 1)]
          >> ((3-(i & 3)) * 8) ) & 255);  // Endian independent
     }
-    Sha1Update( Context, (uint8_t*)"\x80", 1 );
-    while( (Context->Count[0] & 504) != 448 )
-    {
-        Sha1Update( Context, (uint8_t*)"\0", 1 );
-    }
+    // 0x80 then zeros up to 56 bytes into a block, in one update
+    i = (Context->Count[0] >> 3) & 63;
+    Sha1Update( Context, padding, i < 56 ? 56 - i : 120 - i );
 
     Sha1Update( Context, finalcount, 8 );  // Should cause a Sha1TransformFunction()
     for( i=0; i<SHA1_HASH_SIZE; i++ )
@@ -248,6 +543,48 @@ void
     }
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Sha1UseHardware
+//
+//  Selects the SHA extensions when Enable is non zero and the CPU has them, the portable code otherwise. Returns
+//  whether the SHA extensions are used. They are selected on first use when available.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int
+    Sha1UseHardware
+    (
+        int                 Enable          // [in]
+    )
+{
+#ifdef USE_SHA_EXTENSIONS
+    if( Enable && HasShaExtensions() )
+    {
+        StoreTransform( TransformBlocksShaExtensions );
+        return 1;
+    }
+#endif
+    (void)Enable;
+    StoreTransform( TransformBlocks );
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Sha1SelectTransform
+//
+//  Picks the transform for the CPU, unless Sha1UseHardware has already chosen one. The first hash does it otherwise.
+//  Call it once before several threads start hashing, so that none of them has to pick it.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void
+    Sha1SelectTransform
+    (
+        void
+    )
+{
+    if( LoadTransform() == SelectTransform )
+    {
+        Sha1UseHardware( 1 );
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //  Sha1Calculate
 //
@@ -80,6 +80,30 @@ void
         SHA1_HASH*          Digest          // [in]
     );
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Sha1UseHardware
+//
+//  Selects the SHA extensions when Enable is non zero and the CPU has them, the portable code otherwise. Returns
+//  whether the SHA extensions are used. They are selected on first use when available.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+int
+    Sha1UseHardware
+    (
+        int                 Enable          // [in]
+    );
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+//  Sha1SelectTransform
+//
+//  Picks the transform for the CPU, unless Sha1UseHardware has already chosen one. The first hash does it otherwise.
+//  Call it once before several threads start hashing, so that none of them has to pick it.
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+void
+    Sha1SelectTransform
+    (
+        void
+    );
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 //  Sha1Calculate
 //
@@ -4,6 +4,10 @@
 #define IA 3877
 #define IC 29573
 
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 static unsigned int s_random_seed = 42;
 
 void lcg_set_random_seed(unsigned int seed)
@@ -16,8 +20,28 @@ unsigned int lcg_get_random_seed(void)
 	return s_random_seed;
 }
 
+// Listener workers draw from the same sequence on their own threads
 unsigned int lcg_random(void)
 {
-	s_random_seed = s_random_seed * IA + IC;
-	return s_random_seed;
+#if defined(_MSC_VER)
+	long seed = _InterlockedCompareExchange((volatile long*)&s_random_seed, 0, 0);
+	long next;
+	for (;;)
+	{
+		next = (long)((unsigned int)seed * IA + IC);
+		long prev = _InterlockedCompareExchange((volatile long*)&s_random_seed, next, seed);
+		if (prev == seed)
+			break;
+		seed = prev;
+	}
+	return (unsigned int)next;
+#else
+	unsigned int seed = __atomic_load_n(&s_random_seed, __ATOMIC_RELAXED);
+	unsigned int next;
+	do
+	{
+		next = seed * IA + IC;
+	} while (!__atomic_compare_exchange_n(&s_random_seed, &seed, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return next;
+#endif
 }
@@ -1,4 +1,5 @@
 ﻿#include "bit_buffer.h"
+#include "bit_stream.h"
 #include <assert.h>
 #include <string.h>
 
@@ -20,25 +21,7 @@ static bool allow_opt(struct bitbuf* buff, size_t bits_length)
 	return buff->num + bits_length <= buff->size;
 }
 
-static uint32_t CeilLogTwo(uint32_t x)
-{
-	static const uint8_t log_2[256] = {/* log_2[i] = ceil(log2(i - 1)) */
-									   0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
-									   6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
-									   7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 8,
-									   8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-									   8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
-									   8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8};
-	int l = 0;
-	x--;
-	while (x >= 256)
-	{
-		l += 8;
-		x >>= 8;
-	}
-	return l + log_2[x];
-}
-
+// appBitsCpy, byte sized shifting, kept as the reference for appBitsCpyWide
 static void appBitsCpy(uint8_t* Dest, int32_t DestBit, const uint8_t* Src, int32_t SrcBit, int32_t BitCount)
 {
 	if (BitCount == 0)
@@ -137,6 +120,92 @@ static void appBitsCpy(uint8_t* Dest, int32_t DestBit, const uint8_t* Src, int32
 	}
 }
 
+static inline uint64_t LoadWord(const uint8_t* Src)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	uint64_t Word = 0;
+	for (int i = 7; i >= 0; --i)
+		Word = (Word << 8) | Src[i];
+	return Word;
+#else
+	uint64_t Word;
+	memcpy(&Word, Src, sizeof(Word));
+	return Word;
+#endif
+}
+
+static inline void StoreWord(uint8_t* Dest, uint64_t Word)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	for (int i = 0; i < 8; ++i, Word >>= 8)
+		Dest[i] = (uint8_t)Word;
+#else
+	memcpy(Dest, &Word, sizeof(Word));
+#endif
+}
+
+// Same result as appBitsCpy, 64 bits per step. The destination is brought to a byte boundary first,
+// then each output word is funnel shifted out of two source loads. Only the bytes in the copied ranges are touched.
+static void appBitsCpyWide(uint8_t* Dest, int32_t DestBit, const uint8_t* Src, int32_t SrcBit, int32_t BitCount)
+{
+	if (BitCount <= 8)
+	{
+		appBitsCpy(Dest, DestBit, Src, SrcBit, BitCount);
+		return;
+	}
+
+	// Lead-in, up to 7 bits
+	int32_t LeadBits = (8 - (DestBit & 7)) & 7;
+	if (LeadBits)
+	{
+		appBitsCpy(Dest, DestBit, Src, SrcBit, LeadBits);
+		DestBit += LeadBits;
+		SrcBit += LeadBits;
+		BitCount -= LeadBits;
+	}
+
+	uint8_t* DestBytes = Dest + DestBit / 8;
+	const uint8_t* SrcBytes = Src + SrcBit / 8;
+	const uint32_t ShiftCount = SrcBit & 7;
+	int32_t ByteCount = BitCount / 8;
+
+	if (ShiftCount == 0)
+	{
+		memcpy(DestBytes, SrcBytes, ByteCount);
+	}
+	else
+	{
+		// Every output byte reads two source bytes, the last source byte read is SrcBytes[ByteCount]
+		int32_t i = 0;
+		for (; i + 8 <= ByteCount; i += 8)
+		{
+			uint64_t Word = (LoadWord(SrcBytes + i) >> ShiftCount) | ((uint64_t)SrcBytes[i + 8] << (64 - ShiftCount));
+			StoreWord(DestBytes + i, Word);
+		}
+		for (; i < ByteCount; ++i)
+		{
+			DestBytes[i] = (uint8_t)((SrcBytes[i] >> ShiftCount) | (SrcBytes[i + 1] << (8 - ShiftCount)));
+		}
+	}
+
+	// Lead-out, up to 7 bits
+	int32_t LeftBits = BitCount & 7;
+	if (LeftBits)
+	{
+		appBitsCpy(DestBytes + ByteCount, 0, SrcBytes + ByteCount, ShiftCount, LeftBits);
+	}
+}
+
+void bitbuf_copy_bits(uint8_t* dest, size_t dest_bit, const uint8_t* src, size_t src_bit, size_t bits_size)
+{
+	appBitsCpyWide(dest, (int32_t)dest_bit, src, (int32_t)src_bit, (int32_t)bits_size);
+}
+
+void bitbuf_copy_bits_reference(uint8_t* dest, size_t dest_bit, const uint8_t* src, size_t src_bit, size_t bits_size)
+{
+	appBitsCpy(dest, (int32_t)dest_bit, src, (int32_t)src_bit, (int32_t)bits_size);
+}
+
 size_t bitbuf_num_bytes(struct bitbuf* buff)
 {
 	return (buff->num + 7) >> 3;
@@ -173,6 +242,15 @@ bool bitbuf_write_end(struct bitbuf* buff)
 	return bitbuf_write_bit(buff, 1);
 }
 
+bool bitbuf_write_align(struct bitbuf* buff)
+{
+	size_t num = (buff->num + 7) & ~(size_t)7;
+	if (num > buff->size)
+		return false;
+	buff->num = num;
+	return true;
+}
+
 bool bitbuf_write_bit(struct bitbuf* buff, uint8_t value)
 {
 	if (!allow_opt(buff, 1))
@@ -196,7 +274,7 @@ bool bitbuf_write_bits(struct bitbuf* buff, const void* data, size_t bits_size)
 	}
 	else
 	{
-		appBitsCpy(buff->buffer, (int)buff->num, (const uint8_t*)data, 0, (int)bits_size);
+		appBitsCpyWide(buff->buffer, (int)buff->num, (const uint8_t*)data, 0, (int)bits_size);
 		buff->num += bits_size;
 	}
 	return true;
@@ -207,7 +285,7 @@ bool bitbuf_write_bytes(struct bitbuf* buff, const void* data, size_t size)
 	size_t bits_size = size * 8;
 	if (!allow_opt(buff, bits_size))
 		return false;
-	appBitsCpy(buff->buffer, (int)buff->num, (const uint8_t*)data, 0, (int)bits_size);
+	appBitsCpyWide(buff->buffer, (int)buff->num, (const uint8_t*)data, 0, (int)bits_size);
 	buff->num += bits_size;
 	return true;
 }
@@ -216,7 +294,7 @@ bool bitbuf_write_int(struct bitbuf* buff, uint32_t value, uint32_t value_max)
 {
 	assert(value_max >= 2);
 
-	const int32_t LengthBits = CeilLogTwo(value_max);
+	const int32_t LengthBits = bitbuf_ceil_log_two(value_max);
 	uint32_t WriteValue = value;
 
 	if (WriteValue >= value_max)
@@ -281,7 +359,7 @@ bool bitbuf_write_int_wrapped(struct bitbuf* buff, uint32_t value, uint32_t valu
 {
 	assert(value_max >= 2);
 
-	const int32_t LengthBits = CeilLogTwo(value_max);
+	const int32_t LengthBits = bitbuf_ceil_log_two(value_max);
 
 	if (!allow_opt(buff, LengthBits))
 		return false;
@@ -338,6 +416,15 @@ bool bitbuf_read_bit(struct bitbuf* buff, uint8_t* value)
 	return true;
 }
 
+bool bitbuf_read_align(struct bitbuf* buff)
+{
+	size_t num = (buff->num + 7) & ~(size_t)7;
+	if (num > buff->size)
+		return false;
+	buff->num = num;
+	return true;
+}
+
 bool bitbuf_read_bits(struct bitbuf* buff, void* buffer, size_t bits_size)
 {
 	if (!allow_opt(buff, bits_size))
@@ -353,7 +440,7 @@ bool bitbuf_read_bits(struct bitbuf* buff, void* buffer, size_t bits_size)
 	else if (bits_size != 0)
 	{
 		((uint8_t*)buffer)[((bits_size + 7) >> 3) - 1] = 0;
-		appBitsCpy((uint8_t*)buffer, 0, buff->buffer, (int32_t)buff->num, (int32_t)bits_size);
+		appBitsCpyWide((uint8_t*)buffer, 0, buff->buffer, (int32_t)buff->num, (int32_t)bits_size);
 		buff->num += bits_size;
 	}
 	return true;
@@ -22,6 +22,7 @@ size_t bitbuf_left_bytes(struct bitbuf* buff);
 bool bitbuf_write_init(struct bitbuf* buff, uint8_t* buffer, size_t size);
 void bitbuf_write_reuse(struct bitbuf* buff, uint8_t* buffer, size_t num_bits, size_t size);
 bool bitbuf_write_end(struct bitbuf* buff);
+bool bitbuf_write_align(struct bitbuf* buff); // Skips to the next byte boundary, the skipped bits stay zero
 bool bitbuf_write_bit(struct bitbuf* buff, uint8_t value);
 bool bitbuf_write_bits(struct bitbuf* buff, const void* data, size_t bits_size);
 bool bitbuf_write_bytes(struct bitbuf* buff, const void* data, size_t size);
@@ -31,9 +32,14 @@ bool bitbuf_write_int_wrapped(struct bitbuf* buff, uint32_t value, uint32_t valu
 bool bitbuf_write_int_byte_order(struct bitbuf* buff, uint32_t value);
 
 bool bitbuf_read_init(struct bitbuf* buff, const uint8_t* data, size_t len);
+bool bitbuf_read_align(struct bitbuf* buff);
 bool bitbuf_read_bit(struct bitbuf* buff, uint8_t* value);
 bool bitbuf_read_bits(struct bitbuf* buff, void* buffer, size_t bits_size);
 bool bitbuf_read_bytes(struct bitbuf* buff, void* buffer, size_t size);
 bool bitbuf_read_int(struct bitbuf* buff, uint32_t* value, uint32_t value_max);
 bool bitbuf_read_int_packed(struct bitbuf* buff, uint32_t* value);
 bool bitbuf_read_int_byte_order(struct bitbuf* buff, uint32_t* value);
+
+// Copies bits_size bits, the other bits of the touched dest bytes are kept. The reference is the byte at a time copier
+void bitbuf_copy_bits(uint8_t* dest, size_t dest_bit, const uint8_t* src, size_t src_bit, size_t bits_size);
+void bitbuf_copy_bits_reference(uint8_t* dest, size_t dest_bit, const uint8_t* src, size_t src_bit, size_t bits_size);
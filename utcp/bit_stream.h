@@ -0,0 +1,256 @@
+﻿// Copyright DPULL, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "bit_buffer.h"
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Bit stream over a bitbuf that keeps the bits in a 64 bit accumulator, for serializing headers field by field.
+// The writer spills 32 bit words and overwrites the bits it covers, the bits after the end are kept.
+// The reader refills up to 64 bits at a time. Each field costs one bounds check on the stream.
+// bitbuf_stream_*_end writes the position back to the bitbuf.
+
+struct bitbuf_stream
+{
+	uint8_t* buffer;
+	size_t size;
+	size_t num;
+	size_t byte_pos;
+	uint64_t accu;
+	uint32_t accu_bits;
+};
+
+// Same as CeilLogTwo in bit_buffer.c: the number of bits for values in [0, x)
+static inline uint32_t bitbuf_ceil_log_two(uint32_t x)
+{
+	if (x <= 1)
+		return 0;
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, x - 1);
+	return index + 1;
+#else
+	return 32 - __builtin_clz(x - 1);
+#endif
+}
+
+static inline uint64_t bitbuf_stream_load64(const uint8_t* src)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	uint64_t value = 0;
+	for (int i = 7; i >= 0; --i)
+		value = (value << 8) | src[i];
+	return value;
+#else
+	uint64_t value;
+	memcpy(&value, src, sizeof(value));
+	return value;
+#endif
+}
+
+static inline void bitbuf_stream_store32(uint8_t* dest, uint32_t value)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	dest[0] = (uint8_t)value;
+	dest[1] = (uint8_t)(value >> 8);
+	dest[2] = (uint8_t)(value >> 16);
+	dest[3] = (uint8_t)(value >> 24);
+#else
+	memcpy(dest, &value, sizeof(value));
+#endif
+}
+
+static inline void bitbuf_stream_write_begin(struct bitbuf_stream* stream, struct bitbuf* buff)
+{
+	stream->buffer = buff->buffer;
+	stream->size = buff->size;
+	stream->num = buff->num;
+	stream->byte_pos = buff->num >> 3;
+	stream->accu_bits = buff->num & 7;
+	stream->accu = stream->accu_bits ? buff->buffer[stream->byte_pos] & ((1u << stream->accu_bits) - 1) : 0;
+}
+
+// bits_size is at most 32
+static inline bool bitbuf_stream_write(struct bitbuf_stream* stream, uint32_t value, uint32_t bits_size)
+{
+	if (stream->num + bits_size > stream->size)
+		return false;
+
+	stream->accu |= ((uint64_t)value & ((1ull << bits_size) - 1)) << stream->accu_bits;
+	stream->accu_bits += bits_size;
+	stream->num += bits_size;
+	if (stream->accu_bits >= 32)
+	{
+		// All 32 bits are below num, so inside the buffer
+		bitbuf_stream_store32(stream->buffer + stream->byte_pos, (uint32_t)stream->accu);
+		stream->byte_pos += 4;
+		stream->accu >>= 32;
+		stream->accu_bits -= 32;
+	}
+	return true;
+}
+
+static inline void bitbuf_stream_write_end(struct bitbuf_stream* stream, struct bitbuf* buff)
+{
+	uint8_t* dest = stream->buffer + stream->byte_pos;
+	uint32_t bits = stream->accu_bits;
+	for (; bits >= 8; bits -= 8)
+	{
+		*dest++ = (uint8_t)stream->accu;
+		stream->accu >>= 8;
+	}
+	if (bits)
+	{
+		const uint8_t mask = (uint8_t)((1u << bits) - 1);
+		*dest = (uint8_t)((*dest & ~mask) | (stream->accu & mask));
+	}
+	buff->num = stream->num;
+}
+
+static inline bool bitbuf_stream_write_bit(struct bitbuf_stream* stream, uint8_t value)
+{
+	return bitbuf_stream_write(stream, value ? 1 : 0, 1);
+}
+
+// Same bits as bitbuf_write_int, including the shorter forms for values_max that are not a power of two
+static inline bool bitbuf_stream_write_int(struct bitbuf_stream* stream, uint32_t value, uint32_t value_max)
+{
+	if (value >= value_max)
+		return false;
+	if ((value_max & (value_max - 1)) == 0)
+		return bitbuf_stream_write(stream, value, bitbuf_ceil_log_two(value_max));
+
+	uint32_t NewValue = 0;
+	for (uint32_t Mask = 1; NewValue + Mask < value_max && Mask; Mask *= 2)
+	{
+		const uint32_t Bit = (value & Mask) ? 1 : 0;
+		if (!bitbuf_stream_write(stream, Bit, 1))
+			return false;
+		NewValue += Bit ? Mask : 0;
+	}
+	return true;
+}
+
+// Same bits as bitbuf_write_int_wrapped, for a power of two value_max
+static inline bool bitbuf_stream_write_int_wrapped(struct bitbuf_stream* stream, uint32_t value, uint32_t value_max)
+{
+	return bitbuf_stream_write(stream, value & (value_max - 1), bitbuf_ceil_log_two(value_max));
+}
+
+// FBitWriter::SerializeIntPacked
+static inline bool bitbuf_stream_write_int_packed(struct bitbuf_stream* stream, uint32_t value)
+{
+	do
+	{
+		const uint32_t Next = value >> 7;
+		if (!bitbuf_stream_write(stream, ((value & 0x7F) << 1) | (Next ? 1 : 0), 8))
+			return false;
+		value = Next;
+	} while (value);
+	return true;
+}
+
+static inline void bitbuf_stream_refill(struct bitbuf_stream* stream)
+{
+	const size_t byte_end = (stream->size + 7) >> 3;
+	if (stream->byte_pos + 8 <= byte_end)
+	{
+		// The bits above the whole bytes taken are loaded again by the next refill
+		stream->accu |= bitbuf_stream_load64(stream->buffer + stream->byte_pos) << stream->accu_bits;
+		const uint32_t bytes = (63 - stream->accu_bits) >> 3;
+		stream->byte_pos += bytes;
+		stream->accu_bits += bytes * 8;
+		return;
+	}
+
+	for (; stream->accu_bits <= 56 && stream->byte_pos < byte_end; stream->byte_pos++, stream->accu_bits += 8)
+	{
+		stream->accu |= (uint64_t)stream->buffer[stream->byte_pos] << stream->accu_bits;
+	}
+}
+
+static inline void bitbuf_stream_read_begin(struct bitbuf_stream* stream, struct bitbuf* buff)
+{
+	stream->buffer = buff->buffer;
+	stream->size = buff->size;
+	stream->num = buff->num;
+	stream->byte_pos = buff->num >> 3;
+	stream->accu = 0;
+	stream->accu_bits = 0;
+
+	const uint32_t skip = buff->num & 7;
+	if (skip && stream->num < stream->size)
+	{
+		bitbuf_stream_refill(stream);
+		stream->accu >>= skip;
+		stream->accu_bits -= skip;
+	}
+}
+
+// bits_size is at most 32
+static inline bool bitbuf_stream_read(struct bitbuf_stream* stream, uint32_t* value, uint32_t bits_size)
+{
+	if (stream->num + bits_size > stream->size)
+		return false;
+	if (stream->accu_bits < bits_size)
+		bitbuf_stream_refill(stream);
+
+	*value = (uint32_t)(stream->accu & ((1ull << bits_size) - 1));
+	stream->accu >>= bits_size;
+	stream->accu_bits -= bits_size;
+	stream->num += bits_size;
+	return true;
+}
+
+static inline void bitbuf_stream_read_end(struct bitbuf_stream* stream, struct bitbuf* buff)
+{
+	buff->num = stream->num;
+}
+
+static inline bool bitbuf_stream_read_bit(struct bitbuf_stream* stream, uint8_t* value)
+{
+	uint32_t Bit;
+	if (!bitbuf_stream_read(stream, &Bit, 1))
+		return false;
+	*value = (uint8_t)Bit;
+	return true;
+}
+
+// Same bits as bitbuf_read_int
+static inline bool bitbuf_stream_read_int(struct bitbuf_stream* stream, uint32_t* value, uint32_t value_max)
+{
+	if ((value_max & (value_max - 1)) == 0)
+		return bitbuf_stream_read(stream, value, bitbuf_ceil_log_two(value_max));
+
+	uint32_t Value = 0;
+	for (uint32_t Mask = 1; Value + Mask < value_max && Mask; Mask *= 2)
+	{
+		uint32_t Bit;
+		if (!bitbuf_stream_read(stream, &Bit, 1))
+			return false;
+		Value |= Bit ? Mask : 0;
+	}
+	*value = Value;
+	return true;
+}
+
+// FBitReader::SerializeIntPacked
+static inline bool bitbuf_stream_read_int_packed(struct bitbuf_stream* stream, uint32_t* value)
+{
+	uint32_t Value = 0;
+	for (uint32_t ShiftCount = 0; ShiftCount < 35; ShiftCount += 7)
+	{
+		uint32_t Byte;
+		if (!bitbuf_stream_read(stream, &Byte, 8))
+			return false;
+		Value |= (Byte >> 1) << ShiftCount;
+		if (!(Byte & 1))
+			break;
+	}
+	*value = Value;
+	return true;
+}
@@ -1,8 +1,19 @@
-﻿#include "3rd/WjCryptLib_Sha1.h"
-#include "utcp_utils.h"
-#include <assert.h>
+﻿#include "sha1.h"
 #include <string.h>
 
+// The multi-buffer SHA-1 runs the eight lanes of AVX2, compiled in on x86 and used when cpuid reports AVX2
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#include <immintrin.h>
+#define SHA1_MULTI_BUFFER
+#define SHA1_MULTI_BUFFER_TARGET __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <immintrin.h>
+#include <intrin.h>
+#define SHA1_MULTI_BUFFER
+#define SHA1_MULTI_BUFFER_TARGET
+#endif
+
 /**
  * Calculate the hash on a single block and return it
  *
@@ -35,6 +46,13 @@ static void hash_buffer(const void* Data, uint64_t DataSize, uint8_t* OutHash)
 
 // FSHA1::HMACBuffer
 void sha1_hmac_buffer(const void* Key, uint32_t KeySize, const void* Data, uint64_t DataSize, uint8_t* OutHash)
+{
+	struct sha1_hmac_key HmacKey;
+	sha1_hmac_key_init(&HmacKey, Key, KeySize);
+	sha1_hmac_key_buffer(&HmacKey, Data, DataSize, OutHash);
+}
+
+void sha1_hmac_key_init(struct sha1_hmac_key* HmacKey, const void* Key, uint32_t KeySize)
 {
 	enum
 	{
@@ -70,23 +88,329 @@ void sha1_hmac_buffer(const void* Key, uint32_t KeySize, const void* Data, uint6
 		IKeyPad[i] = 0x36 ^ FinalKey[i];
 	}
 
-	// Start concatenating/hashing the pads/data etc: Hash(OKeyPad + Hash(IKeyPad + Data))
-	//_countof(IKeyPad) + DataSize
-	uint8_t IKeyPad_Data[1024];
-	assert(_countof(IKeyPad_Data) >= _countof(IKeyPad) + DataSize);
+	// The pads are one block each, what is left of them is the hash state
+	Sha1Initialise(&HmacKey->Inner);
+	Sha1Update(&HmacKey->Inner, IKeyPad, BlockSize);
+	Sha1Initialise(&HmacKey->Outer);
+	Sha1Update(&HmacKey->Outer, OKeyPad, BlockSize);
+}
+
+// Hash(OKeyPad + Hash(IKeyPad + Data)), resumed after the pads
+void sha1_hmac_key_buffer(const struct sha1_hmac_key* HmacKey, const void* Data, uint64_t DataSize, uint8_t* OutHash)
+{
+	SHA1_HASH IKeyPad_Data_Hash;
+	Sha1Context sha1Context = HmacKey->Inner;
+	Sha1Update(&sha1Context, Data, (uint32_t)DataSize);
+	Sha1Finalise(&sha1Context, &IKeyPad_Data_Hash);
+
+	sha1Context = HmacKey->Outer;
+	Sha1Update(&sha1Context, IKeyPad_Data_Hash.bytes, sizeof(IKeyPad_Data_Hash.bytes));
+	Sha1Finalise(&sha1Context, (SHA1_HASH*)OutHash);
+}
+
+#ifdef SHA1_MULTI_BUFFER
+enum
+{
+	Lanes = 8,
+	// Longer data goes through sha1_hmac_key_buffer
+	MaxLaneBlocks = 4,
+	MaxLaneDataSize = MaxLaneBlocks * 64 - 9,
+};
+
+#define ROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+
+// One 512-bit block in each lane, Words[t] holds word t of the eight blocks
+SHA1_MULTI_BUFFER_TARGET static void transform_x8(__m256i State[5], __m256i Words[16])
+{
+	__m256i a = State[0];
+	__m256i b = State[1];
+	__m256i c = State[2];
+	__m256i d = State[3];
+	__m256i e = State[4];
+
+	for (int t = 0; t < 80; t++)
+	{
+		__m256i w;
+		if (t < 16)
+		{
+			w = Words[t];
+		}
+		else
+		{
+			w = _mm256_xor_si256(_mm256_xor_si256(Words[(t - 3) & 15], Words[(t - 8) & 15]), _mm256_xor_si256(Words[(t - 14) & 15], Words[t & 15]));
+			w = ROL(w, 1);
+			Words[t & 15] = w;
+		}
+
+		__m256i f;
+		uint32_t k;
+		if (t < 20)
+		{
+			f = _mm256_xor_si256(_mm256_and_si256(b, _mm256_xor_si256(c, d)), d);
+			k = 0x5A827999;
+		}
+		else if (t < 40)
+		{
+			f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+			k = 0x6ED9EBA1;
+		}
+		else if (t < 60)
+		{
+			f = _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)));
+			k = 0x8F1BBCDC;
+		}
+		else
+		{
+			f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+			k = 0xCA62C1D6;
+		}
+
+		__m256i temp = _mm256_add_epi32(_mm256_add_epi32(ROL(a, 5), f), _mm256_add_epi32(_mm256_add_epi32(e, w), _mm256_set1_epi32((int)k)));
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = temp;
+	}
+
+	State[0] = _mm256_add_epi32(State[0], a);
+	State[1] = _mm256_add_epi32(State[1], b);
+	State[2] = _mm256_add_epi32(State[2], c);
+	State[3] = _mm256_add_epi32(State[3], d);
+	State[4] = _mm256_add_epi32(State[4], e);
+}
 
-	memcpy(IKeyPad_Data, IKeyPad, _countof(IKeyPad));
-	memcpy(IKeyPad_Data + _countof(IKeyPad), Data, DataSize);
+// Words[t] = big endian word t of the eight 64 byte rows, an 8x8 transpose per half block
+SHA1_MULTI_BUFFER_TARGET static void load_words_x8(const uint8_t Rows[Lanes][64], __m256i Words[16])
+{
+	const __m256i Swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	for (int Half = 0; Half < 2; Half++)
+	{
+		__m256i r[Lanes];
+		for (int i = 0; i < Lanes; i++)
+			r[i] = _mm256_loadu_si256((const __m256i*)(Rows[i] + Half * 32));
 
-	uint8_t IKeyPad_Data_Hash[HashSize];
+		__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+		__m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+		__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+		__m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+		__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+		__m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+		__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+		__m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
 
-	hash_buffer(IKeyPad_Data, _countof(IKeyPad) + DataSize, IKeyPad_Data_Hash);
+		__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+		__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+		__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+		__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+		__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+		__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+		__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+		__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
 
-	uint8_t OKeyPad_IHash[_countof(OKeyPad) + HashSize];
+		__m256i* w = Words + Half * 8;
+		w[0] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u0, u4, 0x20), Swap);
+		w[1] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u1, u5, 0x20), Swap);
+		w[2] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u2, u6, 0x20), Swap);
+		w[3] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u3, u7, 0x20), Swap);
+		w[4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u0, u4, 0x31), Swap);
+		w[5] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u1, u5, 0x31), Swap);
+		w[6] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u2, u6, 0x31), Swap);
+		w[7] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u3, u7, 0x31), Swap);
+	}
+}
 
-	memcpy(OKeyPad_IHash, OKeyPad, _countof(OKeyPad));
-	memcpy(OKeyPad_IHash + _countof(OKeyPad), IKeyPad_Data_Hash, HashSize);
+static void write_be32(uint8_t* Out, uint32_t Value)
+{
+	Out[0] = (uint8_t)(Value >> 24);
+	Out[1] = (uint8_t)(Value >> 16);
+	Out[2] = (uint8_t)(Value >> 8);
+	Out[3] = (uint8_t)Value;
+}
+
+// Up to eight jobs whose data fits MaxLaneDataSize, the idle lanes hash nothing
+SHA1_MULTI_BUFFER_TARGET static void hmac_x8(const struct sha1_hmac_job* Jobs, int Count)
+{
+	uint8_t Blocks[MaxLaneBlocks][Lanes][64];
+	uint32_t InnerState[5][Lanes];
+	uint32_t OuterState[5][Lanes];
+	int32_t LaneBlocks[Lanes];
+	int32_t MaxBlocks = 0;
 
-	// Output the final hash
-	hash_buffer(OKeyPad_IHash, _countof(OKeyPad_IHash), OutHash);
+	for (int Lane = 0; Lane < Lanes; Lane++)
+	{
+		if (Lane >= Count)
+		{
+			LaneBlocks[Lane] = 0;
+			for (int i = 0; i < 5; i++)
+				InnerState[i][Lane] = OuterState[i][Lane] = 0;
+			continue;
+		}
+
+		// The data after the inner pad block, then the usual padding for 64 + DataSize bytes
+		const struct sha1_hmac_job* Job = &Jobs[Lane];
+		const uint32_t Size = Job->DataSize;
+		const int32_t NumBlocks = (int32_t)(Size + 9 + 63) / 64;
+		const uint64_t Bits = (uint64_t)(64 + Size) * 8;
+		for (int32_t i = 0; i < NumBlocks; i++)
+		{
+			uint32_t Offset = i * 64;
+			uint32_t Copy = Offset < Size ? Size - Offset : 0;
+			Copy = Copy > 64 ? 64 : Copy;
+			memcpy(Blocks[i][Lane], (const uint8_t*)Job->Data + Offset, Copy);
+			memset(Blocks[i][Lane] + Copy, 0, 64 - Copy);
+		}
+		Blocks[Size / 64][Lane][Size % 64] = 0x80;
+		uint8_t* Length = Blocks[NumBlocks - 1][Lane] + 56;
+		write_be32(Length, (uint32_t)(Bits >> 32));
+		write_be32(Length + 4, (uint32_t)Bits);
+
+		LaneBlocks[Lane] = NumBlocks;
+		MaxBlocks = NumBlocks > MaxBlocks ? NumBlocks : MaxBlocks;
+		for (int i = 0; i < 5; i++)
+		{
+			InnerState[i][Lane] = Job->Key->Inner.State[i];
+			OuterState[i][Lane] = Job->Key->Outer.State[i];
+		}
+	}
+
+	// What the idle lanes read is thrown away, zeros all the same
+	for (int Lane = 0; Lane < Lanes; Lane++)
+	{
+		for (int32_t i = LaneBlocks[Lane]; i < MaxBlocks; i++)
+			memset(Blocks[i][Lane], 0, 64);
+	}
+
+	__m256i State[5];
+	for (int i = 0; i < 5; i++)
+		State[i] = _mm256_loadu_si256((const __m256i*)InnerState[i]);
+
+	const __m256i LaneBlocksVec = _mm256_loadu_si256((const __m256i*)LaneBlocks);
+	__m256i Words[16];
+	for (int32_t Block = 0; Block < MaxBlocks; Block++)
+	{
+		// The lanes whose data ended keep their state
+		const __m256i Active = _mm256_cmpgt_epi32(LaneBlocksVec, _mm256_set1_epi32(Block));
+		__m256i Next[5];
+		memcpy(Next, State, sizeof(Next));
+		load_words_x8(Blocks[Block], Words);
+		transform_x8(Next, Words);
+		for (int i = 0; i < 5; i++)
+			State[i] = _mm256_blendv_epi8(State[i], Next[i], Active);
+	}
+
+	// The outer block is the inner hash and the padding for 64 + 20 bytes, already in words
+	for (int i = 0; i < 5; i++)
+	{
+		Words[i] = State[i];
+		State[i] = _mm256_loadu_si256((const __m256i*)OuterState[i]);
+	}
+	Words[5] = _mm256_set1_epi32((int)0x80000000);
+	for (int i = 6; i < 15; i++)
+		Words[i] = _mm256_setzero_si256();
+	Words[15] = _mm256_set1_epi32((64 + 20) * 8);
+	transform_x8(State, Words);
+
+	uint32_t Hash[5][Lanes];
+	for (int i = 0; i < 5; i++)
+		_mm256_storeu_si256((__m256i*)Hash[i], State[i]);
+	for (int Lane = 0; Lane < Count; Lane++)
+	{
+		for (int i = 0; i < 5; i++)
+			write_be32(Jobs[Lane].OutHash + i * 4, Hash[i][Lane]);
+	}
+}
+
+static bool has_avx2(void)
+{
+	// AVX2: leaf 7 ebx bit 5. The OS must save the ymm registers: OSXSAVE (leaf 1 ecx bit 27) and XCR0 bits 1 and 2
+#if defined(_MSC_VER)
+	int regs[4];
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return false;
+	__cpuid(regs, 1);
+	if (!(regs[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 27)))
+		return false;
+	uint32_t xcr0_lo, xcr0_hi;
+	__asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+	if ((xcr0_lo & 6) != 6)
+		return false;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ebx & (1u << 5)) != 0;
+#endif
+}
+
+// -1 until the first call checks the CPU. Every thread that hashes reads it, so it is only accessed atomically
+static int multi_buffer = -1;
+
+#if defined(_MSC_VER)
+#define load_multi_buffer() ((int)_InterlockedCompareExchange((volatile long*)&multi_buffer, 0, 0))
+#define store_multi_buffer(value) _InterlockedExchange((volatile long*)&multi_buffer, (long)(value))
+#else
+#define load_multi_buffer() __atomic_load_n(&multi_buffer, __ATOMIC_RELAXED)
+#define store_multi_buffer(value) __atomic_store_n(&multi_buffer, (value), __ATOMIC_RELAXED)
+#endif
+#endif
+
+bool sha1_use_multi_buffer(bool Enable)
+{
+#ifdef SHA1_MULTI_BUFFER
+	const int value = Enable && has_avx2();
+	store_multi_buffer(value);
+	return value;
+#else
+	(void)Enable;
+	return false;
+#endif
+}
+
+void sha1_select(void)
+{
+	Sha1SelectTransform();
+#ifdef SHA1_MULTI_BUFFER
+	if (load_multi_buffer() < 0)
+		sha1_use_multi_buffer(true);
+#endif
+}
+
+void sha1_hmac_key_buffers(const struct sha1_hmac_job* Jobs, int Count)
+{
+	int i = 0;
+#ifdef SHA1_MULTI_BUFFER
+	int use_multi_buffer = load_multi_buffer();
+	if (use_multi_buffer < 0)
+	{
+		sha1_select();
+		use_multi_buffer = load_multi_buffer();
+	}
+
+	// Runs of jobs that fit a lane, the others one by one
+	while (use_multi_buffer && i < Count)
+	{
+		int Run = 0;
+		while (Run < Lanes && i + Run < Count && Jobs[i + Run].DataSize <= MaxLaneDataSize)
+			Run++;
+
+		if (Run > 1)
+		{
+			hmac_x8(Jobs + i, Run);
+			i += Run;
+		}
+		else
+		{
+			sha1_hmac_key_buffer(Jobs[i].Key, Jobs[i].Data, Jobs[i].DataSize, Jobs[i].OutHash);
+			i++;
+		}
+	}
+#endif
+	for (; i < Count; i++)
+		sha1_hmac_key_buffer(Jobs[i].Key, Jobs[i].Data, Jobs[i].DataSize, Jobs[i].OutHash);
 }
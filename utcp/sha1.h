@@ -0,0 +1,34 @@
+﻿// Copyright DPULL, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "3rd/WjCryptLib_Sha1.h"
+#include <stdbool.h>
+
+// The HMAC key pads hashed ahead of time. Each HMAC then hashes only the data and the inner hash
+struct sha1_hmac_key
+{
+	Sha1Context Inner;
+	Sha1Context Outer;
+};
+
+void sha1_hmac_buffer(const void* Key, uint32_t KeySize, const void* Data, uint64_t DataSize, uint8_t* OutHash);
+void sha1_hmac_key_init(struct sha1_hmac_key* HmacKey, const void* Key, uint32_t KeySize);
+void sha1_hmac_key_buffer(const struct sha1_hmac_key* HmacKey, const void* Data, uint64_t DataSize, uint8_t* OutHash);
+
+// One HMAC of sha1_hmac_key_buffers
+struct sha1_hmac_job
+{
+	const struct sha1_hmac_key* Key;
+	const void* Data;
+	uint32_t DataSize;
+	uint8_t* OutHash;
+};
+
+// sha1_hmac_key_buffer for each job. Eight jobs at a time go through one multi-buffer SHA-1 when the CPU has AVX2
+void sha1_hmac_key_buffers(const struct sha1_hmac_job* Jobs, int Count);
+// Returns whether sha1_hmac_key_buffers uses the multi-buffer SHA-1, which is the default where the CPU has AVX2
+bool sha1_use_multi_buffer(bool Enable);
+// Picks the SHA-1 code for the CPU where it has not been chosen yet, otherwise the first hash does it.
+// utcp_listener_init calls it, so a listener created before the worker threads start resolves it for all of them
+void sha1_select(void);
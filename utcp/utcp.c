@@ -1,6 +1,9 @@
 ﻿#include "utcp.h"
 #include "bit_buffer.h"
+#include "utcp_address.h"
+#include "utcp_bunch.h"
 #include "utcp_channel.h"
+#include "utcp_compress.h"
 #include "utcp_handshake.h"
 #include "utcp_packet.h"
 #include "utcp_packet_notify.h"
@@ -13,14 +16,40 @@
 
 static struct utcp_config utcp_config = {0};
 
+#if defined(_MSC_VER)
+static __declspec(thread) struct utcp_send_batch* utcp_send_batch = NULL;
+#else
+static _Thread_local struct utcp_send_batch* utcp_send_batch = NULL;
+#endif
+
 struct utcp_config* utcp_get_config()
 {
 	return &utcp_config;
 }
 
+void utcp_set_send_batch(struct utcp_send_batch* batch)
+{
+	utcp_send_batch = batch;
+}
+
+struct utcp_send_batch* utcp_get_send_batch()
+{
+	return utcp_send_batch;
+}
+
 void utcp_add_elapsed_time(int64_t delta_time_ns)
 {
-	utcp_config.ElapsedTime += (delta_time_ns / 1000);
+	// Listener workers read the clock on their own threads
+#if defined(_MSC_VER)
+	_InterlockedExchangeAdd64(&utcp_config.ElapsedTime, delta_time_ns / 1000);
+#else
+	__atomic_fetch_add(&utcp_config.ElapsedTime, delta_time_ns / 1000, __ATOMIC_RELAXED);
+#endif
+}
+
+void utcp_set_compress_dictionary(const uint8_t* dict, int dict_len)
+{
+	utcp_compress_set_dictionary(dict, dict_len);
 }
 
 struct utcp_listener* utcp_listener_create()
@@ -32,6 +61,8 @@ void utcp_listener_destroy(struct utcp_listener* fd)
 {
 	if (fd)
 	{
+		utcp_listener_set_pending_accepts(fd, 0);
+		utcp_listener_set_limits(fd, NULL);
 		utcp_realloc(fd, 0);
 	}
 }
@@ -42,6 +73,7 @@ void utcp_listener_init(struct utcp_listener* fd, void* userdata)
 	fd->userdata = userdata;
 	fd->ActiveSecret = 255;
 
+	sha1_select();
 	utcp_listener_update_secret(fd, NULL);
 }
 
@@ -60,6 +92,7 @@ void utcp_listener_update_secret(struct utcp_listener* fd, uint8_t special_secre
 		{
 			CurArray[i] = utcp_rand() % 255;
 		}
+		sha1_hmac_key_init(&fd->HandshakeKeys[1], CurArray, SECRET_BYTE_SIZE);
 
 		fd->ActiveSecret = 0;
 	}
@@ -80,26 +113,110 @@ void utcp_listener_update_secret(struct utcp_listener* fd, uint8_t special_secre
 			CurArray[i] = utcp_rand() % 255;
 		}
 	}
+	sha1_hmac_key_init(&fd->HandshakeKeys[fd->ActiveSecret], CurArray, SECRET_BYTE_SIZE);
+}
+
+void utcp_listener_copy_secret(struct utcp_listener* fd, const struct utcp_listener* source)
+{
+	memcpy(fd->HandshakeSecret, source->HandshakeSecret, sizeof(fd->HandshakeSecret));
+	memcpy(fd->HandshakeKeys, source->HandshakeKeys, sizeof(fd->HandshakeKeys));
+	fd->ActiveSecret = source->ActiveSecret;
+	fd->LastSecretUpdateTimestamp = source->LastSecretUpdateTimestamp;
 }
 
 int utcp_listener_incoming(struct utcp_listener* fd, const char* address, const uint8_t* buffer, int len)
 {
 	utcp_dump("listener", "incoming", buffer, len);
-	return process_connectionless_packet(fd, address, buffer, len);
+	struct utcp_address key;
+	utcp_address_from_string(&key, address);
+	return process_connectionless_packet(fd, &key, buffer, len);
 }
 
-void utcp_listener_accept(struct utcp_listener* listener, struct utcp_connection* conn, bool reconnect)
+int utcp_listener_incoming_addr(struct utcp_listener* fd, const struct sockaddr* addr, int addr_len, const uint8_t* buffer, int len)
+{
+	utcp_dump("listener", "incoming", buffer, len);
+	struct utcp_address key;
+	if (!utcp_address_from_sockaddr(&key, addr, addr_len))
+	{
+		fd->Stats.Dropped++;
+		return -9;
+	}
+	return process_connectionless_packet(fd, &key, buffer, len);
+}
+
+void utcp_listener_incoming_batch(struct utcp_listener* fd, struct utcp_listener_datagram* datagrams, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		utcp_dump("listener", "incoming", datagrams[i].Buffer, datagrams[i].Len);
+	}
+	process_connectionless_batch(fd, datagrams, count);
+}
+
+static void accept_connection(struct utcp_connection* conn, const uint8_t* AuthorisedCookie, int32_t ClientSequence, int32_t ServerSequence, uint8_t Features,
+							  bool reconnect)
 {
 	conn->LastReceiveRealtime = utcp_gettime_ms();
 	conn->LastSendTime = utcp_gettime_ms();
 	if (!reconnect)
 	{
 		assert(conn->challenge_data == NULL);
-		memcpy(conn->AuthorisedCookie, listener->AuthorisedCookie, sizeof(conn->AuthorisedCookie));
-		utcp_sequence_init(conn, listener->LastClientSequence, listener->LastServerSequence);
+		memcpy(conn->AuthorisedCookie, AuthorisedCookie, sizeof(conn->AuthorisedCookie));
+		utcp_sequence_init(conn, ClientSequence, ServerSequence);
+		conn->Features = Features;
 	}
 }
 
+void utcp_listener_accept(struct utcp_listener* listener, struct utcp_connection* conn, bool reconnect)
+{
+	accept_connection(conn, listener->AuthorisedCookie, listener->LastClientSequence, listener->LastServerSequence, listener->LastFeatures, reconnect);
+}
+
+bool utcp_listener_set_pending_accepts(struct utcp_listener* fd, int capacity)
+{
+	return resize_pending_accepts(fd, capacity);
+}
+
+int utcp_listener_take_accepts(struct utcp_listener* fd, struct utcp_accept_info* accepts, int max)
+{
+	return take_pending_accepts(fd, accepts, max);
+}
+
+void utcp_listener_accept_pending(struct utcp_connection* conn, const struct utcp_accept_info* accept)
+{
+	accept_connection(conn, accept->AuthorisedCookie, accept->ClientSequence, accept->ServerSequence, accept->Features, accept->bRestartedHandshake);
+}
+
+bool utcp_listener_set_limits(struct utcp_listener* fd, const struct utcp_listener_limits* limits)
+{
+	double* PrefixBuckets = NULL;
+	if (limits && limits->PrefixRate > 0)
+	{
+		if (limits->PrefixBuckets <= 0)
+			return false;
+		PrefixBuckets = (double*)utcp_realloc(NULL, limits->PrefixBuckets * sizeof(double));
+		if (!PrefixBuckets)
+			return false;
+		memset(PrefixBuckets, 0, limits->PrefixBuckets * sizeof(double));
+	}
+
+	if (fd->PrefixBuckets)
+		utcp_realloc(fd->PrefixBuckets, 0);
+	fd->PrefixBuckets = PrefixBuckets;
+	fd->PrefixSeed = ((uint32_t)utcp_rand() << 16) ^ (uint32_t)utcp_rand();
+	fd->ChallengeBucket = 0;
+	if (limits)
+		fd->Limits = *limits;
+	else
+		memset(&fd->Limits, 0, sizeof(fd->Limits));
+	return true;
+}
+
+void utcp_listener_get_stats(const struct utcp_listener* fd, struct utcp_listener_stats* stats)
+{
+	*stats = fd->Stats;
+}
+
 struct utcp_connection* utcp_connection_create()
 {
 	return (struct utcp_connection*)utcp_realloc(NULL, sizeof(struct utcp_connection));
@@ -123,6 +240,7 @@ void utcp_uninit(struct utcp_connection* fd)
 {
 	utcp_mark_close(fd, Cleanup);
 	utcp_channels_uninit(&fd->channels);
+	FreePacketOrderCache(fd);
 	if (fd->challenge_data)
 	{
 		utcp_realloc(fd->challenge_data, 0);
@@ -185,6 +303,11 @@ int utcp_update(struct utcp_connection* fd)
 		handshake_update(fd);
 	}
 
+	// Missing packets that did not arrive in time are given up
+	struct utcp_packet_order_cache* PacketOrderCache = fd->PacketOrderCache;
+	if (!fd->bClose && PacketOrderCache && PacketOrderCache->Count > 0 && utcp_gettime_ms() - PacketOrderCache->WaitStart > PACKET_ORDER_CACHE_TIMEOUT)
+		FlushPacketOrderCache(fd, true);
+
 	utcp_delay_close_channel(&fd->channels);
 
 	if (!fd->bClose)
@@ -194,7 +317,9 @@ int utcp_update(struct utcp_connection* fd)
 	return -1;
 }
 
-int32_t utcp_peep_packet_id(struct utcp_connection* fd, uint8_t* buffer, int len)
+_Static_assert(sizeof(struct packet_header) <= sizeof(((struct utcp_peeked_packet*)0)->PacketHeader), "utcp_peeked_packet::PacketHeader too small");
+
+int32_t utcp_peep_packet(struct utcp_connection* fd, const uint8_t* buffer, int len, struct utcp_peeked_packet* peeked)
 {
 	struct bitbuf bitbuf;
 	if (!bitbuf_read_init(&bitbuf, buffer, len))
@@ -205,7 +330,49 @@ int32_t utcp_peep_packet_id(struct utcp_connection* fd, uint8_t* buffer, int len
 		return -2;
 	if (bHandshakePacket)
 		return 0;
-	return PeekPacketId(fd, &bitbuf);
+
+	// The end bit is dropped before the packet header, as in utcp_incoming
+	if (bitbuf_left_bits(&bitbuf) == 0)
+		return -3;
+	bitbuf.size--;
+
+	struct packet_header packet_header;
+	int32_t packet_id = PeekPacketId(fd, &bitbuf, &packet_header);
+	if (packet_id > 0 && peeked)
+	{
+		peeked->PacketId = packet_id;
+		peeked->SizeBits = (uint32_t)bitbuf.size;
+		peeked->HeaderEndBits = (uint32_t)bitbuf.num;
+		peeked->SessionID = SessionID;
+		peeked->ClientID = ClientID;
+		memcpy(peeked->PacketHeader, &packet_header, sizeof(packet_header));
+	}
+	return packet_id;
+}
+
+int32_t utcp_peep_packet_id(struct utcp_connection* fd, uint8_t* buffer, int len)
+{
+	return utcp_peep_packet(fd, buffer, len, NULL);
+}
+
+bool utcp_incoming_peeked(struct utcp_connection* fd, uint8_t* buffer, int len, const struct utcp_peeked_packet* peeked)
+{
+	utcp_dump(fd->debug_name, "incoming", buffer, len);
+	assert(peeked->SizeBits < (uint64_t)len * 8);
+	assert(peeked->HeaderEndBits <= peeked->SizeBits);
+
+	// What handshake_incoming does with a data packet
+	fd->LastSessionID = peeked->SessionID;
+	fd->LastClientID = peeked->ClientID;
+	fd->LastReceiveRealtime = utcp_gettime_ms();
+
+	struct packet_header packet_header;
+	memcpy(&packet_header, peeked->PacketHeader, sizeof(packet_header));
+
+	struct bitbuf bitbuf = {buffer, peeked->SizeBits, peeked->HeaderEndBits};
+	if (!ReceivedPacketAfterHeader(fd, &bitbuf, &packet_header))
+		return false;
+	return bitbuf_left_bits(&bitbuf) == 0;
 }
 
 int32_t utcp_expect_packet_id(struct utcp_connection* fd)
@@ -213,9 +380,74 @@ int32_t utcp_expect_packet_id(struct utcp_connection* fd)
 	return fd->InPacketId + 1;
 }
 
-int32_t utcp_send_bunch(struct utcp_connection* fd, struct utcp_bunch* bunch)
+void utcp_set_packet_order_cache(struct utcp_connection* fd, bool enable)
 {
-	int32_t packet_id = SendRawBunch(fd, bunch);
+	if (enable && !fd->PacketOrderCache)
+	{
+		fd->PacketOrderCache = (struct utcp_packet_order_cache*)utcp_realloc(NULL, sizeof(*fd->PacketOrderCache));
+		memset(fd->PacketOrderCache, 0, sizeof(*fd->PacketOrderCache));
+	}
+	else if (!enable && fd->PacketOrderCache)
+	{
+		FlushPacketOrderCache(fd, true);
+		FreePacketOrderCache(fd);
+	}
+}
+
+void utcp_flush_packet_order_cache(struct utcp_connection* fd)
+{
+	FlushPacketOrderCache(fd, true);
+}
+
+void utcp_bunch_view_read(const struct utcp_bunch_view* view, uint8_t* dst)
+{
+	const uint32_t DataBitsLen = view->DataBitsLen;
+	if (DataBitsLen & 7)
+		dst[DataBitsLen >> 3] = 0;
+	bitbuf_copy_bits(dst, 0, view->Data, view->DataBitOffset, DataBitsLen);
+}
+
+void utcp_bunch_view_split(const struct utcp_bunch_view* view, struct utcp_bunch* bunches)
+{
+	const int32_t Count = view->PartialCount;
+	const struct utcp_bunch* Header = view->Bunch;
+	assert(Header->bPartial && Count > 0);
+
+	// The header is the one of the last bunch, the sequences and flags of the others follow from it
+	uint32_t DataBitOffset = view->DataBitOffset;
+	for (int32_t i = 0; i < Count; ++i)
+	{
+		struct utcp_bunch* utcp_bunch = &bunches[i];
+		memcpy(utcp_bunch, Header, offsetof(struct utcp_bunch, Data));
+		utcp_bunch->ChSequence = Header->bReliable ? Header->ChSequence - (Count - 1 - i) : Header->ChSequence;
+		utcp_bunch->bOpen = Header->bOpen && i == 0;
+		utcp_bunch->bClose = Header->bClose && i == Count - 1;
+		utcp_bunch->CloseReason = utcp_bunch->bClose ? Header->CloseReason : 0;
+		utcp_bunch->bPartialInitial = i == 0;
+		utcp_bunch->bPartialFinal = i == Count - 1;
+		utcp_bunch->DataBitsLen = view->PartialBitsLen[i];
+
+		struct utcp_bunch_view part = {utcp_bunch, view->Data, DataBitOffset, utcp_bunch->DataBitsLen, NULL, 0};
+		utcp_bunch_view_read(&part, utcp_bunch->Data);
+		DataBitOffset += utcp_bunch->DataBitsLen;
+	}
+}
+
+// Both are made of UTCP_BUNCH_HEADER_FIELDS, the bitfields included. What send_bunch_iov copies between them is checked here as well
+#define ASSERT_BUNCH_HEADER_FIELD(Field) \
+	_Static_assert(offsetof(struct utcp_bunch_header, Field) == offsetof(struct utcp_bunch, Field), "utcp_bunch_header::" #Field " must match utcp_bunch")
+ASSERT_BUNCH_HEADER_FIELD(ChSequence);
+ASSERT_BUNCH_HEADER_FIELD(PacketId);
+ASSERT_BUNCH_HEADER_FIELD(NameIndex);
+ASSERT_BUNCH_HEADER_FIELD(ChIndex);
+ASSERT_BUNCH_HEADER_FIELD(DataBitsLen);
+#undef ASSERT_BUNCH_HEADER_FIELD
+_Static_assert(sizeof(struct utcp_bunch_header) >= offsetof(struct utcp_bunch, Data), "utcp_bunch_header must hold the header fields of utcp_bunch");
+_Static_assert(offsetof(struct utcp_bunch, Data) == offsetof(struct utcp_bunch, DataBitsLen) + sizeof(uint16_t) + 2, "the bitfields of utcp_bunch take two bytes");
+
+static int32_t send_bunch(struct utcp_connection* fd, struct utcp_bunch* bunch, const struct utcp_iov* iov, int iovcnt, bool merge)
+{
+	int32_t packet_id = SendRawBunch(fd, bunch, iov, iovcnt, merge);
 	if (packet_id >= 0)
 	{
 		utcp_log(Verbose, "[%s]send bunch, bOpen=%d, bClose=%d, NameIndex=%d, ChIndex=%d, NumBits=%d, PacketId=%d", fd->debug_name, bunch->bOpen, bunch->bClose, bunch->NameIndex,
@@ -223,7 +455,119 @@ int32_t utcp_send_bunch(struct utcp_connection* fd, struct utcp_bunch* bunch)
 		return packet_id;
 	}
 
-	utcp_log(Warning, "[%s]send bunch failed:%d", packet_id);
+	utcp_log(Warning, "[%s]send bunch failed:%d", fd->debug_name, packet_id);
+	return PACKET_ID_INDEX_NONE;
+}
+
+static int32_t send_bunch_iov(struct utcp_connection* fd, struct utcp_bunch_header* header, const struct utcp_iov* iov, int iovcnt, bool merge)
+{
+	uint32_t DataBitsLen = 0;
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		DataBitsLen += iov[i].DataBitsLen;
+	}
+	if (DataBitsLen > UTCP_MAX_PACKET * 8)
+	{
+		utcp_log(Warning, "[%s]send bunch failed, %u bits do not fit in a packet", fd->debug_name, DataBitsLen);
+		return PACKET_ID_INDEX_NONE;
+	}
+
+	// Only the header fields are copied, the Data of the bunch is never touched
+	struct utcp_bunch bunch;
+	memcpy(&bunch, header, offsetof(struct utcp_bunch, Data));
+	bunch.DataBitsLen = (uint16_t)DataBitsLen;
+	int32_t packet_id = send_bunch(fd, &bunch, iov, iovcnt, merge);
+	memcpy(header, &bunch, offsetof(struct utcp_bunch, Data));
+	return packet_id;
+}
+
+int32_t utcp_send_bunch(struct utcp_connection* fd, struct utcp_bunch* bunch)
+{
+	struct utcp_iov iov = {bunch->Data, bunch->DataBitsLen};
+	return send_bunch(fd, bunch, &iov, 1, false);
+}
+
+int32_t utcp_send_bunch_merge(struct utcp_connection* fd, struct utcp_bunch* bunch)
+{
+	struct utcp_iov iov = {bunch->Data, bunch->DataBitsLen};
+	return send_bunch(fd, bunch, &iov, 1, true);
+}
+
+int32_t utcp_send_bunch_data(struct utcp_connection* fd, struct utcp_bunch* bunch, const uint8_t* data)
+{
+	struct utcp_iov iov = {data, bunch->DataBitsLen};
+	return send_bunch(fd, bunch, &iov, 1, false);
+}
+
+int32_t utcp_send_bunch_iov(struct utcp_connection* fd, struct utcp_bunch_header* header, const struct utcp_iov* iov, int iovcnt)
+{
+	return send_bunch_iov(fd, header, iov, iovcnt, false);
+}
+
+int32_t utcp_send_bunch_iov_merge(struct utcp_connection* fd, struct utcp_bunch_header* header, const struct utcp_iov* iov, int iovcnt)
+{
+	return send_bunch_iov(fd, header, iov, iovcnt, true);
+}
+
+struct utcp_shared_bunch* utcp_shared_bunch_create(const struct utcp_bunch_header* header, const struct utcp_iov* iov, int iovcnt)
+{
+	uint32_t DataBitsLen = 0;
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		DataBitsLen += iov[i].DataBitsLen;
+	}
+	if (DataBitsLen > UTCP_MAX_PACKET * 8)
+	{
+		utcp_log(Warning, "shared bunch failed, %u bits do not fit in a packet", DataBitsLen);
+		return NULL;
+	}
+
+	struct utcp_bunch bunch;
+	memcpy(&bunch, header, offsetof(struct utcp_bunch, Data));
+	bunch.ChSequence = 0;
+	bunch.PacketId = 0;
+	bunch.DataBitsLen = (uint16_t)DataBitsLen;
+
+	const size_t DataBytes = (DataBitsLen + 7) / 8;
+	struct utcp_shared_bunch* shared = (struct utcp_shared_bunch*)utcp_realloc(NULL, sizeof(*shared) + DataBytes);
+	shared->RefCount = 1;
+	memcpy(&shared->Header, &bunch, offsetof(struct utcp_bunch, Data));
+
+	struct bitbuf bitbuf;
+	size_t ChSequencePos = 0;
+	bitbuf_write_init(&bitbuf, shared->HeaderBits, sizeof(shared->HeaderBits));
+	if (!utcp_bunch_write_header_pos(&bunch, &bitbuf, &ChSequencePos))
+	{
+		assert(false);
+		utcp_realloc(shared, 0);
+		return NULL;
+	}
+	shared->HeaderBitsNum = (uint16_t)bitbuf.num;
+	shared->ChSequencePos = (uint16_t)ChSequencePos;
+
+	// The fragments are gathered once, every connection copies the data from here
+	bitbuf_write_init(&bitbuf, shared->Data, DataBytes);
+	for (int i = 0; i < iovcnt; ++i)
+	{
+		bitbuf_write_bits(&bitbuf, iov[i].Data, iov[i].DataBitsLen);
+	}
+	return shared;
+}
+
+void utcp_shared_bunch_release(struct utcp_shared_bunch* shared)
+{
+	release_shared_bunch(shared);
+}
+
+int32_t utcp_send_shared_bunch(struct utcp_connection* fd, struct utcp_shared_bunch* shared)
+{
+	struct utcp_bunch bunch;
+	memcpy(&bunch, &shared->Header, offsetof(struct utcp_bunch, Data));
+	int32_t packet_id = SendSharedBunch(fd, &bunch, shared);
+	if (packet_id >= 0)
+		return packet_id;
+
+	utcp_log(Warning, "[%s]send shared bunch failed:%d", fd->debug_name, packet_id);
 	return PACKET_ID_INDEX_NONE;
 }
 
@@ -240,6 +584,9 @@ int utcp_send_flush(struct utcp_connection* fd)
 	if (fd->SendBufferBitsNum == 0)
 		WriteBitsToSendBuffer(fd, NULL, 0);
 
+	if (fd->Features & UTCP_FEATURE_COMPRESSION)
+		CompressSendBuffer(fd);
+
 	struct bitbuf bitbuf;
 	bitbuf_write_reuse(&bitbuf, fd->SendBuffer, fd->SendBufferBitsNum, sizeof(fd->SendBuffer));
 
@@ -253,8 +600,15 @@ int utcp_send_flush(struct utcp_connection* fd)
 	bitbuf_write_end(&bitbuf);
 	utcp_raw_send(fd, bitbuf.buffer, bitbuf_num_bytes(&bitbuf));
 
+	if (fd->MergedHeaderBits > 0)
+	{
+		utcp_log(Verbose, "[%s]packet %d merged bunches, saved %u header bits", fd->debug_name, fd->OutPacketId, fd->MergedHeaderBits);
+		fd->MergedHeaderBits = 0;
+	}
+
 	memset(fd->SendBuffer, 0, sizeof(fd->SendBuffer));
 	fd->SendBufferBitsNum = 0;
+	fd->LastEnd = 0;
 
 	packet_notify_commit_and_inc_outseq(&fd->packet_notify);
 	fd->LastSendTime = now;
@@ -268,6 +622,18 @@ bool utcp_send_would_block(struct utcp_connection* fd, int count)
 	return fd->OutPacketId - fd->OutAckPacketId + count >= (MaxSequenceHistoryLength - 2);
 }
 
+void utcp_set_channel_unordered(struct utcp_connection* fd, uint16_t ChIndex, bool unordered)
+{
+	utcp_channels_set_unordered(&fd->channels, ChIndex, unordered);
+}
+
+int32_t utcp_channel_reliable_in_flight(struct utcp_connection* fd, uint16_t ChIndex)
+{
+	assert(ChIndex < DEFAULT_MAX_CHANNEL_SIZE);
+	struct utcp_channel* utcp_channel = fd->channels.Channels[ChIndex];
+	return utcp_channel ? outgoing_reliable_span(utcp_channel) : 0;
+}
+
 void utcp_mark_close(struct utcp_connection* fd, uint8_t close_reason)
 {
 	if (fd->bClose)
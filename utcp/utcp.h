@@ -13,6 +13,12 @@ extern "C"
 // global API
 struct utcp_config* utcp_get_config();
 void utcp_add_elapsed_time(int64_t delta_time_ns);
+// Shared dictionary for UTCP_FEATURE_COMPRESSION, e.g. captured replication payloads. Compression is only agreed when both sides use the same one
+void utcp_set_compress_dictionary(const uint8_t* dict, int dict_len);
+// When set, the packets this thread sends are appended to the batch instead of going through on_outgoing. Every thread
+// has its own, NULL (the default) sends them right away
+void utcp_set_send_batch(struct utcp_send_batch* batch);
+struct utcp_send_batch* utcp_get_send_batch();
 
 // listener API
 struct utcp_listener* utcp_listener_create();
@@ -20,8 +26,33 @@ void utcp_listener_destroy(struct utcp_listener* fd);
 
 void utcp_listener_init(struct utcp_listener* fd, void* userdata);
 void utcp_listener_update_secret(struct utcp_listener* fd, uint8_t special_secret[64] /* = NULL*/);
+// Takes both secrets and the rotation time of source, a cookie issued by either listener then validates on the other.
+// For listeners sharing a port (SO_REUSEPORT): rotate one with utcp_listener_update_secret and copy it to the others
+void utcp_listener_copy_secret(struct utcp_listener* fd, const struct utcp_listener* source);
 int utcp_listener_incoming(struct utcp_listener* fd, const char* address, const uint8_t* buffer, int len);
+// utcp_listener_incoming keyed by the binary form of an AF_INET or AF_INET6 address, no string is made for it.
+// Returns -9 for other families
+int utcp_listener_incoming_addr(struct utcp_listener* fd, const struct sockaddr* addr, int addr_len, const uint8_t* buffer, int len);
+// utcp_listener_incoming for each datagram, in order. The cookies of the batch are hashed together, and each reply is
+// returned in its datagram instead of going to on_outgoing
+void utcp_listener_incoming_batch(struct utcp_listener* fd, struct utcp_listener_datagram* datagrams, int count);
 void utcp_listener_accept(struct utcp_listener* listener, struct utcp_connection* conn, bool reconnect);
+// With a capacity, the handshakes that succeed wait in a table instead of going to on_accept, and are taken in batches.
+// A retried challenge response takes the slot of its address again. When the table is full, the response is not acked,
+// utcp_listener_incoming returns -8 and the client retries later. 0 (the default) frees the table and drops what it holds
+bool utcp_listener_set_pending_accepts(struct utcp_listener* fd, int capacity);
+// Moves up to max pending accepts to accepts, oldest first, and returns how many
+int utcp_listener_take_accepts(struct utcp_listener* fd, struct utcp_accept_info* accepts, int max);
+// utcp_listener_accept for a taken accept
+void utcp_listener_accept_pending(struct utcp_connection* conn, const struct utcp_accept_info* accept);
+// Checked once a connectionless packet is read, before its cookie is hashed or anything is sent back. A packet over the
+// limits is dropped and utcp_listener_incoming returns -10. NULL (the default) removes them
+bool utcp_listener_set_limits(struct utcp_listener* fd, const struct utcp_listener_limits* limits);
+void utcp_listener_get_stats(const struct utcp_listener* fd, struct utcp_listener_stats* stats);
+// "ip:port" for a binary address, the string itself otherwise
+const char* utcp_address_format(const struct utcp_address* address, char* str, int size);
+// The sockaddr a binary address was made from, false for a string one
+bool utcp_address_to_sockaddr(const struct utcp_address* address, struct sockaddr_storage* addr, int* addr_len);
 
 // connection API
 struct utcp_connection* utcp_connection_create();
@@ -36,12 +67,46 @@ bool utcp_incoming(struct utcp_connection* fd, uint8_t* buffer, int len);
 int utcp_update(struct utcp_connection* fd);
 
 int32_t utcp_peep_packet_id(struct utcp_connection* fd, uint8_t* buffer, int len);
+// utcp_peep_packet_id that keeps the parsed header, a packet with PacketId > 0 can then be passed to utcp_incoming_peeked instead of utcp_incoming
+int32_t utcp_peep_packet(struct utcp_connection* fd, const uint8_t* buffer, int len, struct utcp_peeked_packet* peeked);
+bool utcp_incoming_peeked(struct utcp_connection* fd, uint8_t* buffer, int len, const struct utcp_peeked_packet* peeked);
 int32_t utcp_expect_packet_id(struct utcp_connection* fd);
 
+// Packets arriving after a gap are held back until the missing ones arrive, or until utcp_flush_packet_order_cache
+// or the timeout in utcp_update gives the missing ones up. Packets arriving in order are processed without being copied
+void utcp_set_packet_order_cache(struct utcp_connection* fd, bool enable);
+void utcp_flush_packet_order_cache(struct utcp_connection* fd);
+
 int32_t utcp_send_bunch(struct utcp_connection* fd, struct utcp_bunch* bunch);
+// Like utcp_send_bunch, but an unreliable bunch may be appended to the previous unreliable bunch of the same channel in the current packet
+int32_t utcp_send_bunch_merge(struct utcp_connection* fd, struct utcp_bunch* bunch);
+// Like utcp_send_bunch, but the DataBitsLen bits are read from data, bunch->Data is left untouched. The data is copied into the send buffer
+// (and the reliable buffer) before it returns, so a large message can be sent in partial bunches straight from the caller buffer
+int32_t utcp_send_bunch_data(struct utcp_connection* fd, struct utcp_bunch* bunch, const uint8_t* data);
+// Scatter-gather send: the header fields and the payload in fragments, which are written straight into the send buffer one after the other.
+// header->ChSequence and header->DataBitsLen are filled in
+int32_t utcp_send_bunch_iov(struct utcp_connection* fd, struct utcp_bunch_header* header, const struct utcp_iov* iov, int iovcnt);
+int32_t utcp_send_bunch_iov_merge(struct utcp_connection* fd, struct utcp_bunch_header* header, const struct utcp_iov* iov, int iovcnt);
+// Fan-out of one bunch to many connections: the header and the payload are serialized once, every connection only patches its ChSequence.
+// The reliable buffer of every connection references the shared bunch instead of copying it, it is freed when the caller and all of them released it.
+// Connections that negotiated UTCP_FEATURE_DELTA_HEADER still write their own delta header. Returns NULL if the payload does not fit in a packet
+struct utcp_shared_bunch* utcp_shared_bunch_create(const struct utcp_bunch_header* header, const struct utcp_iov* iov, int iovcnt);
+void utcp_shared_bunch_release(struct utcp_shared_bunch* shared);
+int32_t utcp_send_shared_bunch(struct utcp_connection* fd, struct utcp_shared_bunch* shared);
 int utcp_send_flush(struct utcp_connection* fd);
 bool utcp_send_would_block(struct utcp_connection* fd, int count);
 
+// Reliable bunches of an unordered channel are delivered on first receipt instead of waiting for the missing ones, set it before the channel opens
+void utcp_set_channel_unordered(struct utcp_connection* fd, uint16_t ChIndex, bool unordered);
+// Reliable bunches of the channel from the oldest one not acked yet to the last one sent, 0 if all are acked or the channel is not open.
+// The receiver may have to hold back that many, keep it below UTCP_RELIABLE_BUFFER
+int32_t utcp_channel_reliable_in_flight(struct utcp_connection* fd, uint16_t ChIndex);
+
+// Copies the data of a bunch received by on_recv_bunch_view to dst, the last byte is zero padded
+void utcp_bunch_view_read(const struct utcp_bunch_view* view, uint8_t* dst);
+// Rebuilds the PartialCount bunches a completed partial bunch view was sent as, header and data, into bunches
+void utcp_bunch_view_split(const struct utcp_bunch_view* view, struct utcp_bunch* bunches);
+
 void utcp_mark_close(struct utcp_connection* fd, uint8_t close_reason);
 
 #ifdef __cplusplus
@@ -0,0 +1,146 @@
+﻿#include "utcp_address.h"
+#include "utcp.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netinet/in.h>
+#include <sys/socket.h>
+#endif
+
+enum
+{
+	AddressKeyV4 = 4,
+	AddressKeyV6 = 6,
+	AddressKeyV4Size = 2 + 2 + 4,
+	AddressKeyV6Size = 2 + 2 + 16 + 4, // With the scope id, link local addresses differ by interface
+};
+
+static_assert(sizeof(((struct utcp_address*)0)->Data) >= AddressKeyV6Size, "utcp_address::Data");
+
+void utcp_address_from_string(struct utcp_address* out, const char* address)
+{
+	size_t len = strnlen(address, sizeof(out->Data) - 1);
+	memcpy(out->Data, address, len);
+	out->Data[len] = '\0';
+	out->Len = (uint8_t)(len + 1);
+}
+
+bool utcp_address_from_sockaddr(struct utcp_address* out, const struct sockaddr* addr, int addr_len)
+{
+	if (addr->sa_family == AF_INET && addr_len >= (int)sizeof(struct sockaddr_in))
+	{
+		const struct sockaddr_in* in4 = (const struct sockaddr_in*)addr;
+		out->Data[0] = 0;
+		out->Data[1] = AddressKeyV4;
+		memcpy(out->Data + 2, &in4->sin_port, 2);
+		memcpy(out->Data + 4, &in4->sin_addr, 4);
+		out->Len = AddressKeyV4Size;
+		return true;
+	}
+	if (addr->sa_family == AF_INET6 && addr_len >= (int)sizeof(struct sockaddr_in6))
+	{
+		const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+		out->Data[0] = 0;
+		out->Data[1] = AddressKeyV6;
+		memcpy(out->Data + 2, &in6->sin6_port, 2);
+		memcpy(out->Data + 4, &in6->sin6_addr, 16);
+		memcpy(out->Data + 20, &in6->sin6_scope_id, 4);
+		out->Len = AddressKeyV6Size;
+		return true;
+	}
+	return false;
+}
+
+const char* utcp_address_format(const struct utcp_address* address, char* str, int size)
+{
+	if (size <= 0)
+		return str;
+	if (!utcp_address_is_binary(address))
+	{
+		snprintf(str, size, "%.*s", address->Len > 0 ? address->Len - 1 : 0, (const char*)address->Data);
+		return str;
+	}
+
+	const uint8_t* data = address->Data;
+	unsigned port = (data[2] << 8) | data[3];
+	if (data[1] == AddressKeyV4)
+	{
+		snprintf(str, size, "%u.%u.%u.%u:%u", data[4], data[5], data[6], data[7], port);
+	}
+	else
+	{
+		// All eight groups, without the :: shortening
+		snprintf(str, size, "[%x:%x:%x:%x:%x:%x:%x:%x]:%u", (data[4] << 8) | data[5], (data[6] << 8) | data[7], (data[8] << 8) | data[9],
+				 (data[10] << 8) | data[11], (data[12] << 8) | data[13], (data[14] << 8) | data[15], (data[16] << 8) | data[17],
+				 (data[18] << 8) | data[19], port);
+	}
+	return str;
+}
+
+// FNV-1a, the seed keeps the buckets from being targeted
+static uint32_t fnv1a(const uint8_t* data, int len, uint32_t seed)
+{
+	uint32_t hash = 2166136261u ^ seed;
+	for (int i = 0; i < len; ++i)
+	{
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+uint32_t utcp_address_prefix_hash(const struct utcp_address* address, uint32_t seed)
+{
+	const uint8_t* data = address->Data;
+	int len;
+	if (utcp_address_is_binary(address))
+	{
+		data += 4;
+		len = address->Data[1] == AddressKeyV4 ? 3 : 8;
+	}
+	else
+	{
+		len = address->Len > 0 ? address->Len - 1 : 0;
+		while (len > 0 && data[len - 1] != ':')
+			len--;
+		if (len == 0)
+			len = address->Len;
+	}
+	return fnv1a(data, len, seed);
+}
+
+uint32_t utcp_address_hash(const struct utcp_address* address, uint32_t seed)
+{
+	return fnv1a(address->Data, address->Len, seed);
+}
+
+bool utcp_address_to_sockaddr(const struct utcp_address* address, struct sockaddr_storage* addr, int* addr_len)
+{
+	if (!utcp_address_is_binary(address))
+		return false;
+
+	memset(addr, 0, sizeof(*addr));
+	if (address->Data[1] == AddressKeyV4)
+	{
+		struct sockaddr_in* in4 = (struct sockaddr_in*)addr;
+		in4->sin_family = AF_INET;
+		memcpy(&in4->sin_port, address->Data + 2, 2);
+		memcpy(&in4->sin_addr, address->Data + 4, 4);
+		*addr_len = (int)sizeof(*in4);
+	}
+	else
+	{
+		struct sockaddr_in6* in6 = (struct sockaddr_in6*)addr;
+		in6->sin6_family = AF_INET6;
+		memcpy(&in6->sin6_port, address->Data + 2, 2);
+		memcpy(&in6->sin6_addr, address->Data + 4, 16);
+		memcpy(&in6->sin6_scope_id, address->Data + 20, 4);
+		*addr_len = (int)sizeof(*in6);
+	}
+	return true;
+}
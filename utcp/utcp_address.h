@@ -0,0 +1,30 @@
+﻿// Copyright DPULL, Inc. All Rights Reserved.
+
+#pragma once
+
+#include "utcp_def.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// The listener keys the clients by struct utcp_address. A string key keeps its terminator, a binary key is 0, the
+// family (4 or 6), the port and the address, all in network order, so the two never match each other
+
+void utcp_address_from_string(struct utcp_address* out, const char* address);
+// false for families other than AF_INET and AF_INET6
+bool utcp_address_from_sockaddr(struct utcp_address* out, const struct sockaddr* addr, int addr_len);
+
+// Hashes the part the rate limits group by: the /24 of IPv4, the /64 of IPv6, the host of a string
+uint32_t utcp_address_prefix_hash(const struct utcp_address* address, uint32_t seed);
+// Hashes the whole key
+uint32_t utcp_address_hash(const struct utcp_address* address, uint32_t seed);
+
+static inline bool utcp_address_is_binary(const struct utcp_address* address)
+{
+	return address->Len > 1 && address->Data[0] == 0;
+}
+
+static inline bool utcp_address_equal(const struct utcp_address* lhs, const struct utcp_address* rhs)
+{
+	return lhs->Len == rhs->Len && memcmp(lhs->Data, rhs->Data, lhs->Len) == 0;
+}
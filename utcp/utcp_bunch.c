@@ -1,5 +1,6 @@
 ﻿#include "utcp_bunch.h"
 #include "bit_buffer.h"
+#include "bit_stream.h"
 #include "utcp_def_internal.h"
 #include <assert.h>
 #include <string.h>
@@ -8,7 +9,7 @@
 	do                                                                                                                                                                             \
 	{                                                                                                                                                                              \
 		uint8_t __VALUE;                                                                                                                                                           \
-		if (!bitbuf_read_bit(bitbuf, &__VALUE))                                                                                                                                    \
+		if (!bitbuf_stream_read_bit(stream, &__VALUE))                                                                                                                                       \
 			return false;                                                                                                                                                          \
 		VAR = __VALUE;                                                                                                                                                             \
 	} while (0);
@@ -16,7 +17,7 @@
 #define BITBUF_WRITE_BIT(VAR)                                                                                                                                                      \
 	do                                                                                                                                                                             \
 	{                                                                                                                                                                              \
-		if (!bitbuf_write_bit(bitbuf, VAR))                                                                                                                                        \
+		if (!bitbuf_stream_write_bit(stream, VAR))                                                                                                                                           \
 			return false;                                                                                                                                                          \
 	} while (0);
 
@@ -25,10 +26,8 @@ enum
 	EChannelCloseReasonMAX = 15
 };
 
-// UNetConnection::ReceivedPacket
-bool utcp_bunch_read(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf)
+static bool read_header(struct utcp_bunch* utcp_bunch, struct bitbuf_stream* stream)
 {
-	memset(utcp_bunch, 0, sizeof(*utcp_bunch));
 	uint8_t bControl;
 
 	BITBUF_READ_BIT(bControl);
@@ -43,7 +42,7 @@ bool utcp_bunch_read(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf)
 	if (utcp_bunch->bClose)
 	{
 		uint32_t CloseReason;
-		if (!bitbuf_read_int(bitbuf, &CloseReason, EChannelCloseReasonMAX))
+		if (!bitbuf_stream_read_int(stream, &CloseReason, EChannelCloseReasonMAX))
 			return false;
 		utcp_bunch->CloseReason = CloseReason;
 	}
@@ -51,7 +50,7 @@ bool utcp_bunch_read(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf)
 	BITBUF_READ_BIT(utcp_bunch->bReliable);
 
 	uint32_t ChIndex;
-	if (!bitbuf_read_int_packed(bitbuf, &ChIndex))
+	if (!bitbuf_stream_read_int_packed(stream, &ChIndex))
 		return false;
 
 	utcp_bunch->ChIndex = ChIndex;
@@ -64,7 +63,7 @@ bool utcp_bunch_read(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf)
 	if (utcp_bunch->bReliable)
 	{
 		uint32_t ChSequence = 0;
-		if (!bitbuf_read_int(bitbuf, (uint32_t*)&utcp_bunch->ChSequence, UTCP_MAX_CHSEQUENCE))
+		if (!bitbuf_stream_read_int(stream, (uint32_t*)&utcp_bunch->ChSequence, UTCP_MAX_CHSEQUENCE))
 		{
 			return false;
 		}
@@ -90,22 +89,32 @@ bool utcp_bunch_read(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf)
 		}
 
 		uint32_t NameIndex = 0;
-		if (!bitbuf_read_int_packed(bitbuf, &NameIndex))
+		if (!bitbuf_stream_read_int_packed(stream, &NameIndex))
 			return false;
 		utcp_bunch->NameIndex = NameIndex;
 	}
+	return true;
+}
 
+static bool read_size(struct utcp_bunch* utcp_bunch, struct bitbuf_stream* stream)
+{
 	uint32_t BunchDataBits;
-	if (!bitbuf_read_int(bitbuf, &BunchDataBits, UTCP_MAX_PACKET * 8))
+	if (!bitbuf_stream_read_int(stream, &BunchDataBits, UTCP_MAX_PACKET * 8))
 		return false;
 	utcp_bunch->DataBitsLen = BunchDataBits;
-	if (!bitbuf_read_bits(bitbuf, utcp_bunch->Data, utcp_bunch->DataBitsLen))
-		return false;
 	return true;
 }
 
-// UNetConnection::SendRawBunch
-bool utcp_bunch_write_header(const struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf)
+// UNetConnection::ReceivedPacket
+bool utcp_bunch_read(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf)
+{
+	if (!utcp_bunch_read_header(utcp_bunch, bitbuf, NULL))
+		return false;
+	memset(utcp_bunch->Data, 0, sizeof(utcp_bunch->Data));
+	return bitbuf_read_bits(bitbuf, utcp_bunch->Data, utcp_bunch->DataBitsLen);
+}
+
+static bool write_header(const struct utcp_bunch* utcp_bunch, struct bitbuf_stream* stream, size_t* ChSequencePos)
 {
 	const bool bIsOpenOrClose = utcp_bunch->bOpen || utcp_bunch->bClose;
 	const bool bIsOpenOrReliable = utcp_bunch->bOpen || utcp_bunch->bReliable;
@@ -118,7 +127,7 @@ bool utcp_bunch_write_header(const struct utcp_bunch* utcp_bunch, struct bitbuf*
 
 		if (utcp_bunch->bClose)
 		{
-			if (!bitbuf_write_int(bitbuf, utcp_bunch->CloseReason, EChannelCloseReasonMAX))
+			if (!bitbuf_stream_write_int(stream, utcp_bunch->CloseReason, EChannelCloseReasonMAX))
 				return false;
 		}
 	}
@@ -126,16 +135,18 @@ bool utcp_bunch_write_header(const struct utcp_bunch* utcp_bunch, struct bitbuf*
 	BITBUF_WRITE_BIT(utcp_bunch->bIsReplicationPaused);
 	BITBUF_WRITE_BIT(utcp_bunch->bReliable);
 
-	if (!bitbuf_write_int_packed(bitbuf, utcp_bunch->ChIndex))
+	if (!bitbuf_stream_write_int_packed(stream, utcp_bunch->ChIndex))
 		return false;
 
 	BITBUF_WRITE_BIT(utcp_bunch->bHasPackageMapExports);
 	BITBUF_WRITE_BIT(utcp_bunch->bHasMustBeMappedGUIDs);
 	BITBUF_WRITE_BIT(utcp_bunch->bPartial);
 
+	if (ChSequencePos)
+		*ChSequencePos = stream->num;
 	if (utcp_bunch->bReliable)
 	{
-		if (!bitbuf_write_int_wrapped(bitbuf, utcp_bunch->ChSequence, UTCP_MAX_CHSEQUENCE))
+		if (!bitbuf_stream_write_int_wrapped(stream, utcp_bunch->ChSequence, UTCP_MAX_CHSEQUENCE))
 			return false;
 	}
 
@@ -148,11 +159,317 @@ bool utcp_bunch_write_header(const struct utcp_bunch* utcp_bunch, struct bitbuf*
 	if (bIsOpenOrReliable)
 	{
 		BITBUF_WRITE_BIT(1);
-		if (!bitbuf_write_int_packed(bitbuf, utcp_bunch->NameIndex))
+		if (!bitbuf_stream_write_int_packed(stream, utcp_bunch->NameIndex))
 			return false;
 	}
+	return true;
+}
+
+// UNetConnection::SendRawBunch
+bool utcp_bunch_write_header(const struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf)
+{
+	return utcp_bunch_write_header_pos(utcp_bunch, bitbuf, NULL);
+}
+
+bool utcp_bunch_write_header_pos(const struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf, size_t* ChSequencePos)
+{
+	struct bitbuf_stream stream;
+	bitbuf_stream_write_begin(&stream, bitbuf);
+	if (!write_header(utcp_bunch, &stream, ChSequencePos))
+		return false;
+	if (!bitbuf_stream_write_int_wrapped(&stream, utcp_bunch->DataBitsLen, UTCP_MAX_PACKET * 8))
+		return false;
+	bitbuf_stream_write_end(&stream, bitbuf);
+	return true;
+}
+
+void utcp_bunch_patch_sequence(uint8_t* Header, size_t ChSequencePos, int32_t ChSequence)
+{
+	const uint32_t Value = (uint32_t)ChSequence & (UTCP_MAX_CHSEQUENCE - 1);
+	const uint32_t Bits = bitbuf_ceil_log_two(UTCP_MAX_CHSEQUENCE);
+	for (uint32_t i = 0; i < Bits; ++i)
+	{
+		const size_t Pos = ChSequencePos + i;
+		Header[Pos >> 3] = (uint8_t)((Header[Pos >> 3] & ~(1u << (Pos & 7))) | (((Value >> i) & 1) << (Pos & 7)));
+	}
+}
+
+// The header fields that are actually on the wire, both sides keep the same context from them
+static uint16_t get_flags(const struct utcp_bunch* utcp_bunch)
+{
+	uint16_t Flags = utcp_bunch->bOpen | (utcp_bunch->bClose << 1) | (utcp_bunch->bIsReplicationPaused << 2) | (utcp_bunch->bReliable << 3) |
+					 (utcp_bunch->bHasPackageMapExports << 4) | (utcp_bunch->bHasMustBeMappedGUIDs << 5) | (utcp_bunch->bPartial << 6);
+	if (utcp_bunch->bClose)
+		Flags |= utcp_bunch->CloseReason << 7;
+	if (utcp_bunch->bPartial)
+		Flags |= (utcp_bunch->bPartialInitial << 11) | (utcp_bunch->bPartialFinal << 12);
+	return Flags;
+}
+
+static void set_flags(struct utcp_bunch* utcp_bunch, uint16_t Flags)
+{
+	utcp_bunch->bOpen = Flags & 1;
+	utcp_bunch->bClose = (Flags >> 1) & 1;
+	utcp_bunch->bIsReplicationPaused = (Flags >> 2) & 1;
+	utcp_bunch->bReliable = (Flags >> 3) & 1;
+	utcp_bunch->bHasPackageMapExports = (Flags >> 4) & 1;
+	utcp_bunch->bHasMustBeMappedGUIDs = (Flags >> 5) & 1;
+	utcp_bunch->bPartial = (Flags >> 6) & 1;
+	utcp_bunch->CloseReason = (Flags >> 7) & 15;
+	utcp_bunch->bPartialInitial = (Flags >> 11) & 1;
+	utcp_bunch->bPartialFinal = (Flags >> 12) & 1;
+}
+
+static void update_delta_context(const struct utcp_bunch* utcp_bunch, struct utcp_bunch_delta_context* ctx)
+{
+	ctx->bValid = 1;
+	ctx->Flags = get_flags(utcp_bunch);
+	ctx->ChIndex = utcp_bunch->ChIndex;
+	ctx->ChSequence = utcp_bunch->bReliable ? utcp_bunch->ChSequence & (UTCP_MAX_CHSEQUENCE - 1) : 0;
+	ctx->NameIndex = (utcp_bunch->bOpen || utcp_bunch->bReliable) ? utcp_bunch->NameIndex : 0;
+}
+
+static int32_t predict_sequence(const struct utcp_bunch_delta_context* ctx, uint16_t ChIndex)
+{
+	// Reliable bunches of one channel are numbered one after another, channels opened together start from the same sequence
+	if (!(ctx->Flags & (1 << 3)))
+		return -1;
+	return (ctx->ChSequence + (ctx->ChIndex == ChIndex ? 1 : 0)) & (UTCP_MAX_CHSEQUENCE - 1);
+}
+
+static bool write_flags(const struct utcp_bunch* utcp_bunch, struct bitbuf_stream* stream)
+{
+	const bool bIsOpenOrClose = utcp_bunch->bOpen || utcp_bunch->bClose;
+	BITBUF_WRITE_BIT(bIsOpenOrClose);
+	if (bIsOpenOrClose)
+	{
+		BITBUF_WRITE_BIT(utcp_bunch->bOpen);
+		BITBUF_WRITE_BIT(utcp_bunch->bClose);
+
+		if (utcp_bunch->bClose)
+		{
+			if (!bitbuf_stream_write_int(stream, utcp_bunch->CloseReason, EChannelCloseReasonMAX))
+				return false;
+		}
+	}
 
+	BITBUF_WRITE_BIT(utcp_bunch->bIsReplicationPaused);
+	BITBUF_WRITE_BIT(utcp_bunch->bReliable);
+	BITBUF_WRITE_BIT(utcp_bunch->bHasPackageMapExports);
+	BITBUF_WRITE_BIT(utcp_bunch->bHasMustBeMappedGUIDs);
+	BITBUF_WRITE_BIT(utcp_bunch->bPartial);
+	if (utcp_bunch->bPartial)
+	{
+		BITBUF_WRITE_BIT(utcp_bunch->bPartialInitial);
+		BITBUF_WRITE_BIT(utcp_bunch->bPartialFinal);
+	}
+	return true;
+}
+
+static bool read_flags(struct utcp_bunch* utcp_bunch, struct bitbuf_stream* stream)
+{
+	uint8_t bIsOpenOrClose;
+	BITBUF_READ_BIT(bIsOpenOrClose);
+	if (bIsOpenOrClose)
+	{
+		BITBUF_READ_BIT(utcp_bunch->bOpen);
+		BITBUF_READ_BIT(utcp_bunch->bClose);
+
+		if (utcp_bunch->bClose)
+		{
+			uint32_t CloseReason;
+			if (!bitbuf_stream_read_int(stream, &CloseReason, EChannelCloseReasonMAX))
+				return false;
+			utcp_bunch->CloseReason = CloseReason;
+		}
+	}
+
+	BITBUF_READ_BIT(utcp_bunch->bIsReplicationPaused);
+	BITBUF_READ_BIT(utcp_bunch->bReliable);
+	BITBUF_READ_BIT(utcp_bunch->bHasPackageMapExports);
+	BITBUF_READ_BIT(utcp_bunch->bHasMustBeMappedGUIDs);
+	BITBUF_READ_BIT(utcp_bunch->bPartial);
+	if (utcp_bunch->bPartial)
+	{
+		BITBUF_READ_BIT(utcp_bunch->bPartialInitial);
+		BITBUF_READ_BIT(utcp_bunch->bPartialFinal);
+	}
+	return true;
+}
+
+static bool write_delta_header(const struct utcp_bunch* utcp_bunch, struct bitbuf_stream* stream, const struct utcp_bunch_delta_context* ctx)
+{
+	const bool bSameFlags = get_flags(utcp_bunch) == ctx->Flags;
+	BITBUF_WRITE_BIT(bSameFlags);
+	if (!bSameFlags && !write_flags(utcp_bunch, stream))
+		return false;
+
+	// ChIndex: 0 same channel, 10 next channel, 11 explicit
+	if (utcp_bunch->ChIndex == ctx->ChIndex)
+	{
+		BITBUF_WRITE_BIT(0);
+	}
+	else
+	{
+		BITBUF_WRITE_BIT(1);
+		const bool bNextChannel = utcp_bunch->ChIndex == ctx->ChIndex + 1;
+		BITBUF_WRITE_BIT(!bNextChannel);
+		if (!bNextChannel && !bitbuf_stream_write_int_packed(stream, utcp_bunch->ChIndex))
+			return false;
+	}
+
+	if (utcp_bunch->bReliable)
+	{
+		const int32_t ChSequence = utcp_bunch->ChSequence & (UTCP_MAX_CHSEQUENCE - 1);
+		const bool bPredicted = predict_sequence(ctx, utcp_bunch->ChIndex) == ChSequence;
+		BITBUF_WRITE_BIT(bPredicted);
+		if (!bPredicted && !bitbuf_stream_write_int_wrapped(stream, ChSequence, UTCP_MAX_CHSEQUENCE))
+			return false;
+	}
+
+	if (utcp_bunch->bOpen || utcp_bunch->bReliable)
+	{
+		const bool bSameName = utcp_bunch->NameIndex == ctx->NameIndex;
+		BITBUF_WRITE_BIT(bSameName);
+		if (!bSameName && !bitbuf_stream_write_int_packed(stream, utcp_bunch->NameIndex))
+			return false;
+	}
+	return true;
+}
+
+static bool read_delta_header(struct utcp_bunch* utcp_bunch, struct bitbuf_stream* stream, const struct utcp_bunch_delta_context* ctx)
+{
+	uint8_t bSameFlags;
+	BITBUF_READ_BIT(bSameFlags);
+	if (bSameFlags)
+		set_flags(utcp_bunch, ctx->Flags);
+	else if (!read_flags(utcp_bunch, stream))
+		return false;
+
+	uint8_t bChangeChannel;
+	BITBUF_READ_BIT(bChangeChannel);
+	utcp_bunch->ChIndex = ctx->ChIndex;
+	if (bChangeChannel)
+	{
+		uint8_t bExplicitChannel;
+		BITBUF_READ_BIT(bExplicitChannel);
+		if (bExplicitChannel)
+		{
+			uint32_t ChIndex;
+			if (!bitbuf_stream_read_int_packed(stream, &ChIndex))
+				return false;
+			utcp_bunch->ChIndex = ChIndex;
+		}
+		else
+		{
+			utcp_bunch->ChIndex = ctx->ChIndex + 1;
+		}
+	}
+
+	if (utcp_bunch->bReliable)
+	{
+		uint8_t bPredicted;
+		BITBUF_READ_BIT(bPredicted);
+		if (bPredicted)
+		{
+			utcp_bunch->ChSequence = predict_sequence(ctx, utcp_bunch->ChIndex);
+			if (utcp_bunch->ChSequence < 0)
+				return false;
+		}
+		else if (!bitbuf_stream_read_int(stream, (uint32_t*)&utcp_bunch->ChSequence, UTCP_MAX_CHSEQUENCE))
+		{
+			return false;
+		}
+	}
+
+	if (utcp_bunch->bOpen || utcp_bunch->bReliable)
+	{
+		uint8_t bSameName;
+		BITBUF_READ_BIT(bSameName);
+		utcp_bunch->NameIndex = ctx->NameIndex;
+		if (!bSameName)
+		{
+			uint32_t NameIndex;
+			if (!bitbuf_stream_read_int_packed(stream, &NameIndex))
+				return false;
+			utcp_bunch->NameIndex = NameIndex;
+		}
+	}
+	return true;
+}
+
+bool utcp_bunch_read_header(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf, struct utcp_bunch_delta_context* ctx)
+{
+	memset(utcp_bunch, 0, offsetof(struct utcp_bunch, Data));
+	struct bitbuf_stream stream_data;
+	struct bitbuf_stream* stream = &stream_data;
+	bitbuf_stream_read_begin(stream, bitbuf);
+	if (!ctx)
+	{
+		if (!read_header(utcp_bunch, stream) || !read_size(utcp_bunch, stream))
+			return false;
+		bitbuf_stream_read_end(stream, bitbuf);
+		return true;
+	}
+
+	uint8_t bDelta;
+	BITBUF_READ_BIT(bDelta);
+	if (bDelta)
+	{
+		if (!ctx->bValid || !read_delta_header(utcp_bunch, stream, ctx))
+			return false;
+	}
+	else if (!read_header(utcp_bunch, stream))
+	{
+		return false;
+	}
+
+	update_delta_context(utcp_bunch, ctx);
+	if (!read_size(utcp_bunch, stream))
+		return false;
+	bitbuf_stream_read_end(stream, bitbuf);
+	return true;
+}
+
+bool utcp_bunch_read_delta(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf, struct utcp_bunch_delta_context* ctx)
+{
+	if (!utcp_bunch_read_header(utcp_bunch, bitbuf, ctx))
+		return false;
+	memset(utcp_bunch->Data, 0, sizeof(utcp_bunch->Data));
+	return bitbuf_read_bits(bitbuf, utcp_bunch->Data, utcp_bunch->DataBitsLen);
+}
+
+bool utcp_bunch_write_header_delta(const struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf, struct utcp_bunch_delta_context* ctx)
+{
+	uint8_t full_buffer[MAX_BUNCH_HEADER_BYTES];
+	struct bitbuf full;
+	struct bitbuf_stream stream;
+	if (!bitbuf_write_init(&full, full_buffer, sizeof(full_buffer)))
+		return false;
+	bitbuf_stream_write_begin(&stream, &full);
+	if (!bitbuf_stream_write_bit(&stream, 0) || !write_header(utcp_bunch, &stream, NULL))
+		return false;
+	bitbuf_stream_write_end(&stream, &full);
+
+	struct bitbuf* shortest = &full;
+	uint8_t delta_buffer[MAX_BUNCH_HEADER_BYTES];
+	struct bitbuf delta;
+	if (ctx->bValid && bitbuf_write_init(&delta, delta_buffer, sizeof(delta_buffer)))
+	{
+		bitbuf_stream_write_begin(&stream, &delta);
+		if (bitbuf_stream_write_bit(&stream, 1) && write_delta_header(utcp_bunch, &stream, ctx))
+		{
+			bitbuf_stream_write_end(&stream, &delta);
+			if (delta.num < full.num)
+				shortest = &delta;
+		}
+	}
+
+	if (!bitbuf_write_bits(bitbuf, shortest->buffer, shortest->num))
+		return false;
 	if (!bitbuf_write_int_wrapped(bitbuf, utcp_bunch->DataBitsLen, UTCP_MAX_PACKET * 8))
 		return false;
+
+	update_delta_context(utcp_bunch, ctx);
 	return true;
 }
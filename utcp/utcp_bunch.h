@@ -8,5 +8,24 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+enum
+{
+	MAX_BUNCH_HEADER_BYTES = 32,
+};
+
+struct utcp_bunch_delta_context;
+
 bool utcp_bunch_read(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf);
 bool utcp_bunch_write_header(const struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf);
+
+// The full header is the same for every connection but ChSequence, which always takes the same number of bits.
+// ChSequencePos is where it is written, utcp_bunch_patch_sequence rewrites it in a copy of the header
+bool utcp_bunch_write_header_pos(const struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf, size_t* ChSequencePos);
+void utcp_bunch_patch_sequence(uint8_t* Header, size_t ChSequencePos, int32_t ChSequence);
+
+// UTCP_FEATURE_DELTA_HEADER: a leading bit tells whether the header is written in full or relative to the previous bunch of the packet
+bool utcp_bunch_read_delta(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf, struct utcp_bunch_delta_context* ctx);
+
+// Reads the header up to and including the size, ctx is NULL without UTCP_FEATURE_DELTA_HEADER. Data is left untouched
+bool utcp_bunch_read_header(struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf, struct utcp_bunch_delta_context* ctx);
+bool utcp_bunch_write_header_delta(const struct utcp_bunch* utcp_bunch, struct bitbuf* bitbuf, struct utcp_bunch_delta_context* ctx);
@@ -1,4 +1,5 @@
 ﻿#include "utcp_channel.h"
+#include "bit_buffer.h"
 #include "utcp_channel_internal.h"
 #include "utcp_def_internal.h"
 #include <assert.h>
@@ -8,6 +9,18 @@ struct utcp_bunch_node* alloc_utcp_bunch_node()
 {
 	struct utcp_bunch_node* utcp_bunch_node = (struct utcp_bunch_node*)utcp_realloc(NULL, sizeof(*utcp_bunch_node));
 	memset(&utcp_bunch_node->dl_list_node, 0, sizeof(utcp_bunch_node->dl_list_node));
+	utcp_bunch_node->shared = NULL;
+	return utcp_bunch_node;
+}
+
+struct utcp_bunch_node* alloc_shared_bunch_node(struct utcp_shared_bunch* shared)
+{
+	// Only the header is kept in bunch_data, the node stops after it
+	const size_t size = offsetof(struct utcp_bunch_node, bunch_data) + MAX_BUNCH_HEADER_BYTES + 1;
+	struct utcp_bunch_node* utcp_bunch_node = (struct utcp_bunch_node*)utcp_realloc(NULL, size);
+	memset(&utcp_bunch_node->dl_list_node, 0, sizeof(utcp_bunch_node->dl_list_node));
+	utcp_bunch_node->shared = shared;
+	shared->RefCount++;
 	return utcp_bunch_node;
 }
 
@@ -18,6 +31,20 @@ void free_utcp_bunch_node(struct utcp_bunch_node* utcp_bunch_node)
 	utcp_realloc(utcp_bunch_node, 0);
 }
 
+void free_outgoing_bunch_node(struct utcp_bunch_node* utcp_bunch_node)
+{
+	if (utcp_bunch_node->shared)
+		release_shared_bunch(utcp_bunch_node->shared);
+	free_utcp_bunch_node(utcp_bunch_node);
+}
+
+void release_shared_bunch(struct utcp_shared_bunch* shared)
+{
+	assert(shared->RefCount > 0);
+	if (--shared->RefCount == 0)
+		utcp_realloc(shared, 0);
+}
+
 // UChannel::ReceivedRawBunch
 bool enqueue_incoming_data(struct utcp_channel* utcp_channel, struct utcp_bunch_node* utcp_bunch_node)
 {
@@ -102,31 +129,72 @@ int remove_ougoing_data(struct utcp_channel* utcp_channel, int32_t packet_id, st
 	return count;
 }
 
-static struct utcp_bunch* get_last_partial_bunch(struct utcp_channel* utcp_channel)
+// Resends move to the back of OutRec, the oldest sequence can be anywhere in it
+int32_t outgoing_reliable_span(struct utcp_channel* utcp_channel)
 {
-	if (dl_list_empty(&utcp_channel->InPartialBunch))
-		return NULL;
+	int32_t OldestSequence = utcp_channel->OutReliable + 1;
+	struct dl_list_node* dl_list_node = utcp_channel->OutRec.next;
+	while (dl_list_node != &utcp_channel->OutRec)
+	{
+		struct utcp_bunch_node* cur_utcp_bunch_node = CONTAINING_RECORD(dl_list_node, struct utcp_bunch_node, dl_list_node);
+		dl_list_node = dl_list_node->next;
+		if (cur_utcp_bunch_node->ch_sequence < OldestSequence)
+			OldestSequence = cur_utcp_bunch_node->ch_sequence;
+	}
+	return utcp_channel->OutReliable + 1 - OldestSequence;
+}
 
-	struct dl_list_node* dl_list_node = utcp_channel->InPartialBunch.prev;
-	struct utcp_bunch_node* last_utcp_bunch_node = CONTAINING_RECORD(dl_list_node, struct utcp_bunch_node, dl_list_node);
-	return &last_utcp_bunch_node->utcp_bunch;
+static struct utcp_partial_bunch* get_last_partial_bunch(struct utcp_channel* utcp_channel)
+{
+	struct utcp_partial_bunch* partial_bunch = utcp_channel->InPartialBunch;
+	return partial_bunch && partial_bunch->Count > 0 ? partial_bunch : NULL;
+}
+
+// FInBunch::AppendDataFromChecked
+static bool append_partial_data(struct utcp_partial_bunch* partial_bunch, const struct utcp_bunch* utcp_bunch, const uint8_t* Data, size_t DataBitOffset)
+{
+	const uint32_t DataBitsLen = partial_bunch->DataBitsLen + utcp_bunch->DataBitsLen;
+	if (partial_bunch->Count >= UTCP_MAX_PARTIAL_BUNCHES || DataBitsLen > UTCP_MAX_PARTIAL_BUNCH_BYTES * 8)
+	{
+		utcp_log(Warning, "Final partial bunch too large");
+		return false;
+	}
+
+	const uint32_t DataBytes = (DataBitsLen + 7) / 8;
+	if (DataBytes > partial_bunch->DataCapacity)
+	{
+		uint32_t DataCapacity = partial_bunch->DataCapacity ? partial_bunch->DataCapacity : UTCP_MAX_PACKET;
+		while (DataCapacity < DataBytes)
+			DataCapacity *= 2;
+		if (DataCapacity > UTCP_MAX_PARTIAL_BUNCH_BYTES)
+			DataCapacity = UTCP_MAX_PARTIAL_BUNCH_BYTES;
+		partial_bunch->Data = (uint8_t*)utcp_realloc(partial_bunch->Data, DataCapacity);
+		partial_bunch->DataCapacity = DataCapacity;
+	}
+
+	bitbuf_copy_bits(partial_bunch->Data, partial_bunch->DataBitsLen, Data, DataBitOffset, utcp_bunch->DataBitsLen);
+	if (DataBitsLen & 7)
+		partial_bunch->Data[DataBitsLen >> 3] &= (uint8_t)((1 << (DataBitsLen & 7)) - 1);
+	partial_bunch->DataBitsLen = DataBitsLen;
+	partial_bunch->BunchBitsLen[partial_bunch->Count++] = utcp_bunch->DataBitsLen;
+	return true;
 }
 
 // UChannel::ReceivedNextBunch
-enum merge_partial_result merge_partial_data(struct utcp_channel* utcp_channel, struct utcp_bunch_node* utcp_bunch_node, bool* bOutSkipAck)
+enum merge_partial_result merge_partial_data(struct utcp_channel* utcp_channel, const struct utcp_bunch* utcp_bunch, const uint8_t* Data, size_t DataBitOffset,
+											 bool* bOutSkipAck)
 {
 	*bOutSkipAck = false;
-
-	struct utcp_bunch* utcp_bunch = &utcp_bunch_node->utcp_bunch;
 	assert(utcp_bunch->bPartial);
 
 	if (utcp_bunch->bPartialInitial)
 	{
 		// Create new InPartialBunch if this is the initial bunch of a new sequence.
 
-		struct utcp_bunch* last_utcp_bunch = get_last_partial_bunch(utcp_channel);
-		if (last_utcp_bunch)
+		struct utcp_partial_bunch* last_partial_bunch = get_last_partial_bunch(utcp_channel);
+		if (last_partial_bunch)
 		{
+			const struct utcp_bunch* last_utcp_bunch = &last_partial_bunch->Header;
 			if (!last_utcp_bunch->bPartialFinal)
 			{
 				if (last_utcp_bunch->bReliable)
@@ -151,12 +219,24 @@ enum merge_partial_result merge_partial_data(struct utcp_channel* utcp_channel,
 				// InPartialBunch->ChSequence);
 			}
 			clear_partial_data(utcp_channel);
-			last_utcp_bunch = NULL;
 		}
 
-		assert(dl_list_empty(&utcp_channel->InPartialBunch));
-		dl_list_push_before(&utcp_channel->InPartialBunch, &utcp_bunch_node->dl_list_node);
+		struct utcp_partial_bunch* partial_bunch = utcp_channel->InPartialBunch;
+		if (!partial_bunch)
+		{
+			partial_bunch = (struct utcp_partial_bunch*)utcp_realloc(NULL, sizeof(*partial_bunch));
+			memset(partial_bunch, 0, sizeof(*partial_bunch));
+			utcp_channel->InPartialBunch = partial_bunch;
+		}
+		assert(partial_bunch->Count == 0);
 
+		memcpy(&partial_bunch->Header, utcp_bunch, offsetof(struct utcp_bunch, Data));
+		partial_bunch->Header.DataBitsLen = 0;
+		if (!append_partial_data(partial_bunch, utcp_bunch, Data, DataBitOffset))
+		{
+			clear_partial_data(utcp_channel);
+			return utcp_bunch->bReliable ? partial_merge_fatal : partial_merge_failed;
+		}
 		return partial_merge_succeed;
 	}
 	else
@@ -168,7 +248,8 @@ enum merge_partial_result merge_partial_data(struct utcp_channel* utcp_channel,
 		//	-Reliability flag matches
 
 		bool bSequenceMatches = false;
-		struct utcp_bunch* last_utcp_bunch = get_last_partial_bunch(utcp_channel);
+		struct utcp_partial_bunch* last_partial_bunch = get_last_partial_bunch(utcp_channel);
+		struct utcp_bunch* last_utcp_bunch = last_partial_bunch ? &last_partial_bunch->Header : NULL;
 		if (last_utcp_bunch)
 		{
 			const bool bReliableSequencesMatches = utcp_bunch->ChSequence == last_utcp_bunch->ChSequence + 1;
@@ -185,7 +266,21 @@ enum merge_partial_result merge_partial_data(struct utcp_channel* utcp_channel,
 			// Merge.
 			// UE_LOG(LogNetPartialBunch, Verbose, TEXT("Merging Partial Bunch: %d Bytes"), Bunch.GetBytesLeft());
 
-			dl_list_push_before(&utcp_channel->InPartialBunch, &utcp_bunch_node->dl_list_node);
+			if (!append_partial_data(last_partial_bunch, utcp_bunch, Data, DataBitOffset))
+			{
+				const bool bReliable = last_utcp_bunch->bReliable;
+				clear_partial_data(utcp_channel);
+				return bReliable ? partial_merge_fatal : partial_merge_failed;
+			}
+
+			last_utcp_bunch->ChSequence = utcp_bunch->ChSequence;
+			last_utcp_bunch->PacketId = utcp_bunch->PacketId;
+			last_utcp_bunch->bIsReplicationPaused = utcp_bunch->bIsReplicationPaused;
+			last_utcp_bunch->bHasPackageMapExports |= utcp_bunch->bHasPackageMapExports;
+			last_utcp_bunch->bHasMustBeMappedGUIDs |= utcp_bunch->bHasMustBeMappedGUIDs;
+			last_utcp_bunch->bPartialFinal = utcp_bunch->bPartialFinal;
+			last_utcp_bunch->bClose = utcp_bunch->bClose;
+			last_utcp_bunch->CloseReason = utcp_bunch->CloseReason;
 
 			if (utcp_bunch->bPartialFinal)
 			{
@@ -236,35 +331,69 @@ enum merge_partial_result merge_partial_data(struct utcp_channel* utcp_channel,
 
 void clear_partial_data(struct utcp_channel* utcp_channel)
 {
-	while (!dl_list_empty(&utcp_channel->InPartialBunch))
+	struct utcp_partial_bunch* partial_bunch = utcp_channel->InPartialBunch;
+	if (!partial_bunch)
+		return;
+
+	partial_bunch->Count = 0;
+	partial_bunch->DataBitsLen = 0;
+
+	// Keep a buffer for the common sizes only, a large message should not pin its memory
+	if (partial_bunch->DataCapacity > UTCP_MAX_PACKET * 8)
 	{
-		struct dl_list_node* dl_list_node = dl_list_pop_next(&utcp_channel->InPartialBunch);
-		struct utcp_bunch_node* utcp_bunch_node = CONTAINING_RECORD(dl_list_node, struct utcp_bunch_node, dl_list_node);
-		free_utcp_bunch_node(utcp_bunch_node);
+		utcp_realloc(partial_bunch->Data, 0);
+		partial_bunch->Data = NULL;
+		partial_bunch->DataCapacity = 0;
 	}
 }
 
-int get_partial_bunch(struct utcp_channel* utcp_channel, struct utcp_bunch* bunches[], int bunches_size)
+void free_partial_data(struct utcp_channel* utcp_channel)
 {
-	int count = 0;
-	struct dl_list_node* dl_list_node = utcp_channel->InPartialBunch.next;
-	while (dl_list_node != &utcp_channel->InPartialBunch)
-	{
-		if (count >= bunches_size)
-			return -1;
+	struct utcp_partial_bunch* partial_bunch = utcp_channel->InPartialBunch;
+	if (!partial_bunch)
+		return;
 
-		struct utcp_bunch_node* utcp_bunch_node = CONTAINING_RECORD(dl_list_node, struct utcp_bunch_node, dl_list_node);
-		dl_list_node = dl_list_node->next;
+	if (partial_bunch->Data)
+		utcp_realloc(partial_bunch->Data, 0);
+	utcp_realloc(partial_bunch, 0);
+	utcp_channel->InPartialBunch = NULL;
+}
 
-		bunches[count] = &utcp_bunch_node->utcp_bunch;
-		assert(bunches[count]->bPartial);
-		count++;
-	}
+struct utcp_partial_bunch* get_partial_bunch(struct utcp_channel* utcp_channel)
+{
+	struct utcp_partial_bunch* partial_bunch = get_last_partial_bunch(utcp_channel);
+	assert(partial_bunch);
+	assert(partial_bunch->Count > 1);
+	assert(partial_bunch->Header.bPartialInitial);
+	assert(partial_bunch->Header.bPartialFinal);
+	return partial_bunch;
+}
 
-	assert(count > 1);
-	assert(bunches[0]->bPartialInitial);
-	assert(bunches[count - 1]->bPartialFinal);
-	return count;
+// Returns 1 if the sequence is seen for the first time, 0 if it was already delivered, -1 if it is too far ahead to be tracked
+int mark_unordered_incoming(struct utcp_channel* utcp_channel, int32_t sequence)
+{
+	int32_t offset = sequence - utcp_channel->InReliable - 1;
+	assert(offset >= 0);
+	if (offset >= UTCP_UNORDERED_WINDOW)
+		return -1;
+
+	uint32_t* word = &utcp_channel->InUnorderedMask[offset / 32];
+	uint32_t mask = 1u << (offset % 32);
+	if (*word & mask)
+		return 0;
+	*word |= mask;
+	return 1;
+}
+
+// InReliable has been advanced by one, drop the bit that belonged to it
+void shift_unordered_incoming(struct utcp_channel* utcp_channel)
+{
+	const int count = _countof(utcp_channel->InUnorderedMask);
+	for (int i = 0; i < count; ++i)
+	{
+		uint32_t next = (i + 1 < count) ? utcp_channel->InUnorderedMask[i + 1] : 0;
+		utcp_channel->InUnorderedMask[i] = (utcp_channel->InUnorderedMask[i] >> 1) | (next << 31);
+	}
 }
 
 static void utcp_close_channel(struct utcp_channels* utcp_channels, int ChIndex)
@@ -298,6 +427,7 @@ struct utcp_channel* utcp_channels_get_channel(struct utcp_channels* utcp_channe
 		if (utcp_bunch->bOpen)
 		{
 			utcp_channel = alloc_utcp_channel(utcp_channels->InitInReliable, utcp_channels->InitOutReliable);
+			utcp_channel->bUnordered = (utcp_channels->UnorderedChannels[utcp_bunch->ChIndex / 8] >> (utcp_bunch->ChIndex % 8)) & 1;
 			utcp_channels->Channels[utcp_bunch->ChIndex] = utcp_channel;
 			opened_channels_add(&utcp_channels->open_channels, utcp_bunch->ChIndex);
 
@@ -309,14 +439,29 @@ struct utcp_channel* utcp_channels_get_channel(struct utcp_channels* utcp_channe
 			utcp_log(Warning, "utcp_get_channel failed");
 		}
 	}
-	if (utcp_bunch->bClose && utcp_channel)
-	{
-		mark_channel_close(utcp_channel, utcp_bunch->CloseReason);
-		utcp_channels->bHasChannelClose = true;
-	}
 	return utcp_channel;
 }
 
+// The channel is freed by the next utcp_delay_close_channel
+void utcp_channels_mark_close(struct utcp_channels* utcp_channels, struct utcp_channel* utcp_channel, int8_t CloseReason)
+{
+	mark_channel_close(utcp_channel, CloseReason);
+	utcp_channels->bHasChannelClose = true;
+}
+
+void utcp_channels_set_unordered(struct utcp_channels* utcp_channels, uint16_t ChIndex, bool unordered)
+{
+	assert(ChIndex < DEFAULT_MAX_CHANNEL_SIZE);
+	uint8_t mask = (uint8_t)(1u << (ChIndex % 8));
+	if (unordered)
+		utcp_channels->UnorderedChannels[ChIndex / 8] |= mask;
+	else
+		utcp_channels->UnorderedChannels[ChIndex / 8] &= ~mask;
+
+	if (utcp_channels->Channels[ChIndex])
+		utcp_channels->Channels[ChIndex]->bUnordered = unordered;
+}
+
 void utcp_channels_on_ack(struct utcp_channels* utcp_channels, int32_t AckPacketId)
 {
 	struct utcp_bunch_node* utcp_bunch_node[UTCP_RELIABLE_BUFFER];
@@ -329,12 +474,12 @@ void utcp_channels_on_ack(struct utcp_channels* utcp_channels, int32_t AckPacket
 		int count = remove_ougoing_data(utcp_channel, AckPacketId, utcp_bunch_node, _countof(utcp_bunch_node));
 		for (int i = 0; i < count; ++i)
 		{
-			free_utcp_bunch_node(utcp_bunch_node[i]);
+			free_outgoing_bunch_node(utcp_bunch_node[i]);
 		}
 	}
 }
 
-void utcp_channels_on_nak(struct utcp_channels* utcp_channels, int32_t NakPacketId, write_bunch_fn WriteBitsToSendBuffer, struct utcp_connection* fd)
+void utcp_channels_on_nak(struct utcp_channels* utcp_channels, int32_t NakPacketId, resend_bunch_fn ResendBunch, struct utcp_connection* fd)
 {
 	struct utcp_bunch_node* utcp_bunch_node[UTCP_RELIABLE_BUFFER];
 	for (int j = 0; j < utcp_channels->open_channels.num; ++j)
@@ -347,7 +492,7 @@ void utcp_channels_on_nak(struct utcp_channels* utcp_channels, int32_t NakPacket
 		int count = remove_ougoing_data(utcp_channel, NakPacketId, utcp_bunch_node, _countof(utcp_bunch_node));
 		for (int i = 0; i < count; ++i)
 		{
-			int32_t packet_id = WriteBitsToSendBuffer(fd, utcp_bunch_node[i]->bunch_data, utcp_bunch_node[i]->bunch_data_len);
+			int32_t packet_id = ResendBunch(fd, utcp_bunch_node[i]);
 			utcp_bunch_node[i]->packet_id = packet_id;
 			add_ougoing_data(utcp_channel, utcp_bunch_node[i]);
 
@@ -8,13 +8,20 @@
 #include <stdlib.h>
 
 struct utcp_bunch_node* alloc_utcp_bunch_node();
+// An outgoing reliable bunch whose data stays in the shared bunch, the node holds a reference to it
+struct utcp_bunch_node* alloc_shared_bunch_node(struct utcp_shared_bunch* shared);
 void free_utcp_bunch_node(struct utcp_bunch_node* utcp_bunch_node);
+// For the nodes of OutRec, which may hold a shared bunch
+void free_outgoing_bunch_node(struct utcp_bunch_node* utcp_bunch_node);
+void release_shared_bunch(struct utcp_shared_bunch* shared);
 
 bool enqueue_incoming_data(struct utcp_channel* utcp_channel, struct utcp_bunch_node* utcp_bunch_node);
 struct utcp_bunch_node* dequeue_incoming_data(struct utcp_channel* utcp_channel, int sequence);
 
 void add_ougoing_data(struct utcp_channel* utcp_channel, struct utcp_bunch_node* utcp_bunch_node);
 int remove_ougoing_data(struct utcp_channel* utcp_channel, int32_t packet_id, struct utcp_bunch_node* bunch_node[], int bunch_node_size);
+// Sequences from the oldest reliable bunch not acked yet to the last one sent, 0 if all are acked
+int32_t outgoing_reliable_span(struct utcp_channel* utcp_channel);
 
 enum merge_partial_result
 {
@@ -23,13 +30,21 @@ enum merge_partial_result
 	partial_merge_succeed = 0,
 	partial_available = 1,
 };
-enum merge_partial_result merge_partial_data(struct utcp_channel* utcp_channel, struct utcp_bunch_node* utcp_bunch_node, bool* bOutSkipAck);
+// The bunch data is copied from Data at DataBitOffset, the caller keeps the bunch
+enum merge_partial_result merge_partial_data(struct utcp_channel* utcp_channel, const struct utcp_bunch* utcp_bunch, const uint8_t* Data, size_t DataBitOffset,
+											 bool* bOutSkipAck);
 void clear_partial_data(struct utcp_channel* utcp_channel);
-int get_partial_bunch(struct utcp_channel* utcp_channel, struct utcp_bunch* bunches[], int bunches_size);
+void free_partial_data(struct utcp_channel* utcp_channel);
+struct utcp_partial_bunch* get_partial_bunch(struct utcp_channel* utcp_channel);
+
+int mark_unordered_incoming(struct utcp_channel* utcp_channel, int32_t sequence);
+void shift_unordered_incoming(struct utcp_channel* utcp_channel);
 
 void utcp_channels_uninit(struct utcp_channels* utcp_channels);
 struct utcp_channel* utcp_channels_get_channel(struct utcp_channels* utcp_channels, struct utcp_bunch* utcp_bunch);
+void utcp_channels_mark_close(struct utcp_channels* utcp_channels, struct utcp_channel* utcp_channel, int8_t CloseReason);
+void utcp_channels_set_unordered(struct utcp_channels* utcp_channels, uint16_t ChIndex, bool unordered);
 void utcp_channels_on_ack(struct utcp_channels* utcp_channels, int32_t AckPacketId);
-typedef int (*write_bunch_fn)(struct utcp_connection* fd, const uint8_t* Bits, const int32_t SizeInBits);
-void utcp_channels_on_nak(struct utcp_channels* utcp_channels, int32_t NakPacketId, write_bunch_fn WriteBitsToSendBuffer, struct utcp_connection* fd);
+typedef int (*resend_bunch_fn)(struct utcp_connection* fd, const struct utcp_bunch_node* utcp_bunch_node);
+void utcp_channels_on_nak(struct utcp_channels* utcp_channels, int32_t NakPacketId, resend_bunch_fn ResendBunch, struct utcp_connection* fd);
 void utcp_delay_close_channel(struct utcp_channels* utcp_channels);
@@ -3,12 +3,28 @@
 #pragma once
 
 #include "3rd/dl_list.h"
+#include "utcp_bunch.h"
 #include "utcp_def.h"
 #include <stdint.h>
 #include <stdlib.h>
 
 #define UTCP_MAX_PACKET 1024
 #define DEFAULT_MAX_CHANNEL_SIZE 32767
+#define UTCP_UNORDERED_WINDOW 256
+// NetMaxConstructedPartialBunchSizeBytes
+#define UTCP_MAX_PARTIAL_BUNCH_BYTES (64 * 1024)
+#define UTCP_MAX_PARTIAL_BUNCHES 256
+
+// A bunch serialized once for utcp_send_shared_bunch, every connection it is sent to only patches ChSequence into a copy of the header
+struct utcp_shared_bunch
+{
+	int32_t RefCount; // The caller and every reliable bunch not acked yet, connections of one thread only
+	struct utcp_bunch_header Header;
+	uint16_t HeaderBitsNum; // The full header, with ChSequence 0
+	uint16_t ChSequencePos; // Where ChSequence is in HeaderBits, reliable bunches only
+	uint8_t HeaderBits[MAX_BUNCH_HEADER_BYTES];
+	uint8_t Data[]; // Header.DataBitsLen bits
+};
 
 struct utcp_bunch_node
 {
@@ -19,15 +35,28 @@ struct utcp_bunch_node
 		struct
 		{
 			int32_t packet_id;
+			int32_t ch_sequence;
+			struct utcp_shared_bunch* shared; // Outgoing: the data follows bunch_data in shared->Data, NULL if bunch_data has it all
 			uint16_t bunch_data_len;
 			uint8_t bunch_data[UDP_MTU_SIZE];
 		};
 	};
 };
 
+// Partial bunches received so far, their data appended to one contiguous buffer as they arrive
+struct utcp_partial_bunch
+{
+	struct utcp_bunch Header; // The header of the initial bunch, updated by the following ones. Header.Data is not used
+	uint8_t* Data;
+	uint32_t DataBitsLen;
+	uint32_t DataCapacity;
+	int32_t Count; // Partial bunches merged, 0 when there is no partial bunch
+	uint16_t BunchBitsLen[UTCP_MAX_PARTIAL_BUNCHES]; // Size of every merged bunch, on_recv_bunch gets them one by one
+};
+
 struct utcp_channel
 {
-	struct dl_list_node InPartialBunch;
+	struct utcp_partial_bunch* InPartialBunch; // NULL until the first partial bunch
 
 	struct dl_list_node InRec;
 	struct dl_list_node OutRec;
@@ -38,8 +67,12 @@ struct utcp_channel
 	int32_t OutReliable;
 	int32_t InReliable;
 
+	// Unordered reliable channel: bit N is set when ChSequence InReliable + 1 + N was already delivered ahead of order
+	uint32_t InUnorderedMask[UTCP_UNORDERED_WINDOW / 32];
+
 	uint8_t bClose : 1;
 	uint8_t CloseReason : 4;
+	uint8_t bUnordered : 1;
 };
 
 struct utcp_opened_channels
@@ -56,4 +89,5 @@ struct utcp_channels
 	int32_t InitOutReliable;
 	int32_t InitInReliable;
 	uint8_t bHasChannelClose;
+	uint8_t UnorderedChannels[(DEFAULT_MAX_CHANNEL_SIZE + 7) / 8];
 };
\ No newline at end of file
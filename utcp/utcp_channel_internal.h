@@ -17,7 +17,6 @@ static inline struct utcp_channel* alloc_utcp_channel(int32_t InitInReliable, in
 	utcp_channel->OutReliable = InitOutReliable;
 	dl_list_init(&utcp_channel->InRec);
 	dl_list_init(&utcp_channel->OutRec);
-	dl_list_init(&utcp_channel->InPartialBunch);
 
 	return utcp_channel;
 }
@@ -37,12 +36,12 @@ static inline void free_utcp_channel(struct utcp_channel* utcp_channel)
 	{
 		struct dl_list_node* dl_list_node = dl_list_pop_next(&utcp_channel->OutRec);
 		struct utcp_bunch_node* cur_utcp_bunch_node = CONTAINING_RECORD(dl_list_node, struct utcp_bunch_node, dl_list_node);
-		utcp_realloc(cur_utcp_bunch_node, 0);
+		free_outgoing_bunch_node(cur_utcp_bunch_node);
 		utcp_channel->NumOutRec--;
 	}
 	assert(utcp_channel->NumOutRec == 0);
 
-	clear_partial_data(utcp_channel);
+	free_partial_data(utcp_channel);
 
 	utcp_realloc(utcp_channel, 0);
 }
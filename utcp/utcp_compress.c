@@ -0,0 +1,284 @@
+﻿#include "utcp_compress.h"
+#include <assert.h>
+#include <string.h>
+
+// Block format follows LZ4: each sequence is a token (literal length << 4 | match length - MIN_MATCH),
+// optional length extension bytes, the literals, then a 2 byte little endian offset and the match length extension.
+// The last sequence only has literals. Offsets reaching before the start of the block refer to the end of the dictionary.
+
+enum
+{
+	MIN_MATCH = 4,
+	HASH_LOG = 12,
+	HASH_SIZE = 1 << HASH_LOG,
+	MAX_OFFSET = 65535,
+	RUN_MASK = 15,
+};
+
+static struct
+{
+	uint8_t data[UTCP_MAX_DICTIONARY_SIZE];
+	int len;
+	uint16_t id;
+	uint16_t table[HASH_SIZE]; // position + 1, 0 means empty
+} dictionary;
+
+static inline uint32_t read32(const uint8_t* p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline uint32_t hash32(const uint8_t* p)
+{
+	return (read32(p) * 2654435761u) >> (32 - HASH_LOG);
+}
+
+void utcp_compress_set_dictionary(const uint8_t* dict, int dict_len)
+{
+	memset(&dictionary, 0, sizeof(dictionary));
+	if (!dict || dict_len <= 0)
+		return;
+
+	// Only the tail can be reached, keep the most recent data
+	if (dict_len > UTCP_MAX_DICTIONARY_SIZE)
+	{
+		dict += dict_len - UTCP_MAX_DICTIONARY_SIZE;
+		dict_len = UTCP_MAX_DICTIONARY_SIZE;
+	}
+	memcpy(dictionary.data, dict, dict_len);
+	dictionary.len = dict_len;
+
+	for (int pos = 0; pos + MIN_MATCH <= dict_len; ++pos)
+	{
+		dictionary.table[hash32(dictionary.data + pos)] = (uint16_t)(pos + 1);
+	}
+
+	// FNV-1a, folded to 16 bits, both sides must agree on it during the handshake
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < dict_len; ++i)
+	{
+		hash = (hash ^ dict[i]) * 16777619u;
+	}
+	dictionary.id = (uint16_t)((hash >> 16) ^ hash);
+	if (dictionary.id == 0)
+		dictionary.id = 1;
+}
+
+uint16_t utcp_compress_dictionary_id()
+{
+	return dictionary.id;
+}
+
+static inline int count_match(const uint8_t* ip, const uint8_t* iend, const uint8_t* match, const uint8_t* match_end)
+{
+	const uint8_t* start = ip;
+	while (ip + sizeof(uint64_t) <= iend && match + sizeof(uint64_t) <= match_end)
+	{
+		uint64_t a, b;
+		memcpy(&a, ip, sizeof(a));
+		memcpy(&b, match, sizeof(b));
+		if (a != b)
+			break;
+		ip += sizeof(uint64_t);
+		match += sizeof(uint64_t);
+	}
+	while (ip < iend && match < match_end && *ip == *match)
+	{
+		ip++;
+		match++;
+	}
+	return (int)(ip - start);
+}
+
+static inline bool write_length(uint8_t** op, uint8_t* oend, int len)
+{
+	for (; len >= 255; len -= 255)
+	{
+		if (*op >= oend)
+			return false;
+		*(*op)++ = 255;
+	}
+	if (*op >= oend)
+		return false;
+	*(*op)++ = (uint8_t)len;
+	return true;
+}
+
+// match_len == 0 writes the last sequence
+static bool write_sequence(uint8_t** op, uint8_t* oend, const uint8_t* literals, int literal_len, int offset, int match_len)
+{
+	if (*op >= oend)
+		return false;
+
+	uint8_t* token = (*op)++;
+	int match_code = match_len ? match_len - MIN_MATCH : 0;
+	*token = (uint8_t)(((literal_len < RUN_MASK ? literal_len : RUN_MASK) << 4) | (match_code < RUN_MASK ? match_code : RUN_MASK));
+
+	if (literal_len >= RUN_MASK && !write_length(op, oend, literal_len - RUN_MASK))
+		return false;
+
+	if (oend - *op < literal_len)
+		return false;
+	memcpy(*op, literals, literal_len);
+	*op += literal_len;
+
+	if (match_len == 0)
+		return true;
+
+	if (oend - *op < 2)
+		return false;
+	*(*op)++ = (uint8_t)offset;
+	*(*op)++ = (uint8_t)(offset >> 8);
+
+	if (match_code >= RUN_MASK && !write_length(op, oend, match_code - RUN_MASK))
+		return false;
+	return true;
+}
+
+int utcp_compress(const uint8_t* src, int src_len, uint8_t* dst, int dst_cap)
+{
+	assert(src_len < MAX_OFFSET);
+
+	uint16_t table[HASH_SIZE];
+	memset(table, 0, sizeof(table));
+
+	const uint8_t* ip = src;
+	const uint8_t* anchor = src;
+	const uint8_t* iend = src + src_len;
+	uint8_t* op = dst;
+	uint8_t* oend = dst + dst_cap;
+
+	while (ip + MIN_MATCH <= iend)
+	{
+		uint32_t h = hash32(ip);
+		uint16_t candidate = table[h];
+		table[h] = (uint16_t)(ip - src + 1);
+
+		int offset = 0;
+		int match_len = 0;
+		if (candidate)
+		{
+			const uint8_t* match = src + candidate - 1;
+			if (read32(match) == read32(ip))
+			{
+				offset = (int)(ip - match);
+				match_len = count_match(ip, iend, match, iend);
+			}
+		}
+
+		if (match_len == 0 && dictionary.table[h])
+		{
+			int dict_pos = dictionary.table[h] - 1;
+			int dict_offset = (int)(ip - src) + dictionary.len - dict_pos;
+			if (dict_offset <= MAX_OFFSET && read32(dictionary.data + dict_pos) == read32(ip))
+			{
+				offset = dict_offset;
+				match_len = count_match(ip, iend, dictionary.data + dict_pos, dictionary.data + dictionary.len);
+				// The match runs off the end of the dictionary and continues at the start of the block
+				if (dict_pos + match_len == dictionary.len)
+					match_len += count_match(ip + match_len, iend, src, ip);
+			}
+		}
+
+		if (match_len < MIN_MATCH)
+		{
+			ip++;
+			continue;
+		}
+
+		if (!write_sequence(&op, oend, anchor, (int)(ip - anchor), offset, match_len))
+			return -1;
+
+		ip += match_len;
+		anchor = ip;
+	}
+
+	if (!write_sequence(&op, oend, anchor, (int)(iend - anchor), 0, 0))
+		return -1;
+	return (int)(op - dst);
+}
+
+static inline bool read_length(const uint8_t** ip, const uint8_t* iend, int* len)
+{
+	uint8_t byte;
+	do
+	{
+		if (*ip >= iend)
+			return false;
+		byte = *(*ip)++;
+		*len += byte;
+	} while (byte == 255);
+	return true;
+}
+
+int utcp_decompress(const uint8_t* src, int src_len, uint8_t* dst, int dst_cap)
+{
+	const uint8_t* ip = src;
+	const uint8_t* iend = src + src_len;
+	uint8_t* op = dst;
+	uint8_t* oend = dst + dst_cap;
+
+	while (ip < iend)
+	{
+		uint8_t token = *ip++;
+
+		int literal_len = token >> 4;
+		if (literal_len == RUN_MASK && !read_length(&ip, iend, &literal_len))
+			return -1;
+		if (literal_len > iend - ip || literal_len > oend - op)
+			return -1;
+		memcpy(op, ip, literal_len);
+		ip += literal_len;
+		op += literal_len;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		int offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		int match_len = token & RUN_MASK;
+		if (match_len == RUN_MASK && !read_length(&ip, iend, &match_len))
+			return -1;
+		match_len += MIN_MATCH;
+
+		if (offset == 0 || match_len > oend - op)
+			return -1;
+
+		const uint8_t* match;
+		int produced = (int)(op - dst);
+		if (offset > produced)
+		{
+			int back = offset - produced;
+			if (back > dictionary.len)
+				return -1;
+
+			int dict_len = back < match_len ? back : match_len;
+			memcpy(op, dictionary.data + dictionary.len - back, dict_len);
+			op += dict_len;
+			match_len -= dict_len;
+			match = dst;
+		}
+		else
+		{
+			match = op - offset;
+		}
+
+		if (op - match >= match_len)
+		{
+			memcpy(op, match, match_len);
+			op += match_len;
+		}
+		else
+		{
+			// Overlapping copy, repeats the pattern
+			while (match_len-- > 0)
+				*op++ = *match++;
+		}
+	}
+	return (int)(op - dst);
+}
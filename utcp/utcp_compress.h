@@ -0,0 +1,19 @@
+﻿// Copyright DPULL, Inc. All Rights Reserved.
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// LZ4 style block codec, the matches may also reference the shared dictionary set by utcp_compress_set_dictionary
+
+#define UTCP_MAX_DICTIONARY_SIZE (32 * 1024)
+
+void utcp_compress_set_dictionary(const uint8_t* dict, int dict_len);
+uint16_t utcp_compress_dictionary_id();
+
+// Returns the compressed size, or -1 if the output does not fit in dst_cap
+int utcp_compress(const uint8_t* src, int src_len, uint8_t* dst, int dst_cap);
+
+// Returns the decompressed size, or -1 if the input is malformed or the output does not fit in dst_cap
+int utcp_decompress(const uint8_t* src, int src_len, uint8_t* dst, int dst_cap);
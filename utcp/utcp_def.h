@@ -15,6 +15,19 @@ extern "C"
 struct utcp_listener;
 struct utcp_connection;
 struct utcp_bunch;
+struct utcp_bunch_view;
+struct utcp_shared_bunch;
+struct utcp_send_batch;
+struct sockaddr;
+struct sockaddr_storage;
+
+// Optional protocol features, negotiated during the handshake
+enum utcp_feature
+{
+	UTCP_FEATURE_COMPRESSION = 1 << 0, // Packet payload compression, both sides must use the same dictionary
+	UTCP_FEATURE_DELTA_HEADER = 1 << 1, // Bunch headers written relative to the previous bunch of the packet
+	UTCP_FEATURE_BYTE_ALIGNED = 1 << 2, // Bunch headers padded so that the data starts on a byte boundary
+};
 
 struct utcp_config
 {
@@ -23,15 +36,18 @@ struct utcp_config
 	void (*on_disconnect)(struct utcp_connection* fd, void* userdata, int close_reason);
 	void (*on_outgoing)(void* fd, void* userdata, const void* data, int len); // "void* fd" is "struct utcp_listener* fd" or "struct utcp_connection* fd"
 	void (*on_recv_bunch)(struct utcp_connection* fd, void* userdata, struct utcp_bunch* const bunches[], int count);
+	// Replaces on_recv_bunch when set, a bunch is only copied out of the packet when it has to wait for others
+	void (*on_recv_bunch_view)(struct utcp_connection* fd, void* userdata, const struct utcp_bunch_view* views, int count);
 	void (*on_delivery_status)(struct utcp_connection* fd, void* userdata, int32_t packet_id, bool ack);
 	void (*on_log)(int level, const char* msg, va_list args);
 	void* (*on_realloc)(void* ptr, size_t size);
 	unsigned (*on_rand)();
 
-	int64_t ElapsedTime;
+	int64_t ElapsedTime; // Microseconds, only accessed atomically: advanced by utcp_add_elapsed_time
 	uint32_t MagicHeader;
 	uint8_t MagicHeaderBits;
 	uint8_t EnableDump;
+	uint8_t Features; // enum utcp_feature, what the local side supports
 
 	uint32_t GlobalNetTravelCount;
 	// LogNetVersion: Example 1.0.0.0, NetCL: 0, EngineNetVer: 30, GameNetVer: 0 (Checksum: 2743834095)
@@ -53,30 +69,146 @@ That leaves 1472 bytes (ipv4) or 1452 (ipv6) for your data.
 */
 #define UDP_MTU_SIZE (1452)
 
+// The header fields of utcp_bunch. utcp_bunch_header is made of the same list, so the two keep the same layout, bitfields included
+#define UTCP_BUNCH_HEADER_FIELDS \
+	int32_t ChSequence; /* 内部赋值 */ \
+	int32_t PacketId;	/* 内部赋值 */ \
+	uint32_t NameIndex; \
+	uint16_t ChIndex; \
+	uint16_t DataBitsLen; \
+	uint8_t bOpen : 1; \
+	uint8_t bClose : 1; \
+	uint8_t CloseReason : 4; \
+	uint8_t bIsReplicationPaused : 1; \
+	uint8_t bReliable : 1; \
+	uint8_t bHasPackageMapExports : 1; \
+	uint8_t bHasMustBeMappedGUIDs : 1; \
+	uint8_t bPartial : 1; \
+	uint8_t bPartialInitial : 1; \
+	uint8_t bPartialFinal : 1;
+
 struct utcp_bunch
 {
-	int32_t ChSequence; // 内部赋值
-	int32_t PacketId;	// 内部赋值
-
-	uint32_t NameIndex;
-	uint16_t ChIndex;
-	uint16_t DataBitsLen;
-
-	uint8_t bOpen : 1;
-	uint8_t bClose : 1;
-	uint8_t CloseReason : 4;
-	uint8_t bIsReplicationPaused : 1;
-	uint8_t bReliable : 1;
-
-	uint8_t bHasPackageMapExports : 1;
-	uint8_t bHasMustBeMappedGUIDs : 1;
-	uint8_t bPartial : 1;
-	uint8_t bPartialInitial : 1;
-	uint8_t bPartialFinal : 1;
+	UTCP_BUNCH_HEADER_FIELDS
 
 	uint8_t Data[UDP_MTU_SIZE];
 };
 
+// The header fields of utcp_bunch, for utcp_send_bunch_iov which takes the data in fragments. DataBitsLen (内部赋值) is the sum of the fragments
+struct utcp_bunch_header
+{
+	UTCP_BUNCH_HEADER_FIELDS
+};
+
+// A payload fragment for utcp_send_bunch_iov, fragments do not have to end on a byte boundary
+struct utcp_iov
+{
+	const uint8_t* Data;
+	uint32_t DataBitsLen;
+};
+
+// A packet of utcp_send_batch, fd and userdata are the arguments on_outgoing would have got
+struct utcp_send_batch_item
+{
+	void* fd;
+	void* userdata; // The caller finds the address from it
+	uint32_t Offset; // Of the packet in Buffer
+	uint32_t Len;
+};
+
+// Outgoing packets collected for the caller, who sends them all at once (e.g. sendmmsg) and empties the batch
+struct utcp_send_batch
+{
+	uint8_t* Buffer;
+	uint32_t BufferSize;
+	uint32_t BufferUsed;
+	struct utcp_send_batch_item* Items;
+	int32_t ItemCapacity;
+	int32_t Count;
+	// Called when the next packet does not fit, it has to send and empty the batch. Without it the packet goes to on_outgoing
+	void (*on_full)(struct utcp_send_batch* batch);
+	void* userdata;
+};
+
+// A received bunch for on_recv_bunch_view, only valid during the callback
+struct utcp_bunch_view
+{
+	const struct utcp_bunch* Bunch; // The header fields, Bunch->Data is only filled in when Data points to it
+	const uint8_t* Data;			// DataBitsLen bits starting at DataBitOffset, usually the received packet itself
+	uint32_t DataBitOffset;
+	uint32_t DataBitsLen; // A completed partial bunch comes as one view of the whole payload, which may not fit Bunch->DataBitsLen
+	// A completed partial bunch: the DataBitsLen of every partial bunch it was merged from, see utcp_bunch_view_split. NULL otherwise
+	const uint16_t* PartialBitsLen;
+	int32_t PartialCount;
+};
+
+// A client address as the listener keys it: the string given to utcp_listener_incoming, or the binary form of the
+// sockaddr given to utcp_listener_incoming_addr. See utcp_address_format and utcp_address_to_sockaddr
+struct utcp_address
+{
+	uint8_t Len;
+	uint8_t Data[64]; // ADDRSTR_PORT_SIZE
+};
+
+// A validated challenge response waiting in the listener for the caller to accept it, see utcp_listener_set_pending_accepts
+struct utcp_accept_info
+{
+	struct utcp_address Address;
+	uint8_t AuthorisedCookie[20]; // COOKIE_BYTE_SIZE
+	int32_t ServerSequence;
+	int32_t ClientSequence;
+	uint8_t Features;
+	uint8_t bRestartedHandshake; // The connection with the same AuthorisedCookie is taken over, the others are new connections
+};
+
+// Rate limits for connectionless packets, see utcp_listener_set_limits. A rate of 0 is no limit
+struct utcp_listener_limits
+{
+	float PrefixRate;		// Packets per second from one source prefix: the /24 of IPv4, the /64 of IPv6, the host of a string address
+	float PrefixBurst;		// How many the prefix may send at once
+	int32_t PrefixBuckets;	// The prefixes are hashed into this many buckets, the ones that collide share one
+	float ChallengeRate;	// Challenges and restart requests per second, from the whole listener
+	float ChallengeBurst;
+};
+
+// What the listener did with the connectionless packets, see utcp_listener_get_stats
+struct utcp_listener_stats
+{
+	uint64_t Dropped;		  // Malformed, or not a packet a client sends to a listener: -1, -2, -4, -9
+	uint64_t RateLimited;	  // Over the prefix rate or the challenge budget: -10
+	uint64_t Challenged;	  // Initial packets answered with a challenge
+	uint64_t RestartRequests; // Packets of unknown connections answered with a restart request
+	uint64_t Rejected;		  // Challenge responses with a stale or wrong cookie, or no room to wait: -6, -7, -8
+	uint64_t Accepted;		  // Challenge responses acked
+};
+
+// Big enough for any handshake packet the listener sends: challenge, ack or restart request
+#define UTCP_HANDSHAKE_REPLY_SIZE 64
+
+// A connectionless datagram for utcp_listener_incoming_batch, which fills in the result and the reply
+struct utcp_listener_datagram
+{
+	const char* Address;
+	const uint8_t* Buffer;
+	int32_t Len;
+	const struct sockaddr* SockAddr; // Used instead of Address when set, like utcp_listener_incoming_addr
+	int32_t SockAddrLen;
+	int32_t Result; // What utcp_listener_incoming returns for it
+	int32_t ReplyLen; // 0 when nothing is sent back
+	uint8_t Reply[UTCP_HANDSHAKE_REPLY_SIZE];
+};
+
+// A packet whose header was parsed by utcp_peep_packet, utcp_incoming_peeked continues after the header
+struct utcp_peeked_packet
+{
+	int32_t PacketId;
+	uint32_t SizeBits;		// Without the end bit, a datagram may be larger than UTCP_MAX_PACKET
+	uint32_t HeaderEndBits; // Where the bunches start
+	uint8_t SessionID;
+	uint8_t ClientID;
+	uint64_t PacketHeader[8]; // struct packet_header
+};
+
 #ifdef __cplusplus
 }
 #endif
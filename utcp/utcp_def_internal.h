@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "sha1.h"
 #include "utcp_channel_def.h"
 #include "utcp_def.h"
 #include "utcp_packet_notify_def.h"
@@ -26,6 +27,8 @@ enum
 #define SECRET_UPDATE_TIME 15.f
 #define SECRET_UPDATE_TIME_VARIANCE 5.f
 #define UTCP_CONNECT_TIMEOUT (120 * 1000)
+// How long (ms) the packet order cache waits for missing packets before they are treated as lost
+#define PACKET_ORDER_CACHE_TIMEOUT 100
 
 // The maximum allowed lifetime (in seconds) of any one handshake cookie
 #define MAX_COOKIE_LIFETIME ((SECRET_UPDATE_TIME + SECRET_UPDATE_TIME_VARIANCE) * (float)SECRET_COUNT)
@@ -41,7 +44,10 @@ struct utcp_listener
 	uint8_t bRestartedHandshake : 1;
 
 	/** The serverside-only 'secret' value, used to help with generating cookies. */
-	uint8_t HandshakeSecret[SECRET_BYTE_SIZE][SECRET_COUNT];
+	uint8_t HandshakeSecret[SECRET_COUNT][SECRET_BYTE_SIZE];
+
+	/** HandshakeSecret as HMAC keys, kept in step with it */
+	struct sha1_hmac_key HandshakeKeys[SECRET_COUNT];
 
 	/** Which of the two secret values above is active (values are changed frequently, to limit replay attacks) */
 	uint8_t ActiveSecret;
@@ -61,7 +67,33 @@ struct utcp_listener
 	/** The initial client sequence value, from the last successful handshake */
 	int32_t LastClientSequence;
 
-	char LastChallengeSuccessAddress[ADDRSTR_PORT_SIZE];
+	struct utcp_address LastChallengeSuccessAddress;
+
+	/** The features agreed with the client, from the last successful handshake */
+	uint8_t LastFeatures;
+
+	// The successful handshakes waiting for utcp_listener_take_accepts, one per address. No table: on_accept right away.
+	// A ring of PendingAcceptCapacity from PendingAcceptHead, and PendingAcceptIndex finds the slot of an address: open
+	// addressing over PendingAcceptIndexMask + 1 entries, at least twice the capacity, -1 is empty
+	struct utcp_accept_info* PendingAccepts;
+	int32_t* PendingAcceptIndex;
+	int32_t PendingAcceptHead;
+	int32_t PendingAcceptCount;
+	int32_t PendingAcceptCapacity;
+	uint32_t PendingAcceptIndexMask;
+	uint32_t PendingAcceptSeed;
+
+	// utcp_listener_set_limits. A bucket is the time it is full again (GCRA), 0 is full
+	struct utcp_listener_limits Limits;
+	double* PrefixBuckets;
+	uint32_t PrefixSeed;
+	double ChallengeBucket;
+
+	struct utcp_listener_stats Stats;
+
+	// utcp_listener_incoming_batch: the datagram being handled, which takes the reply, and its cookie hashed with the batch
+	struct utcp_listener_datagram* BatchDatagram;
+	const struct utcp_batch_cookie* BatchCookie;
 };
 
 struct utcp_challenge_data
@@ -103,6 +135,42 @@ struct utcp_challenge_data
 	uint32_t CachedClientID;
 };
 
+// The previous bunch header of the packet, for UTCP_FEATURE_DELTA_HEADER
+struct utcp_bunch_delta_context
+{
+	uint32_t NameIndex;
+	int32_t ChSequence;
+	uint16_t ChIndex;
+	uint16_t Flags;
+	uint8_t bValid;
+};
+
+enum
+{
+	// Power of two, a packet is held back when at most PACKET_ORDER_CACHE_SIZE - 1 packets are missing before it
+	PACKET_ORDER_CACHE_SIZE = 32,
+};
+
+struct utcp_cached_packet
+{
+	int32_t PacketId;
+	uint16_t SizeBits;
+	uint16_t HeaderEndBits;
+	struct packet_header PacketHeader;
+	uint8_t Data[UTCP_MAX_PACKET + 32 /*MagicHeader*/ + 1 /*EndBits*/];
+};
+
+// UNetConnection::PacketOrderCache, a ring indexed by PacketId
+struct utcp_packet_order_cache
+{
+	struct utcp_cached_packet* Slots[PACKET_ORDER_CACHE_SIZE];
+	struct utcp_cached_packet* Pool[PACKET_ORDER_CACHE_SIZE]; // Released buffers, reused by the next out of order packets
+	uint8_t PoolCount;
+	uint8_t Count;
+	uint8_t bFlushing;
+	int64_t WaitStart; // When the oldest gap started being waited for
+};
+
 struct utcp_connection
 {
 	void* userdata;
@@ -111,6 +179,9 @@ struct utcp_connection
 	uint8_t bClose : 1;
 	uint8_t CloseReason : 7;
 
+	/** enum utcp_feature, agreed by both sides during the handshake */
+	uint8_t Features;
+
 	/** The cookie which completed the connection handshake. */
 	uint8_t AuthorisedCookie[COOKIE_BYTE_SIZE];
 
@@ -128,19 +199,39 @@ struct utcp_connection
 
 	struct packet_notify packet_notify;
 
+	/** Out of order packets waiting for the missing ones, NULL unless enabled by utcp_set_packet_order_cache */
+	struct utcp_packet_order_cache* PacketOrderCache;
+
 	struct utcp_channels channels;
 
 	/** Keep old behavior where we send a packet with only acks even if we have no other outgoing data if we got incoming data */
-	uint32_t HasDirtyAcks; // TODO 这个变量究竟做什么
+	uint32_t HasDirtyAcks; // Packets received since the last sent packet, their acks are still to be sent
 
 	uint8_t SendBuffer[UTCP_MAX_PACKET + 32 /*MagicHeader*/ + 1 /*EndBits*/];
 	size_t SendBufferBitsNum;
 
 	int64_t LastSendTime; // Last time a packet was sent, for keepalives.
 
+	/** Last unreliable bunch written to SendBuffer, the next bunch of the same channel may be merged into it (LastEnd == 0 means none) */
+	size_t LastStart;
+	size_t LastEnd;
+	uint16_t LastOutHeaderBits;
+	uint16_t LastOutDataBitsLen;
+	uint16_t LastOutChIndex;
+	uint8_t LastOutFlags;
+
+	/** Bunch header bits saved by merging in the current packet */
+	uint32_t MergedHeaderBits;
+
+	/** The last bunch header written to SendBuffer, invalid after raw bits such as resends */
+	struct utcp_bunch_delta_context OutDeltaContext;
+
 	/** Stores the bit number where we wrote the dummy packet info in the packet header */
 	// size_t HeaderMarkForPacketInfo;
 
+	/** Stores the bit number of the compression flag, the payload after it may be replaced by its compressed form */
+	size_t HeaderMarkForCompression;
+
 	uint8_t LastSessionID;
 	uint8_t LastClientID;
 };
@@ -193,4 +284,10 @@ enum UTcpNetCloseResult
 
 	/** Reliable buffer overflowed when attempting to send */
 	ReliableBufferOverflow,
+
+	/** Compressed packet payload could not be decompressed */
+	PacketDecompressFail,
+
+	/** A reliable partial bunch could not be merged, its data is lost */
+	PartialMergeFail,
 };
\ No newline at end of file
@@ -1,6 +1,7 @@
 ﻿#include "utcp_handshake.h"
 #include "bit_buffer.h"
 #include "utcp.h"
+#include "utcp_compress.h"
 #include "utcp_packet.h"
 #include "utcp_sequence_number.h"
 #include "utcp_utils.h"
@@ -50,6 +51,12 @@ enum
 
 	/** RESTART_RESPONSE_SIZE_BITS for EHandshakeVersion::Randomized */
 	VerRandomizedRestartResponseSizeBits = 419,
+
+	/** Marks the feature trailer at the start of the random data, peers without it write zeros there */
+	FeatureTrailerMagic = 0x5546,
+
+	/** Magic + Features + ~Features + DictionaryId */
+	FeatureTrailerSizeBytes = 6,
 };
 
 enum utcp_challenge_state
@@ -108,6 +115,12 @@ struct FParsedHandshakeData
 
 	/** If this is a restart handshake challenge response, this is the original handshake's cookie */
 	uint8_t OrigCookie[COOKIE_BYTE_SIZE];
+
+	/** The features from the trailer in the random data, 0 if there is none */
+	uint8_t RemoteFeatures;
+
+	/** The compression dictionary id of the remote side */
+	uint16_t RemoteDictionaryId;
 };
 
 static uint8_t CachedGlobalNetTravelCount()
@@ -136,26 +149,97 @@ static inline int32_t GetAdjustedSizeBits(int32_t InSizeBits, uint8_t InHandshak
 	return ReturnVal;
 }
 
-// StatelessConnectHandlerComponent::GenerateCookie
-extern void sha1_hmac_buffer(const void* Key, uint32_t KeySize, const void* Data, uint64_t DataSize, uint8_t* OutHash);
-static void GenerateCookie(struct utcp_listener* fd, const char* ClientAddress, uint8_t SecretId, double Timestamp, uint8_t* OutCookie)
+enum
+{
+	CookieDataSize = sizeof(double) + sizeof(size_t) + ADDRSTR_PORT_SIZE,
+	// utcp_listener_incoming_batch hashes this many cookies at once
+	BatchCookieCount = 64,
+};
+
+// A cookie hashed by utcp_listener_incoming_batch before the handshake code asks for it
+struct utcp_batch_cookie
 {
-	size_t ClientAddressLen = strlen(ClientAddress);
-	uint8_t CookieData[sizeof(double) + sizeof(int32_t) + ADDRSTR_PORT_SIZE];
+	const struct utcp_address* Address;
+	uint8_t SecretId;
+	double Timestamp;
+	uint8_t Cookie[COOKIE_BYTE_SIZE];
+};
+
+static size_t MakeCookieData(const struct utcp_address* ClientAddress, double Timestamp, uint8_t CookieData[CookieDataSize])
+{
+	size_t ClientAddressLen = ClientAddress->Len;
 	size_t Offset = 0;
 
 	memcpy(CookieData + Offset, &Timestamp, sizeof(Timestamp));
 	Offset += sizeof(Timestamp);
 	memcpy(CookieData + Offset, &ClientAddressLen, sizeof(ClientAddressLen));
 	Offset += sizeof(ClientAddressLen);
-	memcpy(CookieData + Offset, ClientAddress, ClientAddressLen);
+	memcpy(CookieData + Offset, ClientAddress->Data, ClientAddressLen);
 	Offset += ClientAddressLen;
+	return Offset;
+}
+
+// StatelessConnectHandlerComponent::GenerateCookie
+static void GenerateCookie(struct utcp_listener* fd, const struct utcp_address* ClientAddress, uint8_t SecretId, double Timestamp, uint8_t* OutCookie)
+{
+	const struct utcp_batch_cookie* BatchCookie = fd->BatchCookie;
+	if (BatchCookie && BatchCookie->Address == ClientAddress && BatchCookie->SecretId == !!SecretId && BatchCookie->Timestamp == Timestamp)
+	{
+		memcpy(OutCookie, BatchCookie->Cookie, COOKIE_BYTE_SIZE);
+		return;
+	}
+
+	uint8_t CookieData[CookieDataSize];
+	size_t Size = MakeCookieData(ClientAddress, Timestamp, CookieData);
+	sha1_hmac_key_buffer(&fd->HandshakeKeys[!!SecretId], CookieData, Size, OutCookie);
+}
+
+// The features a connection can use, given what the remote side supports
+static uint8_t AgreeFeatures(uint8_t RemoteFeatures, uint16_t RemoteDictionaryId)
+{
+	struct utcp_config* utcp_config = utcp_get_config();
+	uint8_t Features = utcp_config->Features & RemoteFeatures;
+	if (RemoteDictionaryId != utcp_compress_dictionary_id())
+	{
+		Features &= ~UTCP_FEATURE_COMPRESSION;
+	}
+	return Features;
+}
+
+// The feature trailer takes the place of the first random data bytes
+static void WriteFeatureTrailer(struct bitbuf* bitbuf, uint8_t Features)
+{
+	uint16_t Magic = FeatureTrailerMagic;
+	uint8_t InvFeatures = (uint8_t)~Features;
+	uint16_t DictionaryId = utcp_compress_dictionary_id();
+	bitbuf_write_bytes(bitbuf, &Magic, sizeof(Magic));
+	bitbuf_write_bytes(bitbuf, &Features, sizeof(Features));
+	bitbuf_write_bytes(bitbuf, &InvFeatures, sizeof(InvFeatures));
+	bitbuf_write_bytes(bitbuf, &DictionaryId, sizeof(DictionaryId));
+}
+
+static void ReadFeatureTrailer(struct bitbuf* bitbuf, struct FParsedHandshakeData* OutResult)
+{
+	if (bitbuf_left_bits(bitbuf) < FeatureTrailerSizeBytes * 8)
+		return;
+
+	uint16_t Magic;
+	uint8_t Features;
+	uint8_t InvFeatures;
+	uint16_t DictionaryId;
+	bitbuf_read_bytes(bitbuf, &Magic, sizeof(Magic));
+	bitbuf_read_bytes(bitbuf, &Features, sizeof(Features));
+	bitbuf_read_bytes(bitbuf, &InvFeatures, sizeof(InvFeatures));
+	bitbuf_read_bytes(bitbuf, &DictionaryId, sizeof(DictionaryId));
+	if (Magic != FeatureTrailerMagic || Features != (uint8_t)~InvFeatures)
+		return;
 
-	sha1_hmac_buffer(fd->HandshakeSecret[!!SecretId], SECRET_BYTE_SIZE, CookieData, Offset, OutCookie);
+	OutResult->RemoteFeatures = Features;
+	OutResult->RemoteDictionaryId = DictionaryId;
 }
 
 // StatelessConnectHandlerComponent::CapHandshakePacket
-void CapHandshakePacket(struct utcp_challenge_data* challenge_data, struct bitbuf* bitbuf, uint8_t HandshakeVersion)
+void CapHandshakePacket(struct utcp_challenge_data* challenge_data, struct bitbuf* bitbuf, uint8_t HandshakeVersion, uint8_t Features)
 {
 	size_t NumBits = bitbuf->num - GetAdjustedSizeBits(0, HandshakeVersion);
 	if (HandshakeVersion == EHandshakeVersion_Original)
@@ -182,11 +266,17 @@ void CapHandshakePacket(struct utcp_challenge_data* challenge_data, struct bitbu
 				RandomDataLengthBytes = RandomDataLengthBytes > 0 ? RandomDataLengthBytes : 0;
 			}
 		}
+		if (Features && RandomDataLengthBytes >= FeatureTrailerSizeBytes)
+		{
+			WriteFeatureTrailer(bitbuf, Features);
+			RandomDataLengthBytes -= FeatureTrailerSizeBytes;
+		}
+		uint8_t RandData[BaseRandomDataLengthBytes];
 		for (int32_t RandIdx = 0; RandIdx < RandomDataLengthBytes; RandIdx++)
 		{
-			uint8_t RandVal = utcp_rand() % 255;
-			bitbuf_read_bytes(bitbuf, &RandVal, sizeof(RandVal));
+			RandData[RandIdx] = utcp_rand() % 255;
 		}
+		bitbuf_write_bytes(bitbuf, RandData, RandomDataLengthBytes);
 	}
 
 	// Add a termination bit, the same as the UNetConnection code does
@@ -199,7 +289,7 @@ void CapHandshakePacket(struct utcp_challenge_data* challenge_data, struct bitbu
 }
 
 // StatelessConnectHandlerComponent::SendConnectChallenge
-static void SendConnectChallenge(struct utcp_listener* fd, const char* address, uint8_t HandshakeVersion, uint8_t ClientSentHandshakePacketCount, uint32_t InClientID,
+static void SendConnectChallenge(struct utcp_listener* fd, const struct utcp_address* address, uint8_t HandshakeVersion, uint8_t ClientSentHandshakePacketCount, uint32_t InClientID,
 								 uint32_t LocalNetworkVersion)
 {
 	// GetAdjustedSizeBits(HANDSHAKE_PACKET_SIZE_BITS) + 1 /* Termination bit */
@@ -238,7 +328,7 @@ static void SendConnectChallenge(struct utcp_listener* fd, const char* address,
 	bitbuf_write_bytes(&bitbuf, &Timestamp, sizeof(Timestamp));
 	bitbuf_write_bytes(&bitbuf, Cookie, sizeof(Cookie));
 
-	CapHandshakePacket(NULL, &bitbuf, HandshakeVersion);
+	CapHandshakePacket(NULL, &bitbuf, HandshakeVersion, 0);
 
 	utcp_raw_send(fd, bitbuf.buffer, bitbuf_num_bytes(&bitbuf));
 }
@@ -263,7 +353,7 @@ static void SendRestartHandshakeRequest(struct utcp_listener* fd, uint8_t Handsh
 	{
 		uint8_t MinVersion = EHandshakeVersion_Randomized;
 		uint8_t CurVersion = HandshakeVersion;
-		uint8_t HandshakePacketType = EHandshakePacketType_Challenge;
+		uint8_t HandshakePacketType = EHandshakePacketType_RestartHandshake;
 		bitbuf_write_bytes(&bitbuf, &MinVersion, sizeof(MinVersion));
 		bitbuf_write_bytes(&bitbuf, &CurVersion, sizeof(CurVersion));
 		bitbuf_write_bytes(&bitbuf, &HandshakePacketType, sizeof(HandshakePacketType));
@@ -275,14 +365,14 @@ static void SendRestartHandshakeRequest(struct utcp_listener* fd, uint8_t Handsh
 		bitbuf_write_bytes(&bitbuf, &LocalNetworkVersion, sizeof(LocalNetworkVersion));
 	}
 
-	CapHandshakePacket(NULL, &bitbuf, HandshakeVersion);
+	CapHandshakePacket(NULL, &bitbuf, HandshakeVersion, 0);
 
 	utcp_raw_send(fd, bitbuf.buffer, bitbuf_num_bytes(&bitbuf));
 }
 
 // StatelessConnectHandlerComponent::SendChallengeAck
 static void SendChallengeAck(struct utcp_listener* listener_fd, struct utcp_connection* fd, uint8_t InCookie[COOKIE_BYTE_SIZE], uint8_t HandshakeVersion,
-							 uint8_t ClientSentHandshakePacketCount, uint32_t InClientID, uint32_t LocalNetworkVersion)
+							 uint8_t ClientSentHandshakePacketCount, uint32_t InClientID, uint32_t LocalNetworkVersion, uint8_t Features)
 {
 	// GetAdjustedSizeBits(HANDSHAKE_PACKET_SIZE_BITS) + 1 /* Termination bit */
 	uint8_t buffer[UTCP_MAX_PACKET];
@@ -320,12 +410,12 @@ static void SendChallengeAck(struct utcp_listener* listener_fd, struct utcp_conn
 
 	if (listener_fd)
 	{
-		CapHandshakePacket(NULL, &bitbuf, HandshakeVersion);
+		CapHandshakePacket(NULL, &bitbuf, HandshakeVersion, Features);
 		utcp_raw_send(listener_fd, bitbuf.buffer, bitbuf_num_bytes(&bitbuf));
 	}
 	else
 	{
-		CapHandshakePacket(fd->challenge_data, &bitbuf, HandshakeVersion);
+		CapHandshakePacket(fd->challenge_data, &bitbuf, HandshakeVersion, Features);
 		utcp_raw_send(fd, bitbuf.buffer, bitbuf_num_bytes(&bitbuf));
 	}
 }
@@ -478,49 +568,237 @@ static bool ParseHandshakePacket(struct bitbuf* bitbuf, bool bIsClient, struct F
 
 	if (bValidPacket)
 	{
+		ReadFeatureTrailer(bitbuf, OutResult);
 		bitbuf->num = bitbuf->size;
 	}
 
 	return bValidPacket;
 }
 
-// StatelessConnectHandlerComponent::IncomingConnectionless
-static int IncomingConnectionless(struct utcp_listener* fd, const char* address, struct bitbuf* bitbuf)
+static_assert(sizeof(((struct utcp_address*)0)->Data) == ADDRSTR_PORT_SIZE, "utcp_address::Data");
+static_assert(sizeof(((struct utcp_accept_info*)0)->AuthorisedCookie) == COOKIE_BYTE_SIZE, "utcp_accept_info::AuthorisedCookie");
+
+static uint32_t PendingAcceptHome(const struct utcp_listener* fd, const struct utcp_address* address)
 {
-	uint8_t SessionID, ClientID, bHandshakePacket;
-	if (!read_packet_header(bitbuf, LastRemoteHandshakeVersion(), &SessionID, &ClientID, &bHandshakePacket))
-		return -2;
+	return utcp_address_hash(address, fd->PendingAcceptSeed) & fd->PendingAcceptIndexMask;
+}
 
-	if (!bHandshakePacket)
+// The index entry of address, or the empty entry it would take. The index is at most half full, a probe always ends
+static uint32_t FindPendingAcceptEntry(const struct utcp_listener* fd, const struct utcp_address* address)
+{
+	uint32_t Entry = PendingAcceptHome(fd, address);
+	for (;;)
 	{
-		SendRestartHandshakeRequest(fd, EHandshakeVersion_Original, 0, 0, 0);
-		return -3;
+		int32_t Slot = fd->PendingAcceptIndex[Entry];
+		if (Slot < 0 || utcp_address_equal(&fd->PendingAccepts[Slot].Address, address))
+			return Entry;
+		Entry = (Entry + 1) & fd->PendingAcceptIndexMask;
 	}
+}
 
-	struct FParsedHandshakeData HandshakeData;
-	ParsedHandshakeDataInit(&HandshakeData);
+// Backward shift deletion: the entries after it that probed past it move up, so no tombstones pile up
+static void RemovePendingAcceptEntry(struct utcp_listener* fd, uint32_t Entry)
+{
+	const uint32_t Mask = fd->PendingAcceptIndexMask;
+	for (uint32_t Next = (Entry + 1) & Mask;; Next = (Next + 1) & Mask)
+	{
+		int32_t Slot = fd->PendingAcceptIndex[Next];
+		if (Slot < 0)
+			break;
+		uint32_t Home = PendingAcceptHome(fd, &fd->PendingAccepts[Slot].Address);
+		if (((Next - Home) & Mask) >= ((Next - Entry) & Mask))
+		{
+			fd->PendingAcceptIndex[Entry] = Slot;
+			Entry = Next;
+		}
+	}
+	fd->PendingAcceptIndex[Entry] = -1;
+}
 
-	bHandshakePacket = ParseHandshakePacket(bitbuf, false, &HandshakeData);
-	if (!bHandshakePacket)
+static struct utcp_accept_info* FindPendingAccept(struct utcp_listener* fd, const struct utcp_address* address)
+{
+	if (fd->PendingAcceptCount == 0)
+		return NULL;
+	int32_t Slot = fd->PendingAcceptIndex[FindPendingAcceptEntry(fd, address)];
+	return Slot < 0 ? NULL : &fd->PendingAccepts[Slot];
+}
+
+bool resize_pending_accepts(struct utcp_listener* fd, int capacity)
+{
+	if (capacity > 0 && capacity < fd->PendingAcceptCount)
+		return false;
+
+	struct utcp_accept_info* PendingAccepts = NULL;
+	int32_t* PendingAcceptIndex = NULL;
+	uint32_t IndexSize = 0;
+	if (capacity > 0)
 	{
+		if (capacity > INT32_MAX / 4)
+			return false;
+		IndexSize = 2;
+		while (IndexSize < (uint32_t)capacity * 2)
+			IndexSize <<= 1;
+		PendingAccepts = (struct utcp_accept_info*)utcp_realloc(NULL, capacity * sizeof(struct utcp_accept_info));
+		PendingAcceptIndex = (int32_t*)utcp_realloc(NULL, IndexSize * sizeof(int32_t));
+		if (!PendingAccepts || !PendingAcceptIndex)
+		{
+			if (PendingAccepts)
+				utcp_realloc(PendingAccepts, 0);
+			if (PendingAcceptIndex)
+				utcp_realloc(PendingAcceptIndex, 0);
+			return false;
+		}
+	}
+
+	// The waiting accepts keep their order at the front of the new ring
+	int32_t Count = capacity > 0 ? fd->PendingAcceptCount : 0;
+	for (int32_t i = 0; i < Count; ++i)
+		memcpy(&PendingAccepts[i], &fd->PendingAccepts[(fd->PendingAcceptHead + i) % fd->PendingAcceptCapacity], sizeof(struct utcp_accept_info));
+
+	if (fd->PendingAccepts)
+		utcp_realloc(fd->PendingAccepts, 0);
+	if (fd->PendingAcceptIndex)
+		utcp_realloc(fd->PendingAcceptIndex, 0);
+
+	fd->PendingAccepts = PendingAccepts;
+	fd->PendingAcceptIndex = PendingAcceptIndex;
+	fd->PendingAcceptHead = 0;
+	fd->PendingAcceptCount = Count;
+	fd->PendingAcceptCapacity = capacity;
+	fd->PendingAcceptIndexMask = IndexSize > 0 ? IndexSize - 1 : 0;
+	if (capacity > 0)
+	{
+		// A new seed with every table, the clients pick their addresses
+		fd->PendingAcceptSeed = ((uint32_t)utcp_rand() << 16) ^ (uint32_t)utcp_rand();
+		memset(PendingAcceptIndex, 0xff, IndexSize * sizeof(int32_t));
+		for (int32_t i = 0; i < Count; ++i)
+			PendingAcceptIndex[FindPendingAcceptEntry(fd, &PendingAccepts[i].Address)] = i;
+	}
+	return true;
+}
+
+int take_pending_accepts(struct utcp_listener* fd, struct utcp_accept_info* accepts, int max)
+{
+	int count = fd->PendingAcceptCount < max ? fd->PendingAcceptCount : max;
+	for (int i = 0; i < count; ++i)
+	{
+		struct utcp_accept_info* Accept = &fd->PendingAccepts[fd->PendingAcceptHead];
+		RemovePendingAcceptEntry(fd, FindPendingAcceptEntry(fd, &Accept->Address));
+		memcpy(&accepts[i], Accept, sizeof(*Accept));
+		fd->PendingAcceptHead = (fd->PendingAcceptHead + 1) % fd->PendingAcceptCapacity;
+		fd->PendingAcceptCount--;
+	}
+	return count > 0 ? count : 0;
+}
+
+// The first half of StatelessConnectHandlerComponent::IncomingConnectionless, reading the packet.
+// -3 is a packet that is not a handshake packet, the caller asks the client to restart the handshake
+static int ParseConnectionless(struct bitbuf* bitbuf, uint8_t* OutClientID, struct FParsedHandshakeData* OutHandshakeData)
+{
+	uint8_t SessionID, bHandshakePacket;
+	if (!read_packet_header(bitbuf, LastRemoteHandshakeVersion(), &SessionID, OutClientID, &bHandshakePacket))
+		return -2;
+
+	if (!bHandshakePacket)
+		return -3;
+
+	ParsedHandshakeDataInit(OutHandshakeData);
+	if (!ParseHandshakePacket(bitbuf, false, OutHandshakeData))
 		return -4;
+
+	// Only what a client sends gets through, before any cookie is hashed: an initial packet without a timestamp, or a
+	// response with one
+	const uint8_t Type = OutHandshakeData->HandshakePacketType;
+	const double Timestamp = OutHandshakeData->Timestamp;
+	const bool bInitialPacket = Type == EHandshakePacketType_InitialPacket && Timestamp == 0.0;
+	const bool bResponse = (Type == EHandshakePacketType_Response || Type == EHandshakePacketType_RestartResponse) && Timestamp > 0.0;
+	if (!bInitialPacket && !bResponse)
+		return -4;
+	return 0;
+}
+
+// A token from a bucket kept as the time it is full again, Burst packets at once then Rate per second
+static bool TakeToken(double* Bucket, float Rate, float Burst)
+{
+	if (Rate <= 0)
+		return true;
+
+	// The clock of the connection timers, utcp_gettime is the cookie clock
+	const double Now = utcp_gettime_ms() / 1000.0;
+	const double Interval = 1.0 / Rate;
+	const double Full = *Bucket > Now ? *Bucket : Now;
+	if (Full - Now > (Burst > 1 ? Burst - 1 : 0) * Interval)
+		return false;
+	*Bucket = Full + Interval;
+	return true;
+}
+
+// utcp_listener_set_limits for a packet that was read, bReply when it is answered with a challenge or a restart request
+static int LimitConnectionless(struct utcp_listener* fd, const struct utcp_address* address, bool bReply)
+{
+	if (fd->PrefixBuckets)
+	{
+		uint32_t Index = utcp_address_prefix_hash(address, fd->PrefixSeed) % (uint32_t)fd->Limits.PrefixBuckets;
+		if (!TakeToken(&fd->PrefixBuckets[Index], fd->Limits.PrefixRate, fd->Limits.PrefixBurst))
+			return -10;
 	}
+	if (bReply && !TakeToken(&fd->ChallengeBucket, fd->Limits.ChallengeRate, fd->Limits.ChallengeBurst))
+		return -10;
+	return 0;
+}
 
-	bool bInitialConnect = HandshakeData.HandshakePacketType == EHandshakePacketType_InitialPacket && HandshakeData.Timestamp == 0.0;
-	if (bInitialConnect)
+static void CountConnectionless(struct utcp_listener* fd, int ret)
+{
+	switch (ret)
 	{
-		SendConnectChallenge(fd, address, HandshakeData.RemoteCurVersion, HandshakeData.RemoteSentHandshakePacketCount, ClientID, HandshakeData.RemoteNetworkVersion);
-		return 0;
+	case -1:
+	case -2:
+	case -4:
+	case -9:
+		fd->Stats.Dropped++;
+		break;
+	case -10:
+		fd->Stats.RateLimited++;
+		break;
+	case -6:
+	case -7:
+	case -8:
+		fd->Stats.Rejected++;
+		break;
 	}
+}
+
+static bool IsInitialConnect(const struct FParsedHandshakeData* HandshakeData)
+{
+	return HandshakeData->HandshakePacketType == EHandshakePacketType_InitialPacket && HandshakeData->Timestamp == 0.0;
+}
+
+static bool IsValidCookieTimestamp(struct utcp_listener* fd, const struct FParsedHandshakeData* HandshakeData)
+{
 	// NOTE: Allow CookieDelta to be 0.0, as it is possible for a server to send a challenge and receive a response,
 	//			during the same tick
-	bool bChallengeSuccess = false;
-	const double CookieDelta = utcp_gettime() - HandshakeData.Timestamp;
-	const double SecretDelta = HandshakeData.Timestamp - fd->LastSecretUpdateTimestamp;
+	const double CookieDelta = utcp_gettime() - HandshakeData->Timestamp;
+	const double SecretDelta = HandshakeData->Timestamp - fd->LastSecretUpdateTimestamp;
 	const bool bValidCookieLifetime = CookieDelta >= 0.0 && (MAX_COOKIE_LIFETIME - CookieDelta) > 0.0;
-	const bool bValidSecretIdTimestamp = (HandshakeData.SecretId == fd->ActiveSecret) ? (SecretDelta >= 0.0) : (SecretDelta <= 0.0);
+	const bool bValidSecretIdTimestamp = (HandshakeData->SecretId == fd->ActiveSecret) ? (SecretDelta >= 0.0) : (SecretDelta <= 0.0);
+	return bValidCookieLifetime && bValidSecretIdTimestamp;
+}
 
-	if (bValidCookieLifetime && bValidSecretIdTimestamp)
+// StatelessConnectHandlerComponent::IncomingConnectionless, once the packet is read
+// A successful challenge response is returned in OutAccept, whose Address is left empty otherwise
+static int HandleConnectionless(struct utcp_listener* fd, const struct utcp_address* address, uint8_t ClientID, const struct FParsedHandshakeData* Parsed,
+								struct utcp_accept_info* OutAccept)
+{
+	struct FParsedHandshakeData HandshakeData = *Parsed;
+	if (IsInitialConnect(&HandshakeData))
+	{
+		SendConnectChallenge(fd, address, HandshakeData.RemoteCurVersion, HandshakeData.RemoteSentHandshakePacketCount, ClientID, HandshakeData.RemoteNetworkVersion);
+		fd->Stats.Challenged++;
+		return 0;
+	}
+
+	bool bChallengeSuccess = false;
+	if (IsValidCookieTimestamp(fd, &HandshakeData))
 	{
 		// Regenerate the cookie from the packet info, and see if the received cookie matches the regenerated one
 		uint8_t RegenCookie[COOKIE_BYTE_SIZE];
@@ -531,26 +809,35 @@ static int IncomingConnectionless(struct utcp_listener* fd, const char* address,
 
 		if (bChallengeSuccess)
 		{
+			// No room to wait for the accept, the client retries the response
+			if (fd->PendingAcceptCapacity > 0 && fd->PendingAcceptCount == fd->PendingAcceptCapacity && !FindPendingAccept(fd, address))
+			{
+				return -8;
+			}
+
+			memset(OutAccept, 0, sizeof(*OutAccept));
 			if (HandshakeData.bRestartHandshake)
 			{
-				memcpy(fd->AuthorisedCookie, HandshakeData.OrigCookie, sizeof(fd->AuthorisedCookie));
+				memcpy(OutAccept->AuthorisedCookie, HandshakeData.OrigCookie, sizeof(OutAccept->AuthorisedCookie));
 			}
 			else
 			{
 				int16_t* CurSequence = (int16_t*)HandshakeData.Cookie;
 
-				fd->LastServerSequence = *CurSequence & (MAX_PACKETID - 1);
-				fd->LastClientSequence = *(CurSequence + 1) & (MAX_PACKETID - 1);
+				OutAccept->ServerSequence = *CurSequence & (MAX_PACKETID - 1);
+				OutAccept->ClientSequence = *(CurSequence + 1) & (MAX_PACKETID - 1);
 
-				memcpy(fd->AuthorisedCookie, HandshakeData.Cookie, sizeof(fd->AuthorisedCookie));
+				memcpy(OutAccept->AuthorisedCookie, HandshakeData.Cookie, sizeof(OutAccept->AuthorisedCookie));
 			}
 
-			fd->bRestartedHandshake = HandshakeData.bRestartHandshake;
-			strncpy(fd->LastChallengeSuccessAddress, address, sizeof(fd->LastChallengeSuccessAddress));
+			OutAccept->bRestartedHandshake = HandshakeData.bRestartHandshake;
+			OutAccept->Features = AgreeFeatures(HandshakeData.RemoteFeatures, HandshakeData.RemoteDictionaryId);
+			OutAccept->Address = *address;
 
 			// Now ack the challenge response - the cookie is stored in AuthorisedCookie, to enable retries
-			SendChallengeAck(fd, NULL, fd->AuthorisedCookie, HandshakeData.RemoteCurVersion, HandshakeData.RemoteSentHandshakePacketCount, ClientID,
-							 HandshakeData.RemoteNetworkVersion);
+			SendChallengeAck(fd, NULL, OutAccept->AuthorisedCookie, HandshakeData.RemoteCurVersion, HandshakeData.RemoteSentHandshakePacketCount, ClientID,
+							 HandshakeData.RemoteNetworkVersion, OutAccept->Features);
+			fd->Stats.Accepted++;
 			return 0;
 		}
 		return -7;
@@ -558,39 +845,88 @@ static int IncomingConnectionless(struct utcp_listener* fd, const char* address,
 	return -6;
 }
 
+// StatelessConnectHandlerComponent::IncomingConnectionless
+static int IncomingConnectionless(struct utcp_listener* fd, const struct utcp_address* address, struct bitbuf* bitbuf, struct utcp_accept_info* OutAccept)
+{
+	uint8_t ClientID;
+	struct FParsedHandshakeData HandshakeData;
+	int ret = ParseConnectionless(bitbuf, &ClientID, &HandshakeData);
+	if (ret == 0 || ret == -3)
+	{
+		int limited = LimitConnectionless(fd, address, ret == -3 || IsInitialConnect(&HandshakeData));
+		if (limited)
+		{
+			return limited;
+		}
+	}
+	if (ret == -3)
+	{
+		// Written the way the client reads its packets, with the ClientID of the data packet
+		SendRestartHandshakeRequest(fd, CurrentHandshakeVersion(), 0, ClientID, utcp_get_config()->CachedNetworkChecksum);
+		fd->Stats.RestartRequests++;
+	}
+	if (ret)
+	{
+		return ret;
+	}
+	return HandleConnectionless(fd, address, ClientID, &HandshakeData, OutAccept);
+}
+
 // StatelessConnectHandlerComponent::HasPassedChallenge
-static bool HasPassedChallenge(struct utcp_listener* fd, const char* address, bool* bOutRestartedHandshake)
+static bool HasPassedChallenge(struct utcp_listener* fd, const struct utcp_address* address, bool* bOutRestartedHandshake)
 {
 	*bOutRestartedHandshake = fd->bRestartedHandshake;
-	return strncmp(fd->LastChallengeSuccessAddress, address, sizeof(fd->LastChallengeSuccessAddress)) == 0;
+	return utcp_address_equal(&fd->LastChallengeSuccessAddress, address);
+}
+
+static void SetChallengeData(struct utcp_listener* fd, const struct utcp_accept_info* Accept)
+{
+	fd->LastChallengeSuccessAddress = Accept->Address;
+	fd->bRestartedHandshake = Accept->bRestartedHandshake;
+	fd->LastServerSequence = Accept->ServerSequence;
+	fd->LastClientSequence = Accept->ClientSequence;
+	fd->LastFeatures = Accept->Features;
+	memcpy(fd->AuthorisedCookie, Accept->AuthorisedCookie, COOKIE_BYTE_SIZE);
+}
+
+static void PushPendingAccept(struct utcp_listener* fd, const struct utcp_accept_info* Accept)
+{
+	uint32_t Entry = FindPendingAcceptEntry(fd, &Accept->Address);
+	int32_t Slot = fd->PendingAcceptIndex[Entry];
+	if (Slot < 0)
+	{
+		assert(fd->PendingAcceptCount < fd->PendingAcceptCapacity);
+		Slot = (fd->PendingAcceptHead + fd->PendingAcceptCount++) % fd->PendingAcceptCapacity;
+		fd->PendingAcceptIndex[Entry] = Slot;
+	}
+	memcpy(&fd->PendingAccepts[Slot], Accept, sizeof(*Accept));
 }
 
 // StatelessConnectHandlerComponent::ResetChallengeData
 static void ResetChallengeData(struct utcp_listener* fd)
 {
-	fd->LastChallengeSuccessAddress[0] = '\0';
+	fd->LastChallengeSuccessAddress.Len = 0;
 	fd->bRestartedHandshake = false;
 	fd->LastServerSequence = 0;
 	fd->LastClientSequence = 0;
+	fd->LastFeatures = 0;
 	memset(fd->AuthorisedCookie, 0, COOKIE_BYTE_SIZE);
 }
 
-// UIpNetDriver::ProcessConnectionlessPacket
-int process_connectionless_packet(struct utcp_listener* fd, const char* address, const uint8_t* buffer, int len)
+// The rest of UIpNetDriver::ProcessConnectionlessPacket, once the handshake packet was handled
+static void AcceptConnectionless(struct utcp_listener* fd, const struct utcp_address* address, const struct utcp_accept_info* Accept)
 {
-	struct bitbuf bitbuf;
-	if (!bitbuf_read_init(&bitbuf, buffer, len))
+	if (Accept->Address.Len == 0)
 	{
-		return -1;
+		return;
 	}
 
-	int ret = IncomingConnectionless(fd, address, &bitbuf);
-	if (ret)
+	if (fd->PendingAcceptCapacity > 0)
 	{
-		return ret;
+		PushPendingAccept(fd, Accept);
+		return;
 	}
-
-	assert(bitbuf.num == bitbuf.size);
+	SetChallengeData(fd, Accept);
 
 	bool bPassedChallenge = false;
 	bool bRestartedHandshake = false;
@@ -614,9 +950,140 @@ int process_connectionless_packet(struct utcp_listener* fd, const char* address,
 		}
 		ResetChallengeData(fd);
 	}
+}
+
+// UIpNetDriver::ProcessConnectionlessPacket
+int process_connectionless_packet(struct utcp_listener* fd, const struct utcp_address* address, const uint8_t* buffer, int len)
+{
+	struct bitbuf bitbuf;
+	if (!bitbuf_read_init(&bitbuf, buffer, len))
+	{
+		fd->Stats.Dropped++;
+		return -1;
+	}
+
+	struct utcp_accept_info Accept;
+	Accept.Address.Len = 0;
+	int ret = IncomingConnectionless(fd, address, &bitbuf, &Accept);
+	if (ret)
+	{
+		CountConnectionless(fd, ret);
+		return ret;
+	}
+
+	assert(bitbuf.num == bitbuf.size);
+	AcceptConnectionless(fd, address, &Accept);
 	return 0;
 }
 
+// process_connectionless_packet for up to BatchCookieCount datagrams: all of them are read, their cookies hashed
+// together, then they are handled in order as if they came one by one
+static void ProcessConnectionlessChunk(struct utcp_listener* fd, struct utcp_listener_datagram* datagrams, int count)
+{
+	uint8_t ClientIDs[BatchCookieCount];
+	struct utcp_address Addresses[BatchCookieCount];
+	struct FParsedHandshakeData HandshakeData[BatchCookieCount];
+	struct utcp_batch_cookie Cookies[BatchCookieCount];
+	uint8_t CookieData[BatchCookieCount][CookieDataSize];
+	struct sha1_hmac_job Jobs[BatchCookieCount];
+	int8_t JobIndex[BatchCookieCount];
+	int JobCount = 0;
+
+	assert(count <= BatchCookieCount);
+	for (int i = 0; i < count; ++i)
+	{
+		struct utcp_listener_datagram* datagram = &datagrams[i];
+		datagram->ReplyLen = 0;
+		JobIndex[i] = -1;
+
+		if (!datagram->SockAddr)
+		{
+			utcp_address_from_string(&Addresses[i], datagram->Address);
+		}
+		else if (!utcp_address_from_sockaddr(&Addresses[i], datagram->SockAddr, datagram->SockAddrLen))
+		{
+			datagram->Result = -9;
+			continue;
+		}
+
+		struct bitbuf bitbuf;
+		if (!bitbuf_read_init(&bitbuf, datagram->Buffer, datagram->Len))
+		{
+			datagram->Result = -1;
+			continue;
+		}
+		datagram->Result = ParseConnectionless(&bitbuf, &ClientIDs[i], &HandshakeData[i]);
+		if (datagram->Result == 0 || datagram->Result == -3)
+		{
+			int limited = LimitConnectionless(fd, &Addresses[i], datagram->Result == -3 || IsInitialConnect(&HandshakeData[i]));
+			if (limited)
+				datagram->Result = limited;
+		}
+		if (datagram->Result)
+			continue;
+		assert(bitbuf.num == bitbuf.size);
+
+		// The cookie the challenge is sent with, or the one the response is checked against
+		struct utcp_batch_cookie* Cookie = &Cookies[JobCount];
+		if (IsInitialConnect(&HandshakeData[i]))
+		{
+			Cookie->SecretId = fd->ActiveSecret;
+			Cookie->Timestamp = utcp_gettime();
+		}
+		else if (IsValidCookieTimestamp(fd, &HandshakeData[i]))
+		{
+			Cookie->SecretId = !!HandshakeData[i].SecretId;
+			Cookie->Timestamp = HandshakeData[i].Timestamp;
+		}
+		else
+		{
+			continue;
+		}
+
+		Cookie->Address = &Addresses[i];
+		Jobs[JobCount].Key = &fd->HandshakeKeys[Cookie->SecretId];
+		Jobs[JobCount].Data = CookieData[JobCount];
+		Jobs[JobCount].DataSize = (uint32_t)MakeCookieData(&Addresses[i], Cookie->Timestamp, CookieData[JobCount]);
+		Jobs[JobCount].OutHash = Cookie->Cookie;
+		JobIndex[i] = (int8_t)JobCount++;
+	}
+
+	sha1_hmac_key_buffers(Jobs, JobCount);
+
+	for (int i = 0; i < count; ++i)
+	{
+		struct utcp_listener_datagram* datagram = &datagrams[i];
+		fd->BatchDatagram = datagram;
+		fd->BatchCookie = JobIndex[i] >= 0 ? &Cookies[JobIndex[i]] : NULL;
+		if (datagram->Result == -3)
+		{
+			SendRestartHandshakeRequest(fd, CurrentHandshakeVersion(), 0, ClientIDs[i], utcp_get_config()->CachedNetworkChecksum);
+			fd->Stats.RestartRequests++;
+		}
+		else if (datagram->Result == 0)
+		{
+			struct utcp_accept_info Accept;
+			Accept.Address.Len = 0;
+			datagram->Result = HandleConnectionless(fd, &Addresses[i], ClientIDs[i], &HandshakeData[i], &Accept);
+			if (datagram->Result == 0)
+			{
+				AcceptConnectionless(fd, &Addresses[i], &Accept);
+			}
+		}
+		CountConnectionless(fd, datagram->Result);
+	}
+	fd->BatchDatagram = NULL;
+	fd->BatchCookie = NULL;
+}
+
+void process_connectionless_batch(struct utcp_listener* fd, struct utcp_listener_datagram* datagrams, int count)
+{
+	for (int i = 0; i < count; i += BatchCookieCount)
+	{
+		ProcessConnectionlessChunk(fd, datagrams + i, count - i < BatchCookieCount ? count - i : BatchCookieCount);
+	}
+}
+
 // StatelessConnectHandlerComponent::SendInitialPacket
 static void SendInitialPacket(struct utcp_connection* fd, uint8_t HandshakeVersion)
 {
@@ -661,7 +1128,7 @@ static void SendInitialPacket(struct utcp_connection* fd, uint8_t HandshakeVersi
 	memset(PacketSizeFiller, 0, sizeof(PacketSizeFiller));
 	bitbuf_write_bytes(&bitbuf, PacketSizeFiller, sizeof(PacketSizeFiller));
 
-	CapHandshakePacket(fd->challenge_data, &bitbuf, HandshakeVersion);
+	CapHandshakePacket(fd->challenge_data, &bitbuf, HandshakeVersion, utcp_get_config()->Features);
 
 	utcp_raw_send(fd, bitbuf.buffer, bitbuf_num_bytes(&bitbuf));
 	fd->challenge_data->LastClientSendTimestamp = utcp_gettime_ms();
@@ -727,7 +1194,7 @@ static void SendChallengeResponse(struct utcp_connection* fd, uint8_t InSecretId
 		bitbuf_write_bytes(&bitbuf, fd->AuthorisedCookie, COOKIE_BYTE_SIZE);
 	}
 
-	CapHandshakePacket(fd->challenge_data, &bitbuf, HandshakeVersion);
+	CapHandshakePacket(fd->challenge_data, &bitbuf, HandshakeVersion, utcp_get_config()->Features);
 	utcp_raw_send(fd, bitbuf.buffer, bitbuf_num_bytes(&bitbuf));
 
 	fd->challenge_data->LastClientSendTimestamp = utcp_gettime_ms();
@@ -763,7 +1230,7 @@ int handshake_incoming(struct utcp_connection* fd, struct bitbuf* bitbuf)
 	struct FParsedHandshakeData HandshakeData;
 	ParsedHandshakeDataInit(&HandshakeData);
 
-	bHandshakePacket = ParseHandshakePacket(bitbuf, false, &HandshakeData);
+	bHandshakePacket = ParseHandshakePacket(bitbuf, is_client(fd), &HandshakeData);
 	if (!bHandshakePacket)
 	{
 		return -2;
@@ -777,7 +1244,9 @@ int handshake_incoming(struct utcp_connection* fd, struct bitbuf* bitbuf)
 
 		// The server should not be receiving handshake packets at this stage - resend the ack in case it was lost.
 		// In this codepath, this component is linked to a UNetConnection, and the Last* values below, cache the handshake info.
-		SendChallengeAck(NULL, fd, fd->AuthorisedCookie, EHandshakeVersion_Original, 0, 0, 0);
+		// The resend must carry the feature trailer as well, a client that lost the first ack agrees on the features from this one.
+		SendChallengeAck(NULL, fd, fd->AuthorisedCookie, HandshakeData.RemoteCurVersion, HandshakeData.RemoteSentHandshakePacketCount, ClientID,
+						 HandshakeData.RemoteNetworkVersion, fd->Features);
 
 		return 0;
 	}
@@ -817,6 +1286,9 @@ int handshake_incoming(struct utcp_connection* fd, struct bitbuf* bitbuf)
 				utcp_sequence_init(fd, LastServerSequence, LastClientSequence);
 				// Save the final authorized cookie
 				memcpy(fd->AuthorisedCookie, HandshakeData.Cookie, sizeof(fd->AuthorisedCookie));
+
+				// The ack carries the features the server agreed to
+				fd->Features = AgreeFeatures(HandshakeData.RemoteFeatures, HandshakeData.RemoteDictionaryId);
 			}
 
 			// Now finish initializing the handler - flushing the queued packet buffer in the process.
@@ -3,11 +3,16 @@
 #pragma once
 
 #include "bit_buffer.h"
+#include "utcp_address.h"
 #include "utcp_def_internal.h"
 
 // The design of handshake: https://blog.dpull.com/post/2022-11-13-utcp_handshake
 
-int process_connectionless_packet(struct utcp_listener* fd, const char* address, const uint8_t* buffer, int len);
+int process_connectionless_packet(struct utcp_listener* fd, const struct utcp_address* address, const uint8_t* buffer, int len);
+void process_connectionless_batch(struct utcp_listener* fd, struct utcp_listener_datagram* datagrams, int count);
+
+bool resize_pending_accepts(struct utcp_listener* fd, int capacity);
+int take_pending_accepts(struct utcp_listener* fd, struct utcp_accept_info* accepts, int max);
 
 void handshake_begin(struct utcp_connection* fd);
 int handshake_incoming(struct utcp_connection* fd, struct bitbuf* bitbuf);
@@ -3,10 +3,12 @@
 #include "utcp.h"
 #include "utcp_bunch.h"
 #include "utcp_channel.h"
+#include "utcp_compress.h"
 #include "utcp_packet_notify.h"
 #include "utcp_sequence_number.h"
 #include "utcp_utils.h"
 #include <assert.h>
+#include <string.h>
 
 #include "utcp_handshake.h"
 
@@ -15,10 +17,17 @@ enum
 	MAX_PACKET_TRAILER_BITS = 1,
 	MAX_PACKET_RELIABLE_SEQUENCE_HEADER_BITS = 32 /*PackedHeader*/ + MaxSequenceHistoryLength,
 	MAX_PACKET_INFO_HEADER_BITS = 1 /*bHasPacketInfo*/ + NumBitsForJitterClockTimeInHeader + 1 /*bHasServerFrameTime*/ + 8 /*ServerFrameTime*/,
-	MAX_PACKET_HEADER_BITS = MAX_PACKET_RELIABLE_SEQUENCE_HEADER_BITS + MAX_PACKET_INFO_HEADER_BITS,
+	MAX_PACKET_COMPRESSION_HEADER_BITS = 1 /*bCompressed*/,
+	MAX_PACKET_HEADER_BITS = MAX_PACKET_RELIABLE_SEQUENCE_HEADER_BITS + MAX_PACKET_INFO_HEADER_BITS + MAX_PACKET_COMPRESSION_HEADER_BITS,
 	// MAX_BUNCH_HEADER_BITS = 256,
 	// MaxPacketHandlerBits = 2,
 	// MAX_SINGLE_BUNCH_SIZE_BITS = (UTCP_MAX_PACKET * 8) - MAX_BUNCH_HEADER_BITS - MAX_PACKET_TRAILER_BITS - MAX_PACKET_HEADER_BITS - MaxPacketHandlerBits,
+
+	// Smaller payloads are sent as they are, the gain does not pay for the compression header
+	MIN_COMPRESS_PAYLOAD_BITS = 32 * 8,
+	COMPRESSED_PAYLOAD_SIZE_BITS = 13, // CeilLogTwo(UTCP_MAX_PACKET * 8)
+	BUNCH_SIZE_BITS = 13,			   // The last field of every bunch header
+	MAX_ALIGN_BITS = 7,
 };
 
 static inline int32_t BestSignedDifference(int32_t Value, int32_t Reference, int32_t Max)
@@ -33,16 +42,81 @@ static inline int32_t MakeRelative(int32_t Value, int32_t Reference, int32_t Max
 
 static struct utcp_channel* utcp_get_channel(struct utcp_connection* fd, struct utcp_bunch* utcp_bunch)
 {
-	if (utcp_bunch->bClose && utcp_bunch->ChIndex == 0)
-	{
+	return utcp_channels_get_channel(&fd->channels, utcp_bunch);
+}
+
+// A received close only takes effect when its bunch is processed in order: the earlier bunches it overtook are still
+// resent to the channel
+static void utcp_close_channel_on_bunch(struct utcp_connection* fd, struct utcp_channel* utcp_channel, const struct utcp_bunch* utcp_bunch)
+{
+	if (!utcp_bunch->bClose)
+		return;
+	if (utcp_bunch->ChIndex == 0)
 		utcp_mark_close(fd, ControlChannelClose);
+	utcp_channels_mark_close(&fd->channels, utcp_channel, utcp_bunch->CloseReason);
+}
+
+// Copies the data bits out of the packet, the last byte is zero padded
+static void ReadBunchData(struct utcp_bunch* utcp_bunch, const uint8_t* Buffer, size_t DataBitOffset)
+{
+	if (utcp_bunch->DataBitsLen & 7)
+		utcp_bunch->Data[utcp_bunch->DataBitsLen >> 3] = 0;
+	bitbuf_copy_bits(utcp_bunch->Data, 0, Buffer, DataBitOffset, utcp_bunch->DataBitsLen);
+}
+
+// A bunch that has to wait in InRec gets a copy of its own
+static struct utcp_bunch_node* CopyBunchNode(const struct utcp_bunch* utcp_bunch, const uint8_t* Buffer, size_t DataBitOffset)
+{
+	struct utcp_bunch_node* utcp_bunch_node = alloc_utcp_bunch_node();
+	memcpy(&utcp_bunch_node->utcp_bunch, utcp_bunch, offsetof(struct utcp_bunch, Data));
+	ReadBunchData(&utcp_bunch_node->utcp_bunch, Buffer, DataBitOffset);
+	return utcp_bunch_node;
+}
+
+// Delivers a complete bunch whose data is at DataBitOffset of Buffer, the packet or its own copy
+static void DeliverBunch(struct utcp_connection* fd, struct utcp_bunch* utcp_bunch, const uint8_t* Buffer, size_t DataBitOffset)
+{
+	if (utcp_get_config()->on_recv_bunch_view)
+	{
+		struct utcp_bunch_view view = {utcp_bunch, Buffer, (uint32_t)DataBitOffset, utcp_bunch->DataBitsLen, NULL, 0};
+		utcp_recv_bunch_view(fd, &view, 1);
+		return;
 	}
-	return utcp_channels_get_channel(&fd->channels, utcp_bunch);
+
+	if (Buffer != utcp_bunch->Data)
+		ReadBunchData(utcp_bunch, Buffer, DataBitOffset);
+	struct utcp_bunch* HandleBunch[1] = {utcp_bunch};
+	utcp_recv_bunch(fd, HandleBunch, 1);
+}
+
+// Delivers a completed partial bunch, as one contiguous payload to on_recv_bunch_view
+static void DeliverPartialBunch(struct utcp_connection* fd, struct utcp_partial_bunch* partial_bunch)
+{
+	utcp_log(Verbose, "[%s]received partial bunch, bOpen=%d, bClose=%d, NameIndex=%d, ChIndex=%d, NumBits=%u, Count=%d", fd->debug_name, partial_bunch->Header.bOpen,
+			 partial_bunch->Header.bClose, partial_bunch->Header.NameIndex, partial_bunch->Header.ChIndex, partial_bunch->DataBitsLen, partial_bunch->Count);
+
+	struct utcp_bunch_view view = {&partial_bunch->Header, partial_bunch->Data, 0, partial_bunch->DataBitsLen, partial_bunch->BunchBitsLen, partial_bunch->Count};
+	if (utcp_get_config()->on_recv_bunch_view)
+	{
+		utcp_recv_bunch_view(fd, &view, 1);
+		return;
+	}
+
+	// on_recv_bunch gets the partial bunches one by one, as they were sent. That costs a second copy of the data,
+	// a receiver of large messages should use on_recv_bunch_view
+	const int32_t Count = partial_bunch->Count;
+	struct utcp_bunch* Bunches = (struct utcp_bunch*)utcp_realloc(NULL, Count * sizeof(struct utcp_bunch));
+	struct utcp_bunch* HandleBunch[UTCP_MAX_PARTIAL_BUNCHES];
+	utcp_bunch_view_split(&view, Bunches);
+	for (int32_t i = 0; i < Count; ++i)
+		HandleBunch[i] = &Bunches[i];
+	utcp_recv_bunch(fd, HandleBunch, Count);
+	utcp_realloc(Bunches, 0);
 }
 
 // UChannel::ReceivedNextBunch
-// 原本ReceivedNextBunch返回值是bDeleted, 为了简化, 该函数做释放或者引用
-static bool ReceivedNextBunch(struct utcp_connection* fd, struct utcp_bunch_node* utcp_bunch_node, bool* bOutSkipAck)
+// The bunch data is at DataBitOffset of Buffer, the packet or the copy of a bunch that waited in InRec, the caller keeps the bunch
+static bool ReceivedNextBunch(struct utcp_connection* fd, struct utcp_bunch* utcp_bunch, const uint8_t* Buffer, size_t DataBitOffset, bool* bOutSkipAck)
 {
 	// We received the next bunch. Basically at this point:
 	//	-We know this is in order if reliable
@@ -51,70 +125,69 @@ static bool ReceivedNextBunch(struct utcp_connection* fd, struct utcp_bunch_node
 
 	// Note this bunch's retirement.
 
-	struct utcp_bunch* utcp_bunch = &utcp_bunch_node->utcp_bunch;
 	struct utcp_channel* utcp_channel = utcp_get_channel(fd, utcp_bunch);
 	assert(utcp_channel);
+	utcp_close_channel_on_bunch(fd, utcp_channel, utcp_bunch);
 
 	if (utcp_bunch->bReliable)
 	{
 		// Reliables should be ordered properly at this point
 		assert(utcp_bunch->ChSequence == utcp_channel->InReliable + 1);
 		utcp_channel->InReliable = utcp_bunch->ChSequence;
+		if (utcp_channel->bUnordered)
+			shift_unordered_incoming(utcp_channel);
 	}
 
-	struct utcp_bunch* HandleBunch[MaxSequenceHistoryLength];
-	HandleBunch[0] = utcp_bunch;
-	int HandleBunchCount = 1;
-	bool bPartial = utcp_bunch->bPartial;
-	if (bPartial)
+	if (!utcp_bunch->bPartial)
 	{
-		enum merge_partial_result ret = merge_partial_data(utcp_channel, utcp_bunch_node, bOutSkipAck);
-		if (ret == partial_merge_succeed)
-		{
-			return true;
-		}
-		else if (ret == partial_available)
-		{
-			HandleBunchCount = get_partial_bunch(utcp_channel, HandleBunch, _countof(HandleBunch));
-			assert(HandleBunchCount > 0);
-		}
-		else
-		{
-			free_utcp_bunch_node(utcp_bunch_node);
-			if (ret == partial_merge_fatal)
-			{
-				// TODO close CONN
-			}
-			return false;
-		}
-	}
-
-	for (int i = 0; i < HandleBunchCount; ++i)
-	{
-		struct utcp_bunch* cur_utcp_bunch = HandleBunch[i];
-		utcp_log(Verbose, "[%s]received bunch, bOpen=%d, bClose=%d, NameIndex=%d, ChIndex=%d, NumBits=%d", fd->debug_name, cur_utcp_bunch->bOpen, cur_utcp_bunch->bClose,
-				 cur_utcp_bunch->NameIndex, cur_utcp_bunch->ChIndex, cur_utcp_bunch->DataBitsLen);
+		utcp_log(Verbose, "[%s]received bunch, bOpen=%d, bClose=%d, NameIndex=%d, ChIndex=%d, NumBits=%d", fd->debug_name, utcp_bunch->bOpen, utcp_bunch->bClose,
+				 utcp_bunch->NameIndex, utcp_bunch->ChIndex, utcp_bunch->DataBitsLen);
+		DeliverBunch(fd, utcp_bunch, Buffer, DataBitOffset);
+		return true;
 	}
 
-	utcp_recv_bunch(fd, HandleBunch, HandleBunchCount);
-	if (bPartial)
+	// The data is appended to the partial bunch right away, nothing keeps the packet
+	enum merge_partial_result ret = merge_partial_data(utcp_channel, utcp_bunch, Buffer, DataBitOffset, bOutSkipAck);
+	if (ret == partial_merge_succeed)
 	{
-		assert(HandleBunchCount > 1);
-		clear_partial_data(utcp_channel);
+		return true;
 	}
-	else
+	else if (ret != partial_available)
 	{
-		free_utcp_bunch_node(utcp_bunch_node);
+		if (ret == partial_merge_fatal)
+		{
+			utcp_log(Warning, "[%s]Reliable partial bunch merge failed, ChIndex=%d, ChSequence=%d", fd->debug_name, utcp_bunch->ChIndex, utcp_bunch->ChSequence);
+			utcp_mark_close(fd, PartialMergeFail);
+		}
+		return false;
 	}
+
+	DeliverPartialBunch(fd, get_partial_bunch(utcp_channel));
+	clear_partial_data(utcp_channel);
 	return true;
 }
 
+// Reliable bunch of an unordered channel, delivered as soon as it arrives
+static void ReceivedUnorderedBunch(struct utcp_connection* fd, struct utcp_bunch* utcp_bunch, const uint8_t* Buffer, size_t DataBitOffset)
+{
+	utcp_log(Verbose, "[%s]received unordered bunch, ChIndex=%d, ChSequence=%d, NumBits=%d", fd->debug_name, utcp_bunch->ChIndex, utcp_bunch->ChSequence, utcp_bunch->DataBitsLen);
+	DeliverBunch(fd, utcp_bunch, Buffer, DataBitOffset);
+}
+
 // Dispatch any waiting bunches.
 static void DispatchWaitingBunches(struct utcp_connection* fd, struct utcp_channel* utcp_channel)
 {
 	for (;;)
 	{
 		assert(utcp_channel);
+
+		// Skip the sequences an unordered channel has already delivered
+		while (utcp_channel->InUnorderedMask[0] & 1)
+		{
+			utcp_channel->InReliable++;
+			shift_unordered_incoming(utcp_channel);
+		}
+
 		struct utcp_bunch_node* utcp_bunch_node = dequeue_incoming_data(utcp_channel, utcp_channel->InReliable + 1);
 		if (!utcp_bunch_node)
 			break;
@@ -124,30 +197,35 @@ static void DispatchWaitingBunches(struct utcp_connection* fd, struct utcp_chann
 		bool bLocalSkipAck = false;
 		assert(utcp_bunch_node->dl_list_node.prev == NULL);
 		assert(utcp_bunch_node->dl_list_node.next == NULL);
-		ReceivedNextBunch(fd, utcp_bunch_node, &bLocalSkipAck);
+		ReceivedNextBunch(fd, &utcp_bunch_node->utcp_bunch, utcp_bunch_node->utcp_bunch.Data, 0, &bLocalSkipAck);
+		free_utcp_bunch_node(utcp_bunch_node);
 	}
 }
 
-static void ReceivedRawBunch(struct utcp_connection* fd, struct bitbuf* bitbuf, bool* bOutSkipAck)
+static void ReceivedRawBunch(struct utcp_connection* fd, struct bitbuf* bitbuf, struct utcp_bunch_delta_context* DeltaContext, bool* bOutSkipAck)
 {
+	// Only the header is read here, the data stays in the packet unless the bunch has to wait in InRec
+	struct utcp_bunch utcp_bunch_data;
+	struct utcp_bunch* utcp_bunch = &utcp_bunch_data;
 	struct utcp_bunch_node* utcp_bunch_node = NULL;
 	struct utcp_channel* utcp_channel = NULL;
 
 	do
 	{
-		utcp_bunch_node = alloc_utcp_bunch_node();
-		if (!utcp_bunch_node)
-		{
-			break;
-		}
-
-		struct utcp_bunch* utcp_bunch = &utcp_bunch_node->utcp_bunch;
-		if (!utcp_bunch_read(utcp_bunch, bitbuf))
+		bool bRead = utcp_bunch_read_header(utcp_bunch, bitbuf, DeltaContext);
+		if (bRead && (fd->Features & UTCP_FEATURE_BYTE_ALIGNED))
+			bRead = bitbuf_read_align(bitbuf);
+		if (bRead)
+			bRead = bitbuf_left_bits(bitbuf) >= utcp_bunch->DataBitsLen;
+		if (!bRead)
 		{
 			utcp_log(Warning, "[%s]Bunch header overflowed", fd->debug_name);
 			utcp_mark_close(fd, BunchOverflow);
 			break;
 		}
+		const uint8_t* Buffer = bitbuf->buffer;
+		const size_t DataBitOffset = bitbuf->num;
+		bitbuf->num += utcp_bunch->DataBitsLen;
 		utcp_bunch->PacketId = fd->InPacketId;
 
 		if (utcp_bunch->ChIndex >= DEFAULT_MAX_CHANNEL_SIZE)
@@ -180,6 +258,24 @@ static void ReceivedRawBunch(struct utcp_connection* fd, struct bitbuf* bitbuf,
 			break;
 		}
 
+		// Opening and closing bunches stay in order, a close delivered ahead of the bunches before it would free the channel they still arrive on
+		if (utcp_bunch->bReliable && utcp_bunch->ChSequence != utcp_channel->InReliable + 1 && utcp_channel->bUnordered && !utcp_bunch->bPartial && !utcp_bunch->bOpen &&
+			!utcp_bunch->bClose)
+		{
+			// No head-of-line blocking: deliver on first receipt, the sequence bitmap filters out resends
+			int ret = mark_unordered_incoming(utcp_channel, utcp_bunch->ChSequence);
+			if (ret > 0)
+			{
+				ReceivedUnorderedBunch(fd, utcp_bunch, Buffer, DataBitOffset);
+			}
+			else if (ret < 0)
+			{
+				// Too far ahead to remember, don't ack so that it will be resent
+				*bOutSkipAck = true;
+			}
+			break;
+		}
+
 		if (utcp_bunch->bReliable && utcp_bunch->ChSequence != utcp_channel->InReliable + 1)
 		{
 			// If this bunch has a dependency on a previous unreceived bunch, buffer it.
@@ -188,15 +284,13 @@ static void ReceivedRawBunch(struct utcp_connection* fd, struct bitbuf* bitbuf,
 			// Verify that UConnection::ReceivedPacket has passed us a valid bunch.
 			assert(utcp_bunch->ChSequence > utcp_channel->InReliable);
 
+			utcp_bunch_node = CopyBunchNode(utcp_bunch, Buffer, DataBitOffset);
 			if (enqueue_incoming_data(utcp_channel, utcp_bunch_node))
 				utcp_bunch_node = NULL;
 			break;
 		}
 
-		assert(utcp_bunch_node->dl_list_node.prev == NULL);
-		assert(utcp_bunch_node->dl_list_node.next == NULL);
-		ReceivedNextBunch(fd, utcp_bunch_node, bOutSkipAck);
-		utcp_bunch_node = NULL;
+		ReceivedNextBunch(fd, utcp_bunch, Buffer, DataBitOffset, bOutSkipAck);
 	} while (false);
 
 	if (utcp_bunch_node)
@@ -223,10 +317,12 @@ static void ReceivedAck(struct utcp_connection* fd, int32_t AckPacketId)
 	utcp_delivery_status(fd, AckPacketId, true);
 }
 
+static int ResendRawBunch(struct utcp_connection* fd, const struct utcp_bunch_node* utcp_bunch_node);
+
 // UNetConnection::ReceivedNak
 static void ReceivedNak(struct utcp_connection* fd, int32_t NakPacketId)
 {
-	utcp_channels_on_nak(&fd->channels, NakPacketId, WriteBitsToSendBuffer, fd);
+	utcp_channels_on_nak(&fd->channels, NakPacketId, ResendRawBunch, fd);
 	utcp_delivery_status(fd, NakPacketId, false);
 }
 
@@ -272,6 +368,122 @@ void utcp_sequence_init(struct utcp_connection* fd, int32_t IncomingSequence, in
 	packet_notify_init(&fd->packet_notify, seq_num_init(fd->InPacketId), seq_num_init(fd->OutPacketId));
 }
 
+// Reads the rest of the packet, the payload is decompressed into Payload
+static bool DecompressPayload(struct bitbuf* bitbuf, uint8_t* Payload, size_t PayloadSize, struct bitbuf* OutPayload)
+{
+	uint32_t PayloadBits;
+	if (!bitbuf_read_int(bitbuf, &PayloadBits, UTCP_MAX_PACKET * 8))
+		return false;
+
+	const size_t LeftBits = bitbuf_left_bits(bitbuf);
+	uint8_t Compressed[UTCP_MAX_PACKET];
+	if (LeftBits % 8 != 0 || LeftBits / 8 > sizeof(Compressed))
+		return false;
+
+	const size_t CompressedBytes = LeftBits / 8;
+	if (!bitbuf_read_bytes(bitbuf, Compressed, CompressedBytes))
+		return false;
+
+	int PayloadBytes = utcp_decompress(Compressed, (int)CompressedBytes, Payload, (int)PayloadSize);
+	if (PayloadBytes < 0 || (size_t)PayloadBytes != (PayloadBits + 7) / 8)
+		return false;
+
+	OutPayload->buffer = Payload;
+	OutPayload->size = PayloadBits;
+	OutPayload->num = 0;
+	return true;
+}
+
+// Returns false if the packet cannot be held back and has to be processed now
+static bool CachePacket(struct utcp_connection* fd, struct bitbuf* bitbuf, size_t HeaderEndBits, struct packet_header* packet_header, int32_t PacketId)
+{
+	struct utcp_packet_order_cache* Cache = fd->PacketOrderCache;
+	const size_t Bytes = (bitbuf->size + 7) / 8;
+	if (Bytes > sizeof(((struct utcp_cached_packet*)0)->Data))
+		return false;
+
+	struct utcp_cached_packet** Slot = &Cache->Slots[PacketId & (PACKET_ORDER_CACHE_SIZE - 1)];
+	if (*Slot)
+	{
+		// Already cached
+		assert((*Slot)->PacketId == PacketId);
+		return true;
+	}
+
+	struct utcp_cached_packet* Packet =
+		Cache->PoolCount > 0 ? Cache->Pool[--Cache->PoolCount] : (struct utcp_cached_packet*)utcp_realloc(NULL, sizeof(struct utcp_cached_packet));
+	Packet->PacketId = PacketId;
+	Packet->SizeBits = (uint16_t)bitbuf->size;
+	Packet->HeaderEndBits = (uint16_t)HeaderEndBits;
+	Packet->PacketHeader = *packet_header;
+	memcpy(Packet->Data, bitbuf->buffer, Bytes);
+	*Slot = Packet;
+
+	if (Cache->Count == 0)
+		Cache->WaitStart = utcp_gettime_ms();
+	Cache->Count++;
+	utcp_log(Verbose, "[%s]cache out of order packet: PacketId=%d, InPacketId=%d, Count=%d", fd->debug_name, PacketId, fd->InPacketId, Cache->Count);
+	return true;
+}
+
+// UNetConnection::FlushPacketOrderCache
+void FlushPacketOrderCache(struct utcp_connection* fd, bool bFlushWholeCache)
+{
+	struct utcp_packet_order_cache* Cache = fd->PacketOrderCache;
+	if (!Cache || Cache->Count == 0 || Cache->bFlushing)
+		return;
+
+	// Every cached packet is within PACKET_ORDER_CACHE_SIZE of the expected one, so one turn of the ring visits them in order
+	Cache->bFlushing = 1;
+	bool bDelivered = false;
+	const int32_t FirstPacketId = fd->InPacketId + 1;
+	for (int32_t i = 0; i < PACKET_ORDER_CACHE_SIZE && Cache->Count > 0; ++i)
+	{
+		struct utcp_cached_packet** Slot = &Cache->Slots[(FirstPacketId + i) & (PACKET_ORDER_CACHE_SIZE - 1)];
+		struct utcp_cached_packet* Packet = *Slot;
+		if (!Packet)
+		{
+			if (!bFlushWholeCache)
+				break;
+			continue;
+		}
+		assert(Packet->PacketId == FirstPacketId + i);
+
+		*Slot = NULL;
+		Cache->Count--;
+		if (!fd->bClose)
+		{
+			struct bitbuf bitbuf = {Packet->Data, Packet->SizeBits, Packet->HeaderEndBits};
+			ReceivedPacketAfterHeader(fd, &bitbuf, &Packet->PacketHeader);
+		}
+		Cache->Pool[Cache->PoolCount++] = Packet;
+		bDelivered = true;
+	}
+
+	if (bDelivered)
+		Cache->WaitStart = utcp_gettime_ms();
+	Cache->bFlushing = 0;
+}
+
+void FreePacketOrderCache(struct utcp_connection* fd)
+{
+	struct utcp_packet_order_cache* Cache = fd->PacketOrderCache;
+	if (!Cache)
+		return;
+
+	for (int i = 0; i < PACKET_ORDER_CACHE_SIZE; ++i)
+	{
+		if (Cache->Slots[i])
+			utcp_realloc(Cache->Slots[i], 0);
+	}
+	for (int i = 0; i < Cache->PoolCount; ++i)
+	{
+		utcp_realloc(Cache->Pool[i], 0);
+	}
+	utcp_realloc(Cache, 0);
+	fd->PacketOrderCache = NULL;
+}
+
 // UNetConnection::ReceivedPacket
 bool ReceivedPacket(struct utcp_connection* fd, struct bitbuf* bitbuf)
 {
@@ -282,8 +494,20 @@ bool ReceivedPacket(struct utcp_connection* fd, struct bitbuf* bitbuf)
 		utcp_mark_close(fd, ret);
 		return false;
 	}
+	return ReceivedPacketAfterHeader(fd, bitbuf, &packet_header);
+}
 
-	int32_t PacketSequenceDelta = packet_notify_delta_seq(&fd->packet_notify, &packet_header.notification_header);
+bool ReceivedPacketAfterHeader(struct utcp_connection* fd, struct bitbuf* bitbuf, struct packet_header* packet_header)
+{
+	const size_t HeaderEndBits = bitbuf->num;
+	uint8_t bCompressed = 0;
+	if ((fd->Features & UTCP_FEATURE_COMPRESSION) && !bitbuf_read_bit(bitbuf, &bCompressed))
+	{
+		utcp_mark_close(fd, ReadHeaderFail);
+		return false;
+	}
+
+	int32_t PacketSequenceDelta = packet_notify_delta_seq(&fd->packet_notify, &packet_header->notification_header);
 	if (PacketSequenceDelta <= 0)
 	{
 		// Protect against replay attacks
@@ -291,32 +515,74 @@ bool ReceivedPacket(struct utcp_connection* fd, struct bitbuf* bitbuf)
 		// The only bunch we would process would be unreliable RPC's, which could allow for replay attacks
 		// So rather than add individual protection for unreliable RPC's as well, just kill it at the source,
 		// which protects everything in one fell swoop
-		utcp_log(Verbose, "[%s]'out of order' packet sequences: PacketSeq=%d, NotifyPacketSeq=%d", fd->debug_name, packet_header.notification_header.Seq, fd->packet_notify.InSeq);
+		utcp_log(Verbose, "[%s]'out of order' packet sequences: PacketSeq=%d, NotifyPacketSeq=%d", fd->debug_name, packet_header->notification_header.Seq, fd->packet_notify.InSeq);
 		return true;
 	}
 
-	const bool bPacketOrderCacheActive = false;
+	struct utcp_packet_order_cache* PacketOrderCache = fd->PacketOrderCache;
+	const bool bPacketOrderCacheActive = PacketOrderCache && !PacketOrderCache->bFlushing;
 	if (bPacketOrderCacheActive)
 	{
-		// 按照我们的设计, PacketOrderCache 以及 FlushPacketOrderCache 功能由外部实现
 		const int32_t MissingPacketCount = PacketSequenceDelta - 1;
-		if (MissingPacketCount > 0)
+		if (MissingPacketCount > 0 && MissingPacketCount < PACKET_ORDER_CACHE_SIZE &&
+			CachePacket(fd, bitbuf, HeaderEndBits, packet_header, fd->InPacketId + PacketSequenceDelta))
+		{
+			bitbuf->num = bitbuf->size;
 			return true;
+		}
+
+		// Too far ahead to wait for the gap, the held back packets go first and the rest of the gap is lost
+		if (MissingPacketCount > 0 && PacketOrderCache->Count > 0)
+		{
+			FlushPacketOrderCache(fd, true);
+			if (fd->bClose)
+				return false;
+			PacketSequenceDelta = packet_notify_delta_seq(&fd->packet_notify, &packet_header->notification_header);
+			assert(PacketSequenceDelta > 0);
+		}
+	}
+
+	uint8_t Payload[UTCP_MAX_PACKET];
+	struct bitbuf payload_bitbuf;
+	if (bCompressed)
+	{
+		if (!DecompressPayload(bitbuf, Payload, sizeof(Payload), &payload_bitbuf))
+		{
+			utcp_log(Warning, "[%s]Failed to decompress packet payload", fd->debug_name);
+			utcp_mark_close(fd, PacketDecompressFail);
+			return false;
+		}
+		bitbuf = &payload_bitbuf;
 	}
 
 	fd->InPacketId += PacketSequenceDelta;
 	// Update incoming sequence data and deliver packet notifications
 	// Packet is only accepted if both the incoming sequence number and incoming ack data are valid
-	packet_notify_update(HandlePacketNotification, fd, &fd->packet_notify, &packet_header.notification_header);
+	packet_notify_update(HandlePacketNotification, fd, &fd->packet_notify, &packet_header->notification_header);
 
 	if (bitbuf->num == bitbuf->size)
 		utcp_log(Verbose, "[%s] InPacketId=%d no bunch", fd->debug_name, fd->InPacketId);
 
+	struct utcp_bunch_delta_context DeltaContext;
+	memset(&DeltaContext, 0, sizeof(DeltaContext));
+
 	bool bSkipAck = false;
 	while (bitbuf->num < bitbuf->size)
 	{
+		// Every bunch starts on a byte boundary, what is left after the last one is padding
+		if (fd->Features & UTCP_FEATURE_BYTE_ALIGNED)
+		{
+			size_t BunchStart = (bitbuf->num + 7) & ~(size_t)7;
+			if (BunchStart >= bitbuf->size)
+			{
+				bitbuf->num = bitbuf->size;
+				break;
+			}
+			bitbuf->num = BunchStart;
+		}
+
 		bool bLocalSkipAck = false;
-		ReceivedRawBunch(fd, bitbuf, &bLocalSkipAck);
+		ReceivedRawBunch(fd, bitbuf, (fd->Features & UTCP_FEATURE_DELTA_HEADER) ? &DeltaContext : NULL, &bLocalSkipAck);
 		if (bLocalSkipAck)
 			bSkipAck = true;
 	}
@@ -329,18 +595,30 @@ bool ReceivedPacket(struct utcp_connection* fd, struct bitbuf* bitbuf)
 	{
 		packet_notify_ack_seq(&fd->packet_notify, fd->InPacketId, true);
 	}
+
+	// Keep track of the number of packets we have received that has not yet been acked,
+	// utcp_send_flush sends them even when there is nothing else to send
+	++fd->HasDirtyAcks;
+	if (fd->HasDirtyAcks >= MaxSequenceHistoryLength)
+	{
+		utcp_log(Warning, "[%s]too many received packets to ack (%u) since last sent packet, InPacketId=%d", fd->debug_name, fd->HasDirtyAcks, fd->InPacketId);
+		utcp_send_flush(fd);
+	}
+
+	// The packets held back for this one can follow now
+	if (bPacketOrderCacheActive && PacketOrderCache->Count > 0)
+		FlushPacketOrderCache(fd, false);
 	return true;
 }
 
-int32_t PeekPacketId(struct utcp_connection* fd, struct bitbuf* bitbuf)
+// Reads the whole packet header, ReceivedPacketAfterHeader can continue from it
+int32_t PeekPacketId(struct utcp_connection* fd, struct bitbuf* bitbuf, struct packet_header* packet_header)
 {
-	struct notification_header notification_header;
-	int ret = packet_notify_read_header(bitbuf, &notification_header);
-	if (ret)
+	if (packet_header_read(packet_header, bitbuf) != 0)
 	{
-		return ret;
+		return -3;
 	}
-	int32_t PacketSequenceDelta = packet_notify_delta_seq(&fd->packet_notify, &notification_header);
+	int32_t PacketSequenceDelta = packet_notify_delta_seq(&fd->packet_notify, &packet_header->notification_header);
 	if (PacketSequenceDelta <= 0)
 	{
 		return -8;
@@ -426,6 +704,22 @@ static void PrepareWriteBitsToSendBuffer(struct utcp_connection* fd, const int32
 		// Write Packet Header, before sending the packet we will go back and rewrite the data
 		WritePacketHeader(fd, &bitbuf);
 
+		// Delta headers never reference a bunch of another packet
+		fd->OutDeltaContext.bValid = 0;
+
+		// Pre-write the compression flag, CompressSendBuffer sets it when the payload is replaced
+		if (fd->Features & UTCP_FEATURE_COMPRESSION)
+		{
+			fd->HeaderMarkForCompression = bitbuf.num;
+			bitbuf_write_bit(&bitbuf, 0);
+		}
+
+		// The payload starts on a byte boundary, also inside a compressed payload
+		if (fd->Features & UTCP_FEATURE_BYTE_ALIGNED)
+		{
+			bitbuf_write_align(&bitbuf);
+		}
+
 		// Pre-write the bits for the packet info
 
 		// We do not allow the first bunch to merge with the ack data as this will "revert" the ack data.
@@ -437,8 +731,14 @@ static void PrepareWriteBitsToSendBuffer(struct utcp_connection* fd, const int32
 	}
 }
 
+static void AlignSendBuffer(struct utcp_connection* fd)
+{
+	fd->SendBufferBitsNum = (fd->SendBufferBitsNum + 7) & ~(size_t)7;
+}
+
 // UNetConnection::WriteBitsToSendBufferInternal
-static int32_t WriteBitsToSendBufferInternal(struct utcp_connection* fd, const uint8_t* Bits, const int32_t SizeInBits, const uint8_t* ExtraBits, const int32_t ExtraSizeInBits)
+// The extra bits come in fragments, they are gathered straight into the send buffer
+static int32_t WriteBitsToSendBufferInternal(struct utcp_connection* fd, const uint8_t* Bits, const int32_t SizeInBits, const struct utcp_iov* ExtraIov, int ExtraIovCount)
 {
 	struct bitbuf bitbuf;
 	bitbuf_write_reuse(&bitbuf, fd->SendBuffer, fd->SendBufferBitsNum, sizeof(fd->SendBuffer));
@@ -449,9 +749,9 @@ static int32_t WriteBitsToSendBufferInternal(struct utcp_connection* fd, const u
 			return -1;
 	}
 
-	if (ExtraBits)
+	for (int i = 0; i < ExtraIovCount; ++i)
 	{
-		if (!bitbuf_write_bits(&bitbuf, ExtraBits, ExtraSizeInBits))
+		if (!bitbuf_write_bits(&bitbuf, ExtraIov[i].Data, ExtraIov[i].DataBitsLen))
 			return -2;
 	}
 
@@ -467,14 +767,73 @@ static int32_t WriteBitsToSendBufferInternal(struct utcp_connection* fd, const u
 	return RememberedPacketId;
 }
 
+static inline bool IsMergeableBunch(const struct utcp_bunch* bunch)
+{
+	return !bunch->bReliable && !bunch->bOpen && !bunch->bClose && !bunch->bPartial;
+}
+
+static inline uint8_t GetMergeFlags(const struct utcp_bunch* bunch)
+{
+	return (uint8_t)(bunch->bIsReplicationPaused | (bunch->bHasPackageMapExports << 1) | (bunch->bHasMustBeMappedGUIDs << 2));
+}
+
+// UChannel::SendBunch, "Contemplate merging."
+static bool CanMergeBunch(struct utcp_connection* fd, const struct utcp_bunch* bunch)
+{
+	if (fd->LastEnd == 0 || fd->LastEnd != fd->SendBufferBitsNum)
+		return false;
+	if (!IsMergeableBunch(bunch) || bunch->ChIndex != fd->LastOutChIndex || GetMergeFlags(bunch) != fd->LastOutFlags)
+		return false;
+	if (fd->LastOutDataBitsLen + bunch->DataBitsLen >= UTCP_MAX_PACKET * 8)
+		return false;
+	return bunch->DataBitsLen <= GetFreeSendBufferBits(fd);
+}
+
+// Append the data to the last bunch and rewrite the size at the end of its header
+static int32_t MergeRawBunch(struct utcp_connection* fd, struct utcp_bunch* bunch, const struct utcp_iov* Iov, int IovCount)
+{
+	const uint16_t DataBitsLen = bunch->DataBitsLen;
+	const size_t HeaderEnd = fd->LastStart + fd->LastOutHeaderBits;
+	const size_t SizeStart = HeaderEnd - BUNCH_SIZE_BITS;
+	for (size_t i = SizeStart; i < HeaderEnd; ++i)
+	{
+		fd->SendBuffer[i >> 3] &= (uint8_t)~(1u << (i & 7));
+	}
+
+	struct bitbuf bitbuf;
+	bitbuf_write_reuse(&bitbuf, fd->SendBuffer, SizeStart, sizeof(fd->SendBuffer));
+	if (!bitbuf_write_int_wrapped(&bitbuf, fd->LastOutDataBitsLen + DataBitsLen, UTCP_MAX_PACKET * 8) || bitbuf.num != HeaderEnd)
+	{
+		assert(false);
+		return -1;
+	}
+
+	fd->LastOutDataBitsLen += DataBitsLen;
+	fd->MergedHeaderBits += fd->LastOutHeaderBits;
+
+	int32_t PacketId = WriteBitsToSendBufferInternal(fd, NULL, 0, Iov, IovCount);
+	if (fd->LastEnd != 0)
+		fd->LastEnd = fd->SendBufferBitsNum;
+	return PacketId;
+}
+
 // UNetConnection::SendRawBunch
-int32_t SendRawBunch(struct utcp_connection* fd, struct utcp_bunch* bunch)
+// The DataBitsLen bits of the bunch are the fragments in Iov, bunch->Data is not read.
+// With Shared the full header is copied from it and the reliable buffer references its data instead of copying it
+static int32_t SendRawBunchInternal(struct utcp_connection* fd, struct utcp_bunch* bunch, const struct utcp_iov* Iov, int IovCount, bool bAllowMerging,
+									struct utcp_shared_bunch* Shared)
 {
 	struct utcp_channel* utcp_channel = utcp_get_channel(fd, bunch);
 	if (!utcp_channel)
 	{
 		return -2;
 	}
+	utcp_close_channel_on_bunch(fd, utcp_channel, bunch);
+
+	if (bAllowMerging && CanMergeBunch(fd, bunch))
+	{
+		return MergeRawBunch(fd, bunch, Iov, IovCount);
+	}
 
 	//  UChannel::PrepBunch
 	bunch->ChSequence = 0;
@@ -498,33 +857,112 @@ int32_t SendRawBunch(struct utcp_connection* fd, struct utcp_bunch* bunch)
 		return -1;
 	}
 
-	if (!utcp_bunch_write_header(bunch, &bitbuf))
+	if (Shared)
+	{
+		// Serialized once for all the connections, only the sequence differs
+		memcpy(buffer, Shared->HeaderBits, (Shared->HeaderBitsNum + 7) / 8);
+		bitbuf.num = Shared->HeaderBitsNum;
+		if (bunch->bReliable)
+			utcp_bunch_patch_sequence(buffer, Shared->ChSequencePos, bunch->ChSequence);
+	}
+	else if (!utcp_bunch_write_header(bunch, &bitbuf))
 	{
 		assert(false);
 		return -1;
 	}
 
+	const bool bDeltaHeader = fd->Features & UTCP_FEATURE_DELTA_HEADER;
+	const bool bByteAligned = fd->Features & UTCP_FEATURE_BYTE_ALIGNED;
+
 	// If the bunch does not fit in the current packet,
 	// flush packet now so that we can report collected stats in the correct scope
-	PrepareWriteBitsToSendBuffer(fd, (int32_t)bitbuf.num, bunch->DataBitsLen);
+	PrepareWriteBitsToSendBuffer(fd, (int32_t)bitbuf.num + bDeltaHeader + (bByteAligned ? MAX_ALIGN_BITS : 0), bunch->DataBitsLen);
+	if (bByteAligned)
+	{
+		AlignSendBuffer(fd);
+	}
+
+	// The delta header depends on the packet, so it is only written once the packet is known. It is never longer than the full one
+	uint8_t delta_buffer[MAX_BUNCH_HEADER_BYTES];
+	struct bitbuf delta_bitbuf;
+	const uint8_t* HeaderBits = buffer;
+	size_t HeaderBitsNum = bitbuf.num;
+	if (bDeltaHeader)
+	{
+		if (!bitbuf_write_init(&delta_bitbuf, delta_buffer, sizeof(delta_buffer)) || !utcp_bunch_write_header_delta(bunch, &delta_bitbuf, &fd->OutDeltaContext))
+		{
+			assert(false);
+			return -1;
+		}
+		HeaderBits = delta_buffer;
+		HeaderBitsNum = delta_bitbuf.num;
+	}
+
+	// The padding after the header puts the data on a byte boundary
+	uint8_t aligned_buffer[MAX_BUNCH_HEADER_BYTES];
+	size_t AlignedBitsNum = HeaderBitsNum;
+	if (bByteAligned)
+	{
+		struct bitbuf aligned_bitbuf;
+		bitbuf_write_init(&aligned_bitbuf, aligned_buffer, sizeof(aligned_buffer));
+		if (!bitbuf_write_bits(&aligned_bitbuf, HeaderBits, HeaderBitsNum) || !bitbuf_write_align(&aligned_bitbuf))
+		{
+			assert(false);
+			return -1;
+		}
+		HeaderBits = aligned_buffer;
+		AlignedBitsNum = aligned_bitbuf.num;
+	}
 
 	// Write the bits to the buffer and remember the packet id used
-	int32_t PacketId = WriteBitsToSendBufferInternal(fd, buffer, (int32_t)bitbuf.num, bunch->Data, bunch->DataBitsLen);
+	const size_t BunchStart = fd->SendBufferBitsNum;
+	int32_t PacketId = WriteBitsToSendBufferInternal(fd, HeaderBits, (int32_t)AlignedBitsNum, Iov, IovCount);
 	if (PacketId < 0)
 	{
 		assert(false);
 		return -1;
 	}
 
+	// Remember where the bunch is, unless the packet has already been flushed
+	fd->LastEnd = 0;
+	if (IsMergeableBunch(bunch) && fd->SendBufferBitsNum > BunchStart)
+	{
+		fd->LastStart = BunchStart;
+		fd->LastEnd = fd->SendBufferBitsNum;
+		fd->LastOutHeaderBits = (uint16_t)HeaderBitsNum;
+		fd->LastOutDataBitsLen = bunch->DataBitsLen;
+		fd->LastOutChIndex = bunch->ChIndex;
+		fd->LastOutFlags = GetMergeFlags(bunch);
+	}
+
 	if (bunch->bReliable)
 	{
-		struct utcp_bunch_node* utcp_bunch_node = alloc_utcp_bunch_node();
+		struct utcp_bunch_node* utcp_bunch_node;
 		struct bitbuf bitbuf_all;
-		bitbuf_write_init(&bitbuf_all, utcp_bunch_node->bunch_data, sizeof(utcp_bunch_node->bunch_data));
+		if (Shared)
+		{
+			utcp_bunch_node = alloc_shared_bunch_node(Shared);
+			bitbuf_write_init(&bitbuf_all, utcp_bunch_node->bunch_data, MAX_BUNCH_HEADER_BYTES + 1);
+		}
+		else
+		{
+			utcp_bunch_node = alloc_utcp_bunch_node();
+			bitbuf_write_init(&bitbuf_all, utcp_bunch_node->bunch_data, sizeof(utcp_bunch_node->bunch_data));
+		}
+
+		// Resends can land in any packet, they keep the full header
+		if (bDeltaHeader)
+			bitbuf_write_bit(&bitbuf_all, 0);
 		bitbuf_write_bits(&bitbuf_all, buffer, bitbuf.num);
-		bitbuf_write_bits(&bitbuf_all, bunch->Data, bunch->DataBitsLen);
+		if (bByteAligned)
+			bitbuf_write_align(&bitbuf_all);
+		for (int i = 0; !Shared && i < IovCount; ++i)
+		{
+			bitbuf_write_bits(&bitbuf_all, Iov[i].Data, Iov[i].DataBitsLen);
+		}
 
 		utcp_bunch_node->packet_id = PacketId;
+		utcp_bunch_node->ch_sequence = bunch->ChSequence;
 		utcp_bunch_node->bunch_data_len = (uint16_t)bitbuf_all.num;
 		add_ougoing_data(utcp_channel, utcp_bunch_node);
 	}
@@ -532,9 +970,90 @@ int32_t SendRawBunch(struct utcp_connection* fd, struct utcp_bunch* bunch)
 	return PacketId;
 }
 
+int32_t SendRawBunch(struct utcp_connection* fd, struct utcp_bunch* bunch, const struct utcp_iov* Iov, int IovCount, bool bAllowMerging)
+{
+	return SendRawBunchInternal(fd, bunch, Iov, IovCount, bAllowMerging, NULL);
+}
+
+int32_t SendSharedBunch(struct utcp_connection* fd, struct utcp_bunch* bunch, struct utcp_shared_bunch* Shared)
+{
+	struct utcp_iov Iov = {Shared->Data, Shared->Header.DataBitsLen};
+	return SendRawBunchInternal(fd, bunch, &Iov, 1, false, Shared);
+}
+
+static int WriteIovToSendBuffer(struct utcp_connection* fd, const struct utcp_iov* Iov, int IovCount)
+{
+	int32_t SizeInBits = 0;
+	for (int i = 0; i < IovCount; ++i)
+	{
+		SizeInBits += Iov[i].DataBitsLen;
+	}
+
+	const bool bByteAligned = (fd->Features & UTCP_FEATURE_BYTE_ALIGNED) && SizeInBits > 0;
+	PrepareWriteBitsToSendBuffer(fd, bByteAligned ? MAX_ALIGN_BITS : 0, SizeInBits);
+	if (bByteAligned)
+	{
+		// A resent bunch, its header is already padded
+		AlignSendBuffer(fd);
+	}
+	int32_t PacketId = WriteBitsToSendBufferInternal(fd, NULL, 0, Iov, IovCount);
+
+	// The receiver takes a resent bunch as the previous header, the sender can not, so the next header is written in full
+	fd->OutDeltaContext.bValid = 0;
+	return PacketId;
+}
+
 // UNetConnection::WriteBitsToSendBuffer
 int WriteBitsToSendBuffer(struct utcp_connection* fd, const uint8_t* Bits, const int32_t SizeInBits)
 {
-	PrepareWriteBitsToSendBuffer(fd, 0, SizeInBits);
-	return WriteBitsToSendBufferInternal(fd, NULL, 0, Bits, SizeInBits);
+	struct utcp_iov Iov = {Bits, (uint32_t)SizeInBits};
+	return WriteIovToSendBuffer(fd, &Iov, Bits ? 1 : 0);
+}
+
+// A shared bunch keeps only the header in the node, its data follows from the shared bunch
+static int ResendRawBunch(struct utcp_connection* fd, const struct utcp_bunch_node* utcp_bunch_node)
+{
+	struct utcp_iov Iov[2] = {{utcp_bunch_node->bunch_data, utcp_bunch_node->bunch_data_len}};
+	int IovCount = 1;
+	if (utcp_bunch_node->shared)
+	{
+		Iov[1].Data = utcp_bunch_node->shared->Data;
+		Iov[1].DataBitsLen = utcp_bunch_node->shared->Header.DataBitsLen;
+		IovCount = 2;
+	}
+	return WriteIovToSendBuffer(fd, Iov, IovCount);
+}
+
+// Replace the payload after the compression flag with its compressed form, when that is smaller
+void CompressSendBuffer(struct utcp_connection* fd)
+{
+	const size_t Mark = fd->HeaderMarkForCompression;
+	size_t PayloadStart = Mark + 1;
+	if (fd->Features & UTCP_FEATURE_BYTE_ALIGNED)
+		PayloadStart = (PayloadStart + 7) & ~(size_t)7;
+
+	const size_t PayloadBits = fd->SendBufferBitsNum - PayloadStart;
+	if (PayloadBits < MIN_COMPRESS_PAYLOAD_BITS)
+		return;
+
+	uint8_t Payload[UTCP_MAX_PACKET];
+	struct bitbuf reader = {fd->SendBuffer, fd->SendBufferBitsNum, PayloadStart};
+	if (!bitbuf_read_bits(&reader, Payload, PayloadBits))
+		return;
+
+	uint8_t Compressed[UTCP_MAX_PACKET];
+	int CompressedBytes = utcp_compress(Payload, (int)((PayloadBits + 7) / 8), Compressed, sizeof(Compressed));
+	const int32_t CompressedBits = 1 /*bCompressed*/ + COMPRESSED_PAYLOAD_SIZE_BITS + CompressedBytes * 8;
+	if (CompressedBytes < 0 || (size_t)CompressedBits >= fd->SendBufferBitsNum - Mark)
+		return;
+
+	fd->SendBuffer[Mark >> 3] &= (uint8_t)((1u << (Mark & 7)) - 1);
+	memset(fd->SendBuffer + (Mark >> 3) + 1, 0, sizeof(fd->SendBuffer) - (Mark >> 3) - 1);
+
+	struct bitbuf bitbuf;
+	bitbuf_write_reuse(&bitbuf, fd->SendBuffer, Mark, sizeof(fd->SendBuffer));
+	bitbuf_write_bit(&bitbuf, 1);
+	bitbuf_write_int_wrapped(&bitbuf, (uint32_t)PayloadBits, UTCP_MAX_PACKET * 8);
+	bitbuf_write_bytes(&bitbuf, Compressed, CompressedBytes);
+	fd->SendBufferBitsNum = bitbuf.num;
 }
@@ -7,7 +7,12 @@
 
 void utcp_sequence_init(struct utcp_connection* fd, int32_t IncomingSequence, int32_t OutgoingSequence);
 bool ReceivedPacket(struct utcp_connection* fd, struct bitbuf* bitbuf);
-int32_t PeekPacketId(struct utcp_connection* fd, struct bitbuf* bitbuf);
+bool ReceivedPacketAfterHeader(struct utcp_connection* fd, struct bitbuf* bitbuf, struct packet_header* packet_header);
+void FlushPacketOrderCache(struct utcp_connection* fd, bool bFlushWholeCache);
+void FreePacketOrderCache(struct utcp_connection* fd);
+int32_t PeekPacketId(struct utcp_connection* fd, struct bitbuf* bitbuf, struct packet_header* packet_header);
 int WriteBitsToSendBuffer(struct utcp_connection* fd, const uint8_t* Bits, const int32_t SizeInBits);
 void WritePacketHeader(struct utcp_connection* fd, struct bitbuf* bitbuf);
-int32_t SendRawBunch(struct utcp_connection* fd, struct utcp_bunch* bunch);
+int32_t SendRawBunch(struct utcp_connection* fd, struct utcp_bunch* bunch, const struct utcp_iov* Iov, int IovCount, bool bAllowMerging);
+int32_t SendSharedBunch(struct utcp_connection* fd, struct utcp_bunch* bunch, struct utcp_shared_bunch* Shared);
+void CompressSendBuffer(struct utcp_connection* fd);
@@ -1,5 +1,6 @@
 ﻿#include "utcp_packet_notify.h"
 #include "bit_buffer.h"
+#include "bit_stream.h"
 #include "utcp_def_internal.h"
 #include "utcp_packet.h"
 #include "utcp_sequence_number.h"
@@ -44,6 +45,49 @@ static void PackedHeader_UnPack(uint32_t Packed, uint16_t* Seq, uint16_t* AckedS
 	*HistoryWordCount = (Packed & HistoryWordCountMask);
 }
 
+// Index of the highest set bit, Word must not be 0
+static inline int32_t HighestBitIndex(SequenceHistoryWord Word)
+{
+#ifdef _MSC_VER
+	unsigned long Index;
+	_BitScanReverse(&Index, Word);
+	return (int32_t)Index;
+#else
+	return 31 - __builtin_clz(Word);
+#endif
+}
+
+// TSequenceHistory<HistorySize>::AddDeliveryStatus, Count times at once: the history moves up by Count bits,
+// the new bits are NAKs except the lowest one
+static void SequenceHistory_AddDeliveryStatus(SequenceHistoryWord* History, uint32_t Count, bool bDelivered)
+{
+	const uint32_t WordShift = Count / SequenceHistoryBitsPerWord;
+	const uint32_t BitShift = Count % SequenceHistoryBitsPerWord;
+	for (int32_t WordIt = SequenceHistoryWordCount - 1; WordIt >= 0; --WordIt)
+	{
+		const int32_t Src = WordIt - (int32_t)WordShift;
+		// Funnel shift of the two source words that end up in this word
+		const uint64_t High = Src >= 0 ? History[Src] : 0;
+		const uint64_t Low = Src >= 1 ? History[Src - 1] : 0;
+		History[WordIt] = (SequenceHistoryWord)((((High << 32) | Low) << BitShift) >> 32);
+	}
+	History[0] |= bDelivered ? 1u : 0u;
+}
+
+// TSequenceHistory<HistorySize>::IsDelivered, for all indices up to Index: the highest delivered one, or -1
+static int32_t SequenceHistory_FindDelivered(const SequenceHistoryWord* History, int32_t Index)
+{
+	int32_t WordIndex = Index / SequenceHistoryBitsPerWord;
+	SequenceHistoryWord Word = History[WordIndex] & (SequenceHistoryWord)(0xFFFFFFFFu >> (SequenceHistoryBitsPerWord - 1 - (Index & (SequenceHistoryBitsPerWord - 1))));
+	while (Word == 0)
+	{
+		if (--WordIndex < 0)
+			return -1;
+		Word = History[WordIndex];
+	}
+	return WordIndex * SequenceHistoryBitsPerWord + HighestBitIndex(Word);
+}
+
 // FNetPacketNotify::UpdateInAckSeqAck
 static uint16_t UpdateInAckSeqAck(struct packet_notify* packet_notify, int32_t AckCount, uint16_t AckedSeq)
 {
@@ -104,28 +148,23 @@ void packet_notify_ack_seq(struct packet_notify* packet_notify, uint16_t AckedSe
 	AckedSeq = seq_num_init(AckedSeq);
 	assert(AckedSeq == packet_notify->InSeq);
 
-	while (seq_num_greater_than(AckedSeq, packet_notify->InAckSeq))
-	{
-		packet_notify->InAckSeq = seq_num_inc(packet_notify->InAckSeq, 1);
+	if (!seq_num_greater_than(AckedSeq, packet_notify->InAckSeq))
+		return;
 
-		const bool bReportAcked = packet_notify->InAckSeq == AckedSeq ? IsAck : false;
+	// Every skipped sequence is a NAK, older history past MaxSequenceHistoryLength falls off
+	const int32_t Count = seq_num_diff(AckedSeq, packet_notify->InAckSeq);
+	packet_notify->InAckSeq = AckedSeq;
 
-		utcp_log(Verbose, "packet_notify_ack_seq:%hd, %s", packet_notify->InAckSeq, bReportAcked ? "ACK" : "NAK");
-
-		// TSequenceHistory<HistorySize>::AddDeliveryStatus
-		{
-			SequenceHistoryWord Carry = bReportAcked ? 1u : 0u;
-			const SequenceHistoryWord ValueMask = 1u << (SequenceHistoryBitsPerWord - 1);
-
-			for (size_t CurrentWordIt = 0; CurrentWordIt < SequenceHistoryWordCount; ++CurrentWordIt)
-			{
-				const SequenceHistoryWord OldValue = Carry;
+	utcp_log(Verbose, "packet_notify_ack_seq:%hd, %s, %d NAK before", AckedSeq, IsAck ? "ACK" : "NAK", Count - 1);
 
-				// carry over highest bit in each word to the next word
-				Carry = (packet_notify->InSeqHistory[CurrentWordIt] & ValueMask) >> (SequenceHistoryBitsPerWord - 1);
-				packet_notify->InSeqHistory[CurrentWordIt] = (packet_notify->InSeqHistory[CurrentWordIt] << 1u) | OldValue;
-			}
-		}
+	if (Count >= MaxSequenceHistoryLength)
+	{
+		memset(packet_notify->InSeqHistory, 0, sizeof(packet_notify->InSeqHistory));
+		packet_notify->InSeqHistory[0] = IsAck ? 1u : 0u;
+	}
+	else
+	{
+		SequenceHistory_AddDeliveryStatus(packet_notify->InSeqHistory, Count, IsAck);
 	}
 }
 
@@ -164,27 +203,25 @@ int32_t packet_notify_update(handle_notify_fn handle, void* fd, struct packet_no
 				CurrentAck = seq_num_inc(CurrentAck, 1);
 			}
 
-			// For sequence numbers contained in the history we lookup the delivery status from the history
+			// For sequence numbers contained in the history we lookup the delivery status from the history,
+			// oldest first: skip to the next delivered bit, everything before it is a NAK
 			while (AckCount > 0)
 			{
-				--AckCount;
+				assert(AckCount <= MaxSequenceHistoryLength);
+				const int32_t Delivered = SequenceHistory_FindDelivered(notification_header->History, AckCount - 1);
 
-				// TSequenceHistory<HistorySize>::IsDelivered
-				bool IsDelivered;
+				for (; AckCount - 1 > Delivered; --AckCount)
 				{
-					size_t Index = AckCount;
-					assert(Index < MaxSequenceHistoryLength);
-
-					const size_t WordIndex = Index / SequenceHistoryBitsPerWord;
-					const SequenceHistoryWord WordMask = ((SequenceHistoryWord)(1) << (Index & (SequenceHistoryBitsPerWord - 1)));
-
-					IsDelivered = (notification_header->History[WordIndex] & WordMask) != 0u;
+					handle(fd, CurrentAck, false);
+					CurrentAck = seq_num_inc(CurrentAck, 1);
 				}
 
-				// UE_LOG_PACKET_NOTIFY(TEXT("Notification::ProcessReceivedAcks Seq: %u - IsAck: %u HistoryIndex: %u"), CurrentAck.Get(),
-				// NotificationData.History.IsDelivered(AckCount) ? 1u : 0u, AckCount);
-				handle(fd, CurrentAck, IsDelivered);
-				CurrentAck = seq_num_inc(CurrentAck, 1);
+				if (AckCount > 0)
+				{
+					--AckCount;
+					handle(fd, CurrentAck, true);
+					CurrentAck = seq_num_inc(CurrentAck, 1);
+				}
 			}
 			packet_notify->OutAckSeq = notification_header->AckedSeq;
 		}
@@ -230,11 +267,11 @@ static size_t packet_notify_GetCurrentSequenceHistoryLength(struct packet_notify
 }
 
 // FNetPacketNotify::ReadHeader
-int packet_notify_read_header(struct bitbuf* bitbuf, struct notification_header* notification_header)
+static int read_notification_header(struct bitbuf_stream* stream, struct notification_header* notification_header)
 {
 	// Read packed header
 	uint32_t PackedHeader = 0;
-	if (!bitbuf_read_int_byte_order(bitbuf, &PackedHeader))
+	if (!bitbuf_stream_read(stream, &PackedHeader, 32))
 	{
 		return -1;
 	}
@@ -248,23 +285,35 @@ int packet_notify_read_header(struct bitbuf* bitbuf, struct notification_header*
 
 	for (int i = 0; i < notification_header->HistoryWordCount; ++i)
 	{
-		if (!bitbuf_read_int_byte_order(bitbuf, &notification_header->History[i]))
+		if (!bitbuf_stream_read(stream, &notification_header->History[i], 32))
 			return -2;
 	}
 
 	return 0;
 }
 
+int packet_notify_read_header(struct bitbuf* bitbuf, struct notification_header* notification_header)
+{
+	struct bitbuf_stream stream;
+	bitbuf_stream_read_begin(&stream, bitbuf);
+	int ret = read_notification_header(&stream, notification_header);
+	if (ret == 0)
+		bitbuf_stream_read_end(&stream, bitbuf);
+	return ret;
+}
+
 int packet_header_read(struct packet_header* packet_header, struct bitbuf* bitbuf)
 {
-	int ret = packet_notify_read_header(bitbuf, &packet_header->notification_header);
+	struct bitbuf_stream stream;
+	bitbuf_stream_read_begin(&stream, bitbuf);
+	int ret = read_notification_header(&stream, &packet_header->notification_header);
 	if (ret != 0)
 	{
 		utcp_log(Warning, "Failed to read PacketHeader.%d", ret);
 		return ReadHeaderFail;
 	}
 
-	if (!bitbuf_read_bit(bitbuf, &packet_header->bHasPacketInfoPayload))
+	if (!bitbuf_stream_read_bit(&stream, &packet_header->bHasPacketInfoPayload))
 	{
 		utcp_log(Warning, "Failed to read extra PacketHeader information.%d", 1);
 		return ReadHeaderExtraFail;
@@ -272,14 +321,14 @@ int packet_header_read(struct packet_header* packet_header, struct bitbuf* bitbu
 
 	if (packet_header->bHasPacketInfoPayload)
 	{
-		if (!bitbuf_read_int(bitbuf, &packet_header->PacketJitterClockTimeMS, 1 << NumBitsForJitterClockTimeInHeader))
+		if (!bitbuf_stream_read_int(&stream, &packet_header->PacketJitterClockTimeMS, 1 << NumBitsForJitterClockTimeInHeader))
 		{
 			utcp_log(Warning, "Failed to read extra PacketHeader information.%d", 2);
 			return ReadHeaderExtraFail;
 		}
 
 		// UNetConnection::ReadPacketInfo
-		if (!bitbuf_read_bit(bitbuf, &packet_header->bHasServerFrameTime))
+		if (!bitbuf_stream_read_bit(&stream, &packet_header->bHasServerFrameTime))
 		{
 			utcp_log(Warning, "Failed to read extra PacketHeader information.%d", 3);
 			return ReadHeaderExtraFail;
@@ -287,13 +336,16 @@ int packet_header_read(struct packet_header* packet_header, struct bitbuf* bitbu
 
 		if (packet_header->bHasServerFrameTime)
 		{
-			if (!bitbuf_read_bytes(bitbuf, &packet_header->FrameTimeByte, 1))
+			uint32_t FrameTimeByte;
+			if (!bitbuf_stream_read(&stream, &FrameTimeByte, 8))
 			{
 				utcp_log(Warning, "Failed to read extra PacketHeader information.%d", 3);
 				return ReadHeaderExtraFail;
 			}
+			packet_header->FrameTimeByte = (uint8_t)FrameTimeByte;
 		}
 	}
+	bitbuf_stream_read_end(&stream, bitbuf);
 	return 0;
 }
 
@@ -330,13 +382,13 @@ bool packet_notify_fill_notification_header(struct packet_notify* packet_notify,
 	return true;
 }
 
-static int packet_notify_WriteHeader(struct bitbuf* bitbuf, struct notification_header* notification_header)
+static int packet_notify_WriteHeader(struct bitbuf_stream* stream, struct notification_header* notification_header)
 {
 	// Pack data into a uint
 	uint32_t PackedHeader = PackedHeader_Pack(notification_header->Seq, notification_header->AckedSeq, notification_header->HistoryWordCount - 1);
 
 	// Write packed header
-	if (!bitbuf_write_int_byte_order(bitbuf, PackedHeader))
+	if (!bitbuf_stream_write(stream, PackedHeader, 32))
 		return false;
 
 	// Write ack history
@@ -345,7 +397,7 @@ static int packet_notify_WriteHeader(struct bitbuf* bitbuf, struct notification_
 		size_t NumWords = MIN(notification_header->HistoryWordCount, SequenceHistoryWordCount);
 		for (size_t i = 0; i < NumWords; ++i)
 		{
-			if (!bitbuf_write_int_byte_order(bitbuf, notification_header->History[i]))
+			if (!bitbuf_stream_write(stream, notification_header->History[i], 32))
 				return false;
 		}
 	}
@@ -359,27 +411,30 @@ static int packet_notify_WriteHeader(struct bitbuf* bitbuf, struct notification_
 // FNetPacketNotify::WriteHeader
 bool packet_header_write(struct packet_header* packet_header, struct bitbuf* bitbuf)
 {
-	if (!packet_notify_WriteHeader(bitbuf, &packet_header->notification_header))
+	struct bitbuf_stream stream;
+	bitbuf_stream_write_begin(&stream, bitbuf);
+	if (!packet_notify_WriteHeader(&stream, &packet_header->notification_header))
 		return false;
 
 	// UNetConnection::WriteDummyPacketInfo
-	if (!bitbuf_write_bit(bitbuf, packet_header->bHasPacketInfoPayload))
+	if (!bitbuf_stream_write_bit(&stream, packet_header->bHasPacketInfoPayload))
 		return false;
 
 	if (packet_header->bHasPacketInfoPayload)
 	{
 		// UNetConnection::WriteFinalPacketInfo
-		if (!bitbuf_write_int(bitbuf, packet_header->PacketJitterClockTimeMS, 1 << NumBitsForJitterClockTimeInHeader))
+		if (!bitbuf_stream_write_int(&stream, packet_header->PacketJitterClockTimeMS, 1 << NumBitsForJitterClockTimeInHeader))
 			return false;
 
-		if (!bitbuf_write_bit(bitbuf, packet_header->bHasServerFrameTime))
+		if (!bitbuf_stream_write_bit(&stream, packet_header->bHasServerFrameTime))
 			return false;
 
 		if (packet_header->bHasServerFrameTime)
 		{
-			if (!bitbuf_write_bytes(bitbuf, &packet_header->FrameTimeByte, 1))
+			if (!bitbuf_stream_write(&stream, packet_header->FrameTimeByte, 8))
 				return false;
 		}
 	}
+	bitbuf_stream_write_end(&stream, bitbuf);
 	return true;
 }
@@ -13,16 +13,6 @@ enum
 	NumBitsForJitterClockTimeInHeader = 10,
 };
 
-struct packet_header
-{
-	struct notification_header notification_header;
-
-	uint8_t bHasPacketInfoPayload;
-	uint32_t PacketJitterClockTimeMS;
-	uint8_t bHasServerFrameTime;
-	uint8_t FrameTimeByte;
-};
-
 void packet_notify_init(struct packet_notify* packet_notify, uint16_t InitialInSeq, uint16_t InitialOutSeq);
 
 int packet_notify_read_header(struct bitbuf* bitbuf, struct notification_header* notification_header);
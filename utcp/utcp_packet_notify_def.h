@@ -53,3 +53,13 @@ struct notification_header
 	size_t HistoryWordCount;
 	SequenceHistoryWord History[SequenceHistoryWordCount]; // typedef uint32 WordT;
 };
+
+struct packet_header
+{
+	struct notification_header notification_header;
+
+	uint8_t bHasPacketInfoPayload;
+	uint32_t PacketJitterClockTimeMS;
+	uint8_t bHasServerFrameTime;
+	uint8_t FrameTimeByte;
+};
@@ -8,8 +8,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 extern struct utcp_config* utcp_get_config();
+extern struct utcp_send_batch* utcp_get_send_batch();
+extern const char* utcp_address_format(const struct utcp_address* address, char* str, int size);
 
 #if defined(__linux) || defined(__APPLE__)
 #define _countof(array) (sizeof(array) / sizeof(array[0]))
@@ -97,44 +102,89 @@ static inline void utcp_dump(const char* debug_name, const char* type, const voi
 	utcp_log(Verbose, "[%s][DUMP]%s\t%d\t{%s}", debug_name, type, len, str);
 }
 
-static inline int64_t utcp_gettime_ms(void)
+// utcp_add_elapsed_time may run on another thread than the listener that reads the clock
+static inline int64_t utcp_elapsed_time(void)
 {
 	struct utcp_config* utcp_config = utcp_get_config();
-	return utcp_config->ElapsedTime / 1000 + 1000;
+#if defined(_MSC_VER)
+	return _InterlockedCompareExchange64(&utcp_config->ElapsedTime, 0, 0);
+#else
+	return __atomic_load_n(&utcp_config->ElapsedTime, __ATOMIC_RELAXED);
+#endif
+}
+
+static inline int64_t utcp_gettime_ms(void)
+{
+	return utcp_elapsed_time() / 1000 + 1000;
 }
 
 static inline double utcp_gettime(void)
+{
+	return ((double)utcp_elapsed_time()) / 1000 / 1000 / 1000 + 1;
+}
+
+static inline bool utcp_send_batch_fits(struct utcp_send_batch* batch, size_t len)
+{
+	return batch->Count < batch->ItemCapacity && batch->BufferSize - batch->BufferUsed >= len;
+}
+
+static inline void utcp_outgoing(void* fd, void* userdata, const void* buffer, size_t len)
 {
 	struct utcp_config* utcp_config = utcp_get_config();
-	return ((double)utcp_config->ElapsedTime) / 1000 / 1000 / 1000 + 1;
+	struct utcp_send_batch* batch = utcp_get_send_batch();
+	if (batch)
+	{
+		if (!utcp_send_batch_fits(batch, len) && batch->on_full)
+			batch->on_full(batch);
+
+		if (utcp_send_batch_fits(batch, len))
+		{
+			struct utcp_send_batch_item* item = &batch->Items[batch->Count++];
+			item->fd = fd;
+			item->userdata = userdata;
+			item->Offset = batch->BufferUsed;
+			item->Len = (uint32_t)len;
+			memcpy(batch->Buffer + batch->BufferUsed, buffer, len);
+			batch->BufferUsed += (uint32_t)len;
+			return;
+		}
+	}
+
+	if (utcp_config->on_outgoing)
+	{
+		utcp_config->on_outgoing(fd, userdata, buffer, (int)len);
+	}
 }
 
 static inline void utcp_listener_outgoing(struct utcp_listener* fd, const void* buffer, size_t len)
 {
 	utcp_dump("listener", "outgoing", buffer, (int)len);
-	struct utcp_config* utcp_config = utcp_get_config();
-	if (utcp_config->on_outgoing)
+	if (fd->BatchDatagram)
 	{
-		utcp_config->on_outgoing(fd, fd->userdata, buffer, (int)len);
+		assert(len <= sizeof(fd->BatchDatagram->Reply) && fd->BatchDatagram->ReplyLen == 0);
+		memcpy(fd->BatchDatagram->Reply, buffer, len);
+		fd->BatchDatagram->ReplyLen = (int32_t)len;
+		return;
 	}
+	utcp_outgoing(fd, fd->userdata, buffer, len);
 }
 
 static inline void utcp_connection_outgoing(struct utcp_connection* fd, const void* buffer, size_t len)
 {
 	utcp_dump(fd->debug_name, "outgoing", buffer, (int)len);
-	struct utcp_config* utcp_config = utcp_get_config();
-	if (utcp_config->on_outgoing)
-	{
-		utcp_config->on_outgoing(fd, fd->userdata, buffer, (int)len);
-	}
+	utcp_outgoing(fd, fd->userdata, buffer, len);
 }
 
 #define utcp_raw_send(fd, buffer, len) _Generic((fd), struct utcp_listener *: utcp_listener_outgoing, struct utcp_connection *: utcp_connection_outgoing)(fd, buffer, len)
 
 static inline void utcp_on_accept(struct utcp_listener* fd, bool reconnect)
 {
-	utcp_log(Log, "accept:%s, reconnect=%d", fd->LastChallengeSuccessAddress, reconnect);
 	struct utcp_config* utcp_config = utcp_get_config();
+	if (utcp_config->on_log)
+	{
+		char address[ADDRSTR_PORT_SIZE];
+		utcp_log(Log, "accept:%s, reconnect=%d", utcp_address_format(&fd->LastChallengeSuccessAddress, address, sizeof(address)), reconnect);
+	}
 	if (utcp_config->on_accept)
 	{
 		utcp_config->on_accept(fd, fd->userdata, reconnect);
@@ -160,6 +210,16 @@ static inline void utcp_on_disconnect(struct utcp_connection* fd, int close_reas
 	}
 }
 
+static inline void utcp_recv_bunch_view(struct utcp_connection* fd, const struct utcp_bunch_view* views, int views_count)
+{
+	assert(views_count > 0);
+	struct utcp_config* utcp_config = utcp_get_config();
+	if (utcp_config->on_recv_bunch_view)
+	{
+		utcp_config->on_recv_bunch_view(fd, fd->userdata, views, views_count);
+	}
+}
+
 static inline void utcp_recv_bunch(struct utcp_connection* fd, struct utcp_bunch* bunches[], int bunches_count)
 {
 	assert(bunches_count > 0);